@@ -24,6 +24,8 @@ public:
     bool accessed() const { return x & 0x20; }
     bool dirty() const { return x & 0x40; }
     bool large() const { return x & 0x80; }
+    // software bit: read-only mapping of a shared page, copied on write
+    bool cow() const { return x & 0x200; }
     bool nx() const { return x >> 63; }
     phys addr(bool large) const {
         auto v = x & ((u64(1) << (64-page_size_shift)) - 1);
@@ -40,6 +42,7 @@ public:
     void set_accessed(bool v) { set_bit(5, v); }
     void set_dirty(bool v) { set_bit(6, v); }
     void set_large(bool v) { set_bit(7, v); }
+    void set_cow(bool v) { set_bit(9, v); }
     void set_nx(bool v) { set_bit(63, v); }
     void set_addr(phys addr, bool large) {
         auto mask = 0x8000000000000fff | (u64(large) << page_size_shift);
@@ -71,7 +74,9 @@ public:
     void write(pt_element pte) { *const_cast<volatile u64*>(&p->x) = pte.x; }
     bool compare_exchange(pt_element oldval, pt_element newval) {
         std::atomic<u64> *x = reinterpret_cast<std::atomic<u64>*>(&p->x);
-        return x->compare_exchange_strong(oldval.x, newval.x, std::memory_order_relaxed);
+        // release: concurrent page faults publish freshly filled pages
+        // and page tables through this
+        return x->compare_exchange_strong(oldval.x, newval.x, std::memory_order_release);
     }
     hw_ptep at(unsigned idx) { return hw_ptep(p + idx); }
     static hw_ptep force(pt_element* ptep) { return hw_ptep(ptep); }
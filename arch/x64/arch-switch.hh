@@ -130,6 +130,7 @@ void thread::free_tcb()
 
 void thread_main_c(thread* t)
 {
+    t->_detached_state->_cpu->finish_migration();
     arch::irq_enable();
 #ifdef CONF_preempt
     preempt_enable();
@@ -92,6 +92,10 @@ inline void write_cr3(ulong r) {
     asm volatile ("mov %0, %%cr3" : : "r"(r));
 }
 
+inline void invlpg(void* addr) {
+    asm volatile ("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
 inline ulong read_cr4() {
     ulong r;
     asm volatile ("mov %%cr4, %0" : "=r"(r));
@@ -245,6 +249,11 @@ inline void sti_hlt() {
     asm volatile ("sti; hlt" : : : "memory");
 }
 
+// Tells the processor we are spinning, waiting for another one
+inline void pause() {
+    asm volatile ("pause" : : : "memory");
+}
+
 inline u8 inb(u16 port)
 {
     u8 r;
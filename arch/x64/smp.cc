@@ -70,9 +70,44 @@ void parse_madt()
     debug(fmt("%d CPUs detected\n") % nr_cpus);
 }
 
+// Cpus sharing a cache have apic ids that differ only in their low bits;
+// cpuid leaf 4 tells us how many low bits for each cache level.  If the
+// leaf is not available (e.g. AMD), all cpus are reported as sharing
+// everything, and the scheduler ignores topology.
+static void detect_cache_topology()
+{
+    unsigned l2_shift = 0, llc_shift = 0, llc_level = 0;
+    if (cpuid(0).a >= 4) {
+        for (unsigned i = 0; ; i++) {
+            auto r = cpuid(4, i);
+            if (!(r.a & 0x1f)) {
+                break;
+            }
+            unsigned level = (r.a >> 5) & 7;
+            unsigned sharing = ((r.a >> 14) & 0xfff) + 1;
+            unsigned shift = 0;
+            while ((1u << shift) < sharing) {
+                ++shift;
+            }
+            if (level == 2) {
+                l2_shift = shift;
+            }
+            if (level >= llc_level) {
+                llc_level = level;
+                llc_shift = shift;
+            }
+        }
+    }
+    for (auto c : sched::cpus) {
+        c->arch.l2_id = llc_level ? c->arch.apic_id >> l2_shift : 0;
+        c->arch.llc_id = llc_level ? c->arch.apic_id >> llc_shift : 0;
+    }
+}
+
 void __attribute__((constructor(init_prio::sched))) smp_init()
 {
     parse_madt();
+    detect_cache_topology();
     sched::current_cpu = sched::cpus[0];
     for (auto c : sched::cpus) {
         c->incoming_wakeups = new sched::cpu::incoming_wakeup_queue[sched::cpus.size()];
@@ -8,6 +8,7 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <emmintrin.h>
 #include "cpuid.hh"
 #include <osv/string.h>
 #include <osv/prio.hh>
@@ -117,13 +118,200 @@ void *memcpy_repmov(void *__restrict dest, const void *__restrict src, size_t n)
     return ret;
 }
 
+// Unaligned, and allowed to alias anything
+typedef uint16_t __attribute__((may_alias, aligned(1))) u16_unaligned;
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_unaligned;
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned;
+
+template <typename T>
+static inline __always_inline T load(const void *p)
+{
+    return *static_cast<const T*>(p);
+}
+
+template <typename T, typename V>
+static inline __always_inline void store(void *p, V v)
+{
+    *static_cast<T*>(p) = v;
+}
+
+static inline __always_inline __m128i load128(const char *p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+static inline __always_inline void store128(char *p, __m128i v)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+
+// Copies of up to MEMCPY_OVERLAP_SAFE bytes load the start and the end of
+// the source, overlapping in the middle, and only store once all of it is
+// loaded. This avoids both a loop and a byte tail, and means the buffers
+// may overlap either way, which memmove() relies on.
+static inline __always_inline void
+small_memcpy(char *d, const char *s, size_t n)
+{
+    if (n >= 16) {
+        auto a = load128(s);
+        auto b = load128(s + n - 16);
+        if (n > 32) {
+            auto c = load128(s + 16);
+            auto e = load128(s + n - 32);
+            store128(d + 16, c);
+            store128(d + n - 32, e);
+        }
+        store128(d, a);
+        store128(d + n - 16, b);
+    } else if (n >= 8) {
+        auto a = load<u64_unaligned>(s);
+        auto b = load<u64_unaligned>(s + n - 8);
+        store<u64_unaligned>(d, a);
+        store<u64_unaligned>(d + n - 8, b);
+    } else if (n >= 4) {
+        auto a = load<u32_unaligned>(s);
+        auto b = load<u32_unaligned>(s + n - 4);
+        store<u32_unaligned>(d, a);
+        store<u32_unaligned>(d + n - 4, b);
+    } else if (n >= 2) {
+        auto a = load<u16_unaligned>(s);
+        auto b = load<u16_unaligned>(s + n - 2);
+        store<u16_unaligned>(d, a);
+        store<u16_unaligned>(d + n - 2, b);
+    } else if (n) {
+        *d = *s;
+    }
+}
+
+// 64 bytes at a time, unaligned. The last 64 bytes are loaded up front and
+// stored at the end, covering whatever the loop leaves; since the loop
+// also only goes forward, the copy is still safe for dest < src.
+static inline __always_inline void
+sse_memcpy(char *d, const char *s, size_t n)
+{
+    auto t0 = load128(s + n - 64);
+    auto t1 = load128(s + n - 48);
+    auto t2 = load128(s + n - 32);
+    auto t3 = load128(s + n - 16);
+    auto tail = d + n - 64;
+    for (; d < tail; d += 64, s += 64) {
+        auto a = load128(s);
+        auto b = load128(s + 16);
+        auto c = load128(s + 32);
+        auto e = load128(s + 48);
+        store128(d, a);
+        store128(d + 16, b);
+        store128(d + 32, c);
+        store128(d + 48, e);
+    }
+    store128(tail, t0);
+    store128(tail + 16, t1);
+    store128(tail + 32, t2);
+    store128(tail + 48, t3);
+}
+
+// The non-temporal loop below may stop at any of its loads on a fault;
+// after the fixup, rcx need not be a multiple of its step anymore, nor
+// rdi aligned, so it is resumed from the top, where both are checked.
+extern "C" char memcpy_nt_loop[];
+
+extern "C" void memcpy_fixup_nt(exception_frame *ef, size_t fixup)
+{
+    memcpy_fixup_byte(ef, fixup);
+    ef->rip = reinterpret_cast<ulong>(memcpy_nt_loop);
+}
+
+#define MEMCPY_NT_STEP                                      \
+        "1: \n\t"                                           \
+        "movdqu (%%rsi), %%xmm0\n\t"                        \
+        ".pushsection .memcpy_decode, \"ax\" \n\t"          \
+        ".quad 1b, memcpy_fixup_nt\n\t"                     \
+        ".popsection\n\t"                                   \
+        "movntdq %%xmm0, (%%rdi)\n\t"                       \
+        "add $16, %%rsi\n\t"                                \
+        "add $16, %%rdi\n\t"                                \
+        "sub $16, %%rcx\n\t"
+
+// Copies so large that they would only evict the cache bypass it, with
+// non-temporal stores. Not inlined, so there is a single copy of the
+// memcpy_nt_loop label.
+static void __attribute__((noinline, noclone))
+nt_memcpy(void *__restrict dest, const void *__restrict src, size_t n)
+{
+    // movntdq needs an aligned destination
+    size_t head = -reinterpret_cast<uintptr_t>(dest) & 15;
+    n -= head;
+    repmovsb(dest, src, head);
+    asm volatile
+       ("memcpy_nt_loop: \n\t"
+        "cmp $64, %%rcx\n\t"
+        "jb 2f\n\t"
+        "test $15, %%rdi\n\t"
+        "jnz 2f\n\t"
+        MEMCPY_NT_STEP
+        MEMCPY_NT_STEP
+        MEMCPY_NT_STEP
+        MEMCPY_NT_STEP
+        "jmp memcpy_nt_loop\n\t"
+        "2: \n\t"
+        "sfence\n"
+            : "+D"(dest), "+S"(src), "+c"(n) : : "xmm0", "memory");
+    repmovsb(dest, src, n);
+}
+
+#undef MEMCPY_NT_STEP
+
+// rep movsb is the fastest way to copy large buffers, but takes a while to
+// get going, so shorter copies do better with plain loads and stores.
+static constexpr size_t memcpy_rep_threshold = 1024;
+// Copies larger than this would push most of the cache out, for data that
+// is unlikely to be all read again soon.
+static constexpr size_t memcpy_nt_threshold = 4 << 20;
+
+// Only large copies can fault in a way we can fix up (see jvm_balloon.cc),
+// and those all go through instructions listed in .memcpy_decode.
+// No __restrict here: the small and mid-sized paths must keep their loads
+// ahead of their stores for memmove().
+static inline __always_inline void *
+do_memcpy(void *dest, const void *src, size_t n, bool erms)
+{
+    auto d = static_cast<char*>(dest);
+    auto s = static_cast<const char*>(src);
+    if (n <= MEMCPY_OVERLAP_SAFE) {
+        small_memcpy(d, s, n);
+    } else if (n < memcpy_rep_threshold) {
+        sse_memcpy(d, s, n);
+    } else if (n < memcpy_nt_threshold) {
+        if (erms) {
+            memcpy_repmov(dest, src, n);
+        } else {
+            memcpy_repmov_old(dest, src, n);
+        }
+    } else {
+        nt_memcpy(dest, src, n);
+    }
+    return dest;
+}
+
+extern "C"
+void *memcpy_sse_repmov(void *dest, const void *src, size_t n)
+{
+    return do_memcpy(dest, src, n, true);
+}
+
+extern "C"
+void *memcpy_sse_repmov_old(void *dest, const void *src, size_t n)
+{
+    return do_memcpy(dest, src, n, false);
+}
+
 extern "C"
 void *(*resolve_memcpy())(void *__restrict dest, const void *__restrict src, size_t n)
 {
     if (processor::features().repmovsb) {
-        return memcpy_repmov;
+        return memcpy_sse_repmov;
     }
-    return memcpy_repmov_old;
+    return memcpy_sse_repmov_old;
 }
 
 void *memcpy(void *__restrict dest, const void *__restrict src, size_t n)
@@ -280,13 +468,112 @@ void *memset_repstosb(void *__restrict dest, int c, size_t n)
     return ret;
 }
 
+// As small_memcpy(): overlapping stores from both ends
+static inline __always_inline void
+small_memset(char *d, int c, size_t n)
+{
+    if (n >= 16) {
+        auto v = _mm_set1_epi8(c);
+        store128(d, v);
+        store128(d + n - 16, v);
+        if (n > 32) {
+            store128(d + 16, v);
+            store128(d + n - 32, v);
+        }
+    } else if (n >= 8) {
+        uint64_t v = (uint8_t)c * 0x0101010101010101ull;
+        store<u64_unaligned>(d, v);
+        store<u64_unaligned>(d + n - 8, v);
+    } else if (n >= 4) {
+        uint32_t v = (uint8_t)c * 0x01010101u;
+        store<u32_unaligned>(d, v);
+        store<u32_unaligned>(d + n - 4, v);
+    } else if (n >= 2) {
+        uint16_t v = (uint8_t)c * 0x0101u;
+        store<u16_unaligned>(d, v);
+        store<u16_unaligned>(d + n - 2, v);
+    } else if (n) {
+        *d = c;
+    }
+}
+
+static inline __always_inline void
+sse_memset(char *d, int c, size_t n)
+{
+    auto v = _mm_set1_epi8(c);
+    auto tail = d + n - 64;
+    for (; d < tail; d += 64) {
+        store128(d, v);
+        store128(d + 16, v);
+        store128(d + 32, v);
+        store128(d + 48, v);
+    }
+    store128(tail, v);
+    store128(tail + 16, v);
+    store128(tail + 32, v);
+    store128(tail + 48, v);
+}
+
+static void __attribute__((noinline))
+nt_memset(char *d, int c, size_t n)
+{
+    auto v = _mm_set1_epi8(c);
+    auto end = d + n;
+    store128(d, v);
+    d = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(d) + 16) & ~uintptr_t(15));
+    for (; d + 64 <= end; d += 64) {
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d), v);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d + 16), v);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d + 32), v);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d + 48), v);
+    }
+    _mm_sfence();
+    end -= 64;
+    store128(end, v);
+    store128(end + 16, v);
+    store128(end + 32, v);
+    store128(end + 48, v);
+}
+
+static inline __always_inline void *
+do_memset(void *__restrict dest, int c, size_t n, bool erms)
+{
+    auto d = static_cast<char*>(dest);
+    if (n <= 64) {
+        small_memset(d, c, n);
+    } else if (n < memcpy_rep_threshold) {
+        sse_memset(d, c, n);
+    } else if (n < memcpy_nt_threshold) {
+        if (erms) {
+            memset_repstosb(dest, c, n);
+        } else {
+            memset_repstos_old(dest, c, n);
+        }
+    } else {
+        nt_memset(d, c, n);
+    }
+    return dest;
+}
+
+extern "C"
+void *memset_sse_repstosb(void *__restrict dest, int c, size_t n)
+{
+    return do_memset(dest, c, n, true);
+}
+
+extern "C"
+void *memset_sse_repstos_old(void *__restrict dest, int c, size_t n)
+{
+    return do_memset(dest, c, n, false);
+}
+
 extern "C"
 void *(*resolve_memset())(void *__restrict dest, int c, size_t n)
 {
     if (processor::features().repmovsb) {
-        return memset_repstosb;
+        return memset_sse_repstosb;
     }
-    return memset_repstos_old;
+    return memset_sse_repstos_old;
 }
 
 void *memset(void *__restrict dest, int c, size_t n)
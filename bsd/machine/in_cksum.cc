@@ -48,6 +48,9 @@
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/machine/in_cksum.h>
 
+#include <string.h>
+#include <emmintrin.h>
+
 /*
  * Checksum routine for Internet Protocol family headers
  *    (Portable Alpha version).
@@ -88,6 +91,38 @@ union q_util {
 	u_int64_t q;
 };
 
+/*
+ * Sums len bytes (a multiple of 64) as 32-bit words with SSE2, which every
+ * x86-64 cpu has.  The words are zero-extended into 64-bit lanes, so the
+ * lanes cannot overflow.
+ */
+static u_int64_t
+in_cksumdata_sse2(const void *buf, int len)
+{
+	const __m128i *p = (const __m128i *) buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum0 = zero, sum1 = zero, sum2 = zero, sum3 = zero;
+	u_int64_t lanes[2];
+
+	for (; len > 0; len -= 64, p += 4) {
+		__m128i v0 = _mm_loadu_si128(p);
+		__m128i v1 = _mm_loadu_si128(p + 1);
+		__m128i v2 = _mm_loadu_si128(p + 2);
+		__m128i v3 = _mm_loadu_si128(p + 3);
+		sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(v0, zero));
+		sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(v0, zero));
+		sum2 = _mm_add_epi64(sum2, _mm_unpacklo_epi32(v1, zero));
+		sum3 = _mm_add_epi64(sum3, _mm_unpackhi_epi32(v1, zero));
+		sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(v2, zero));
+		sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(v2, zero));
+		sum2 = _mm_add_epi64(sum2, _mm_unpacklo_epi32(v3, zero));
+		sum3 = _mm_add_epi64(sum3, _mm_unpackhi_epi32(v3, zero));
+	}
+	sum0 = _mm_add_epi64(_mm_add_epi64(sum0, sum1), _mm_add_epi64(sum2, sum3));
+	_mm_storeu_si128((__m128i *) lanes, sum0);
+	return lanes[0] + lanes[1];
+}
+
 static u_int64_t
 in_cksumdata(const void *buf, int len)
 {
@@ -134,6 +169,16 @@ in_cksumdata(const void *buf, int len)
 		}
 	}
 #endif
+	if (len >= 64) {
+		int vlen = len & ~63;
+		sum += in_cksumdata_sse2(lw, vlen);
+		lw += vlen / 4;
+		len -= vlen;
+		if (len == 0) {
+			REDUCE32;
+			return sum;
+		}
+	}
 	/*
 	 * access prefilling to start load of next cache line.
 	 * then add current cache line
@@ -169,6 +214,52 @@ in_cksumdata(const void *buf, int len)
 	return sum;
 }
 
+/*
+ * Copies len bytes from src to dst, and returns their sum, folded to 16 bits
+ * but not complemented, as if src started at an even offset of the packet.
+ * The data is read once, for both.
+ */
+u_int
+in_cksum_copy(const void *src, void *dst, int len)
+{
+	const __m128i *s = (const __m128i *) src;
+	__m128i *d = (__m128i *) dst;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum0 = zero, sum1 = zero;
+	u_int64_t lanes[2];
+	u_int64_t sum;
+	union q_util q_util;
+	union l_util l_util;
+
+	for (; len >= 32; len -= 32, s += 2, d += 2) {
+		__m128i v0 = _mm_loadu_si128(s);
+		__m128i v1 = _mm_loadu_si128(s + 1);
+		_mm_storeu_si128(d, v0);
+		_mm_storeu_si128(d + 1, v1);
+		sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(v0, zero));
+		sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(v0, zero));
+		sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(v1, zero));
+		sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(v1, zero));
+	}
+	_mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(sum0, sum1));
+	sum = lanes[0] + lanes[1];
+
+	/* the tail is summed from the copy, which is now in the cache */
+	const u_char *tail = (const u_char *) d;
+	memcpy(d, s, len);
+	for (; len >= 2; len -= 2, tail += 2) {
+		u_int16_t w;
+		memcpy(&w, tail, 2);
+		sum += w;
+	}
+	if (len) {
+		/* a lone byte is the first of its (little-endian) word */
+		sum += *tail;
+	}
+	REDUCE16;
+	return (sum);
+}
+
 u_short
 in_addword(u_short a, u_short b)
 {
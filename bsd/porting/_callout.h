@@ -42,8 +42,13 @@
 #include <osv/clock.hh>
 
 struct callout {
-	/* OSv waiter thread for drain (drain) */
-	void *waiter_thread;
+	/* The per-cpu wheel the callout is on, and its links there */
+	void *c_wheel;
+	struct callout *c_next;
+	struct callout **c_pprev;
+	int c_slot;
+	/* Expiry, in wheel ticks */
+	uint64_t c_expire;
 	/* State of this entry */
 	int c_flags;
 	uint64_t c_ticks;
@@ -6,11 +6,14 @@
  */
 
 #include <mutex>
-#include <set>
+#include <vector>
+#include <limits>
 #include "osv/trace.hh"
 #include <osv/debug.hh>
 #include <osv/sched.hh>
 #include <osv/clock.hh>
+#include <osv/waitqueue.hh>
+#include <osv/printf.hh>
 using namespace osv::clock::literals;
 
 #include <bsd/porting/rwlock.h>
@@ -22,274 +25,421 @@ TRACEPOINT(trace_callout_init, "C=%p", void *);
 TRACEPOINT(trace_callout_reset, "C=%p to_ticks=%d fn=%p arg=%p", void *, uint64_t, void *, void *);
 TRACEPOINT(trace_callout_stop_wait, "C=%p", void *);
 TRACEPOINT(trace_callout_stop, "C=%p flags=%d, is_drain=%d", void *, int, int);
-TRACEPOINT(trace_callout_thread_waiting, "C=%p", void *);
+TRACEPOINT(trace_callout_thread_waiting, "cpu=%d until=%d", unsigned, uint64_t);
 TRACEPOINT(trace_callout_thread_retry, "C=%p", void *);
 TRACEPOINT(trace_callout_thread_dispatching, "C=%p fn=%p", void *, void *);
-TRACEPOINT(trace_callout_thread_waking, "C=%p thread=%p", void *, void *);
-
-int _callout_stop_safe_locked(struct callout *c, int safe);
 
 namespace callouts {
 
-    struct callout_compare {
-        bool operator() (callout *a, callout *b) const {
-            if (a->c_to_ns == b->c_to_ns) {
-                return (a < b);
-            }
-
-            return (a->c_to_ns < b->c_to_ns);
-        }
-    };
+// Callouts are kept in a hierarchical timing wheel per cpu, so arming and
+// stopping one is O(1), and run by a thread of that cpu: the cpu that last
+// armed the callout, unless it was running at the time.
+//
+// A callout due in less than 64 ticks is on level 0, in the slot of its
+// tick; one due within 64^2 ticks on level 1, in the slot of its 64-tick
+// period, and so on.  Whenever the wheel's time enters a new period of a
+// level, the callouts of that period are moved down ("cascaded") to the
+// levels below.  Callouts beyond the last level are put on its last period
+// and re-armed when they get there.
+class wheel {
+public:
+    explicit wheel(unsigned cpu);
+    // Both called with _mtx held
+    void add(callout* c);
+    void remove(callout* c);
+    bool running(callout* c) const { return _curr == c; }
+    void cancel_running() { _curr_cancelled = true; }
+    void wait_for_running(callout* c);
+    bool is_dispatcher() const { return sched::thread::current() == _dispatcher; }
+    void start();
+public:
+    mutex _mtx;
+    unsigned _cpu;
+private:
+    static constexpr unsigned level_bits = 6;
+    static constexpr unsigned slots = 1 << level_bits;
+    static constexpr unsigned levels = 4;
+    static constexpr int expired_slot = levels * slots;
+    static uint64_t now_ticks();
+    void link(callout* c, int slot);
+    void unlink(callout* c);
+    void place(callout* c);
+    void advance(uint64_t to);
+    void cascade(unsigned level);
+    uint64_t next_event() const;
+    void dispatch(callout* c);
+    void run();
+private:
+    callout* _slots[levels * slots + 1] = {};
+    u64 _nonempty[levels] = {};
+    // the next tick to process
+    uint64_t _now;
+    unsigned _count = 0;
+    callout* _curr = nullptr;
+    bool _curr_cancelled = false;
+    waitqueue _curr_done;
+    // when the dispatcher is to wake up; 0 while it is not sleeping
+    uint64_t _sleep_until = 0;
+    bool _have_work = false;
+    sched::thread* _dispatcher = nullptr;
+};
 
-    // We manage callouts in a single ordered set
-    std::set<callout *, callout_compare> _callouts;
+std::vector<wheel*> wheels;
 
-    // Both global data and callout structure are protected using this lock
-    mutex _callout_mutex;
-    void lock(void) { _callout_mutex.lock(); }
-    void unlock(void) { _callout_mutex.unlock(); }
+wheel::wheel(unsigned cpu)
+    : _cpu(cpu), _now(now_ticks())
+{
+}
 
-    // The callout dispatcher thread
-    sched::thread *_callout_dispatcher = nullptr;
-    bool _have_work = false;
+uint64_t wheel::now_ticks()
+{
+    return ns2ticks(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            osv::clock::uptime::now().time_since_epoch()).count());
+}
 
-    void add_callout(callout *c)
-    {
-        _callouts.insert(c);
+void wheel::link(callout* c, int slot)
+{
+    auto& head = _slots[slot];
+    c->c_next = head;
+    if (head) {
+        head->c_pprev = &c->c_next;
     }
-
-    void remove_callout(callout *c)
-    {
-        _callouts.erase(c);
+    head = c;
+    c->c_pprev = &head;
+    c->c_slot = slot;
+    if (slot != expired_slot) {
+        _nonempty[slot / slots] |= u64(1) << (slot % slots);
     }
+}
 
-    callout *get_one(void)
-    {
-        if (_callouts.empty()) {
-            return (nullptr);
-        }
-        return (*_callouts.begin());
+void wheel::unlink(callout* c)
+{
+    *c->c_pprev = c->c_next;
+    if (c->c_next) {
+        c->c_next->c_pprev = c->c_pprev;
     }
+    int slot = c->c_slot;
+    if (slot != expired_slot && !_slots[slot]) {
+        _nonempty[slot / slots] &= ~(u64(1) << (slot % slots));
+    }
+    c->c_next = nullptr;
+    c->c_pprev = nullptr;
+}
 
-    // FIXME: optimize this function
-    bool have_callout(callout *c)
-    {
-        for (auto i: _callouts) {
-            if (i == c) {
-                return (true);
-            }
-        }
-
-        return (false);
+// Puts the callout in the slot for its expiry, relative to _now
+void wheel::place(callout* c)
+{
+    auto expire = std::max(c->c_expire, _now);
+    auto delta = expire - _now;
+    unsigned level = 0;
+    while (level < levels - 1 && delta >= u64(1) << (level_bits * (level + 1))) {
+        level++;
+    }
+    auto limit = u64(1) << (level_bits * levels);
+    if (delta >= limit) {
+        expire = _now + limit - 1;
     }
+    link(c, level * slots + ((expire >> (level_bits * level)) & (slots - 1)));
+}
 
-    void mark_have_work(void)
-    {
+void wheel::add(callout* c)
+{
+    if (!_count++) {
+        // nothing to cascade, catch up with the time directly
+        _now = std::max(_now, now_ticks());
+    }
+    place(c);
+    if (_sleep_until && c->c_expire < _sleep_until && !_have_work) {
         _have_work = true;
+        _dispatcher->wake();
     }
+}
 
-    // wakes the dispatcher
-    void wake_dispatcher(void)
-    {
-        _callout_dispatcher->wake();
+void wheel::remove(callout* c)
+{
+    if (!c->c_pprev) {
+        return;
     }
+    unlink(c);
+    _count--;
 }
 
-static sched::thread* callout_get_waiter(struct callout *c)
+void wheel::cascade(unsigned level)
 {
-    return reinterpret_cast<sched::thread*>(c->waiter_thread);
+    int slot = level * slots + ((_now >> (level_bits * level)) & (slots - 1));
+    auto c = _slots[slot];
+    _slots[slot] = nullptr;
+    _nonempty[level] &= ~(u64(1) << (slot % slots));
+    while (c) {
+        auto next = c->c_next;
+        place(c);
+        c = next;
+    }
 }
 
-static void callout_set_waiter(struct callout *c, sched::thread* t)
+// Moves the callouts due up to tick "to" to the expired list
+void wheel::advance(uint64_t to)
 {
-    if (t != NULL)
-        assert(c->waiter_thread == NULL);
-
-    c->waiter_thread = reinterpret_cast<void*>(t);
+    while (_now <= to) {
+        unsigned idx = _now & (slots - 1);
+        if (idx == 0) {
+            for (unsigned level = 1; level < levels; level++) {
+                cascade(level);
+                if ((_now >> (level_bits * level)) & (slots - 1)) {
+                    break;
+                }
+            }
+        }
+        while (auto c = _slots[idx]) {
+            unlink(c);
+            link(c, expired_slot);
+        }
+        _nonempty[0] &= ~(u64(1) << idx);
+        // skip the empty slots, up to the next cascade
+        u64 ahead = _nonempty[0] >> idx >> 1;
+        if (idx == slots - 1 || !ahead) {
+            _now = std::min(to + 1, (_now | (slots - 1)) + 1);
+        } else {
+            _now = std::min(to + 1, _now + 1 + __builtin_ctzll(ahead));
+        }
+    }
 }
 
-static void _callout_thread(void)
+// The first tick at which there may be something to do; 0 if never
+uint64_t wheel::next_event() const
 {
-    callouts::lock();
-
-    while (true) {
-
-        // Wait for work
-        sched::thread::wait_until(callouts::_callout_mutex, [] {
-            return (callouts::get_one() != nullptr);
-        });
+    if (!_count) {
+        return 0;
+    }
+    uint64_t ret = 0;
+    for (unsigned level = 0; level < levels; level++) {
+        if (!_nonempty[level]) {
+            continue;
+        }
+        unsigned shift = level_bits * level;
+        unsigned cur = (_now >> shift) & (slots - 1);
+        // rotate so that the current slot is bit 0
+        u64 bits = _nonempty[level];
+        bits = (bits >> cur) | (cur ? bits << (slots - cur) : 0);
+        unsigned d;
+        if (level == 0) {
+            d = __builtin_ctzll(bits);
+        } else {
+            // the current period of a level above 0 was cascaded already
+            bits &= ~u64(1);
+            d = bits ? __builtin_ctzll(bits) : slots;
+        }
+        auto t = level == 0 ? _now + d : ((_now >> shift) + d) << shift;
+        if (!ret || t < ret) {
+            ret = t;
+        }
+    }
+    return ret;
+}
 
-        // get the first callout with the earliest time
-        callout *c = callouts::get_one();
+// Called with _mtx held, which is dropped while running the handler
+void wheel::dispatch(callout* c)
+{
+    auto fn = c->c_fn;
+    auto arg = c->c_arg;
+    struct mtx* c_mtx = c->c_mtx;
+    struct rwlock* c_rwlock = c->c_rwlock;
+    bool return_unlocked = ((c->c_flags & CALLOUT_RETURNUNLOCKED) == 0);
+
+    _curr = c;
+    _curr_cancelled = false;
+    if (c_rwlock || c_mtx) {
+        DROP_LOCK(_mtx) {
+            if (c_rwlock)
+                rw_wlock(c_rwlock);
+            if (c_mtx)
+                mtx_lock(c_mtx);
+        }
+    }
+    if (_curr_cancelled) {
+        // stopped or reset while we were waiting for its lock
+        trace_callout_thread_retry(c);
+        DROP_LOCK(_mtx) {
+            if (c_rwlock)
+                rw_wunlock(c_rwlock);
+            if (c_mtx)
+                mtx_unlock(c_mtx);
+        }
+    } else {
+        c->c_flags &= ~CALLOUT_PENDING;
+        //
+        // note: after the handler have been invoked the callout structure
+        // can look much differently, the handler may reschedule the callout
+        // or even freed it, so we don't touch it anymore.
+        //
+        DROP_LOCK(_mtx) {
+            trace_callout_thread_dispatching(c, (void*)fn);
+            fn(arg);
+            if (return_unlocked) {
+                if (c_rwlock)
+                    rw_wunlock(c_rwlock);
+                if (c_mtx)
+                    mtx_unlock(c_mtx);
+            }
+        }
+    }
+    _curr = nullptr;
+    _curr_done.wake_all(_mtx);
+}
 
-        assert(c->c_flags & (CALLOUT_ACTIVE | CALLOUT_PENDING));
+void wheel::wait_for_running(callout* c)
+{
+    trace_callout_stop_wait(c);
+    while (_curr == c) {
+        _curr_done.wait(_mtx);
+    }
+}
 
-        //////////////////////
-        // Wait for timeout //
-        //////////////////////
+void wheel::run()
+{
+    WITH_LOCK(_mtx) {
+        while (true) {
+            _have_work = false;
+            advance(now_ticks());
+            while (auto c = _slots[expired_slot]) {
+                remove(c);
+                if (c->c_expire >= _now) {
+                    // was beyond the wheel's range
+                    add(c);
+                    continue;
+                }
+                dispatch(c);
+            }
 
-        auto cur = osv::clock::uptime::now();
-        bool expired = true;
-        if (cur < c->c_to_ns-1_ms) {
+            auto next = next_event();
+            _sleep_until = next ? next : std::numeric_limits<uint64_t>::max();
+            trace_callout_thread_waiting(_cpu, next);
             sched::timer t(*sched::thread::current());
-            t.set(c->c_to_ns);
-
-            trace_callout_thread_waiting(c);
-            sched::thread::wait_until(callouts::_callout_mutex, [&] {
-                return ( (t.expired()) || (callouts::_have_work));
+            if (next) {
+                t.set(osv::clock::uptime::time_point(
+                        std::chrono::nanoseconds(ticks2ns(next))));
+            }
+            sched::thread::wait_until(_mtx, [&] {
+                return t.expired() || _have_work;
             });
-
-            callouts::_have_work = false;
-            expired = t.expired();
+            _sleep_until = 0;
         }
+    }
+}
 
-        if (!expired  || (!callouts::have_callout(c))) {
-            trace_callout_thread_retry(c);
-            continue;
-        }
-
-        ///////////////
-        // Dispatch! //
-        ///////////////
-
-        auto fn = c->c_fn;
-        auto arg = c->c_arg;
-        struct mtx* c_mtx = c->c_mtx;
-        struct rwlock* c_rwlock = c->c_rwlock;
-        bool return_unlocked = ((c->c_flags & CALLOUT_RETURNUNLOCKED) == 0);
-
-        if (c_rwlock)
-            rw_wlock(c_rwlock);
-        if (c_mtx)
-            mtx_lock(c_mtx);
+void wheel::start()
+{
+    _dispatcher = new sched::thread([this] { run(); },
+            sched::thread::attr().pin(sched::cpus[_cpu]).name(
+                    osv::sprintf("callout%d", _cpu)));
+    _dispatcher->start();
+}
 
-        c->c_flags &= ~CALLOUT_PENDING;
+// Locks the wheel the callout is on, and the target wheel (if given), and
+// returns the former.  A callout which was never armed belongs to cpu 0's.
+wheel* lock(callout* c, wheel* target)
+{
+    while (true) {
+        auto w = static_cast<wheel*>(c->c_wheel);
+        if (!w) {
+            w = wheels[0];
+        }
+        if (!target || target == w) {
+            w->_mtx.lock();
+        } else if (w->_cpu < target->_cpu) {
+            w->_mtx.lock();
+            target->_mtx.lock();
+        } else {
+            target->_mtx.lock();
+            w->_mtx.lock();
+        }
+        auto now = static_cast<wheel*>(c->c_wheel);
+        if (now == w || (!now && w == wheels[0])) {
+            return w;
+        }
+        // moved meanwhile
+        w->_mtx.unlock();
+        if (target && target != w) {
+            target->_mtx.unlock();
+        }
+    }
+}
 
-        callouts::unlock();
+}
 
-        // Callout handler
-        trace_callout_thread_dispatching(c, (void*)fn);
-        fn(arg);
+using callouts::wheel;
 
-        callouts::lock();
+// callout_stop() and callout_drain(); called with the wheel locked
+static int _callout_stop_safe_locked(wheel* w, struct callout *c, int is_drain)
+{
+    int result = 0;
 
-        sched::thread* waiter = nullptr;
+    trace_callout_stop(c, c->c_flags, is_drain);
 
-        //
-        // note: after the handler have been invoked the callout structure
-        // can look much differently, the handler may reschedule the callout
-        // or even freed it.
-        //
-        // if the callout is in the set it means that it hasn't been freed
-        // by the user
-        //
-        // reset || drain || !stop
-        if (callouts::have_callout(c)) {
-
-            waiter = callout_get_waiter(c);
-            callout_set_waiter(c, NULL);
-            // if the callout hadn't been reschedule, remove it
-            if ( ((c->c_flags & CALLOUT_PENDING) == 0) || (waiter) ) {
-                c->c_flags |= CALLOUT_COMPLETED;
-                callouts::remove_callout(c);
-            }
+    if (w->running(c)) {
+        // in case it hasn't started running yet
+        w->cancel_running();
+        if (is_drain && !w->is_dispatcher()) {
+            w->wait_for_running(c);
+            result = 1;
         }
+    }
 
-        // FIXME: should we do this in case the caller called callout_stop?
-        if (return_unlocked) {
-            if (c_rwlock)
-                rw_wunlock(c_rwlock);
-            if (c_mtx)
-                mtx_unlock(c_mtx);
-        }
+    w->remove(c);
 
-        // if we have a waiter then the callout structure must be valid
-        if (waiter) {
-            trace_callout_thread_waking(c, waiter);
-            waiter->wake();
-        }
-    }
+    // Clear flags
+    c->c_flags &= ~(CALLOUT_ACTIVE | CALLOUT_PENDING | CALLOUT_COMPLETED);
+
+    return (result);
 }
 
 int callout_reset_on(struct callout *c, u64 to_ticks, void (*fn)(void *),
     void *arg, int ignore_cpu)
 {
     auto cur = osv::clock::uptime::now();
-    int cur_ticks = ns2ticks(
-            std::chrono::duration_cast<std::chrono::nanoseconds>
-                (cur.time_since_epoch()).count());
+    auto cur_ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+                (cur.time_since_epoch()).count();
+    int cur_ticks = ns2ticks(cur_ns);
     int result = 0;
-    bool queued_first = false;
 
-    callouts::lock();
+    auto target = callouts::wheels[sched::cpu::current()->id];
+    auto w = callouts::lock(c, target);
 
     trace_callout_reset(c, to_ticks, (void*)fn, arg);
 
-    result = _callout_stop_safe_locked(c, 0);
+    result = _callout_stop_safe_locked(w, c, 0);
 
     // Reset the callout
     c->c_ticks = to_ticks;
     c->c_time = cur_ticks + to_ticks;           // for freebsd compatibility
-    c->c_to_ns = cur + ticks2ns(to_ticks) * 1_ns;      // this is what we use
+    c->c_to_ns = cur + ticks2ns(to_ticks) * 1_ns;
+    // round up, so we never run it early
+    c->c_expire = ns2ticks((cur_ns + ticks2ns(to_ticks) + ticks2ns(1) - 1));
     c->c_fn = fn;
     c->c_arg = arg;
     c->c_flags |= (CALLOUT_PENDING | CALLOUT_ACTIVE);
 
-    callouts::add_callout(c);
-    if (c == callouts::get_one()) {
-        callouts::mark_have_work();
-        queued_first = true;
-    }
-
-    callouts::unlock();
-
-    if (queued_first)
-        callouts::wake_dispatcher();
+    // A running callout stays where it is until it returns, so that
+    // callout_drain() knows whom to wait for
+    auto to = w->running(c) ? w : target;
+    c->c_wheel = to;
+    to->add(c);
 
-    return result;
-}
-
-// callout_stop() and callout_drain()
-int _callout_stop_safe_locked(struct callout *c, int is_drain)
-{
-    int result = 0;
-
-    trace_callout_stop(c, c->c_flags, is_drain);
-
-    if ((is_drain) &&
-        (sched::thread::current() != callouts::_callout_dispatcher) &&
-            (callout_pending(c) ||
-             (callout_active(c) && !callout_completed(c))) ) {
-
-        // Wait for callout
-        callout_set_waiter(c, sched::thread::current());
-        callouts::mark_have_work();
-        callouts::wake_dispatcher();
-
-        trace_callout_stop_wait(c);
-
-        sched::thread::wait_until(callouts::_callout_mutex, [&] {
-            return (c->c_flags & CALLOUT_COMPLETED);
-        });
-
-        result = 1;
+    w->_mtx.unlock();
+    if (target != w) {
+        target->_mtx.unlock();
     }
 
-    callouts::remove_callout(c);
-
-    // Clear flags
-    c->c_flags &= ~(CALLOUT_ACTIVE | CALLOUT_PENDING | CALLOUT_COMPLETED);
-
-    return (result);
+    return result;
 }
 
 int _callout_stop_safe(struct callout *c, int is_drain)
 {
     int result = 0;
 
-    callouts::lock();
-    result = _callout_stop_safe_locked(c, is_drain);
-    callouts::unlock();
+    auto w = callouts::lock(c, nullptr);
+    result = _callout_stop_safe_locked(w, c, is_drain);
+    w->_mtx.unlock();
 
     return (result);
 }
@@ -322,9 +472,13 @@ void callout_init_mtx(struct callout *c, struct mtx *mtx, int flags)
 
 void init_callouts(void)
 {
-    // Start the callout thread
-    callouts::_callout_dispatcher = new sched::thread(_callout_thread,
-            sched::thread::attr().name("callout"));
-    callouts::_callout_dispatcher->start();
+    // Start the callout threads, one per cpu
+    for (auto c : sched::cpus) {
+        assert(c->id == callouts::wheels.size());
+        callouts::wheels.push_back(new wheel(c->id));
+    }
+    for (auto w : callouts::wheels) {
+        w->start();
+    }
 }
 
@@ -11,64 +11,307 @@
 #include <bsd/porting/netport.h>
 #include <bsd/porting/uma_stub.h>
 #include <osv/preempt-lock.hh>
+#include <osv/mempool.hh>
+#include <osv/printf.hh>
+#include <algorithm>
+#include <vector>
+#include <sstream>
+
+// All the zones, for draining them under memory pressure and for statistics
+static mutex zones_lock;
+static std::vector<uma_zone*> zones;
+
+// Threads sleeping at the limit of any zone.  The secondary zones (packets)
+// keep items of other zones (clusters) in the items they cache, so while
+// there are any, those give their items back to memory instead.
+static std::atomic<unsigned> limit_sleepers = { 0 };
+
+static bool holds_other_zones(uma_zone_t zone)
+{
+    return zone->master && zone->uz_init;
+}
+
+static bool bypass_cache(uma_zone_t zone)
+{
+    return zone->uz_sleepers.load(std::memory_order_relaxed) ||
+        (holds_other_zones(zone) && limit_sleepers.load(std::memory_order_relaxed));
+}
 
-void* uma_zone::cache::alloc()
+static void drain_secondary_zones()
 {
-    if (len && CONF_debug_memory) {
-        return a[--len];
+    WITH_LOCK(zones_lock) {
+        for (auto z : zones) {
+            if (holds_other_zones(z)) {
+                z->drain();
+            }
+        }
+    }
+}
+
+class uma_shrinker : public memory::shrinker {
+public:
+    uma_shrinker() : shrinker("UMA") {}
+    virtual size_t request_memory(size_t s);
+    virtual size_t release_memory(size_t s) { return 0; }
+};
+
+size_t uma_shrinker::request_memory(size_t s)
+{
+    size_t freed = 0;
+    WITH_LOCK(zones_lock) {
+        // Newest first, so the items that secondary zones (packets) hold
+        // from the older ones (clusters) go back before those are drained.
+        for (auto i = zones.rbegin(); i != zones.rend() && freed < s; ++i) {
+            freed += (*i)->drain();
+        }
+    }
+    return freed;
+}
+
+void* uma_zone::cache_alloc()
+{
+    WITH_LOCK(preempt_lock) {
+        auto& c = *percpu_cache;
+        c.allocs++;
+        if (!c.loaded || !c.loaded->len) {
+            std::swap(c.loaded, c.previous);
+        }
+        if (c.loaded && c.loaded->len) {
+            c.hits++;
+            return c.loaded->items[--c.loaded->len];
+        }
     }
     return nullptr;
 }
 
-bool uma_zone::cache::free(void* obj)
+bool uma_zone::cache_free(void* item)
 {
-    if (len < max_size && CONF_debug_memory) {
-        a[len++] = obj;
-        return true;
+    WITH_LOCK(preempt_lock) {
+        auto& c = *percpu_cache;
+        c.frees++;
+        if (bypass_cache(this)) {
+            return false;
+        }
+        if (!c.loaded || c.loaded->len >= uz_magsize) {
+            std::swap(c.loaded, c.previous);
+        }
+        if (c.loaded && c.loaded->len < uz_magsize) {
+            c.loaded->items[c.loaded->len++] = item;
+            return true;
+        }
     }
     return false;
 }
 
-void * uma_zalloc_arg(uma_zone_t zone, void *udata, int flags)
+// Both magazines of this cpu are empty: trade one for a full one
+void* uma_zone::depot_alloc()
+{
+    std::lock_guard<mutex> guard(uz_lock);
+    if (!uz_full) {
+        return nullptr;
+    }
+    std::lock_guard<preempt_lock_t> preempt(preempt_lock);
+    auto& c = *percpu_cache;
+    // We may have moved to another cpu, with items in its magazine
+    if (c.loaded && c.loaded->len) {
+        c.hits++;
+        return c.loaded->items[--c.loaded->len];
+    }
+    auto m = uz_full;
+    uz_full = m->next;
+    uz_depot_items -= m->len;
+    if (c.loaded) {
+        c.loaded->next = uz_empty;
+        uz_empty = c.loaded;
+    }
+    c.loaded = m;
+    c.hits++;
+    return m->items[--m->len];
+}
+
+// Both magazines of this cpu are full: trade one for an empty one
+void uma_zone::depot_free(void* item)
 {
-    void * ptr;
+    magazine* empty = nullptr;
+    WITH_LOCK(uz_lock) {
+        if (uz_empty) {
+            empty = uz_empty;
+            uz_empty = empty->next;
+        }
+    }
+    if (!empty) {
+        empty = new magazine;
+    }
+    WITH_LOCK(uz_lock) {
+        WITH_LOCK(preempt_lock) {
+            auto& c = *percpu_cache;
+            if (!c.loaded || c.loaded->len >= uz_magsize) {
+                if (c.loaded) {
+                    c.loaded->next = uz_full;
+                    uz_full = c.loaded;
+                    uz_depot_items += c.loaded->len;
+                }
+                c.loaded = empty;
+                empty = nullptr;
+            }
+            c.loaded->items[c.loaded->len++] = item;
+        }
+        if (empty) {
+            empty->next = uz_empty;
+            uz_empty = empty;
+        }
+    }
+}
 
-    WITH_LOCK(preempt_lock) {
-        ptr = (*zone->percpu_cache)->alloc();
+static void* alloc_item_memory(uma_zone_t zone)
+{
+    /*
+     * Because alloc_page is faster than our malloc in the current implementation,
+     * (if it ever change, we should revisit), it is worth it to take an alternate
+     * path if our size + refcnt_size is exactly a page
+     */
+    if (zone->uz_item_size == PAGE_SIZE) {
+        return memory::alloc_page();
+    } else {
+        return malloc(zone->uz_item_size);
     }
+}
 
-    if (!ptr) {
-        auto size = zone->uz_size;
-        if (zone->uz_flags & UMA_ZONE_REFCNT) {
-            size += UMA_ITEM_HDR_LEN;
+static void free_item_memory(uma_zone_t zone, void* item)
+{
+    if (zone->uz_item_size == PAGE_SIZE) {
+        memory::free_page(item);
+    } else {
+        free(item);
+    }
+}
+
+// Takes a new item from memory, within the limit of the zone
+void* uma_zone::mem_alloc(int flags)
+{
+    bool drained_others = false;
+    WITH_LOCK(uz_lock) {
+        while (uz_max && uz_items >= uz_max) {
+            if (uz_full) {
+                // the depot's items count too; let them go first
+                DROP_LOCK(uz_lock) {
+                    drain();
+                }
+                continue;
+            }
+            if (flags & M_NOWAIT) {
+                uz_fails++;
+                return nullptr;
+            }
+            if (!drained_others) {
+                // so may the items cached by the secondary zones, which
+                // nothing else would free while we sleep
+                drained_others = true;
+                DROP_LOCK(uz_lock) {
+                    drain_secondary_zones();
+                }
+                continue;
+            }
+            uz_sleeps++;
+            uz_sleepers++;
+            limit_sleepers++;
+            uz_wait.wait(uz_lock);
+            limit_sleepers--;
+            uz_sleepers--;
+            drained_others = false;
+        }
+        uz_items++;
+    }
+
+    auto item = alloc_item_memory(this);
+    if (item) {
+        bzero(item, uz_size);
+        if (!uz_init || uz_init(item, uz_size, flags) == 0) {
+            return item;
+        }
+        free_item_memory(this, item);
+    }
+    WITH_LOCK(uz_lock) {
+        uz_items--;
+        uz_fails++;
+        if (uz_sleepers) {
+            uz_wait.wake_one();
         }
+    }
+    return nullptr;
+}
 
-        /*
-         * Because alloc_page is faster than our malloc in the current implementation,
-         * (if it ever change, we should revisit), it is worth it to take an alternate
-         * path if our size + refcnt_size is exactly a page
-         */
-        if (size == PAGE_SIZE) {
-            ptr = memory::alloc_page();
-        } else {
-            ptr = malloc(size);
+// Gives an item back to memory
+void uma_zone::mem_free(void* item)
+{
+    if (uz_fini) {
+        uz_fini(item, uz_size);
+    }
+    free_item_memory(this, item);
+    WITH_LOCK(uz_lock) {
+        uz_items--;
+        if (uz_sleepers) {
+            uz_wait.wake_one();
         }
+    }
+}
 
-        bzero(ptr, zone->uz_size);
+// Caches a free item, after its destructor ran
+void uma_zone::put(void* item)
+{
+    if (cache_free(item)) {
+        return;
+    }
+    if (bypass_cache(this)) {
+        mem_free(item);
+    } else {
+        depot_free(item);
+    }
+}
 
-        // Call init
-        if (zone->uz_init != NULL) {
-            if (zone->uz_init(ptr, zone->uz_size, flags) != 0) {
-                free(ptr);
-                return (NULL);
+// Gives the items in the depot back to memory, returning how much it freed.
+// The magazines of the cpus are left alone.
+size_t uma_zone::drain()
+{
+    magazine *full, *empty;
+    WITH_LOCK(uz_lock) {
+        full = uz_full;
+        empty = uz_empty;
+        uz_full = uz_empty = nullptr;
+        uz_depot_items = 0;
+    }
+    size_t freed = 0;
+    for (auto lists : { full, empty }) {
+        while (lists) {
+            auto m = lists;
+            lists = m->next;
+            for (unsigned i = 0; i < m->len; i++) {
+                mem_free(m->items[i]);
             }
+            freed += m->len * uz_item_size + sizeof(*m);
+            delete m;
+        }
+    }
+    return freed;
+}
+
+void * uma_zalloc_arg(uma_zone_t zone, void *udata, int flags)
+{
+    void * ptr = zone->cache_alloc();
+    if (!ptr) {
+        ptr = zone->depot_alloc();
+    }
+    if (!ptr) {
+        ptr = zone->mem_alloc(flags);
+        if (!ptr) {
+            return (NULL);
         }
     }
 
     // Call ctor
     if (zone->uz_ctor != NULL) {
         if (zone->uz_ctor(ptr, zone->uz_size, udata, flags) != 0) {
-            free(ptr);
+            zone->put(ptr);
             return (NULL);
         }
     }
@@ -99,25 +342,7 @@ void uma_zfree_arg(uma_zone_t zone, void *item, void *udata)
         zone->uz_dtor(item, zone->uz_size, udata);
     }
 
-    WITH_LOCK(preempt_lock) {
-        if ((*zone->percpu_cache)->free(item)) {
-            return;
-        }
-    }
-
-    if (zone->uz_fini) {
-        zone->uz_fini(item, zone->uz_size);
-    }
-
-    auto effective_size = zone->uz_size;
-    if (zone->uz_flags)
-        effective_size += UMA_ITEM_HDR_LEN;
-
-    if (effective_size == PAGE_SIZE) {
-       memory::free_page(item);
-    } else {
-       free(item);
-    }
+    zone->put(item);
 }
 
 void uma_zfree(uma_zone_t zone, void *item)
@@ -127,7 +352,7 @@ void uma_zfree(uma_zone_t zone, void *item)
 
 void zone_drain_wait(uma_zone_t zone, int waitok)
 {
-    /* Do nothing here */
+    zone->drain();
 }
 
 void zone_drain(uma_zone_t zone)
@@ -137,9 +362,30 @@ void zone_drain(uma_zone_t zone)
 
 int uma_zone_set_max(uma_zone_t zone, int nitems)
 {
+    WITH_LOCK(zone->uz_lock) {
+        zone->uz_max = std::max(nitems, 0);
+        // Keep what the cpus can hold in their magazines to a fraction of
+        // the limit, or idle cpus could sit on the items others fail for.
+        if (nitems > 0) {
+            unsigned share = nitems / (8 * sched::cpus.size());
+            zone->uz_magsize = std::max(1U, std::min(zone->uz_magsize, share));
+        }
+        zone->uz_wait.wake_all();
+    }
     return (nitems);
 }
 
+static void add_zone(uma_zone_t z)
+{
+    static uma_shrinker* shrinker;
+    WITH_LOCK(zones_lock) {
+        if (!shrinker) {
+            shrinker = new uma_shrinker;
+        }
+        zones.push_back(z);
+    }
+}
+
 uma_zone_t uma_zcreate(const char *name, size_t size, uma_ctor ctor,
             uma_dtor dtor, uma_init uminit, uma_fini fini,
             int align, u_int32_t flags)
@@ -154,12 +400,25 @@ uma_zone_t uma_zcreate(const char *name, size_t size, uma_ctor ctor,
     z->uz_fini = fini;
     z->master = NULL;
     z->uz_flags = flags;
+    z->uz_item_size = size;
+    if (flags & UMA_ZONE_REFCNT) {
+        z->uz_item_size += UMA_ITEM_HDR_LEN;
+    }
+    // Up to 128K of items in a magazine, or as many as fit for the zones
+    // of small items which ask for it (mbufs)
+    if (flags & UMA_ZONE_MAXBUCKET) {
+        z->uz_magsize = uma_zone::magazine::max_size;
+    } else {
+        z->uz_magsize = std::min<size_t>(uma_zone::magazine::max_size,
+                                         std::max<size_t>(4, (128 << 10) / size));
+    }
 
     /* Do we need align and flags?
     args.align = align;
     args.keg = NULL;
     */
 
+    add_zone(z);
     return (z);
 }
 
@@ -176,7 +435,10 @@ uma_zone_t uma_zsecond_create(char *name, uma_ctor ctor, uma_dtor dtor,
     z->uz_fini = zfini;
     z->master = master;
     z->uz_flags = master->uz_flags;
+    z->uz_item_size = master->uz_item_size;
+    z->uz_magsize = master->uz_magsize;
 
+    add_zone(z);
     return (z);
 }
 
@@ -188,12 +450,15 @@ void uma_zone_set_allocf(uma_zone_t zone, uma_alloc allocf)
 
 int uma_zone_exhausted(uma_zone_t zone)
 {
+    WITH_LOCK(zone->uz_lock) {
+        return uma_zone_exhausted_nolock(zone);
+    }
     return 0;
 }
 
 int uma_zone_exhausted_nolock(uma_zone_t zone)
 {
-    return 0;
+    return zone->uz_max && zone->uz_items >= zone->uz_max;
 }
 
 u_int32_t *uma_find_refcnt(uma_zone_t zone, void *item)
@@ -204,5 +469,53 @@ u_int32_t *uma_find_refcnt(uma_zone_t zone, void *item)
 
 void uma_zdestroy(uma_zone_t zone)
 {
+    WITH_LOCK(zones_lock) {
+        zones.erase(std::find(zones.begin(), zones.end(), zone));
+    }
+    zone->drain();
+    for (auto c : sched::cpus) {
+        auto pc = zone->percpu_cache.for_cpu(c);
+        for (auto m : { pc->loaded, pc->previous }) {
+            if (m) {
+                for (unsigned i = 0; i < m->len; i++) {
+                    zone->mem_free(m->items[i]);
+                }
+                delete m;
+            }
+        }
+    }
     delete zone;
 }
+
+std::string procfs_uma_zones()
+{
+    std::ostringstream os;
+    osv::fprintf(os, "%-20s %6s %8s %8s %8s %12s %12s %8s %8s %8s\n",
+        "ITEM", "SIZE", "LIMIT", "USED", "FREE", "REQ", "HITS", "FAIL", "SLEEP", "PAGES");
+    WITH_LOCK(zones_lock) {
+        for (auto z : zones) {
+            u_int64_t allocs = 0, frees = 0, hits = 0;
+            for (auto c : sched::cpus) {
+                auto pc = z->percpu_cache.for_cpu(c);
+                allocs += pc->allocs;
+                frees += pc->frees;
+                hits += pc->hits;
+            }
+            u_int64_t items, max, fails, sleeps;
+            WITH_LOCK(z->uz_lock) {
+                items = z->uz_items;
+                max = z->uz_max;
+                fails = z->uz_fails;
+                sleeps = z->uz_sleeps;
+            }
+            // the counters are read as they go, so this is approximate
+            int64_t live = allocs - frees - fails;
+            u_int64_t used = std::min<u_int64_t>(std::max<int64_t>(live, 0), items);
+            u_int64_t pages = (items * z->uz_item_size + PAGE_SIZE - 1) / PAGE_SIZE;
+            osv::fprintf(os, "%-20s %6d %8d %8d %8d %12d %12d %8d %8d %8d\n",
+                z->uz_name, z->uz_size, max, used, items - used,
+                allocs, hits, fails, sleeps, pages);
+        }
+    }
+    return os.str();
+}
@@ -159,19 +159,36 @@ struct uma_zone;
 #ifdef __cplusplus
 
 #include <osv/percpu.hh>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <atomic>
+#include <string>
 
 struct uma_zone {
     const char  *uz_name;   /* Text name of the zone */
 
+    /*
+     * A magazine is a stack of free items, initialized (uz_init) but not
+     * constructed.  Each cpu allocates from and frees to its own pair of
+     * magazines without locking, and only goes to the zone's depot to
+     * trade an empty magazine for a full one, or the other way around.
+     */
+    struct magazine {
+        static constexpr unsigned max_size = 128;
+        unsigned len = 0;
+        magazine* next = nullptr;
+        void* items[max_size];
+    };
+
     struct cache {
-        static constexpr size_t max_size = 1000;
-        size_t len = 0;
-        void* a[max_size];
-        void* alloc();
-        bool free(void* obj);
+        magazine* loaded = nullptr;
+        magazine* previous = nullptr;
+        u_int64_t allocs = 0;
+        u_int64_t frees = 0;
+        u_int64_t hits = 0;     /* allocations served by the magazines */
     };
 
-    dynamic_percpu_indirect<cache> percpu_cache;
+    dynamic_percpu<cache> percpu_cache;
 
     uma_ctor    uz_ctor;    /* Constructor for each allocation */
     uma_dtor    uz_dtor;    /* Destructor */
@@ -180,12 +197,38 @@ struct uma_zone {
 
     u_int32_t   uz_flags;   /* Flags inherited from kegs */
     u_int32_t   uz_size;    /* Size inherited from kegs */
+    u_int32_t   uz_item_size;   /* uz_size, plus the header if any */
+    unsigned    uz_magsize;     /* Items a magazine is filled to */
 
     /* zones can be nested (and called with multiple ctor?) */
     struct uma_zone* master;
 
+    /* The depot, and the accounting of items; protected by uz_lock */
+    mutex       uz_lock;
+    magazine*   uz_full = nullptr;
+    magazine*   uz_empty = nullptr;
+    unsigned    uz_depot_items = 0;
+    u_int64_t   uz_items = 0;   /* Items allocated from memory */
+    u_int64_t   uz_max = 0;     /* Limit on uz_items, 0 for none */
+    u_int64_t   uz_fails = 0;   /* Allocations that failed */
+    u_int64_t   uz_sleeps = 0;  /* Allocations that waited at the limit */
+    condvar     uz_wait;
+    /* Threads waiting at the limit; frees bypass the magazines meanwhile */
+    std::atomic<unsigned> uz_sleepers = { 0 };
+
+    void* cache_alloc();
+    bool cache_free(void* item);
+    void* depot_alloc();
+    void depot_free(void* item);
+    void* mem_alloc(int flags);
+    void mem_free(void* item);
+    void put(void* item);
+    size_t drain();
 };
 
+/* Statistics of all the zones, for /proc/uma */
+std::string procfs_uma_zones();
+
 #endif
 
 typedef struct uma_zone * uma_zone_t;
@@ -0,0 +1,404 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 2014, Cloudius Systems . All rights reserved.
+ */
+
+/*
+ * LZ4 compression, as used by the org.illumos:lz4_compress pool feature.
+ *
+ * A compressed block is a standard LZ4 block (as produced by the reference
+ * LZ4_compress()) preceded by its length as a 32-bit big-endian integer,
+ * the same on-disk layout as illumos and FreeBSD use, so pools can be
+ * shared with them.  The length is needed because the block is padded to
+ * the sector size on disk, and LZ4 cannot tell the padding from data.
+ *
+ * An LZ4 block is a sequence of (literals, match) pairs.  Each starts with
+ * a token byte, whose high four bits are the number of literals and low
+ * four bits the match length minus MINMATCH; a field of 15 continues in
+ * following bytes, each adding up to 255.  The literals follow, then the
+ * match offset as a 16-bit little-endian integer.  The last pair has only
+ * literals.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/types.h>
+#include <sys/byteorder.h>
+
+#define	MINMATCH	4
+#define	COPYLENGTH	8
+#define	LASTLITERALS	5		/* the end of a block is literals */
+#define	MFLIMIT		(COPYLENGTH + MINMATCH)	/* no match starts after */
+#define	MINLENGTH	(MFLIMIT + 1)
+#define	MAX_DISTANCE	((1 << 16) - 1)
+
+#define	ML_BITS		4
+#define	ML_MASK		((1U << ML_BITS) - 1)
+#define	RUN_BITS	(8 - ML_BITS)
+#define	RUN_MASK	((1U << RUN_BITS) - 1)
+
+/*
+ * 4096 entries of 4 bytes: too large for the stack, so the table is
+ * allocated for each block.
+ */
+#define	HASH_LOG	12
+#define	HASH_SIZE	(1 << HASH_LOG)
+
+/*
+ * When no match is found for a while, the data is probably incompressible,
+ * and we search less and less often.
+ */
+#define	SKIPSTRENGTH	6
+
+/* decompression copies this many bytes at a time, so can write past */
+#define	WILDCOPYLENGTH	16
+
+static int real_lz4_compress(const uchar_t *src, uchar_t *dst, int isize,
+    int osize);
+static int lz4_uncompress(const uchar_t *src, uchar_t *dst, int isize,
+    int osize);
+
+/*ARGSUSED*/
+size_t
+lz4_compress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	uchar_t *dest = d_start;
+	uint32_t bufsiz;
+
+	ASSERT(d_len >= sizeof (bufsiz));
+
+	bufsiz = real_lz4_compress(s_start, &dest[sizeof (bufsiz)], s_len,
+	    d_len - sizeof (bufsiz));
+
+	/* the data did not fit in d_len */
+	if (bufsiz == 0)
+		return (s_len);
+
+	*(uint32_t *)dest = BE_32(bufsiz);
+
+	return (bufsiz + sizeof (bufsiz));
+}
+
+/*ARGSUSED*/
+int
+lz4_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	const uchar_t *src = s_start;
+	uint32_t bufsiz = BE_32(*(const uint32_t *)src);
+
+	/* invalid compressed buffer size encoded at start */
+	if (bufsiz + sizeof (bufsiz) > s_len)
+		return (1);
+
+	return (lz4_uncompress(&src[sizeof (bufsiz)], d_start, bufsiz,
+	    d_len) < 0);
+}
+
+static inline uint32_t
+lz4_read32(const uchar_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof (v));
+	return (v);
+}
+
+static inline uint64_t
+lz4_read64(const uchar_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof (v));
+	return (v);
+}
+
+static inline int
+lz4_hash(uint32_t v)
+{
+	return ((v * 2654435761U) >> (32 - HASH_LOG));
+}
+
+/*
+ * Returns how many bytes from ip and ref on are the same, up to limit;
+ * the bytes are compared eight at a time, little-endian.
+ */
+static inline int
+lz4_count(const uchar_t *ip, const uchar_t *ref, const uchar_t *limit)
+{
+	const uchar_t *start = ip;
+
+	while (ip + sizeof (uint64_t) <= limit) {
+		uint64_t diff = lz4_read64(ip) ^ lz4_read64(ref);
+		if (diff != 0)
+			return (ip - start + (__builtin_ctzll(diff) >> 3));
+		ip += sizeof (uint64_t);
+		ref += sizeof (uint64_t);
+	}
+	while (ip < limit && *ip == *ref) {
+		ip++;
+		ref++;
+	}
+	return (ip - start);
+}
+
+/* Writes the remainder of a length field of 15 or more */
+static inline uchar_t *
+lz4_put_length(uchar_t *op, int len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return (op);
+}
+
+/*
+ * Compresses isize bytes from src into at most osize bytes at dst; returns
+ * the compressed size, or 0 if it would not fit.
+ */
+static int
+lz4_compress_table(uint32_t *table, const uchar_t *src, uchar_t *dst,
+    int isize, int osize)
+{
+	const uchar_t *ip = src;
+	const uchar_t *anchor = src;
+	const uchar_t *const iend = src + isize;
+	const uchar_t *const mflimit = iend - MFLIMIT;
+	const uchar_t *const matchlimit = iend - LASTLITERALS;
+	uchar_t *op = dst;
+	uchar_t *const oend = dst + osize;
+	int len;
+
+	if (isize < MINLENGTH)
+		goto last_literals;
+
+	table[lz4_hash(lz4_read32(ip))] = 0;
+	ip++;
+
+	for (;;) {
+		const uchar_t *ref;
+		uchar_t *token;
+		uint32_t attempts = 1 << SKIPSTRENGTH;
+		int litlen, off;
+
+		/* find a match */
+		for (;;) {
+			int h;
+
+			if (ip > mflimit)
+				goto last_literals;
+			h = lz4_hash(lz4_read32(ip));
+			ref = src + table[h];
+			table[h] = ip - src;
+			if (ref + MAX_DISTANCE >= ip &&
+			    lz4_read32(ref) == lz4_read32(ip))
+				break;
+			ip += attempts++ >> SKIPSTRENGTH;
+		}
+
+		/* it may start earlier */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* the literals before it */
+		litlen = ip - anchor;
+		if (op + 1 + litlen + litlen / 255 + 2 + 1 + LASTLITERALS >
+		    oend)
+			return (0);
+		token = op++;
+		if (litlen >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, litlen - RUN_MASK);
+		} else {
+			*token = litlen << ML_BITS;
+		}
+		bcopy(anchor, op, litlen);
+		op += litlen;
+
+		off = ip - ref;
+		*op++ = off;
+		*op++ = off >> 8;
+
+		/* the match itself */
+		len = lz4_count(ip + MINMATCH, ref + MINMATCH, matchlimit);
+		ip += MINMATCH + len;
+		if (op + len / 255 + 1 + LASTLITERALS > oend)
+			return (0);
+		if (len >= ML_MASK) {
+			*token += ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token += len;
+		}
+		anchor = ip;
+
+		if (ip > mflimit)
+			break;
+		/* the data just skipped may be matched later */
+		table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - src;
+	}
+
+last_literals:
+	len = iend - anchor;
+	if (op + 1 + len + (len + 255 - RUN_MASK) / 255 > oend)
+		return (0);
+	if (len >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else {
+		*op++ = len << ML_BITS;
+	}
+	bcopy(anchor, op, len);
+	op += len;
+
+	return (op - dst);
+}
+
+static int
+real_lz4_compress(const uchar_t *src, uchar_t *dst, int isize, int osize)
+{
+	uint32_t *table;
+	int result;
+
+	table = kmem_zalloc(HASH_SIZE * sizeof (uint32_t), KM_NOSLEEP);
+	/* not compressing the block is always an option */
+	if (table == NULL)
+		return (0);
+	result = lz4_compress_table(table, src, dst, isize, osize);
+	kmem_free(table, HASH_SIZE * sizeof (uint32_t));
+
+	return (result);
+}
+
+/*
+ * Copies at least len bytes, WILDCOPYLENGTH at a time; the caller makes
+ * sure there is room for what is copied past len.
+ */
+static inline void
+lz4_wildcopy(uchar_t *op, const uchar_t *ip, int len)
+{
+	uchar_t *const end = op + len;
+
+	do {
+		uint64_t a = lz4_read64(ip);
+		uint64_t b = lz4_read64(ip + 8);
+		memcpy(op, &a, 8);
+		memcpy(op + 8, &b, 8);
+		op += WILDCOPYLENGTH;
+		ip += WILDCOPYLENGTH;
+	} while (op < end);
+}
+
+/* Reads the remainder of a length field of 15 or more */
+static inline const uchar_t *
+lz4_get_length(const uchar_t *ip, const uchar_t *iend, int *len)
+{
+	uint_t s;
+
+	do {
+		if (ip >= iend)
+			return (NULL);
+		s = *ip++;
+		*len += s;
+	} while (s == 255);
+	return (ip);
+}
+
+/*
+ * Decompresses isize bytes from src into at most osize bytes at dst;
+ * returns the decompressed size, or -1 if the data is corrupt.  Never reads
+ * or writes outside of the two buffers.
+ */
+static int
+lz4_uncompress(const uchar_t *src, uchar_t *dst, int isize, int osize)
+{
+	const uchar_t *ip = src;
+	const uchar_t *const iend = src + isize;
+	uchar_t *op = dst;
+	uchar_t *const oend = dst + osize;
+
+	while (ip < iend) {
+		uint_t token = *ip++;
+		const uchar_t *ref;
+		int len, off;
+
+		/* literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK &&
+		    (ip = lz4_get_length(ip, iend, &len)) == NULL)
+			return (-1);
+		if (len > iend - ip || len > oend - op)
+			return (-1);
+		if (len + WILDCOPYLENGTH <= iend - ip &&
+		    len + WILDCOPYLENGTH <= oend - op)
+			lz4_wildcopy(op, ip, len);
+		else
+			bcopy(ip, op, len);
+		ip += len;
+		op += len;
+		if (ip == iend)
+			break;
+
+		/* match */
+		if (iend - ip < 2)
+			return (-1);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > op - dst)
+			return (-1);
+		ref = op - off;
+		len = token & ML_MASK;
+		if (len == ML_MASK &&
+		    (ip = lz4_get_length(ip, iend, &len)) == NULL)
+			return (-1);
+		len += MINMATCH;
+		if (len > oend - op)
+			return (-1);
+
+		if (len + WILDCOPYLENGTH > oend - op) {
+			/* too near the end for anything but a byte at a time */
+			while (len-- > 0)
+				*op++ = *ref++;
+			continue;
+		}
+		if (off < WILDCOPYLENGTH) {
+			/*
+			 * The match overlaps what it produces, repeating the
+			 * last off bytes.  Copy them until they are repeated
+			 * far enough back, then copy from there instead.
+			 */
+			int period = off * ((WILDCOPYLENGTH + off - 1) / off);
+			int head = MIN(len, period - off);
+
+			len -= head;
+			while (head-- > 0)
+				*op++ = *ref++;
+			if (len == 0)
+				continue;
+			ref = op - period;
+		}
+		lz4_wildcopy(op, ref, len);
+		op += len;
+	}
+
+	return (op - dst);
+}
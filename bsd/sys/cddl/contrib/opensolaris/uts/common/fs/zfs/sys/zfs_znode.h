@@ -209,6 +209,7 @@ typedef struct znode {
 	boolean_t	z_is_sa;	/* are we native sa? */
 #ifdef __OSV__
 	uint32_t	z_ref_cnt;
+	uint32_t	z_lent;		/* pages held by zfs_holdpage() */
 #endif
 } znode_t;
 
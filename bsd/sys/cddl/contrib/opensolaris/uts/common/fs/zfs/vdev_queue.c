@@ -23,6 +23,7 @@
  * Use is subject to license terms.
  */
 
+#include <osv/bio.h>
 #include <sys/zfs_context.h>
 #include <sys/vdev_impl.h>
 #include <sys/zio.h>
@@ -415,6 +416,8 @@ vdev_queue_io_done(zio_t *zio)
 
 	avl_remove(&vq->vq_pending_tree, zio);
 
+	/* Let the disk driver merge the I/Os we issue and submit them at once */
+	bio_plug();
 	for (int i = 0; i < zfs_vdev_ramp_rate; i++) {
 		zio_t *nio = vdev_queue_io_to_issue(vq, zfs_vdev_max_pending);
 		if (nio == NULL)
@@ -430,4 +433,5 @@ vdev_queue_io_done(zio_t *zio)
 	}
 
 	mutex_exit(&vq->vq_lock);
+	bio_unplug();
 }
@@ -983,6 +983,12 @@ zfs_domount(vfs_t *vfsp, char *osname)
 
 	vfsp->vfs_data = zfsvfs;
 
+	/*
+	 * zfs_read() holds a range lock (RL_READER) on what it reads, so
+	 * positioned reads need not be serialized by the vnode lock.
+	 */
+	vfsp->m_flags |= MNT_SHAREDREAD;
+
 	/*
 	 * The fsid is 64 bits, composed of an 8-bit fs type, which
 	 * separates our fsid from any other filesystem types, and a
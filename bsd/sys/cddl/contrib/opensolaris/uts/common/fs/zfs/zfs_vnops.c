@@ -4881,6 +4881,65 @@ vop_listextattr {
 }
 #endif /* NOTYET */
 
+/*
+ * Hold the page at page-aligned offset off right in the buffer the ARC
+ * caches its block in, so that mappings of the file share it rather than
+ * keep a copy.  The dbuf hold keeps the buffer from being evicted or
+ * replaced until zfs_relepage(); writes update it in place, so the page
+ * stays current, but must not be made through it.  Blocks that don't
+ * hold whole, aligned pages, or that may still grow (see
+ * zfs_grow_blocksize()), can't be shared: we return ENOTSUP and the page
+ * is read in instead.
+ */
+static int
+zfs_holdpage(vnode_t *vp, off_t off, void **pagep, void **handlep)
+{
+	znode_t		*zp = VTOZ(vp);
+	zfsvfs_t	*zfsvfs = zp->z_zfsvfs;
+	dmu_buf_t	*db;
+	rl_t		*rl;
+	char		*page;
+	int		error;
+
+	ZFS_ENTER(zfsvfs);
+	ZFS_VERIFY_ZP(zp);
+
+	rl = zfs_range_lock(zp, off, PAGESIZE, RL_READER);
+	if (off >= zp->z_size || zp->z_blksz < PAGESIZE ||
+	    !ISP2(zp->z_blksz)) {
+		error = ENOTSUP;
+		goto out;
+	}
+	error = dmu_buf_hold(zfsvfs->z_os, zp->z_id, off, zp, &db,
+	    DMU_READ_PREFETCH);
+	if (error)
+		goto out;
+	page = (char *)db->db_data + (off - db->db_offset);
+	if (!IS_P2ALIGNED(page, PAGESIZE) ||
+	    off - db->db_offset + PAGESIZE > db->db_size) {
+		dmu_buf_rele(db, zp);
+		error = ENOTSUP;
+		goto out;
+	}
+	atomic_inc_32(&zp->z_lent);
+	*pagep = page;
+	*handlep = db;
+out:
+	zfs_range_unlock(rl);
+	ZFS_EXIT(zfsvfs);
+	return (error);
+}
+
+static int
+zfs_relepage(vnode_t *vp, void *handle)
+{
+	znode_t		*zp = VTOZ(vp);
+
+	dmu_buf_rele(handle, zp);
+	atomic_dec_32(&zp->z_lent);
+	return (0);
+}
+
 struct vnops zfs_vnops = {
 	zfs_open,			/* open */
 	zfs_close,			/* close */
@@ -4901,4 +4960,8 @@ struct vnops zfs_vnops = {
 	zfs_inactive,			/* inactive */
 	zfs_truncate,			/* truncate */
 	zfs_link,			/* link */
+	NULL,				/* getpage */
+	NULL,				/* putpage */
+	zfs_holdpage,			/* holdpage */
+	zfs_relepage,			/* relepage */
 };
@@ -662,6 +662,7 @@ zfs_znode_alloc(zfsvfs_t *zfsvfs, dmu_buf_t *db, int blksz,
 #ifdef __OSV__
 	zp->z_vnode = NULL;
 	zp->z_ref_cnt = 1;
+	zp->z_lent = 0;
 #endif
 
 	zfs_znode_sa_init(zfsvfs, zp, db, obj_type, hdl);
@@ -1452,6 +1453,14 @@ zfs_grow_blocksize(znode_t *zp, uint64_t size, dmu_tx_t *tx)
 	 */
 	if (zp->z_blksz && zp->z_size > zp->z_blksz)
 		return;
+#ifdef __OSV__
+	/*
+	 * Nor while mappings share pages of the block (see zfs_holdpage()):
+	 * they would be left with the old buffer.
+	 */
+	if (zp->z_lent)
+		return;
+#endif
 
 	error = dmu_object_set_blocksize(zp->z_zfsvfs->z_os, zp->z_id,
 	    size, 0, tx);
@@ -30,6 +30,7 @@
 #include <bsd/machine/param.h>
 #include <bsd/sys/sys/mbuf.h>
 #include <sys/errno.h>
+#include <osv/mempool.hh>
 
 #include <sys/cdefs.h>
 
@@ -93,24 +94,28 @@ void
 tunable_mbinit(void *dummy)
 {
 
-    int maxusers = 16;
+	/*
+	 * OSv: the zones enforce these limits, so size them after memory
+	 * as FreeBSD 10 does, allowing mbufs up to half of it.
+	 */
+	long maxmbufmem = memory::phys_mem_size / 2;
 
 	/* This has to be done before VM init. */
 	TUNABLE_INT_FETCH("kern.ipc.nmbclusters", &nmbclusters);
 	if (nmbclusters == 0)
-		nmbclusters = 1024 + maxusers * 64;
+		nmbclusters = maxmbufmem / MCLBYTES / 4;
 
 	TUNABLE_INT_FETCH("kern.ipc.nmbjumbop", &nmbjumbop);
 	if (nmbjumbop == 0)
-		nmbjumbop = nmbclusters / 2;
+		nmbjumbop = maxmbufmem / MJUMPAGESIZE / 4;
 
 	TUNABLE_INT_FETCH("kern.ipc.nmbjumbo9", &nmbjumbo9);
 	if (nmbjumbo9 == 0)
-		nmbjumbo9 = nmbclusters / 4;
+		nmbjumbo9 = maxmbufmem / MJUM9BYTES / 6;
 
 	TUNABLE_INT_FETCH("kern.ipc.nmbjumbo16", &nmbjumbo16);
 	if (nmbjumbo16 == 0)
-		nmbjumbo16 = nmbclusters / 8;
+		nmbjumbo16 = maxmbufmem / MJUM16BYTES / 6;
 }
 SYSINIT(tunable_mbinit, SI_SUB_TUNABLES, SI_ORDER_MIDDLE, tunable_mbinit, NULL);
 
@@ -405,6 +410,7 @@ mb_ctor_mbuf(void *mem, int size, void *arg, int how)
 		m->M_dat.MH.MH_pkthdr.csum_data = 0;
 		m->M_dat.MH.MH_pkthdr.tso_segsz = 0;
 		m->M_dat.MH.MH_pkthdr.ether_vtag = 0;
+		m->M_dat.MH.MH_pkthdr.data_sum = 0;
 		m->M_dat.MH.MH_pkthdr.flowid = 0;
 		SLIST_INIT(&m->M_dat.MH.MH_pkthdr.tags);
 #ifdef MAC
@@ -633,6 +639,7 @@ mb_ctor_pack(void *mem, int size, void *arg, int how)
 		m->M_dat.MH.MH_pkthdr.csum_data = 0;
 		m->M_dat.MH.MH_pkthdr.tso_segsz = 0;
 		m->M_dat.MH.MH_pkthdr.ether_vtag = 0;
+		m->M_dat.MH.MH_pkthdr.data_sum = 0;
 		m->M_dat.MH.MH_pkthdr.flowid = 0;
 		SLIST_INIT(&m->M_dat.MH.MH_pkthdr.tags);
 #ifdef MAC
@@ -663,6 +670,7 @@ m_pkthdr_init(struct mbuf *m, int how)
 	m->M_dat.MH.MH_pkthdr.csum_data = 0;
 	m->M_dat.MH.MH_pkthdr.tso_segsz = 0;
 	m->M_dat.MH.MH_pkthdr.ether_vtag = 0;
+	m->M_dat.MH.MH_pkthdr.data_sum = 0;
 #ifdef MAC
 	/* If the label init fails, fail the alloc */
 	error = mac_mbuf_init(m, how);
@@ -35,6 +35,7 @@
 #include <bsd/porting/uma_stub.h>
 #include <bsd/sys/sys/mbuf.h>
 #include <bsd/machine/atomic.h>
+#include <bsd/machine/in_cksum.h>
 
 int	max_linkhdr;
 int	max_protohdr;
@@ -1677,15 +1678,46 @@ nospace:
 #endif
 
 /*
- * Copy the contents of uio into a properly sized mbuf chain.
+ * Like uiomove() from uio into cp, also adding the sum of the data, which
+ * starts at offset off of the packet, to *sum.
  */
-struct mbuf *
-m_uiotombuf(struct uio *uio, int how, int len, int align, int flags)
+static void
+uiomove_cksum(void *cp, int n, struct uio *uio, int off, u_short *sum)
+{
+	while (n > 0 && uio->uio_resid) {
+		struct iovec *iov = uio->uio_iov;
+		size_t cnt = iov->iov_len;
+		if (cnt == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+		if (cnt > (size_t)n)
+			cnt = n;
+
+		u_int s = in_cksum_copy(iov->iov_base, cp, cnt);
+		if (off & 1)
+			s = ((s << 8) | (s >> 8)) & 0xffff;
+		*sum = in_addword(*sum, s);
+
+		iov->iov_base = (char *)iov->iov_base + cnt;
+		iov->iov_len -= cnt;
+		uio->uio_resid -= cnt;
+		uio->uio_offset += cnt;
+		cp = (char *)cp + cnt;
+		n -= cnt;
+		off += cnt;
+	}
+}
+
+static struct mbuf *
+uiotombuf(struct uio *uio, int how, int len, int align, int flags, bool csum)
 {
 	struct mbuf *m, *mb;
-	int error, length;
+	int error = 0, length;
 	ssize_t total;
 	int progress = 0;
+	u_short sum = 0;
 
 	/*
 	 * len can be zero or an arbitrary large value bound by
@@ -1716,7 +1748,10 @@ m_uiotombuf(struct uio *uio, int how, int len, int align, int flags)
 	for (mb = m; mb != NULL; mb = mb->m_hdr.mh_next) {
 		length = bsd_min(M_TRAILINGSPACE(mb), total - progress);
 
-		error = uiomove(mtod(mb, void *), length, uio);
+		if (csum)
+			uiomove_cksum(mtod(mb, void *), length, uio, progress, &sum);
+		else
+			error = uiomove(mtod(mb, void *), length, uio);
 		if (error) {
 			m_freem(m);
 			return (NULL);
@@ -1729,9 +1764,32 @@ m_uiotombuf(struct uio *uio, int how, int len, int align, int flags)
 	}
 	KASSERT(progress == total, ("%s: progress != total", __func__));
 
+	if (csum && (flags & M_PKTHDR)) {
+		m->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_DATA_SUMMED;
+		m->M_dat.MH.MH_pkthdr.data_sum = sum;
+	}
 	return (m);
 }
 
+/*
+ * Copy the contents of uio into a properly sized mbuf chain.
+ */
+struct mbuf *
+m_uiotombuf(struct uio *uio, int how, int len, int align, int flags)
+{
+	return uiotombuf(uio, how, len, align, flags, false);
+}
+
+/*
+ * Like m_uiotombuf(), but also sums the data as it is copied, so that the
+ * protocol's checksum need not read it again; see CSUM_DATA_SUMMED.
+ */
+struct mbuf *
+m_uiotombuf_csum(struct uio *uio, int how, int len, int align, int flags)
+{
+	return uiotombuf(uio, how, len, align, flags, true);
+}
+
 /*
  * Copy an mbuf chain into a uio limited by len if set.
  */
@@ -155,7 +155,12 @@ sbwait(socket* so, struct sockbuf *sb)
 	signal_catcher sc;
 	if (so->so_nc && !so->so_nc_busy) {
 		so->so_nc_busy = true;
-		sched::thread::wait_for(so->so_mtx->_mutex, *so->so_nc, sb->sb_cc_wq, tmr, sc);
+		// Under request/response load the next packet is often just
+		// behind: spinning for it a little saves a sleep and a wakeup.
+		so->so_nc->poll_wait(so->so_mtx->_mutex);
+		if (so->so_nc) {
+			sched::thread::wait_for(so->so_mtx->_mutex, *so->so_nc, sb->sb_cc_wq, tmr, sc);
+		}
 		so->so_nc_busy = false;
 		so->so_nc_wq.wake_all(so->so_mtx->_mutex);
 	} else {
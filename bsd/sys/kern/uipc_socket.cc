@@ -107,6 +107,7 @@
 #include <sys/epoll.h>
 #include <osv/debug.h>
 #include <cinttypes>
+#include <osv/mempool.hh>
 
 #include <bsd/porting/netport.h>
 #include <bsd/porting/uma_stub.h>
@@ -216,7 +217,11 @@ init_maxsockets(void *ignored)
     mtx_init(&so_global_mtx, "so_global", NULL, MTX_DEF);
 
 	TUNABLE_INT_FETCH("kern.ipc.maxsockets", &maxsockets);
-	maxsockets = 0x2000;
+	/*
+	 * OSv: the pcb zones are limited to maxsockets; allow one for
+	 * every 32K of memory, and never fewer than we used to.
+	 */
+	maxsockets = imax(0x2000, memory::phys_mem_size / 32768);
 }
 SYSINIT(param, SI_SUB_TUNABLES, SI_ORDER_ANY, init_maxsockets, NULL);
 
@@ -858,10 +863,15 @@ sosend_dgram(struct socket *so, struct bsd_sockaddr *addr, struct uio *uio,
 		/*
 		 * Copy the data from userland into a mbuf chain.
 		 * If no data is to be copied in, a single empty mbuf
-		 * is returned.
+		 * is returned.  Protocols which checksum their data have
+		 * it summed on the way, while it is being read anyway.
 		 */
-		top = m_uiotombuf(uio, M_WAITOK, space, max_hdr,
-		    (M_PKTHDR | ((flags & MSG_EOR) ? M_EOR : 0)));
+		if (so->so_proto->pr_flags & PR_CSUMCOPY)
+			top = m_uiotombuf_csum(uio, M_WAITOK, space, max_hdr,
+			    (M_PKTHDR | ((flags & MSG_EOR) ? M_EOR : 0)));
+		else
+			top = m_uiotombuf(uio, M_WAITOK, space, max_hdr,
+			    (M_PKTHDR | ((flags & MSG_EOR) ? M_EOR : 0)));
 		if (top == NULL) {
 			error = EFAULT;	/* only possible error */
 			goto out;
@@ -1868,6 +1878,9 @@ soreceive_dgram(struct socket *so, struct bsd_sockaddr **psa, struct uio *uio,
 	 * Loop blocking while waiting for a datagram.
 	 */
 	SOCK_LOCK(so);
+	if (so->so_nc) {
+		so->so_nc->process_queue();
+	}
 	while ((m = so->so_rcv.sb_mb) == NULL) {
 		KASSERT(so->so_rcv.sb_cc == 0,
 		    ("soreceive_dgram: sb_mb NULL but sb_cc %u",
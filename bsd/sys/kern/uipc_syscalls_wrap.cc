@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include <bsd/uipc_syscalls.h>
 #include <osv/debug.h>
@@ -321,3 +322,68 @@ int socket(int domain, int type, int protocol)
 
 	return s;
 }
+
+/* sendfile() to something other than a socket: copy through a buffer */
+static ssize_t sendfile_copy(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	char buf[16384];
+	off_t off = offset ? *offset : 0;
+	ssize_t total = 0;
+
+	while (count > 0) {
+		size_t len = count < sizeof(buf) ? count : sizeof(buf);
+		ssize_t r = offset ? pread(in_fd, buf, len, off) : read(in_fd, buf, len);
+		if (r <= 0) {
+			if (r < 0 && total == 0)
+				return -1;
+			break;
+		}
+		ssize_t w = write(out_fd, buf, r);
+		if (w < 0) {
+			if (total == 0)
+				return -1;
+			break;
+		}
+		off += w;
+		total += w;
+		count -= w;
+		if (w < r) {
+			if (!offset)
+				lseek(in_fd, w - r, SEEK_CUR);
+			break;
+		}
+	}
+	if (offset)
+		*offset = off;
+	return total;
+}
+
+extern "C"
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	struct file *in_fp;
+	ssize_t bytes;
+	int error;
+
+	sock_d("sendfile(out_fd=%d, in_fd=%d, offset=..., count=%d)", out_fd,
+	    in_fd, count);
+
+	error = fget(in_fd, &in_fp);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	error = kern_sendfile(out_fd, in_fp, offset, count, &bytes);
+	fdrop(in_fp);
+	if (error == ENOTSOCK)
+		return sendfile_copy(out_fd, in_fd, offset, count);
+	if (error) {
+		sock_d("sendfile() failed, errno=%d", error);
+		errno = error;
+		return -1;
+	}
+
+	return bytes;
+}
+
+LFS64(sendfile);
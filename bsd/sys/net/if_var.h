@@ -215,8 +215,8 @@ struct ifnet {
 	int	if_ispare[4];
 	void	*if_pspare[8];		/* 1 netmap, 7 TDB */
 
-	void add_net_channel(net_channel* nc, ipv4_tcp_conn_id id) { if_classifier.add(id, nc); }
-	void del_net_channel(ipv4_tcp_conn_id id) { if_classifier.remove(id); }
+	bool add_net_channel(net_channel* nc, const flow_key& key) { return if_classifier.add(key, nc); }
+	void del_net_channel(const flow_key& key) { if_classifier.remove(key); }
 };
 
 typedef void if_init_f_t(void *);
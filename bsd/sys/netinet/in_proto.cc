@@ -122,7 +122,7 @@ struct protosw inetsw[] = {
     x.pr_type =      SOCK_DGRAM;
     x.pr_domain =        &inetdomain;
     x.pr_protocol =      IPPROTO_UDP;
-    x.pr_flags =     PR_ATOMIC|PR_ADDR;
+    x.pr_flags =     PR_ATOMIC|PR_ADDR|PR_CSUMCOPY;
     x.pr_input =     udp_input;
     x.pr_ctlinput =      udp_ctlinput;
     x.pr_ctloutput =     udp_ctloutput;
@@ -57,6 +57,7 @@
 #include <bsd/sys/netinet/in_var.h>
 #include <bsd/sys/netinet/ip_var.h>
 #include <bsd/sys/netinet/ip_options.h>
+#include <bsd/sys/netinet/udp.h>
 
 #ifdef IPSEC
 #include <netinet/ip_ipsec.h>
@@ -845,7 +846,13 @@ in_delayed_cksum(struct mbuf *m)
 
 	ip = mtod(m, struct ip *);
 	offset = ip->ip_hl << 2 ;
-	csum = in_cksum_skip(m, ip->ip_len, offset);
+	if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_SUMMED) {
+		/* only the UDP header is left to sum */
+		csum = in_cksum_skip(m, offset + sizeof(struct udphdr), offset);
+		csum = ~in_addword(~csum, m->M_dat.MH.MH_pkthdr.data_sum);
+		m->M_dat.MH.MH_pkthdr.csum_flags &= ~CSUM_DATA_SUMMED;
+	} else
+		csum = in_cksum_skip(m, ip->ip_len, offset);
 	if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_UDP && csum == 0)
 		csum = 0xffff;
 	offset += m->M_dat.MH.MH_pkthdr.csum_data;	/* checksum offset */
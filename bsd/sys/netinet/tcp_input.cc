@@ -3663,10 +3663,11 @@ tcp_net_channel_packet(tcpcb* tp, mbuf* m)
 	tcp_do_segment(m, th, so, tp, drop_hdrlen, tlen, iptos, TI_UNLOCKED);
 }
 
-static ipv4_tcp_conn_id tcp_connection_id(tcpcb* tp)
+static flow_key tcp_connection_id(tcpcb* tp)
 {
 	auto& conn = tp->t_inpcb->inp_inc.inc_ie;
 	return {
+		IPPROTO_TCP,
 		conn.ie_dependfaddr.ie46_foreign.ia46_addr4,
 		conn.ie_dependladdr.ie46_local.ia46_addr4,
 		ntohs(conn.ie_fport),
@@ -281,13 +281,28 @@ tcp_lro_flush(struct lro_ctrl *lc, struct lro_entry *le)
 #endif
 	}
 
-	(*lc->ifp->if_input)(lc->ifp, le->m_head);
+	if (lc->lro_input != NULL)
+		(*lc->lro_input)(lc, le->m_head);
+	else
+		(*lc->ifp->if_input)(lc->ifp, le->m_head);
 	lc->lro_queued += le->append_cnt + 1;
 	lc->lro_flushed++;
 	bzero(le, sizeof(*le));
 	SLIST_INSERT_HEAD(&lc->lro_free, le, next);
 }
 
+void
+tcp_lro_flush_all(struct lro_ctrl *lc)
+{
+	struct lro_entry *le;
+
+	while (!SLIST_EMPTY(&lc->lro_active)) {
+		le = SLIST_FIRST(&lc->lro_active);
+		SLIST_REMOVE_HEAD(&lc->lro_active, next);
+		tcp_lro_flush(lc, le);
+	}
+}
+
 #ifdef INET6
 static int
 tcp_lro_rx_ipv6(struct lro_ctrl *lc, struct mbuf *m, struct ip6_hdr *ip6,
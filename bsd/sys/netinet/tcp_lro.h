@@ -77,6 +77,9 @@ SLIST_HEAD(lro_head, lro_entry);
 /* NB: This is part of driver structs. */
 struct lro_ctrl {
 	struct ifnet	*ifp;
+	/* OSv: passes packets up instead of ifp->if_input, if set. */
+	void		(*lro_input)(struct lro_ctrl *, struct mbuf *);
+	void		*lro_arg;
 	int		lro_queued;
 	int		lro_flushed;
 	int		lro_bad_csum;
@@ -91,6 +94,7 @@ __BEGIN_DECLS
 int tcp_lro_init(struct lro_ctrl *);
 void tcp_lro_free(struct lro_ctrl *);
 void tcp_lro_flush(struct lro_ctrl *, struct lro_entry *);
+void tcp_lro_flush_all(struct lro_ctrl *);
 int tcp_lro_rx(struct lro_ctrl *, struct mbuf *, uint32_t);
 
 __END_DECLS
@@ -69,6 +69,10 @@
 #endif
 #include <bsd/sys/netinet/udp.h>
 #include <bsd/sys/netinet/udp_var.h>
+#include <bsd/sys/net/ethernet.h>
+
+#include <osv/net_channel.hh>
+#include <osv/poll.h>
 
 /*
  * UDP protocol implementation.
@@ -128,6 +132,7 @@ SYSCTL_VNET_STRUCT(_net_inet_udp, UDPCTL_STATS, stats, CTLFLAG_RW,
 static void	udp_detach(struct socket *so);
 static int	udp_output(struct inpcb *, struct mbuf *, struct bsd_sockaddr *,
 		    struct mbuf *, struct thread *);
+static void	udp_net_channel_ifattach(void *arg, struct ifnet *ifp);
 #endif
 
 #ifdef IPSEC
@@ -169,6 +174,10 @@ udp_init(void)
 	uma_zone_set_max(V_udpcb_zone, maxsockets);
 	EVENTHANDLER_REGISTER(maxsockets_change, (void *)udp_zone_change, NULL,
 	    EVENTHANDLER_PRI_ANY);
+#ifdef INET
+	EVENTHANDLER_REGISTER(ifnet_arrival_event, (void *)udp_net_channel_ifattach,
+	    NULL, EVENTHANDLER_PRI_ANY);
+#endif
 }
 
 /*
@@ -295,6 +304,39 @@ udp_append(struct inpcb *inp, struct ip *ip, struct mbuf *n, int off,
 		sorwakeup_locked(so);
 }
 
+/*
+ * Verifies the checksum of a datagram, if it has one.  The IP header must be
+ * as ip_input() leaves it, and len is the UDP length.
+ */
+static bool
+udp_checksum_ok(struct mbuf *m, struct ip *ip, struct udphdr *uh, int len)
+{
+	u_short uh_sum;
+
+	if (!uh->uh_sum) {
+		UDPSTAT_INC(udps_nosum);
+		return true;
+	}
+	if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID) {
+		if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_PSEUDO_HDR)
+			uh_sum = m->M_dat.MH.MH_pkthdr.csum_data;
+		else
+			uh_sum = in_pseudo(ip->ip_src.s_addr,
+			    ip->ip_dst.s_addr, htonl((u_short)len +
+			    m->M_dat.MH.MH_pkthdr.csum_data + IPPROTO_UDP));
+		uh_sum ^= 0xffff;
+	} else {
+		char b[9];
+
+		bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
+		bzero(((struct ipovly *)ip)->ih_x1, 9);
+		((struct ipovly *)ip)->ih_len = uh->uh_ulen;
+		uh_sum = in_cksum(m, len + sizeof (struct ip));
+		bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
+	}
+	return uh_sum == 0;
+}
+
 void
 udp_input(struct mbuf *m, int off)
 {
@@ -376,33 +418,11 @@ udp_input(struct mbuf *m, int off)
 	/*
 	 * Checksum extended UDP header and data.
 	 */
-	if (uh->uh_sum) {
-		u_short uh_sum;
-
-		if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID) {
-			if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_PSEUDO_HDR)
-				uh_sum = m->M_dat.MH.MH_pkthdr.csum_data;
-			else
-				uh_sum = in_pseudo(ip->ip_src.s_addr,
-				    ip->ip_dst.s_addr, htonl((u_short)len +
-				    m->M_dat.MH.MH_pkthdr.csum_data + IPPROTO_UDP));
-			uh_sum ^= 0xffff;
-		} else {
-			char b[9];
-
-			bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
-			bzero(((struct ipovly *)ip)->ih_x1, 9);
-			((struct ipovly *)ip)->ih_len = uh->uh_ulen;
-			uh_sum = in_cksum(m, len + sizeof (struct ip));
-			bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
-		}
-		if (uh_sum) {
-			UDPSTAT_INC(udps_badsum);
-			m_freem(m);
-			return;
-		}
-	} else
-		UDPSTAT_INC(udps_nosum);
+	if (!udp_checksum_ok(m, ip, uh, len)) {
+		UDPSTAT_INC(udps_badsum);
+		m_freem(m);
+		return;
+	}
 
 	if (IN_MULTICAST(ntohl(ip->ip_dst.s_addr)) ||
 	    in_broadcast(ip->ip_dst, ifp)) {
@@ -585,6 +605,219 @@ udp_input(struct mbuf *m, int off)
 badunlocked:
 	m_freem(m);
 }
+
+/*
+ * Net channel support: the driver classifies the datagrams of a bound socket
+ * and queues them to the socket's channel, from which the receiving thread
+ * appends them to the socket buffer, bypassing the netisr and the pcb
+ * lookup.  The classifier only passes on unicast, unfragmented IPv4
+ * datagrams without options.
+ *
+ * A channel matches many flows, and so many receive queues may feed it.
+ */
+struct udp_net_channel {
+	explicit udp_net_channel(struct inpcb *inp);
+	net_channel nc;
+	flow_key key;
+	bool registered;
+	bool dead;
+};
+
+/*
+ * Does what ether_input(), ip_input() and udp_input() would have done to a
+ * datagram the classifier passed.  Called with the inpcb lock held.
+ */
+static void
+udp_net_channel_packet(struct inpcb *inp, struct mbuf *m)
+{
+	struct ip *ip;
+	struct udphdr *uh;
+	struct bsd_sockaddr_in udp_in;
+	int iphlen, len, sum;
+
+	m_adj(m, ETHER_HDR_LEN);
+	if (m->m_hdr.mh_len < sizeof(struct ip) + sizeof(struct udphdr)) {
+		m = m_pullup(m, sizeof(struct ip) + sizeof(struct udphdr));
+		if (m == NULL) {
+			UDPSTAT_INC(udps_hdrops);
+			return;
+		}
+	}
+	ip = mtod(m, struct ip *);
+	iphlen = ip->ip_hl << 2;
+	if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_IP_CHECKED)
+		sum = !(m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_IP_VALID);
+	else
+		sum = in_cksum(m, iphlen);
+	if (sum) {
+		IPSTAT_INC(ips_badsum);
+		m_freem(m);
+		return;
+	}
+	ip->ip_len = ntohs(ip->ip_len);
+	if (ip->ip_len < iphlen + sizeof(struct udphdr) ||
+	    m->M_dat.MH.MH_pkthdr.len < ip->ip_len) {
+		IPSTAT_INC(ips_badlen);
+		m_freem(m);
+		return;
+	}
+	if (m->M_dat.MH.MH_pkthdr.len > ip->ip_len)
+		m_adj(m, ip->ip_len - m->M_dat.MH.MH_pkthdr.len);
+	ip->ip_len -= iphlen;
+	ip->ip_off = ntohs(ip->ip_off);
+
+	UDPSTAT_INC(udps_ipackets);
+	uh = (struct udphdr *)((caddr_t)ip + iphlen);
+	len = ntohs((u_short)uh->uh_ulen);
+	if (ip->ip_len != len) {
+		if (len > ip->ip_len || len < sizeof(struct udphdr)) {
+			UDPSTAT_INC(udps_badlen);
+			m_freem(m);
+			return;
+		}
+		m_adj(m, len - ip->ip_len);
+	}
+	if (!udp_checksum_ok(m, ip, uh, len)) {
+		UDPSTAT_INC(udps_badsum);
+		m_freem(m);
+		return;
+	}
+	if (inp->inp_ip_minttl && inp->inp_ip_minttl > ip->ip_ttl) {
+		m_freem(m);
+		return;
+	}
+
+	bzero(&udp_in, sizeof(udp_in));
+	udp_in.sin_len = sizeof(udp_in);
+	udp_in.sin_family = AF_INET;
+	udp_in.sin_port = uh->uh_sport;
+	udp_in.sin_addr = ip->ip_src;
+	udp_append(inp, ip, m, iphlen, &udp_in);
+}
+
+udp_net_channel::udp_net_channel(struct inpcb *inp)
+	: nc([=] (mbuf *m) {
+		if (dead)
+			m_freem(m);
+		else
+			udp_net_channel_packet(inp, m);
+	}, true)
+	, key(IPPROTO_UDP, in_addr(), in_addr(), 0, 0)
+	, registered(false)
+	, dead(false)
+{
+}
+
+static void
+udp_teardown_net_channel(struct inpcb *inp)
+{
+	struct udp_net_channel *unc = intoudpcb(inp)->u_nc;
+	struct ifnet *ifp;
+
+	if (!unc || !unc->registered)
+		return;
+	IFNET_RLOCK();
+	TAILQ_FOREACH(ifp, &V_ifnet, if_link) {
+		ifp->del_net_channel(unc->key);
+	}
+	IFNET_RUNLOCK();
+	unc->registered = false;
+}
+
+/*
+ * (Re)registers the socket's channel with the interfaces, under the key its
+ * current addresses make.  Sockets sharing their port (SO_REUSEADDR or
+ * SO_REUSEPORT) each get a copy of broadcasts, and the choice of socket for
+ * unicast is made by in_pcblookup(), so they keep using udp_input().
+ * Called with the inpcb lock held.
+ */
+static void
+udp_setup_net_channel(struct inpcb *inp)
+{
+	struct udpcb *up = intoudpcb(inp);
+	struct socket *so = inp->inp_socket;
+	struct udp_net_channel *unc;
+	struct ifnet *ifp;
+	poll_link *pl;
+
+	udp_teardown_net_channel(inp);
+	if (inp->inp_lport == 0 ||
+	    (so->so_options & (SO_REUSEADDR | SO_REUSEPORT)))
+		return;
+	if (!up->u_nc) {
+		up->u_nc = new udp_net_channel(inp);
+		so->so_nc = &up->u_nc->nc;
+		if (so->fp) {
+			WITH_LOCK(so->fp->f_lock) {
+				TAILQ_FOREACH(pl, &so->fp->f_poll_list, _link) {
+					so->so_nc->add_poller(*pl->_req);
+				}
+			}
+		}
+	}
+	unc = up->u_nc;
+	unc->key = flow_key(IPPROTO_UDP, inp->inp_faddr, inp->inp_laddr,
+	    ntohs(inp->inp_fport), ntohs(inp->inp_lport));
+	IFNET_RLOCK();
+	TAILQ_FOREACH(ifp, &V_ifnet, if_link) {
+		ifp->add_net_channel(&unc->nc, unc->key);
+	}
+	IFNET_RUNLOCK();
+	unc->registered = true;
+}
+
+/*
+ * An interface attached after sockets set up their channels: register them
+ * with it too.  Setting up a channel concurrently may add the same key to
+ * the new interface first, which is harmless.
+ */
+static void
+udp_net_channel_ifattach(void *arg, struct ifnet *ifp)
+{
+	struct inpcb *inp;
+	struct udpcb *up;
+
+	INP_INFO_RLOCK(&V_udbinfo);
+	LIST_FOREACH(inp, &V_udb, inp_list) {
+		INP_LOCK(inp);
+		up = intoudpcb(inp);
+		if (up && up->u_nc && up->u_nc->registered)
+			ifp->add_net_channel(&up->u_nc->nc, up->u_nc->key);
+		INP_UNLOCK(inp);
+	}
+	INP_INFO_RUNLOCK(&V_udbinfo);
+}
+
+static void
+udp_free_net_channel(struct inpcb *inp)
+{
+	struct udpcb *up = intoudpcb(inp);
+	struct socket *so = inp->inp_socket;
+	struct udp_net_channel *unc = up->u_nc;
+	poll_link *pl;
+
+	if (!unc)
+		return;
+	udp_teardown_net_channel(inp);
+	if (so) {
+		if (so->fp) {
+			TAILQ_FOREACH(pl, &so->fp->f_poll_list, _link) {
+				unc->nc.del_poller(*pl->_req);
+			}
+		}
+		so->so_nc = nullptr;
+	}
+	up->u_nc = nullptr;
+	/*
+	 * Drivers may still be queueing to the channel until the rcu grace
+	 * period ends; drop whatever they did then.
+	 */
+	unc->dead = true;
+	osv::rcu_defer([] (udp_net_channel *unc) {
+		unc->nc.process_queue();
+		delete unc;
+	}, unc);
+}
 #endif /* INET */
 
 /*
@@ -1178,7 +1411,8 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct bsd_sockaddr *addr,
 			faddr.s_addr = INADDR_BROADCAST;
 		ui->ui_sum = in_pseudo(ui->ui_src.s_addr, faddr.s_addr,
 		    htons((u_short)len + sizeof(struct udphdr) + IPPROTO_UDP));
-		m->M_dat.MH.MH_pkthdr.csum_flags = CSUM_UDP;
+		m->M_dat.MH.MH_pkthdr.csum_flags = CSUM_UDP |
+		    (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_SUMMED);
 		m->M_dat.MH.MH_pkthdr.csum_data = offsetof(struct udphdr, uh_sum);
 	} else
 		ui->ui_sum = 0;
@@ -1357,6 +1591,7 @@ udp_abort(struct socket *so)
 		in_pcbdisconnect(inp);
 		inp->inp_laddr.s_addr = INADDR_ANY;
 		INP_HASH_WUNLOCK(&V_udbinfo);
+		udp_setup_net_channel(inp);
 		soisdisconnected(so);
 	}
 	INP_UNLOCK(inp);
@@ -1432,6 +1667,8 @@ udp_bind(struct socket *so, struct bsd_sockaddr *nam, struct thread *td)
 	INP_HASH_WLOCK(&V_udbinfo);
 	error = in_pcbbind(inp, nam, 0);
 	INP_HASH_WUNLOCK(&V_udbinfo);
+	if (error == 0)
+		udp_setup_net_channel(inp);
 	INP_UNLOCK(inp);
 	return (error);
 }
@@ -1449,6 +1686,7 @@ udp_close(struct socket *so)
 		in_pcbdisconnect(inp);
 		inp->inp_laddr.s_addr = INADDR_ANY;
 		INP_HASH_WUNLOCK(&V_udbinfo);
+		udp_setup_net_channel(inp);
 		soisdisconnected(so);
 	}
 	INP_UNLOCK(inp);
@@ -1472,8 +1710,10 @@ udp_connect(struct socket *so, struct bsd_sockaddr *nam, struct thread *td)
 	INP_HASH_WLOCK(&V_udbinfo);
 	error = in_pcbconnect(inp, nam, 0);
 	INP_HASH_WUNLOCK(&V_udbinfo);
-	if (error == 0)
+	if (error == 0) {
+		udp_setup_net_channel(inp);
 		soisconnected(so);
+	}
 	INP_UNLOCK(inp);
 	return (error);
 }
@@ -1492,6 +1732,7 @@ udp_detach(struct socket *so)
 	INP_LOCK(inp);
 	up = intoudpcb(inp);
 	KASSERT(up != NULL, ("%s: up == NULL", __func__));
+	udp_free_net_channel(inp);
 	inp->inp_ppcb = NULL;
 	in_pcbdetach(inp);
 	in_pcbfree(inp);
@@ -1515,6 +1756,7 @@ udp_disconnect(struct socket *so)
 	in_pcbdisconnect(inp);
 	inp->inp_laddr.s_addr = INADDR_ANY;
 	INP_HASH_WUNLOCK(&V_udbinfo);
+	udp_setup_net_channel(inp);
 	SOCK_LOCK(so);
 	so->so_state &= ~SS_ISCONNECTED;		/* XXX */
 	SOCK_UNLOCK(so);
@@ -1528,9 +1770,22 @@ udp_send(struct socket *so, int flags, struct mbuf *m, struct bsd_sockaddr *addr
 {
 	struct inpcb *inp;
 
+	struct udpcb *up;
+	int error;
+
 	inp = sotoinpcb(so);
 	KASSERT(inp != NULL, ("udp_send: inp == NULL"));
-	return (udp_output(inp, m, addr, control, td));
+	error = udp_output(inp, m, addr, control, td);
+	/* The first send on an unbound socket binds it */
+	up = intoudpcb(inp);
+	if (up->u_nc == NULL && inp->inp_lport != 0 &&
+	    !(so->so_options & (SO_REUSEADDR | SO_REUSEPORT))) {
+		INP_LOCK(inp);
+		if (intoudpcb(inp)->u_nc == NULL)
+			udp_setup_net_channel(inp);
+		INP_UNLOCK(inp);
+	}
+	return (error);
 }
 #endif /* INET */
 
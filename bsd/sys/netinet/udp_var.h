@@ -56,9 +56,12 @@ typedef void(*udp_tun_func_t)(struct mbuf *, int off, struct inpcb *);
 /*
  * UDP control block; one per udp.
  */
+struct udp_net_channel;
+
 struct udpcb {
 	udp_tun_func_t	u_tun_func;	/* UDP kernel tunneling callback. */
 	u_int		u_flags;	/* Generic UDP flags. */
+	struct udp_net_channel *u_nc;	/* fast path from the driver */
 };
 
 #define	intoudpcb(ip)	((struct udpcb *)(ip)->inp_ppcb)
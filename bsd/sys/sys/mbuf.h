@@ -126,6 +126,7 @@ struct pkthdr {
 		u_int16_t vt_vtag;	/* Ethernet 802.1p+q vlan tag */
 		u_int16_t vt_nrecs;	/* # of IGMPv3 records in this chain */
 	} PH_vt;
+	u_int16_t	 data_sum;	/* sum of data, see CSUM_DATA_SUMMED */
 	SLIST_HEAD(packet_tags, m_tag) tags; /* list of packet tags */
 };
 #define ether_vtag	PH_vt.vt_vtag
@@ -288,6 +289,12 @@ struct mbuf {
 
 /*	CSUM_FRAGMENT_IPV6	0x10000		will do IPv6 fragementation */
 
+/*
+ * The payload past the transport header was summed when it was copied in,
+ * and data_sum holds the sum.  Only set for UDP over IPv4.
+ */
+#define	CSUM_DATA_SUMMED	0x01000000
+
 #define	CSUM_DELAY_DATA_IPV6	(CSUM_TCP_IPV6 | CSUM_UDP_IPV6)
 #define	CSUM_DATA_VALID_IPV6	CSUM_DATA_VALID
 
@@ -880,6 +887,7 @@ struct mbuf	*m_pullup(struct mbuf *, int);
 int		m_sanity(struct mbuf *, int);
 struct mbuf	*m_split(struct mbuf *, int, int);
 struct mbuf	*m_uiotombuf(struct uio *, int, int, int, int);
+struct mbuf	*m_uiotombuf_csum(struct uio *, int, int, int, int);
 struct mbuf	*m_unshare(struct mbuf *, int how);
 
 /*-
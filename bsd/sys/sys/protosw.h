@@ -124,6 +124,7 @@ struct protosw {
 #define	PR_RIGHTS	0x10		/* passes capabilities */
 #define PR_IMPLOPCL	0x20		/* implied open/close */
 #define	PR_LASTHDR	0x40		/* enforce ipsec policy; last header */
+#define	PR_CSUMCOPY	0x80		/* sum data as it is copied in */
 
 /*
  * In earlier BSD network stacks, a single pr_usrreq() function pointer was
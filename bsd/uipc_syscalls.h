@@ -23,6 +23,8 @@ int kern_connect(int fd, struct bsd_sockaddr *sa);
 int kern_sendit(int s, struct msghdr *mp, int flags,
     struct mbuf *control, ssize_t *bytes);
 int kern_recvit(int s, struct msghdr *mp, struct mbuf **controlp, ssize_t* bytes);
+int kern_sendfile(int s, struct file *in_fp, off_t *offset, size_t count,
+    ssize_t *bytes);
 int kern_setsockopt(int s, int level, int name, void *val, socklen_t valsize);
 int kern_getsockopt(int s, int level, int name, void *val, socklen_t *valsize);
 int kern_socketpair(int domain, int type, int protocol, int *rsv);
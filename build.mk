@@ -182,9 +182,15 @@ boost-tests := tests/tst-rename.so \
 	tests/misc-bdev-wlatency.so \
 	tests/tst-promise.so \
 	tests/tst-dlfcn.so \
-	tests/tst-stat.so
+	tests/tst-stat.so \
+	tests/tst-align.so
 boost-tests += tests/tst-wait-for.so
 boost-tests += tests/tst-bsd-tcp1.so
+boost-tests += tests/tst-rcu-hashtable.so
+boost-tests += tests/tst-net-channel.so
+boost-tests += tests/tst-lro.so
+boost-tests += tests/tst-udp-cksum.so
+boost-tests += tests/tst-uma.so
 
 java_tests := tests/hello/Hello.class
 
@@ -195,11 +201,15 @@ tests += tests/tst-bsd-kthread.so
 tests += tests/tst-bsd-taskqueue.so
 tests += tests/tst-fpu.so
 tests += tests/tst-preempt.so
+tests += tests/tst-affinity.so
+tests += tests/tst-balance.so
 tests += tests/tst-tracepoint.so
 tests += tests/tst-hub.so
 tests += tests/misc-leak.so
 tests += tests/misc-mmap-anon-perf.so
+tests += tests/misc-mmap-fault-scale.so
 tests += tests/tst-mmap-file.so
+tests += tests/tst-ramfs.so
 tests += tests/tst-mmap.so
 tests += tests/tst-huge.so
 tests += tests/misc-mutex.so
@@ -214,6 +224,7 @@ tests += tests/tst-readdir.so
 tests += tests/tst-remove.so
 tests += tests/misc-wake.so
 tests += tests/tst-epoll.so
+tests += tests/misc-epoll.so
 tests += tests/misc-lfring.so
 tests += tests/tst-fsx.so
 tests += tests/tst-sleep.so
@@ -221,6 +232,9 @@ tests += tests/tst-resolve.so
 tests += tests/tst-except.so
 tests += tests/misc-tcp-sendonly.so
 tests += tests/misc-tcp-hash-srv.so
+tests += tests/misc-tcp-churn.so
+tests += tests/misc-sendfile.so
+tests += tests/misc-fs-pread.so
 tests += tests/misc-loadbalance.so
 tests += tests/misc-scheduler.so
 tests += tests/tst-dns-resolver.so
@@ -242,6 +256,8 @@ tests += tests/misc-procfs.so
 tests += tests/tst-chdir.so
 tests += tests/tst-hello.so
 tests += tests/tst-concurrent-init.so
+tests += tests/misc-cksum.so
+tests += tests/misc-memcpy.so
 
 tests/hello/Hello.class: javabase=tests/hello
 
@@ -462,6 +478,7 @@ zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/dsl_prop.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/dsl_scan.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/dsl_synctask.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/gzip.o
+zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/lz4.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/lzjb.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/metaslab.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/refcount.o
@@ -521,6 +538,7 @@ zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/zvol.o
 zfs-tests += tests/misc-zfs-disk.so
 zfs-tests += tests/misc-zfs-io.so
 zfs-tests += tests/misc-zfs-arc.so
+zfs-tests += tests/misc-zfs-compress.so
 
 tests += tests/tst-zfs-mount.so
 
@@ -635,6 +653,7 @@ objects += core/version.o
 objects += core/waitqueue.o
 objects += core/chart.o
 objects += core/net_channel.o
+objects += core/pagecache.o
 
 include $(src)/fs/build.mk
 include $(src)/libc/build.mk
@@ -7,10 +7,12 @@
 
 // Implement the Linux epoll(7) functions in OSV
 
-// NOTE: This is an inefficient implementation, in which epoll_wait() calls
-// poll(), thereby negating all the performance benefits of using epoll and
-// not poll. This is only a temporary implementation, for getting the
-// functionality of epoll which Java needs - but not its performance.
+// Each epoll_file keeps a list of the registered files that may be ready.
+// poll_wake() on a file puts it on the ready lists of the epolls it is
+// registered with, so epoll_wait() only needs to poll() the files on its
+// ready list rather than every registered file. A level-triggered file that
+// is still ready is put back on the list after being reported, and dropped
+// from it once poll() finds nothing, like in Linux.
 
 #include <sys/epoll.h>
 #include <sys/poll.h>
@@ -23,7 +25,13 @@
 #include <fs/fs.hh>
 
 #include <osv/debug.hh>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/sched.hh>
+#include <osv/clock.hh>
 #include <unordered_map>
+#include <vector>
+#include <boost/intrusive/list.hpp>
 #include <boost/range/algorithm/find.hpp>
 
 #include <osv/trace.hh>
@@ -31,11 +39,13 @@ TRACEPOINT(trace_epoll_create, "returned fd=%d", int);
 TRACEPOINT(trace_epoll_ctl, "epfd=%d, fd=%d, op=%s", int, int, const char*);
 TRACEPOINT(trace_epoll_wait, "epfd=%d, maxevents=%d, timeout=%d", int, int, int);
 TRACEPOINT(trace_epoll_ready, "file=%p, event=0x%x", file*, int);
+TRACEPOINT(trace_epoll_wake, "epoll=%p, file=%p, events=0x%x", file*, file*, int);
 
-// We implement epoll using poll(), and therefore need to convert epoll's
-// event bits to and poll(). These are mostly the same, so the conversion
-// is trivial, but we verify this here with static_asserts. We additionally
-// support the epoll-only EPOLLET, but not EPOLLONESHOT.
+// epoll's event bits are mostly the same as poll()'s, so the conversion is
+// trivial, but we verify this here with static_asserts. We additionally
+// support the epoll-only EPOLLET and EPOLLONESHOT, which are handled here
+// and never passed on to file::poll() - except for EPOLLET, which tells
+// sockets to keep asking for wakeups even while they are ready.
 static_assert(POLLIN == EPOLLIN, "POLLIN!=EPOLLIN");
 static_assert(POLLOUT == EPOLLOUT, "POLLOUT!=EPOLLOUT");
 static_assert(POLLRDHUP == EPOLLRDHUP, "POLLRDHUP!=EPOLLRDHUP");
@@ -44,11 +54,11 @@ static_assert(POLLERR == EPOLLERR, "POLLERR!=EPOLLERR");
 static_assert(POLLHUP == EPOLLHUP, "POLLHUP!=EPOLLHUP");
 constexpr int SUPPORTED_EVENTS =
         EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLERR | EPOLLHUP |
-        EPOLLET;
+        EPOLLET | EPOLLONESHOT;
 inline uint32_t events_epoll_to_poll(uint32_t e)
 {
     assert (!(e & ~SUPPORTED_EVENTS));
-    return e;
+    return e & ~EPOLLONESHOT;
 }
 inline uint32_t events_poll_to_epoll(uint32_t e)
 {
@@ -56,97 +66,228 @@ inline uint32_t events_poll_to_epoll(uint32_t e)
     return e;
 }
 
+namespace bi = boost::intrusive;
+
 struct registered_epoll : epoll_event {
-    int last_poll_wake_count; // For implementing EPOLLET
-    registered_epoll(epoll_event e, int c) :
-        epoll_event(e), last_poll_wake_count(c) {}
+    registered_epoll(file* fp, epoll_event e) : epoll_event(e), fp(fp) {}
+    registered_epoll(const registered_epoll&) = delete;
+    registered_epoll& operator=(const registered_epoll&) = delete;
+    file* fp;
+    // an EPOLLONESHOT registration that fired, until rearmed by EPOLL_CTL_MOD
+    bool disabled = false;
+    bi::list_member_hook<> ready_link;
+    bool ready() const { return ready_link.is_linked(); }
+    // events poll_wake() should queue us for: errors and hangups are
+    // reported even if not asked for.
+    bool wanted(int wake_events) const {
+        return !disabled && (wake_events & (events | EPOLLERR | EPOLLHUP));
+    }
 };
 
 class epoll_file final : public special_file {
+    // Lock ordering: a file's f_lock is taken before _mtx, as poll_wake()
+    // calls wake() with it held. file::poll() is never called under _mtx,
+    // since files may call poll_wake() from under their own locks.
+    mutex _mtx;
+    condvar _waiters;
     std::unordered_map<file*, registered_epoll> map;
+    bi::list<registered_epoll,
+             bi::member_hook<registered_epoll,
+                             bi::list_member_hook<>,
+                             &registered_epoll::ready_link>,
+             bi::constant_time_size<false>> _ready;
 public:
     epoll_file() : special_file(0, DTYPE_UNSPEC) {}
     virtual int close() override {
-        for (auto& e : map) {
-            auto fp = e.first;
+        std::vector<file*> fps;
+        WITH_LOCK(_mtx) {
+            _ready.clear();
+            for (auto& e : map) {
+                fps.push_back(e.first);
+            }
+            map.clear();
+        }
+        for (auto fp : fps) {
             remove_me(fp);
         }
         return 0;
     }
     int add(file* fp, struct epoll_event *event)
     {
-        if (map.count(fp)) {
-            return EEXIST;
-        }
         WITH_LOCK(fp->f_lock) {
-            // I used poll_wake_count-1, to ensure EPOLLET returns once when
-            // registering an epoll after data is already available.
-            map.emplace(std::move(fp),
-                    registered_epoll(*event, fp->poll_wake_count - 1));
+            WITH_LOCK(_mtx) {
+                if (map.count(fp)) {
+                    return EEXIST;
+                }
+                map.emplace(std::piecewise_construct, std::forward_as_tuple(fp),
+                            std::forward_as_tuple(fp, *event));
+            }
             if (!fp->f_epolls) {
                 fp->f_epolls.reset(new std::vector<file*>);
             }
             fp->f_epolls->push_back(this);
         }
+        // Pick up events that happened before we were registered; for
+        // sockets this also arms their wakeups.
+        check_ready(fp);
         return 0;
     }
     int mod(file* fp, struct epoll_event *event)
     {
-        try {
-            WITH_LOCK(fp->f_lock) {
-                map.at(fp) = registered_epoll(*event, fp->poll_wake_count - 1);
+        WITH_LOCK(fp->f_lock) {
+            WITH_LOCK(_mtx) {
+                auto i = map.find(fp);
+                if (i == map.end()) {
+                    return ENOENT;
+                }
+                auto& r = i->second;
+                r.events = event->events;
+                r.data = event->data;
+                r.disabled = false;
             }
-            return 0;
-        } catch (std::out_of_range &e) {
-            return ENOENT;
         }
+        check_ready(fp);
+        return 0;
     }
     int del(file* fp)
     {
-        if (map.erase(fp)) {
-            remove_me(fp);
-            return 0;
-        } else {
-            return ENOENT;
+        WITH_LOCK(fp->f_lock) {
+            WITH_LOCK(_mtx) {
+                auto i = map.find(fp);
+                if (i == map.end()) {
+                    return ENOENT;
+                }
+                unlink_ready(i->second);
+                map.erase(i);
+            }
+            remove_me_locked(fp);
+        }
+        return 0;
+    }
+    // Called by poll_wake(), with fp->f_lock held.
+    void wake(file* fp, int events)
+    {
+        trace_epoll_wake(this, fp, events);
+        WITH_LOCK(_mtx) {
+            auto i = map.find(fp);
+            if (i == map.end()) {
+                return;
+            }
+            queue_ready(i->second, events);
         }
     }
     int wait(struct epoll_event *events, int maxevents, int timeout_ms)
     {
-        std::vector<poll_file> pollfds;
-        pollfds.reserve(map.size());
-        for (auto &i : map) {
-            int eevents = i.second.events;
-            auto events = events_epoll_to_poll(eevents);
-            pollfds.emplace_back(i.first, events, 0,
-                    i.second.last_poll_wake_count);
+        sched::timer tmr(*sched::thread::current());
+        if (timeout_ms > 0) {
+            using namespace osv::clock::literals;
+            tmr.set(timeout_ms * 1_ms);
         }
-        int r = do_poll(pollfds, timeout_ms);
-        if (r > 0) {
-            r = std::min(r, maxevents);
-            int remain = r;
-            for (size_t i = 0; i < pollfds.size() && remain;  i++) {
-                if (pollfds[i].revents) {
-                    --remain;
-                    assert(pollfds[i].fp);
-                    events[remain].data = map.at(pollfds[i].fp.get()).data;
-                    events[remain].events =
-                            events_poll_to_epoll(pollfds[i].revents);
-                    trace_epoll_ready(pollfds[i].fp.get(), pollfds[i].revents);
-                    if (pollfds[i].events & EPOLLET) {
-                        map.at(pollfds[i].fp.get()).last_poll_wake_count =
-                                pollfds[i].last_poll_wake_count;
+        std::vector<fileref> fps;
+        fps.reserve(std::min(maxevents, 64));
+        while (true) {
+            fps.clear();
+            WITH_LOCK(_mtx) {
+                while (_ready.empty()) {
+                    if (timeout_ms == 0 || tmr.expired()) {
+                        return 0;
+                    }
+                    _waiters.wait(_mtx, timeout_ms > 0 ? &tmr : nullptr);
+                }
+                // Take files off the ready list; level-triggered ones that
+                // are still ready go back on it below.
+                while (!_ready.empty() && int(fps.size()) < maxevents) {
+                    auto& r = _ready.front();
+                    _ready.pop_front();
+                    // A file being closed will unregister itself shortly
+                    if (fhold_if_positive(r.fp)) {
+                        fps.emplace_back(r.fp, false);
+                    }
+                }
+            }
+            int n = 0;
+            for (auto& fp : fps) {
+                int pevents;
+                WITH_LOCK(_mtx) {
+                    auto i = map.find(fp.get());
+                    if (i == map.end() || i->second.disabled) {
+                        continue;
+                    }
+                    pevents = events_epoll_to_poll(i->second.events);
+                }
+                int revents = fp->poll(pevents);
+                if (!revents) {
+                    continue;
+                }
+                WITH_LOCK(_mtx) {
+                    auto i = map.find(fp.get());
+                    if (i == map.end() || i->second.disabled) {
+                        continue;
+                    }
+                    auto& r = i->second;
+                    events[n].data = r.data;
+                    events[n].events = events_poll_to_epoll(revents);
+                    ++n;
+                    trace_epoll_ready(fp.get(), revents);
+                    if (r.events & EPOLLONESHOT) {
+                        r.disabled = true;
+                        unlink_ready(r);
+                    } else if (!(r.events & EPOLLET) && !r.ready()) {
+                        _ready.push_back(r);
                     }
                 }
             }
+            if (n) {
+                return n;
+            }
         }
-        return r;
     }
 private:
+    void queue_ready(registered_epoll& r, int events)
+    {
+        if (r.ready() || !r.wanted(events)) {
+            return;
+        }
+        bool was_empty = _ready.empty();
+        _ready.push_back(r);
+        if (was_empty) {
+            _waiters.wake_all();
+        }
+    }
+    void unlink_ready(registered_epoll& r)
+    {
+        if (r.ready()) {
+            _ready.erase(_ready.iterator_to(r));
+        }
+    }
+    void check_ready(file* fp)
+    {
+        int pevents;
+        WITH_LOCK(_mtx) {
+            auto i = map.find(fp);
+            if (i == map.end()) {
+                return;
+            }
+            pevents = events_epoll_to_poll(i->second.events);
+        }
+        int revents = fp->poll(pevents);
+        if (revents) {
+            WITH_LOCK(_mtx) {
+                auto i = map.find(fp);
+                if (i != map.end()) {
+                    queue_ready(i->second, revents);
+                }
+            }
+        }
+    }
+    void remove_me_locked(file* fp) {
+        auto i = boost::range::find(*fp->f_epolls, this);
+        assert(i != fp->f_epolls->end());
+        fp->f_epolls->erase(i);
+    }
     void remove_me(file* fp) {
         WITH_LOCK(fp->f_lock) {
-            auto i = boost::range::find(*fp->f_epolls, this);
-            assert(i != fp->f_epolls->end());
-            fp->f_epolls->erase(i);
+            remove_me_locked(fp);
         }
     }
 };
@@ -242,3 +383,8 @@ void epoll_file_closed(file* epoll_fd, file* client)
     auto epoll_obj = dynamic_cast<epoll_file*>(epoll_ptr.get());
     epoll_obj->del(client);
 }
+
+void epoll_wake(file* epoll_fd, file* client, int events)
+{
+    static_cast<epoll_file*>(epoll_fd)->wake(client, events);
+}
@@ -156,7 +156,9 @@ PCPU_WORKERITEM(free_worker, free_worker_fn);
 //
 // Large objects are rounded up to page size.  They have a page-sized header
 // in front that contains the page size.  The free list (free_page_ranges)
-// is an rbtree sorted by address.  Allocation strategy is first-fit.
+// is an rbtree sorted by address, used to coalesce neighbouring ranges; each
+// range is also kept in a second rbtree sorted by size
+// (free_page_ranges_by_size).  Allocation strategy is best-fit.
 //
 // Objects that are exactly page sized, and allocated by alloc_page(), come
 // from the same pool as large objects, except they don't have a header
@@ -401,6 +403,21 @@ struct addr_cmp {
 
 namespace bi = boost::intrusive;
 
+// Orders by size, breaking ties by address so that best-fit prefers lower
+// addresses.
+struct size_cmp {
+    bool operator()(const page_range& fpr1, const page_range& fpr2) const {
+        return fpr1.size < fpr2.size ||
+               (fpr1.size == fpr2.size && &fpr1 < &fpr2);
+    }
+    bool operator()(const page_range& fpr, size_t size) const {
+        return fpr.size < size;
+    }
+    bool operator()(size_t size, const page_range& fpr) const {
+        return size < fpr.size;
+    }
+};
+
 mutex free_page_ranges_lock;
 bi::set<page_range,
         bi::compare<addr_cmp>,
@@ -408,6 +425,43 @@ bi::set<page_range,
                        bi::set_member_hook<>,
                        &page_range::member_hook>
        > free_page_ranges __attribute__((init_priority((int)init_prio::fpranges)));
+bi::set<page_range,
+        bi::compare<size_cmp>,
+        bi::member_hook<page_range,
+                       bi::set_member_hook<>,
+                       &page_range::size_hook>
+       > free_page_ranges_by_size __attribute__((init_priority((int)init_prio::fpranges)));
+
+// Helpers keeping both indexes of the free page ranges in sync. All of
+// them must be called with free_page_ranges_lock held.
+static void erase_page_range(page_range* range)
+{
+    free_page_ranges.erase(*range);
+    free_page_ranges_by_size.erase(*range);
+}
+
+// Changes the size of a free range, whose start stays the same; a range
+// shrunk to nothing is removed.
+static void resize_page_range(page_range* range, size_t size)
+{
+    free_page_ranges_by_size.erase(*range);
+    range->size = size;
+    if (size) {
+        free_page_ranges_by_size.insert(*range);
+    } else {
+        free_page_ranges.erase(*range);
+    }
+}
+
+// Returns the smallest free range of at least size bytes, or nullptr.
+static page_range* find_page_range(size_t size)
+{
+    auto i = free_page_ranges_by_size.lower_bound(size, size_cmp());
+    if (i == free_page_ranges_by_size.end()) {
+        return nullptr;
+    }
+    return &*i;
+}
 
 // Our notion of free memory is "whatever is in the page ranges". Therefore it
 // starts at 0, and increases as we add page ranges.
@@ -533,7 +587,80 @@ void reclaimer::wait_for_memory(size_t mem)
     }
 }
 
-static void* malloc_large(size_t size)
+static void free_page_range_locked(page_range *range);
+
+// Returns the start of the last block of size bytes within range whose
+// address plus offset is a multiple of align, or 0 if there is none.
+static intptr_t aligned_block(page_range* range, size_t size, size_t align,
+                              size_t offset)
+{
+    if (range->size < size) {
+        return 0;
+    }
+    intptr_t v = (intptr_t) range;
+    intptr_t ret = ((v + range->size - size + offset) & ~(align - 1)) - offset;
+    return ret < v ? 0 : ret;
+}
+
+// Finds a free range holding such a block.
+static page_range* find_aligned_page_range(size_t size, size_t align,
+                                           size_t offset)
+{
+    // Any range of at least size + align - page_size bytes holds one, so
+    // the smallest of those is a log(n) lookup away.
+    auto range = find_page_range(size + align - page_size);
+    if (range) {
+        return range;
+    }
+    // Smaller ranges may still hold one if they happen to be well placed;
+    // all remaining candidates are smaller than size + align, so this walk
+    // is short unless memory is badly fragmented.
+    auto i = free_page_ranges_by_size.lower_bound(size, size_cmp());
+    for (; i != free_page_ranges_by_size.end(); ++i) {
+        if (aligned_block(&*i, size, align, offset)) {
+            return &*i;
+        }
+    }
+    return nullptr;
+}
+
+// Takes size bytes out of the free page ranges, starting at an address
+// that is a multiple of align once offset is added to it, and returns that
+// start; nullptr if there is no such block. Must be called with
+// free_page_ranges_lock held.
+static void* alloc_aligned_page_range(size_t size, size_t align, size_t offset)
+{
+    assert(is_power_of_two(align) && align >= page_size);
+    page_range *range = find_aligned_page_range(size, align, offset);
+    if (!range) {
+        return nullptr;
+    }
+    intptr_t v = (intptr_t) range;
+    // Find the the beginning of the last aligned area in the given
+    // page range. This will be our return value:
+    intptr_t ret = aligned_block(range, size, align, offset);
+    // endsize is the number of bytes in the page range *after* the
+    // block we will return. calculate it before changing header->size
+    size_t endsize = v+range->size-ret-size;
+    // Make the original page range smaller, pointing to the part before
+    // our ret (if there's nothing before, remove this page range).
+    // Note that we bill what is taken off our page ranges, not "size"
+    // bytes; the difference is wiped by the on_free() call that exists
+    // within free_page_range_locked in the conditional right below us.
+    size_t alloc_size = range->size - (ret - v);
+    resize_page_range(range, ret - v);
+    on_alloc(alloc_size);
+
+    // Create a new page range for the endsize part (if there is one)
+    if (endsize > 0) {
+        free_page_range_locked(new ((void *)(ret+size)) page_range(endsize));
+    }
+    return (void*) ret;
+}
+
+// Large objects are preceded by a header page, so for alignments beyond a
+// page the header is placed so that the object itself is aligned.
+static void* malloc_large(size_t size, size_t alignment = page_size)
 {
     size = (size + page_size - 1) & ~(page_size - 1);
     size += page_size;
@@ -542,26 +669,25 @@ static void* malloc_large(size_t size)
         WITH_LOCK(free_page_ranges_lock) {
             reclaimer_thread.wait_for_minimum_memory();
 
-            for (auto i = free_page_ranges.begin(); i != free_page_ranges.end(); ++i) {
-                auto header = &*i;
-                page_range* ret_header;
-                if (header->size >= size) {
-                    if (header->size == size) {
-                        free_page_ranges.erase(i);
-                        ret_header = header;
-                    } else {
-                        void *v = header;
-                        header->size -= size;
-                        ret_header = new (v + header->size) page_range(size);
-                    }
-                    on_alloc(size);
-                    void* obj = ret_header;
-                    obj += page_size;
-                    trace_memory_malloc_large(obj, size);
-                    return obj;
-                }
+            void* v = nullptr;
+            if (alignment > page_size) {
+                v = alloc_aligned_page_range(size, alignment, page_size);
+            } else if (auto header = find_page_range(size)) {
+                // Carve the object out of the end of the range, so the
+                // remainder keeps its header where it is.
+                v = header;
+                resize_page_range(header, header->size - size);
+                v += header->size;
+                on_alloc(size);
             }
-            reclaimer_thread.wait_for_memory(size);
+            if (v) {
+                auto ret_header = new (v) page_range(size);
+                void* obj = ret_header;
+                obj += page_size;
+                trace_memory_malloc_large(obj, size);
+                return obj;
+            }
+            reclaimer_thread.wait_for_memory(size + alignment - page_size);
         }
     }
 }
@@ -705,20 +831,6 @@ void reclaimer::_do_reclaim()
     }
 }
 
-static page_range* merge(page_range* a, page_range* b)
-{
-    void* va = a;
-    void* vb = b;
-
-    if (va + a->size == vb) {
-        a->size += b->size;
-        free_page_ranges.erase(*b);
-        return a;
-    } else {
-        return b;
-    }
-}
-
 // Return a page range back to free_page_ranges. Note how the size of the
 // page range is range->size, but its start is at range itself.
 static void free_page_range_locked(page_range *range)
@@ -727,12 +839,25 @@ static void free_page_range_locked(page_range *range)
 
     on_free(range->size);
 
+    // Coalesce with the neighbours; range is only added to the size index
+    // once its final size is known.
     if (i != free_page_ranges.begin()) {
-        i = free_page_ranges.iterator_to(*merge(&*boost::prior(i), &*i));
+        auto prev = &*boost::prior(i);
+        if (static_cast<void*>(prev) + prev->size == range) {
+            free_page_ranges_by_size.erase(*prev);
+            free_page_ranges.erase(i);
+            prev->size += range->size;
+            range = prev;
+            i = free_page_ranges.iterator_to(*range);
+        }
     }
-    if (boost::next(i) != free_page_ranges.end()) {
-        merge(&*i, &*boost::next(i));
+    auto next = boost::next(i);
+    if (next != free_page_ranges.end() &&
+            static_cast<void*>(range) + range->size == &*next) {
+        range->size += next->size;
+        erase_page_range(&*next);
     }
+    free_page_ranges_by_size.insert(*range);
 }
 
 // Return a page range back to free_page_ranges. Note how the size of the
@@ -790,17 +915,16 @@ static void refill_page_buffer()
             auto limit = (pbuf.max + 1) / 2;
 
             while (pbuf.nr < limit) {
-                auto it = free_page_ranges.begin();
-                if (it == free_page_ranges.end())
+                // Take single pages from the smallest ranges, to keep the
+                // large ones intact for large allocations.
+                auto it = free_page_ranges_by_size.begin();
+                if (it == free_page_ranges_by_size.end())
                     break;
                 auto p = &*it;
                 auto size = std::min(p->size, (limit - pbuf.nr) * page_size);
-                p->size -= size;
                 total_size += size;
+                resize_page_range(p, p->size - size);
                 void* pages = static_cast<void*>(p) + p->size;
-                if (!p->size) {
-                    free_page_ranges.erase(*p);
-                }
                 while (size) {
                     pbuf.free[pbuf.nr++] = pages;
                     pages += page_size;
@@ -860,13 +984,10 @@ static void* early_alloc_page()
             abort("alloc_page(): out of memory\n");
         }
 
-        auto p = &*free_page_ranges.begin();
-        p->size -= page_size;
+        auto p = &*free_page_ranges_by_size.begin();
+        resize_page_range(p, p->size - page_size);
         on_alloc(page_size);
         void* page = static_cast<void*>(p) + p->size;
-        if (!p->size) {
-            free_page_ranges.erase(*p);
-        }
         return page;
     }
 }
@@ -924,55 +1045,19 @@ void free_page(void* v)
 void* alloc_huge_page(size_t N)
 {
     WITH_LOCK(free_page_ranges_lock) {
-        for (auto i = free_page_ranges.begin(); i != free_page_ranges.end(); ++i) {
-            page_range *range = &*i;
-            if (range->size < N)
-                continue;
-            intptr_t v = (intptr_t) range;
-            // Find the the beginning of the last aligned area in the given
-            // page range. This will be our return value:
-            intptr_t ret = (v+range->size-N) & ~(N-1);
-            if (ret<v)
-                continue;
-            // endsize is the number of bytes in the page range *after* the
-            // N bytes we will return. calculate it before changing header->size
-            int endsize = v+range->size-ret-N;
-            // Make the original page range smaller, pointing to the part before
-            // our ret (if there's nothing before, remove this page range)
-            size_t alloc_size;
-            if (ret==v) {
-                alloc_size = range->size;
-                free_page_ranges.erase(*range);
-            } else {
-                // Note that this is is done conditionally because we are
-                // operating page ranges. That is what is left on our page
-                // ranges, so that is what we bill. It doesn't matter that we
-                // are currently allocating "N" bytes.  The difference will be
-                // later on wiped by the on_free() call that exists within
-                // free_page_range in the conditional right below us.
-                alloc_size = range->size - (ret - v);
-                range->size = ret-v;
-            }
-            on_alloc(alloc_size);
-
-            // Create a new page range for the endsize part (if there is one)
-            if (endsize > 0) {
-                void *e = (void *)(ret+N);
-                free_page_range(e, endsize);
-            }
-            // Return the middle 2MB part
-            return (void*) ret;
-            // TODO: consider using tracker.remember() for each one of the small
-            // pages allocated. However, this would be inefficient, and since we
-            // only use alloc_huge_page in one place, maybe not worth it.
+        void* ret = alloc_aligned_page_range(N, N, 0);
+        if (!ret) {
+            // Definitely a sign we are somewhat short on memory. It doesn't *mean* we
+            // are, because that might be just fragmentation. But we wake up the reclaimer
+            // just to be sure, and if this is not real pressure, it will just go back to
+            // sleep
+            reclaimer_thread.wake();
+            trace_memory_huge_failure(free_page_ranges.size());
         }
-        // Definitely a sign we are somewhat short on memory. It doesn't *mean* we
-        // are, because that might be just fragmentation. But we wake up the reclaimer
-        // just to be sure, and if this is not real pressure, it will just go back to
-        // sleep
-        reclaimer_thread.wake();
-        trace_memory_huge_failure(free_page_ranges.size());
-        return nullptr;
+        return ret;
+        // TODO: consider using tracker.remember() for each one of the small
+        // pages allocated. However, this would be inefficient, and since we
+        // only use alloc_huge_page in one place, maybe not worth it.
     }
 }
 
@@ -1013,16 +1098,32 @@ void  __attribute__((constructor(init_prio::mempool))) setup()
     arch_setup_free_memory();
 }
 
-void debug_memory_pool(size_t *total, size_t *contig)
+void debug_memory_pool(size_t *total, size_t *contig, fragmentation_report *frag)
 {
     *total = *contig = 0;
+    if (frag) {
+        *frag = {};
+    }
 
     WITH_LOCK(free_page_ranges_lock) {
+        if (!free_page_ranges_by_size.empty()) {
+            *contig = free_page_ranges_by_size.rbegin()->size;
+        }
         for (auto i = free_page_ranges.begin(); i != free_page_ranges.end(); ++i) {
             auto header = &*i;
             *total += header->size;
-            if (header->size > *contig) {
-                *contig = header->size;
+            if (frag) {
+                // floor(log2(pages))
+                unsigned order = ilog2_roundup(header->size / page_size + 1) - 1;
+                order = std::min(order, fragmentation_report::nr_orders - 1);
+                frag->ranges[order]++;
+                frag->nr_ranges++;
+                auto v = reinterpret_cast<uintptr_t>(header);
+                auto start = align_up(v, mmu::huge_page_size);
+                auto end = align_down(v + header->size, mmu::huge_page_size);
+                if (start < end) {
+                    frag->huge_pages += (end - start) / mmu::huge_page_size;
+                }
             }
         }
     }
@@ -1058,6 +1159,28 @@ static inline void* std_malloc(size_t size)
     return ret;
 }
 
+// Objects in the small object pools are naturally aligned to their (power
+// of two) size, so small aligned requests just use a pool of at least the
+// alignment's size. Large objects are page aligned; larger alignments are
+// handled by malloc_large() directly.
+static inline void* std_memalign(size_t alignment, size_t size)
+{
+    if ((ssize_t)size < 0)
+        return libc_error_ptr<void *>(ENOMEM);
+    void *ret;
+    if (size <= memory::pool::max_object_size &&
+            alignment <= memory::pool::max_object_size && smp_allocator) {
+        size = std::max(size, alignment);
+        size = std::max(size, memory::pool::min_object_size);
+        unsigned n = ilog2_roundup(size);
+        ret = memory::malloc_pools[n].alloc();
+    } else {
+        ret = memory::malloc_large(size, std::max(alignment, memory::page_size));
+    }
+    memory::tracker_remember(ret, size);
+    return ret;
+}
+
 void* calloc(size_t nmemb, size_t size)
 {
     if (nmemb > std::numeric_limits<size_t>::max() / size)
@@ -1162,6 +1285,16 @@ void* malloc(size_t size)
     return v;
 }
 
+// Debug allocations are page aligned; larger alignments, and all of them
+// while the debug allocator is not enabled yet, take the ordinary path.
+void* memalign(size_t alignment, size_t size)
+{
+    if (!enabled || alignment > mmu::page_size) {
+        return std_memalign(alignment, size);
+    }
+    return malloc(size);
+}
+
 void free(void* v)
 {
     if (v < debug_base) {
@@ -1235,11 +1368,7 @@ void free(void* obj)
 }
 
 // posix_memalign() and C11's aligned_alloc() return an aligned memory block
-// that can be freed with an ordinary free(). The following is a temporary
-// implementation that simply calls malloc(), aborting when the desired
-// alignment has not been achieved. In particular, for large allocations
-// our malloc() already returns page-aligned blocks, so such memalign()
-// calls will succeed.
+// that can be freed with an ordinary free().
 
 int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
@@ -1250,16 +1379,17 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
     if (!is_power_of_two(alignment)) {
         return EINVAL;
     }
-    void *ret = malloc(size);
+#if CONF_debug_memory == 0
+    void *ret = std_memalign(alignment, size);
+#else
+    void *ret = dbg::memalign(alignment, size);
+#endif
     if (!ret) {
         return ENOMEM;
     }
-    // Until we have a full implementation, just croak if we didn't get
-    // the desired alignment.
-    assert (!(reinterpret_cast<uintptr_t>(ret) & (alignment - 1)));
+    trace_memory_malloc(ret, size);
     *memptr = ret;
     return 0;
-
 }
 
 void *aligned_alloc(size_t alignment, size_t size)
@@ -1284,12 +1414,11 @@ void enable_debug_allocator()
 
 void* alloc_phys_contiguous_aligned(size_t size, size_t align)
 {
-    assert(align <= page_size); // implementation limitation
     assert(is_power_of_two(align));
     // make use of the standard allocator returning page-aligned
     // physically contiguous memory:
     size = std::max(page_size, size);
-    return std_malloc(size);
+    return std_memalign(align, size);
 }
 
 void free_phys_contiguous_aligned(void* p)
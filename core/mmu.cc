@@ -7,6 +7,7 @@
 
 #include <osv/mmu.hh>
 #include <osv/mempool.hh>
+#include <osv/sched.hh>
 #include "processor.hh"
 #include <osv/debug.hh>
 #include "exceptions.hh"
@@ -22,8 +23,12 @@
 #include "fs/vfs/vfs.h"
 #include <osv/error.h>
 #include <osv/trace.hh>
+#include <osv/percpu.hh>
+#include <osv/preempt-lock.hh>
+#include <osv/clock.hh>
 #include "arch-mmu.hh"
 #include <stack>
+#include <atomic>
 #include "java/jvm_balloon.hh"
 
 extern void* elf_start;
@@ -69,9 +74,127 @@ struct vma_list_type : vma_list_base {
 __attribute__((init_priority((int)init_prio::vma_list)))
 vma_list_type vma_list;
 
-// A fairly coarse-grained mutex serializing modifications to both
-// vma_list and the page table itself.
-mutex vma_list_mutex;
+// A reader/writer lock protecting vma_list and the page table itself.
+//
+// Anything that changes the layout of the address space (mmap, munmap,
+// mprotect, ...) takes it for write, using the plain lock()/unlock()
+// interface so std::lock_guard<> and WITH_LOCK() keep working. Page faults
+// on an existing vma only need the vma to stay put while they fill in
+// ptes, which is done with compare-exchange anyway, so they take it for
+// read and can run concurrently.
+//
+// Readers only touch a counter of their own cpu, so concurrent faults do
+// not bounce a shared cache line; a writer announces itself in _writer and
+// waits for the sum of the counters to drop to zero. The read side is
+// reentrant (a fault handler can fault again), and a writer may take the
+// read side too, as it already excludes everybody else.
+class vma_list_lock {
+public:
+    void lock();
+    void unlock();
+    void rlock();
+    void runlock();
+    bool wowned() const {
+        return _wowner.load(std::memory_order_relaxed) == sched::thread::current();
+    }
+private:
+    long readers() const;
+    struct alignas(64) reader_count {
+        std::atomic<long> n { 0 };
+    };
+    // indexed by the cpu the read lock was taken on; a reader may migrate
+    // before unlocking, so a single counter can go negative, only the sum
+    // is meaningful.
+    reader_count _readers[sched::max_cpus];
+    std::atomic<bool> _writer { false };
+    std::atomic<sched::thread*> _wowner { nullptr };
+    unsigned _wdepth = 0;
+    sched::thread_handle _wthread;
+    mutex _wmutex;
+};
+
+static __thread unsigned vma_list_rdepth;
+
+long vma_list_lock::readers() const
+{
+    long sum = 0;
+    for (auto& r : _readers) {
+        sum += r.n.load();
+    }
+    return sum;
+}
+
+void vma_list_lock::rlock()
+{
+    if (vma_list_rdepth++ || wowned()) {
+        return;
+    }
+    for (;;) {
+        auto c = sched::cpu::current();
+        auto& n = _readers[c ? c->id : 0].n;
+        n.fetch_add(1);
+        if (!_writer.load()) {
+            return;
+        }
+        // A writer is waiting for the readers to drain, back off and wait
+        // for it to finish.
+        n.fetch_sub(1);
+        _wthread.wake();
+        WITH_LOCK(_wmutex) {
+        }
+    }
+}
+
+void vma_list_lock::runlock()
+{
+    if (--vma_list_rdepth || wowned()) {
+        return;
+    }
+    auto c = sched::cpu::current();
+    _readers[c ? c->id : 0].n.fetch_sub(1);
+    if (_writer.load()) {
+        _wthread.wake();
+    }
+}
+
+void vma_list_lock::lock()
+{
+    // upgrading a read lock would deadlock against ourselves
+    assert(!vma_list_rdepth || wowned());
+    _wmutex.lock();
+    if (_wdepth++) {
+        return;
+    }
+    auto t = sched::thread::current();
+    _wowner.store(t, std::memory_order_relaxed);
+    _writer.store(true);
+    if (readers() == 0) {
+        return;
+    }
+    _wthread.reset(*t);
+    sched::thread::wait_until([&] { return readers() == 0; });
+}
+
+void vma_list_lock::unlock()
+{
+    if (!--_wdepth) {
+        _writer.store(false);
+        _wthread.clear();
+        _wowner.store(nullptr, std::memory_order_relaxed);
+    }
+    _wmutex.unlock();
+}
+
+vma_list_lock vma_list_mutex;
+
+// Holds vma_list_mutex for read for the lifetime of the object.
+class vma_list_read_guard {
+public:
+    vma_list_read_guard() { vma_list_mutex.rlock(); }
+    ~vma_list_read_guard() { vma_list_mutex.runlock(); }
+    vma_list_read_guard(const vma_list_read_guard&) = delete;
+    vma_list_read_guard& operator=(const vma_list_read_guard&) = delete;
+};
 
 hw_ptep follow(pt_element pte)
 {
@@ -130,10 +253,18 @@ phys allocate_intermediate_level()
     return pt_page;
 }
 
-void allocate_intermediate_level(hw_ptep ptep)
+// Install a new intermediate page table in ptep, provided it still holds
+// org. Page faults run concurrently, so another cpu may have filled the
+// pte in the meantime; in that case keep theirs. Returns the pte installed.
+pt_element allocate_intermediate_level(hw_ptep ptep, pt_element org)
 {
     phys pt_page = allocate_intermediate_level();
-    ptep.write(make_normal_pte(pt_page));
+    auto pte = make_normal_pte(pt_page);
+    if (!ptep.compare_exchange(org, pte)) {
+        memory::free_page(phys_to_virt(pt_page));
+        return ptep.read();
+    }
+    return pte;
 }
 
 bool change_perm(hw_ptep ptep, unsigned int perm)
@@ -147,7 +278,8 @@ bool change_perm(hw_ptep ptep, unsigned int perm)
     // permission is requested, we must also grant read permission.
     // Linux does this too.
     pte.set_present(perm);
-    pte.set_writable(perm & perm_write);
+    // a copy-on-write page stays read-only until the write fault copies it
+    pte.set_writable((perm & perm_write) && !pte.cow());
     pte.set_nx(!(perm & perm_exec));
     ptep.write(pte);
 
@@ -160,7 +292,7 @@ void split_large_page(hw_ptep ptep, unsigned level)
     if (level == 1) {
         pte_orig.set_large(false);
     }
-    allocate_intermediate_level(ptep);
+    allocate_intermediate_level(ptep, pte_orig);
     auto pt = follow(ptep.read());
     for (auto i = 0; i < pte_per_page; ++i) {
         pt_element tmp = pte_orig;
@@ -176,6 +308,9 @@ struct map_page_ops {
     virtual void free(void *addr, uintptr_t offset) = 0;
     virtual void free(void *addr, size_t size, uintptr_t offset) = 0;
     virtual void finalize() = 0;
+    // true if alloc() returns pages shared with others, which a private
+    // mapping must copy before writing to them
+    virtual bool cow() { return false; }
     virtual ~map_page_ops() {}
 };
 
@@ -203,35 +338,172 @@ void tlb_flush_this_processor()
     processor::write_cr3(processor::read_cr3());
 }
 
-// tlb_flush() does TLB flush on *all* processors, not returning before all
-// processors confirm flushing their TLB. This is slow, but necessary for
-// correctness so that, for example, after mprotect() returns, no thread on
-// no cpu can write to the protected page.
+// Invalidating pages one by one beats flushing the whole TLB (and then
+// refilling it) only for small ranges.
+static constexpr size_t tlb_flush_pages_max = 32;
+
+static void tlb_flush_this_processor(uintptr_t start, size_t size)
+{
+    if (size > tlb_flush_pages_max * page_size) {
+        tlb_flush_this_processor();
+        return;
+    }
+    for (auto addr = start; addr < start + size; addr += page_size) {
+        processor::invlpg(reinterpret_cast<void*>(addr));
+    }
+}
+
+// tlb_flush() flushes a range of addresses from the TLB of *all* processors,
+// not returning before all processors confirm flushing their TLB. This is
+// slow, but necessary for correctness so that, for example, after mprotect()
+// returns, no thread on no cpu can write to the protected page.
+//
+// Idle cpus are not interrupted.  The idle thread only uses mappings which
+// never change (the linear map, its own stack), so we just mark them stale,
+// and they flush their whole TLB before switching to another thread.
+//
+// The mark is only made, atomically, on a cpu which is still idle, and the
+// cpu takes it when leaving idle; so a flush either interrupts the cpu or
+// is sure to be seen by it.  A cpu which is interrupted owes nothing to
+// other flushes: the IPI may come when it is already idle, or leaving it.
+enum class lazy_tlb_state {
+    busy,
+    idle,
+    stale,    // idle, and skipped by a flush
+};
+PERCPU(std::atomic<lazy_tlb_state>, lazy_tlb);
+
 mutex tlb_flush_mutex;
 sched::thread *tlb_flush_waiter;
 std::atomic<int> tlb_flush_pendingconfirms;
+uintptr_t tlb_flush_start;
+size_t tlb_flush_size;
+
+TRACEPOINT(trace_mmu_tlb_shootdown, "start=%p, size=%d, cpus=%d", uintptr_t, size_t, unsigned);
+
+// Protected by tlb_flush_mutex
+static struct {
+    ulong total;
+    long second;
+    ulong this_second;
+    ulong last_second;
+} shootdown_stats;
+
+static void roll_shootdown_stats()
+{
+    using namespace std::chrono;
+    auto now = duration_cast<seconds>(osv::clock::uptime::now().time_since_epoch()).count();
+    auto& s = shootdown_stats;
+    if (now != s.second) {
+        s.last_second = now == s.second + 1 ? s.this_second : 0;
+        s.this_second = 0;
+        s.second = now;
+    }
+}
 
 inter_processor_interrupt tlb_flush_ipi{[] {
-        tlb_flush_this_processor();
+        tlb_flush_this_processor(tlb_flush_start, tlb_flush_size);
         if (tlb_flush_pendingconfirms.fetch_add(-1) == 1) {
             tlb_flush_waiter->wake();
         }
 }};
 
-void tlb_flush()
+void lazy_tlb_enter()
+{
+    lazy_tlb->store(lazy_tlb_state::idle, std::memory_order_relaxed);
+}
+
+void lazy_tlb_leave()
+{
+    if (lazy_tlb->exchange(lazy_tlb_state::busy) == lazy_tlb_state::stale) {
+        tlb_flush_this_processor();
+    }
+}
+
+// Marks an idle cpu stale; returns false if the cpu is busy, and has to be
+// interrupted instead.
+static bool lazy_tlb_skip(sched::cpu* c)
 {
-    tlb_flush_this_processor();
-    if (sched::cpus.size() <= 1)
+    auto& lazy = *lazy_tlb.for_cpu(c);
+    auto state = lazy_tlb_state::idle;
+    // a cpu already stale needs no new mark
+    return lazy.compare_exchange_strong(state, lazy_tlb_state::stale)
+            || state == lazy_tlb_state::stale;
+}
+
+void tlb_flush(uintptr_t start, size_t size)
+{
+    if (sched::cpus.size() <= 1) {
+        tlb_flush_this_processor(start, size);
         return;
+    }
+    sched::cpu_set targets;
+    unsigned ntargets = 0;
+    WITH_LOCK(preempt_lock) {
+        tlb_flush_this_processor(start, size);
+        auto self = sched::cpu::current();
+        for (auto c : sched::cpus) {
+            if (c == self) {
+                continue;
+            }
+            if (!lazy_tlb_skip(c)) {
+                targets.set(c->id);
+                ++ntargets;
+            }
+        }
+    }
+    if (!ntargets) {
+        return;
+    }
     std::lock_guard<mutex> guard(tlb_flush_mutex);
+    trace_mmu_tlb_shootdown(start, size, ntargets);
+    roll_shootdown_stats();
+    ++shootdown_stats.total;
+    ++shootdown_stats.this_second;
+    tlb_flush_start = start;
+    tlb_flush_size = size;
     tlb_flush_waiter = sched::thread::current();
-    tlb_flush_pendingconfirms.store((int)sched::cpus.size() - 1);
-    tlb_flush_ipi.send_allbutself();
+    tlb_flush_pendingconfirms.store(ntargets);
+    WITH_LOCK(preempt_lock) {
+        // we may have moved to one of the targets since choosing them
+        if (ntargets == sched::cpus.size() - 1 && !targets.test(sched::cpu::current()->id)) {
+            tlb_flush_ipi.send_allbutself();
+        } else {
+            for (auto id : targets) {
+                tlb_flush_ipi.send(sched::cpus[id]);
+            }
+        }
+    }
     sched::thread::wait_until([] {
             return tlb_flush_pendingconfirms.load() == 0;
     });
 }
 
+namespace stats {
+
+ulong tlb_shootdowns()
+{
+    std::lock_guard<mutex> guard(tlb_flush_mutex);
+    return shootdown_stats.total;
+}
+
+ulong tlb_shootdowns_per_second()
+{
+    std::lock_guard<mutex> guard(tlb_flush_mutex);
+    roll_shootdown_stats();
+    return shootdown_stats.last_second;
+}
+
+}
+
+std::string procfs_tlb()
+{
+    std::ostringstream os;
+    osv::fprintf(os, "shootdowns %d\nshootdowns_per_second %d\n",
+        stats::tlb_shootdowns(), stats::tlb_shootdowns_per_second());
+    return os.str();
+}
+
 void clamp(uintptr_t& vstart1, uintptr_t& vend1,
            uintptr_t min, size_t max, size_t slop)
 {
@@ -356,12 +628,18 @@ private:
         pt_mapper(ptep, base_virt);
     }
     void operator()(hw_ptep parent, uintptr_t base_virt = 0) {
-        if (!parent.read().present()) {
+        auto pte = parent.read();
+        if (!pte.present()) {
             if (!page_mapper.allocate_intermediate()) {
                 return;
             }
-            allocate_intermediate_level(parent);
-        } else if (parent.read().large()) {
+            pte = allocate_intermediate_level(parent, pte);
+            if (pte.large()) {
+                // A concurrent fault mapped a huge page here before us, so
+                // there is nothing left to populate.
+                return;
+            }
+        } else if (pte.large()) {
             if (ParentLevel > 0 && page_mapper.split_large(parent, ParentLevel)) {
                 // We're trying to change a small page out of a huge page (or
                 // in the future, potentially also 2 MB page out of a 1 GB),
@@ -437,6 +715,8 @@ class vma_operation :
 public:
     // returns true if tlb flush is needed after address range processing is completed.
     bool tlb_flush_needed(void) { return false; }
+    // called by operate_range() with the range it is about to process.
+    void set_range(uintptr_t start, size_t size) {}
     // this function is called at the very end of operate_range(). vma_operation may do
     // whatever cleanup is needed here.
     void finalize(void) { return; }
@@ -462,19 +742,38 @@ private:
     map_page_ops* _pops;
     unsigned int perm;
     bool _map_dirty;
+    bool _cow;
+    bool* _failed;
     pt_element dirty(pt_element pte) {
         pte.set_dirty(_map_dirty);
         return pte;
     }
+    pt_element make_pte(phys page) {
+        if (!_cow) {
+            return dirty(make_normal_pte(page, perm));
+        }
+        auto pte = dirty(make_normal_pte(page, perm & ~perm_write));
+        pte.set_cow(true);
+        return pte;
+    }
 public:
-    populate(map_page_ops* pops, unsigned int perm, bool map_dirty = true) :
-        _pops(pops), perm(perm), _map_dirty(map_dirty) { }
+    // failed, if given, is set when a page could not be brought in (an I/O
+    // error reading a file's page), which is left unmapped
+    populate(map_page_ops* pops, unsigned int perm, bool map_dirty = true, bool* failed = nullptr) :
+        _pops(pops), perm(perm), _map_dirty(map_dirty), _cow(pops->cow()), _failed(failed) { }
     void small_page(hw_ptep ptep, uintptr_t offset){
         if (!ptep.read().empty()) {
             return;
         }
-        phys page = virt_to_phys(_pops->alloc(offset));
-        if (!ptep.compare_exchange(make_empty_pte(), dirty(make_normal_pte(page, perm)))) {
+        void* vpage = _pops->alloc(offset);
+        if (!vpage) {
+            if (_failed) {
+                *_failed = true;
+            }
+            return;
+        }
+        phys page = virt_to_phys(vpage);
+        if (!ptep.compare_exchange(make_empty_pte(), make_pte(page))) {
             _pops->free(phys_to_virt(page), offset);
         } else {
             this->account(mmu::page_size);
@@ -503,13 +802,16 @@ public:
 struct tlb_gather {
     explicit tlb_gather(map_page_ops* ops) : ops(ops) {}
     ~tlb_gather() { flush(); }
-    static constexpr size_t max_pages = 20;
+    static constexpr size_t max_pages = 64;
     struct tlb_page {
         void* addr;
         size_t size;
         off_t offset; // FIXME: unneeded?
     };
     map_page_ops* ops;
+    // the addresses the pages were mapped at are somewhere in here
+    uintptr_t start = 0;
+    size_t size = ~size_t(0);
     size_t nr_pages = 0;
     tlb_page pages[max_pages];
     void push(void* addr, size_t size, off_t offset) {
@@ -522,7 +824,7 @@ struct tlb_gather {
         if (!nr_pages) {
             return;
         }
-        tlb_flush();
+        tlb_flush(start, size);
         for (auto i = 0u; i < nr_pages; ++i) {
             auto&& tp = pages[i];
             if (tp.size == page_size) {
@@ -545,6 +847,10 @@ private:
     tlb_gather _tlb_gather;
 public:
     unpopulate(map_page_ops* pops) : _tlb_gather(pops) {}
+    void set_range(uintptr_t start, size_t size) {
+        _tlb_gather.start = start;
+        _tlb_gather.size = size;
+    }
     void small_page(hw_ptep ptep, uintptr_t offset) {
         // Note: we free the page even if it is already marked "not present".
         // evacuate() makes sure we are only called for allocated pages, and
@@ -586,6 +892,80 @@ public:
     bool tlb_flush_needed(void) {return do_flush;}
 };
 
+/*
+ * Unmaps the pages of a file mapping that the file lent from its
+ * filesystem's cache, and lets go of them.  Shared file pages are never
+ * mapped huge.
+ */
+class drop_lent : public vma_operation<allocate_intermediate_opt::no, skip_empty_opt::yes> {
+private:
+    file* _file;
+    f_offset _foffset;
+    tlb_gather _tlb_gather;
+public:
+    drop_lent(file* file, f_offset foffset, map_page_ops* pops)
+        : _file(file), _foffset(foffset), _tlb_gather(pops) {}
+    void set_range(uintptr_t start, size_t size) {
+        _tlb_gather.start = start;
+        _tlb_gather.size = size;
+    }
+    void small_page(hw_ptep ptep, uintptr_t offset) {
+        pt_element pte = ptep.read();
+        void* page = phys_to_virt(pte.addr(false));
+        if (_file->page_lent(page, _foffset + offset)) {
+            ptep.write(make_empty_pte());
+            _tlb_gather.push(page, page_size, offset);
+        }
+    }
+    bool huge_page(hw_ptep ptep, uintptr_t offset) {
+        return true;
+    }
+    bool tlb_flush_needed(void) {
+        return false; // ~tlb_gather will take care of everything
+    }
+};
+
+/*
+ * Replaces a copy-on-write mapping of a shared page with a writable private
+ * copy of it, and lets go of the shared page.
+ */
+class break_cow : public vma_operation<allocate_intermediate_opt::no, skip_empty_opt::yes> {
+private:
+    map_page_ops* _pops;
+    unsigned int _perm;
+    void* _shared = nullptr;
+    uintptr_t _offset = 0;
+public:
+    break_cow(map_page_ops* pops, unsigned int perm) : _pops(pops), _perm(perm) {}
+    void small_page(hw_ptep ptep, uintptr_t offset) {
+        pt_element pte = ptep.read();
+        if (!pte.cow()) {
+            // another thread got here first
+            return;
+        }
+        void* shared = phys_to_virt(pte.addr(false));
+        void* copy = memory::alloc_page();
+        memcpy(copy, shared, page_size);
+        if (ptep.compare_exchange(pte, make_normal_pte(virt_to_phys(copy), _perm))) {
+            _shared = shared;
+            _offset = offset;
+        } else {
+            memory::free_page(copy);
+        }
+    }
+    bool huge_page(hw_ptep ptep, uintptr_t offset) {
+        // shared pages are never mapped huge
+        return true;
+    }
+    bool tlb_flush_needed(void) { return _shared != nullptr; }
+    void finalize() {
+        // after the flush, as other cpus may still be reading it
+        if (_shared) {
+            _pops->free(_shared, _offset);
+        }
+    }
+};
+
 class count_maps:
     public vma_operation<allocate_intermediate_opt::no,
                          skip_empty_opt::yes, account_opt::yes> {
@@ -699,14 +1079,11 @@ template<typename T> ulong operate_range(T mapper, void *vma_start, void *start,
     start = align_down(start, page_size);
     size = std::max(align_up(size, page_size), page_size);
     uintptr_t virt = reinterpret_cast<uintptr_t>(start);
+    mapper.set_range(virt, size);
     map_range(reinterpret_cast<uintptr_t>(vma_start), virt, size, mapper);
 
-    // TODO: consider if instead of requesting a full TLB flush, we should
-    // instead try to make more judicious use of INVLPG - e.g., in
-    // split_large_page() and other specific places where we modify specific
-    // page table entries.
     if (mapper.tlb_flush_needed()) {
-        tlb_flush();
+        tlb_flush(virt, size);
     }
     mapper.finalize();
     return mapper.account_results();
@@ -919,6 +1296,42 @@ public:
     }
 };
 
+// Maps the pages the file lends (its own, or the page cache's), so all
+// mappings of a file share one copy of it, which read() and write() see
+// as well.  Private mappings map them copy-on-write.
+class map_file_page_shared : public map_page_ops {
+private:
+    file *_file;
+    f_offset _foffset;
+    bool _private;
+public:
+    map_file_page_shared(file *file, f_offset foffset, bool priv)
+        : _file(file), _foffset(foffset), _private(priv) {}
+    virtual void* alloc(uintptr_t offset) override {
+        // nullptr on an I/O error, which the fault turns into SIGBUS
+        return _file->get_page(_foffset + offset);
+    }
+    virtual void* alloc(size_t size, uintptr_t offset) override {
+        // the file's pages are not physically contiguous
+        return nullptr;
+    }
+    virtual void free(void *addr, uintptr_t offset) override {
+        if (!_file->put_page(addr, _foffset + offset)) {
+            // a private mapping's copy of the page
+            assert(_private);
+            memory::free_page(addr);
+        }
+    }
+    virtual void free(void *addr, size_t size, uintptr_t offset) override {
+        abort();
+    }
+    virtual void finalize() override {
+    }
+    virtual bool cow() override {
+        return _private;
+    }
+};
+
 uintptr_t allocate(vma *v, uintptr_t start, size_t size, bool search)
 {
     if (search) {
@@ -938,9 +1351,15 @@ uintptr_t allocate(vma *v, uintptr_t start, size_t size, bool search)
     return start;
 }
 
+// The v*() functions below manage page tables of areas that are not covered
+// by any vma (the debug allocator), so they need not exclude page faults;
+// they are called from malloc(), which may run under vma_list_mutex held
+// for read, so they must not wait for it either.
+static mutex vpopulate_mutex;
+
 void vpopulate(void* addr, size_t size)
 {
-    WITH_LOCK(vma_list_mutex) {
+    WITH_LOCK(vpopulate_mutex) {
         map_anon_page map;
         operate_range(populate<>(&map, perm_rwx), addr, size);
     }
@@ -948,7 +1367,7 @@ void vpopulate(void* addr, size_t size)
 
 void vdepopulate(void* addr, size_t size)
 {
-    WITH_LOCK(vma_list_mutex) {
+    WITH_LOCK(vpopulate_mutex) {
         map_anon_page map;
         operate_range(unpopulate<>(&map), addr, size);
     }
@@ -956,7 +1375,7 @@ void vdepopulate(void* addr, size_t size)
 
 void vcleanup(void* addr, size_t size)
 {
-    WITH_LOCK(vma_list_mutex) {
+    WITH_LOCK(vpopulate_mutex) {
         cleanup_intermediate_pages cleaner;
         map_range(reinterpret_cast<uintptr_t>(addr), reinterpret_cast<uintptr_t>(addr), size,
                 cleaner, huge_page_size);
@@ -969,7 +1388,7 @@ void* map_anon(void* addr, size_t size, unsigned flags, unsigned perm)
     size = align_up(size, mmu::page_size);
     auto start = reinterpret_cast<uintptr_t>(addr);
     auto* vma = new mmu::anon_vma(addr_range(start, start + size), perm, flags);
-    std::lock_guard<mutex> guard(vma_list_mutex);
+    std::lock_guard<vma_list_lock> guard(vma_list_mutex);
     auto v = (void*) allocate(vma, start, size, search);
     if (flags & mmap_populate) {
         vma->operate_range(populate<>(vma->page_ops(), perm, vma->map_dirty()), v, size);
@@ -977,6 +1396,19 @@ void* map_anon(void* addr, size_t size, unsigned flags, unsigned perm)
     return v;
 }
 
+// Pages a file lent must not stay mapped once a mapping can write the file
+// (see file::add_writer()): have them fault back in as its own.  Called
+// with vma_list_mutex held for write, so no fault maps more meanwhile.
+static void unmap_lent_pages(file* writer)
+{
+    for (auto& v : vma_list) {
+        auto fv = dynamic_cast<file_vma*>(&v);
+        if (fv) {
+            fv->drop_lent_pages(writer);
+        }
+    }
+}
+
 void* map_file(void* addr, size_t size, unsigned flags, unsigned perm,
               fileref f, f_offset offset)
 {
@@ -989,6 +1421,9 @@ void* map_file(void* addr, size_t size, unsigned flags, unsigned perm,
     void *v;
     WITH_LOCK(vma_list_mutex) {
         v = (void*) allocate(vma, start, asize, search);
+        if (shared && (perm & perm_write)) {
+            unmap_lent_pages(f.get());
+        }
         if (flags & mmap_populate) {
             map = vma->page_ops();
             vma->operate_range(populate<>(map, perm, vma->map_dirty()), v, asize);
@@ -1077,18 +1512,52 @@ void vm_sigsegv(uintptr_t addr, exception_frame* ef)
     osv::handle_segmentation_fault(addr, ef);
 }
 
+void vm_sigbus(uintptr_t addr, exception_frame* ef)
+{
+    auto pc = reinterpret_cast<void*>(ef->rip);
+    if (pc >= text_start && pc < text_end) {
+        abort("failed to read in mapped file page outside application, addr %lx", addr);
+    }
+    osv::handle_bus_error(addr, ef);
+}
+
+static vma* find_fault_vma(uintptr_t addr, exception_frame* ef)
+{
+    auto vma = vma_list.find(addr_range(addr, addr+1), vma::addr_compare());
+    if (vma == vma_list.end() || access_fault(*vma, ef->error_code)) {
+        return nullptr;
+    }
+    return &*vma;
+}
+
 void vm_fault(uintptr_t addr, exception_frame* ef)
 {
     trace_mmu_vm_fault(addr, ef->error_code);
     addr = align_down(addr);
-    WITH_LOCK(vma_list_mutex) {
-        auto vma = vma_list.find(addr_range(addr, addr+1), vma::addr_compare());
-        if (vma == vma_list.end() || access_fault(*vma, ef->error_code)) {
-            vm_sigsegv(addr, ef);
-            trace_mmu_vm_fault_sigsegv(addr, ef->error_code);
-            return;
+    bool exclusive = false;
+    vma* v;
+    {
+        vma_list_read_guard guard;
+        v = find_fault_vma(addr, ef);
+        if (v && v->fault_needs_exclusive()) {
+            exclusive = true;
+        } else if (v) {
+            v->fault(addr, ef);
+        }
+    }
+    if (exclusive) {
+        WITH_LOCK(vma_list_mutex) {
+            // the vma may have gone away while we were not holding the lock
+            v = find_fault_vma(addr, ef);
+            if (v) {
+                v->fault(addr, ef);
+            }
         }
-        vma->fault(addr, ef);
+    }
+    if (!v) {
+        vm_sigsegv(addr, ef);
+        trace_mmu_vm_fault_sigsegv(addr, ef->error_code);
+        return;
     }
     trace_mmu_vm_fault_ret(addr, ef->error_code);
 }
@@ -1148,7 +1617,7 @@ unsigned vma::flags() const
 
 void vma::update_flags(unsigned flag)
 {
-    assert(mutex_owned(&vma_list_mutex));
+    assert(vma_list_mutex.wowned());
     _flags |= flag;
 }
 
@@ -1175,6 +1644,7 @@ bool vma::map_dirty()
 
 void vma::fault(uintptr_t addr, exception_frame *ef)
 {
+    auto fault_addr = addr;
     auto hp_start = ::align_up(_range.start(), huge_page_size);
     auto hp_end = ::align_down(_range.end(), huge_page_size);
     size_t size;
@@ -1186,12 +1656,23 @@ void vma::fault(uintptr_t addr, exception_frame *ef)
     }
 
     map_page_ops *map = page_ops();
-    auto total = operate_range(populate<account_opt::yes>(map, _perm, map_dirty()), (void*)addr, size);
+    bool failed = false;
+    auto total = operate_range(populate<account_opt::yes>(map, _perm, map_dirty(), &failed), (void*)addr, size);
+    if (failed && size != page_size) {
+        // some page of the range could not be brought in; see if it is
+        // the one the fault is for
+        failed = false;
+        total += operate_range(populate<account_opt::yes>(map, _perm, map_dirty(), &failed),
+                               (void*)fault_addr, page_size);
+    }
     map->finalize();
 
     if (_flags & mmap_jvm_heap) {
         memory::stats::on_jvm_heap_alloc(total);
     }
+    if (failed) {
+        vm_sigbus(fault_addr, ef);
+    }
 }
 
 map_page_ops* vma::page_ops()
@@ -1246,7 +1727,7 @@ error jvm_balloon_vma::sync(uintptr_t start, uintptr_t end)
 
 void jvm_balloon_vma::fault(uintptr_t fault_addr, exception_frame *ef)
 {
-    std::lock_guard<mutex> guard(vma_list_mutex);
+    std::lock_guard<vma_list_lock> guard(vma_list_mutex);
     jvm_balloon_fault(_balloon, ef, this);
     delete this;
 }
@@ -1325,14 +1806,40 @@ file_vma::file_vma(addr_range range, unsigned perm, fileref file, f_offset offse
         throw make_error(err);
     }
 
-    _page_ops = new map_file_page(_file.get(), ::size(_file), _offset, size());
+    if (_file->has_pages()) {
+        _page_ops = new map_file_page_shared(_file.get(), _offset, !_shared);
+    } else {
+        _page_ops = new map_file_page(_file.get(), ::size(_file), _offset, size());
+    }
+    if (writes_file(perm)) {
+        _file->add_writer();
+    }
 }
 
 file_vma::~file_vma()
 {
+    if (writes_file(_perm)) {
+        _file->remove_writer();
+    }
     delete _page_ops;
 }
 
+void file_vma::fault(uintptr_t addr, exception_frame *ef)
+{
+    if (!_file->has_pages()) {
+        // map_file_page collects the pages to read in per-vma state, so
+        // concurrent faults on the same file mapping have to take turns.
+        WITH_LOCK(_fault_mutex) {
+            vma::fault(addr, ef);
+        }
+        return;
+    }
+    vma::fault(addr, ef);
+    if (!_shared && (ef->error_code & page_fault_write)) {
+        operate_range(break_cow(_page_ops, _perm), (void*)addr, page_size);
+    }
+}
+
 void file_vma::split(uintptr_t edge)
 {
     if (edge <= _range.start() || edge >= _range.end()) {
@@ -1359,6 +1866,10 @@ private:
     dirty_page_sync(file *file, f_offset offset, uint64_t size) : _file(file), _offset(offset), _size(size) {}
     void operator()(phys addr, uintptr_t offset, size_t size) {
         off_t off = _offset + offset;
+        if (uint64_t(off) >= _size) {
+            // past the end of the file, which must not grow back
+            return;
+        }
         size_t len = std::min(size, _size - off);
         queue.push(elm{{phys_to_virt(addr), len}, off});
     }
@@ -1415,6 +1926,30 @@ f_offset file_vma::offset(uintptr_t addr)
     return _offset + (addr - _range.start());
 }
 
+// Whether the mapping, with perm, stores into the file's pages
+bool file_vma::writes_file(unsigned perm)
+{
+    return _shared && (perm & perm_write) && _file->has_pages();
+}
+
+void file_vma::protect(unsigned perm)
+{
+    if (writes_file(perm) && !writes_file(_perm)) {
+        _file->add_writer();
+        unmap_lent_pages(_file.get());
+    } else if (writes_file(_perm) && !writes_file(perm)) {
+        _file->remove_writer();
+    }
+    vma::protect(perm);
+}
+
+void file_vma::drop_lent_pages(file* writer)
+{
+    if (_file->has_pages() && _file->f_dentry->d_vnode == writer->f_dentry->d_vnode) {
+        operate_range(drop_lent(_file.get(), _offset, _page_ops));
+    }
+}
+
 void linear_map(void* _virt, phys addr, size_t size, size_t slop)
 {
     uintptr_t virt = reinterpret_cast<uintptr_t>(_virt);
@@ -1436,7 +1971,7 @@ void switch_to_runtime_page_table()
 
 error mprotect(void *addr, size_t len, unsigned perm)
 {
-    std::lock_guard<mutex> guard(vma_list_mutex);
+    std::lock_guard<vma_list_lock> guard(vma_list_mutex);
 
     if (!ismapped(addr, len)) {
         return make_error(ENOMEM);
@@ -1447,7 +1982,7 @@ error mprotect(void *addr, size_t len, unsigned perm)
 
 error munmap(void *addr, size_t length)
 {
-    std::lock_guard<mutex> guard(vma_list_mutex);
+    std::lock_guard<vma_list_lock> guard(vma_list_mutex);
 
     if (!ismapped(addr, length)) {
         return make_error(EINVAL);
@@ -1459,7 +1994,7 @@ error munmap(void *addr, size_t length)
 
 error msync(void* addr, size_t length, int flags)
 {
-    std::lock_guard<mutex> guard(vma_list_mutex);
+    std::lock_guard<vma_list_lock> guard(vma_list_mutex);
 
     if (!ismapped(addr, length)) {
         return make_error(ENOMEM);
@@ -1471,7 +2006,7 @@ error mincore(void *addr, size_t length, unsigned char *vec)
 {
     char *end = ::align_up((char *)addr + length, page_size);
     char tmp;
-    std::lock_guard<mutex> guard(vma_list_mutex);
+    std::lock_guard<vma_list_lock> guard(vma_list_mutex);
     if (!is_linear_mapped(addr, length) && !ismapped(addr, length)) {
         return make_error(ENOMEM);
     }
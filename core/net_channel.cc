@@ -12,9 +12,18 @@
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/udp.h>
 #include <bsd/sys/net/ethernet.h>
 
 #include <osv/debug.hh>
+#include <osv/clock.hh>
+#include "processor.hh"
+#include <osv/trace.hh>
+
+TRACEPOINT(trace_net_channel_full, "nc=%p", net_channel*);
+
+unsigned net_channel::ring_depth = 256;
+std::chrono::nanoseconds net_channel::busy_poll{0};
 
 std::ostream& operator<<(std::ostream& os, in_addr ia)
 {
@@ -23,9 +32,22 @@ std::ostream& operator<<(std::ostream& os, in_addr ia)
             (x >> 24) & 255, (x >> 16) & 255, (x >> 8) & 255, x & 255);
 }
 
-std::ostream& operator<<(std::ostream& os, ipv4_tcp_conn_id id)
+std::ostream& operator<<(std::ostream& os, const flow_key& key)
 {
-    return osv::fprintf(os, "{ ipv4 %s:%d -> %s:%d }", id.src_addr, id.src_port, id.dst_addr, id.dst_port);
+    auto addr = [&] (const u32* a) {
+        if (!a[0] && !a[1] && (!a[2] || a[2] == htonl(0xffff))) {
+            in_addr ia;
+            ia.s_addr = a[3];
+            osv::fprintf(os, "%s", ia);
+        } else {
+            osv::fprintf(os, "[%x:%x:%x:%x]", ntohl(a[0]), ntohl(a[1]), ntohl(a[2]), ntohl(a[3]));
+        }
+    };
+    os << "{ " << (key.proto == IPPROTO_TCP ? "tcp " : "udp ");
+    addr(key.src_addr);
+    osv::fprintf(os, ":%d -> ", key.src_port);
+    addr(key.dst_addr);
+    return osv::fprintf(os, ":%d }", key.dst_port);
 }
 
 void net_channel::process_queue()
@@ -36,6 +58,25 @@ void net_channel::process_queue()
     }
 }
 
+bool net_channel::poll_wait(mutex& mtx)
+{
+    if (_queue.size() || busy_poll.count() == 0) {
+        return _queue.size();
+    }
+    auto end = osv::clock::uptime::now() + busy_poll;
+    bool ready;
+    // The channel is freed through rcu once its socket lets go of it, so
+    // rcu, rather than the socket lock, keeps it around while we spin.
+    osv::rcu_read_lock.lock();
+    mtx.unlock();
+    while (!(ready = _queue.size()) && osv::clock::uptime::now() < end) {
+        processor::pause();
+    }
+    osv::rcu_read_lock.unlock();
+    mtx.lock();
+    return ready;
+}
+
 void net_channel::wake_pollers()
 {
     WITH_LOCK(osv::rcu_read_lock) {
@@ -77,82 +118,184 @@ void net_channel::del_poller(pollreq& pr)
 }
 
 classifier::classifier()
-    : _ipv4_tcp_channels(new ipv4_tcp_channels)
 {
 }
 
-void classifier::add(ipv4_tcp_conn_id id, net_channel* channel)
+bool classifier::add(const flow_key& key, net_channel* channel)
 {
-    WITH_LOCK(_mtx) {
-        auto old = _ipv4_tcp_channels.read_by_owner();
-        std::unique_ptr<ipv4_tcp_channels> neww{new ipv4_tcp_channels(*old)};
-        neww->emplace(id, channel);
-        _ipv4_tcp_channels.assign(neww.release());
-        osv::rcu_dispose(old);
+    return _channels.insert(key, channel);
+}
+
+void classifier::remove(const flow_key& key)
+{
+    _channels.erase(key);
+}
+
+void net_channel_batch::add(net_channel* nc)
+{
+    for (unsigned i = 0; i < _nr; i++) {
+        if (_channels[i] == nc) {
+            return;
+        }
     }
+    if (_nr == max_channels) {
+        for (auto c : _channels) {
+            c->wake();
+        }
+        _nr = 0;
+    }
+    _channels[_nr++] = nc;
 }
 
-void classifier::remove(ipv4_tcp_conn_id id)
+void net_channel_batch::flush()
 {
-    WITH_LOCK(_mtx) {
-        auto old = _ipv4_tcp_channels.read_by_owner();
-        std::unique_ptr<ipv4_tcp_channels> neww{new ipv4_tcp_channels(*old)};
-        neww->erase(id);
-        _ipv4_tcp_channels.assign(neww.release());
-        osv::rcu_dispose(old);
+    for (unsigned i = 0; i < _nr; i++) {
+        _channels[i]->wake();
+    }
+    _nr = 0;
+    if (_locked) {
+        osv::rcu_read_lock.unlock();
+        _locked = false;
     }
 }
 
 bool classifier::post_packet(mbuf* m)
 {
-    WITH_LOCK(osv::rcu_read_lock) {
-        if (auto nc = classify_ipv4_tcp(m)) {
-            nc->push(m);
-            // FIXME: find a way to batch wakes
-            nc->wake();
-            return true;
-        }
+    net_channel_batch batch;
+    return post_packet(m, batch);
+}
+
+bool classifier::post_packet(mbuf* m, net_channel_batch& batch)
+{
+    if (!batch._locked) {
+        osv::rcu_read_lock.lock();
+        batch._locked = true;
     }
-    return false;
+    auto nc = classify(m);
+    if (!nc) {
+        return false;
+    }
+    if (!nc->push(m)) {
+        // Let the slow path have it; it flushes the channel first, so the
+        // packets of the connection stay in order.
+        trace_net_channel_full(nc);
+        return false;
+    }
+    batch.add(nc);
+    return true;
 }
 
 // must be called with rcu lock held
-net_channel* classifier::classify_ipv4_tcp(mbuf* m)
+net_channel* classifier::lookup(const flow_key& key)
+{
+    auto nc = _channels.lookup(key);
+    return nc ? *nc : nullptr;
+}
+
+// must be called with rcu lock held
+//
+// Only the simple cases are classified, leaving the others (fragments, IPv6
+// extension headers, IPv4 options on UDP, multicast and broadcast) to the
+// normal input path.  TCP connection setup and teardown segments also take
+// the normal path, which handles the state changes.
+net_channel* classifier::classify(mbuf* m)
 {
     caddr_t h = m->m_hdr.mh_data;
-    if (unsigned(m->m_hdr.mh_len) < ETHER_HDR_LEN + sizeof(ip)) {
+    unsigned len = m->m_hdr.mh_len;
+    if (len < ETHER_HDR_LEN) {
         return nullptr;
     }
     auto ether_hdr = reinterpret_cast<ether_header*>(h);
-    if (ntohs(ether_hdr->ether_type) != ETHERTYPE_IP) {
-        return nullptr;
-    }
     h += ETHER_HDR_LEN;
-    auto ip_hdr = reinterpret_cast<ip*>(h);
-    unsigned ip_size = ip_hdr->ip_hl << 2;
-    if (ip_size < sizeof(ip)) {
-        return nullptr;
+    len -= ETHER_HDR_LEN;
+
+    u8 proto;
+    const u8 *src_addr6 = nullptr, *dst_addr6 = nullptr;
+    in_addr src_addr, dst_addr;
+    // also catches a subnet broadcast, which is sent to the link broadcast
+    bool multicast = ether_hdr->ether_dhost[0] & 1;
+    switch (ntohs(ether_hdr->ether_type)) {
+    case ETHERTYPE_IP: {
+        if (len < sizeof(ip)) {
+            return nullptr;
+        }
+        auto ip_hdr = reinterpret_cast<ip*>(h);
+        unsigned ip_size = ip_hdr->ip_hl << 2;
+        if (ip_size < sizeof(ip) || len < ip_size) {
+            return nullptr;
+        }
+        if (ntohs(ip_hdr->ip_off) & ~IP_DF) {
+            return nullptr;
+        }
+        proto = ip_hdr->ip_p;
+        if (proto == IPPROTO_UDP && ip_size != sizeof(ip)) {
+            return nullptr;
+        }
+        src_addr = ip_hdr->ip_src;
+        dst_addr = ip_hdr->ip_dst;
+        multicast |= IN_MULTICAST(ntohl(dst_addr.s_addr))
+                || dst_addr.s_addr == INADDR_BROADCAST;
+        h += ip_size;
+        len -= ip_size;
+        break;
     }
-    if (ip_hdr->ip_p != IPPROTO_TCP) {
-        return nullptr;
+    case ETHERTYPE_IPV6: {
+        // the fixed header: version/class/label, payload length, next
+        // header, hop limit, source and destination addresses
+        constexpr unsigned ip6_size = 40;
+        if (len < ip6_size) {
+            return nullptr;
+        }
+        auto ip6_hdr = reinterpret_cast<const u8*>(h);
+        proto = ip6_hdr[6];
+        src_addr6 = ip6_hdr + 8;
+        dst_addr6 = ip6_hdr + 24;
+        multicast |= dst_addr6[0] == 0xff;
+        h += ip6_size;
+        len -= ip6_size;
+        break;
     }
-    if (ntohs(ip_hdr->ip_off) & ~IP_DF) {
+    default:
         return nullptr;
     }
-    auto src_addr = ip_hdr->ip_src;
-    auto dst_addr = ip_hdr->ip_dst;
-    h += ip_size;
-    auto tcp_hdr = reinterpret_cast<tcphdr*>(h);
-    if (tcp_hdr->th_flags & (TH_SYN | TH_FIN | TH_RST)) {
-	    return nullptr;
-    }
-    auto src_port = ntohs(tcp_hdr->th_sport);
-    auto dst_port = ntohs(tcp_hdr->th_dport);
-    auto id = ipv4_tcp_conn_id{src_addr, dst_addr, src_port, dst_port};
-    auto ht = _ipv4_tcp_channels.read();
-    auto i = ht->find(id);
-    if (i == ht->end()) {
+
+    in_port_t src_port, dst_port;
+    switch (proto) {
+    case IPPROTO_TCP: {
+        if (len < sizeof(tcphdr)) {
+            return nullptr;
+        }
+        auto tcp_hdr = reinterpret_cast<tcphdr*>(h);
+        if (tcp_hdr->th_flags & (TH_SYN | TH_FIN | TH_RST)) {
+            return nullptr;
+        }
+        src_port = ntohs(tcp_hdr->th_sport);
+        dst_port = ntohs(tcp_hdr->th_dport);
+        break;
+    }
+    case IPPROTO_UDP: {
+        if (len < sizeof(udphdr) || multicast) {
+            return nullptr;
+        }
+        auto udp_hdr = reinterpret_cast<udphdr*>(h);
+        src_port = ntohs(udp_hdr->uh_sport);
+        dst_port = ntohs(udp_hdr->uh_dport);
+        break;
+    }
+    default:
         return nullptr;
     }
-    return i->second;
+
+    auto key = src_addr6 ? flow_key(proto, src_addr6, dst_addr6, src_port, dst_port)
+                         : flow_key(proto, src_addr, dst_addr, src_port, dst_port);
+    auto nc = lookup(key);
+    if (!nc && proto == IPPROTO_UDP) {
+        // sockets not connected to the sender, bound to our address or to
+        // any, as in_pcblookup() would have it
+        nc = lookup(key.unconnected());
+        if (!nc) {
+            nc = lookup(key.unbound());
+        }
+    }
+    return nc;
 }
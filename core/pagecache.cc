@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/pagecache.hh>
+#include <osv/vnode.h>
+#include <osv/uio.h>
+#include <osv/mutex.h>
+#include <osv/mempool.hh>
+#include <unordered_map>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+
+namespace pagecache {
+
+using memory::page_size;
+
+struct cached_page {
+    void* page;
+    unsigned refs;
+    // the filesystem's hold on a page it lent us (see get()); nullptr for
+    // a page of our own
+    void* handle;
+};
+
+// The cached pages of one file, by offset.  Pages are only added with the
+// vnode lock held, but are dropped by munmap(), which can't wait for it.
+struct file_pages {
+    mutex lock;
+    std::unordered_map<off_t, cached_page> map;
+    // lent pages get() replaced in map, until their last reference goes
+    std::unordered_multimap<off_t, cached_page> retired;
+    // mappings that can write the file; while there are any, get() lends
+    // no pages, as stores through them would bypass the filesystem
+    std::atomic<unsigned> writers{0};
+};
+
+// Freed with the vnode (see release())
+static file_pages* pages_of(vnode* vp)
+{
+    return static_cast<file_pages*>(__atomic_load_n(&vp->v_pagecache, __ATOMIC_ACQUIRE));
+}
+
+// add_writer() may come first, without the vnode lock
+static file_pages* pages_for(vnode* vp)
+{
+    auto pages = pages_of(vp);
+    if (!pages) {
+        auto fresh = new file_pages;
+        void* old = nullptr;
+        if (__atomic_compare_exchange_n(&vp->v_pagecache, &old, fresh, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            pages = fresh;
+        } else {
+            delete fresh;
+            pages = static_cast<file_pages*>(old);
+        }
+    }
+    return pages;
+}
+
+static off_t page_base(off_t offset)
+{
+    return offset & ~off_t(page_size - 1);
+}
+
+bool cached(vnode* vp)
+{
+    return __atomic_load_n(&vp->v_npages, __ATOMIC_RELAXED) != 0;
+}
+
+// Returns the cached page at offset with a reference held, or nullptr;
+// also nullptr for a lent page, unless lent_ok
+static void* hold(vnode* vp, off_t offset, bool lent_ok)
+{
+    auto pages = pages_of(vp);
+    if (!pages) {
+        return nullptr;
+    }
+    WITH_LOCK(pages->lock) {
+        auto i = pages->map.find(offset);
+        if (i != pages->map.end() && (lent_ok || !i->second.handle)) {
+            i->second.refs++;
+            return i->second.page;
+        }
+    }
+    return nullptr;
+}
+
+// Returns how much of [offset, offset + len) comes before the next cached
+// page, when the page at offset is not cached
+static size_t uncached(vnode* vp, off_t offset, size_t len)
+{
+    off_t end = offset + len;
+    auto pages = pages_of(vp);
+    if (!pages) {
+        return len;
+    }
+    off_t base = page_base(offset) + page_size;
+    WITH_LOCK(pages->lock) {
+        while (base < end && !pages->map.count(base)) {
+            base += page_size;
+        }
+    }
+    return std::min(end, base) - offset;
+}
+
+// Has the filesystem do only the next len bytes of uio
+template <typename Op>
+static int limit(uio* uio, size_t len, Op op)
+{
+    auto rest = uio->uio_resid - len;
+    uio->uio_resid = len;
+    int error = op();
+    uio->uio_resid += rest;
+    return error;
+}
+
+// Reads the page at offset into a page of our own
+static void* read_page(vnode* vp, file* fp, off_t offset)
+{
+    auto page = memory::alloc_page();
+    if (!page) {
+        return nullptr;
+    }
+    iovec iov{page, page_size};
+    uio data{&iov, 1, offset, ssize_t(page_size), UIO_READ};
+    if (VOP_READ(vp, fp, &data, 0) != 0) {
+        memory::free_page(page);
+        return nullptr;
+    }
+    // zero what is past the end of the file
+    memset(static_cast<char*>(page) + page_size - data.uio_resid, 0, data.uio_resid);
+    return page;
+}
+
+void* get(vnode* vp, file* fp, off_t offset)
+{
+    auto pages = pages_for(vp);
+    WITH_LOCK(pages->lock) {
+        auto i = pages->map.find(offset);
+        if (i != pages->map.end()) {
+            if (!i->second.handle || !pages->writers) {
+                i->second.refs++;
+                return i->second.page;
+            }
+            // A writable mapping must not get a lent page, which can only
+            // be held by other users (see add_writer()): leave it to them,
+            // and have a page of our own for it.
+            pages->retired.emplace(*i);
+            pages->map.erase(i);
+            __atomic_sub_fetch(&vp->v_npages, 1, __ATOMIC_RELAXED);
+        }
+    }
+    // With the vnode lock held, no write can come between reading the page
+    // and publishing it, and no one else can be adding it.
+    void* page;
+    void* handle = nullptr;
+    if (!vp->v_op->vop_holdpage || pages->writers ||
+            VOP_HOLDPAGE(vp, offset, &page, &handle) != 0) {
+        page = read_page(vp, fp, offset);
+        if (!page) {
+            return nullptr;
+        }
+    }
+    WITH_LOCK(pages->lock) {
+        pages->map.emplace(offset, cached_page{page, 1, handle});
+        __atomic_add_fetch(&vp->v_npages, 1, __ATOMIC_RELAXED);
+    }
+    return page;
+}
+
+bool put(vnode* vp, off_t offset, void* page)
+{
+    auto pages = pages_of(vp);
+    if (!pages) {
+        return false;
+    }
+    void* handle;
+    WITH_LOCK(pages->lock) {
+        auto i = pages->map.find(offset);
+        if (i != pages->map.end() && i->second.page == page) {
+            if (--i->second.refs) {
+                return true;
+            }
+            handle = i->second.handle;
+            pages->map.erase(i);
+            __atomic_sub_fetch(&vp->v_npages, 1, __ATOMIC_RELAXED);
+        } else {
+            auto r = pages->retired.equal_range(offset);
+            auto j = std::find_if(r.first, r.second,
+                    [=] (const std::pair<const off_t, cached_page>& e) {
+                        return e.second.page == page;
+                    });
+            if (j == r.second) {
+                return false;
+            }
+            if (--j->second.refs) {
+                return true;
+            }
+            handle = j->second.handle;
+            pages->retired.erase(j);
+        }
+    }
+    if (handle) {
+        VOP_RELEPAGE(vp, handle);
+    } else {
+        memory::free_page(page);
+    }
+    return true;
+}
+
+void add_writer(vnode* vp)
+{
+    pages_for(vp)->writers++;
+}
+
+void remove_writer(vnode* vp)
+{
+    pages_of(vp)->writers--;
+}
+
+bool lent(vnode* vp, off_t offset, void* page)
+{
+    auto pages = pages_of(vp);
+    if (!pages) {
+        return false;
+    }
+    WITH_LOCK(pages->lock) {
+        auto i = pages->map.find(offset);
+        if (i != pages->map.end() && i->second.page == page) {
+            return i->second.handle;
+        }
+        auto r = pages->retired.equal_range(offset);
+        return std::any_of(r.first, r.second,
+                [=] (const std::pair<const off_t, cached_page>& e) {
+                    return e.second.page == page;
+                });
+    }
+}
+
+int read(vnode* vp, file* fp, uio* uio, int ioflags)
+{
+    vattr attr;
+    int error = VOP_GETATTR(vp, &attr);
+    if (error) {
+        return error;
+    }
+    while (uio->uio_resid > 0 && uio->uio_offset < attr.va_size) {
+        off_t offset = uio->uio_offset;
+        off_t base = page_base(offset);
+        auto page = hold(vp, base, true);
+        if (page) {
+            size_t len = std::min<off_t>({uio->uio_resid,
+                    off_t(base + page_size - offset), attr.va_size - offset});
+            error = uiomove(static_cast<char*>(page) + offset - base, len, uio);
+            put(vp, base, page);
+            if (error) {
+                break;
+            }
+            continue;
+        }
+        auto len = uncached(vp, offset, uio->uio_resid);
+        error = limit(uio, len, [&] { return VOP_READ(vp, fp, uio, ioflags); });
+        if (error || uio->uio_offset != off_t(offset + len)) {
+            // error, or end of file
+            break;
+        }
+    }
+    return error;
+}
+
+int write(vnode* vp, uio* uio, int ioflags)
+{
+    int error;
+    if (ioflags & IO_APPEND) {
+        // we need to know where the data goes
+        vattr attr;
+        error = VOP_GETATTR(vp, &attr);
+        if (error) {
+            return error;
+        }
+        uio->uio_offset = attr.va_size;
+        ioflags &= ~IO_APPEND;
+    }
+    while (uio->uio_resid > 0) {
+        off_t offset = uio->uio_offset;
+        off_t base = page_base(offset);
+        // a lent page is updated by the filesystem's own write
+        auto page = hold(vp, base, false);
+        if (page) {
+            // update the cached page, then write the file from it
+            size_t len = std::min<off_t>(uio->uio_resid, base + page_size - offset);
+            auto p = static_cast<char*>(page) + offset - base;
+            error = uiomove(p, len, uio);
+            if (!error) {
+                iovec iov{p, len};
+                struct uio data{&iov, 1, offset, ssize_t(len), UIO_WRITE};
+                error = VOP_WRITE(vp, &data, ioflags);
+            }
+            put(vp, base, page);
+        } else {
+            auto len = uncached(vp, offset, uio->uio_resid);
+            error = limit(uio, len, [&] { return VOP_WRITE(vp, uio, ioflags); });
+        }
+        if (error) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+void truncate(vnode* vp, off_t length)
+{
+    auto pages = pages_of(vp);
+    if (!pages) {
+        return;
+    }
+    // Mappings past the new end keep their pages, but must not see the
+    // old data there, nor should it come back if the file grows again.
+    // The filesystem zeroes the pages it lent itself.
+    WITH_LOCK(pages->lock) {
+        for (auto& e : pages->map) {
+            if (!e.second.handle && e.first + off_t(page_size) > length) {
+                auto from = std::max<off_t>(length - e.first, 0);
+                memset(static_cast<char*>(e.second.page) + from, 0, page_size - from);
+            }
+        }
+    }
+}
+
+void release(vnode* vp)
+{
+    auto pages = pages_of(vp);
+    if (pages) {
+        // every mapping holds a reference on the vnode, so none is left
+        assert(pages->map.empty() && pages->retired.empty());
+        delete pages;
+    }
+}
+
+}
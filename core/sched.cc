@@ -18,6 +18,7 @@
 #include <osv/percpu.hh>
 #include <osv/prio.hh>
 #include <osv/elf.hh>
+#include <osv/mmu.hh>
 #include <stdlib.h>
 #include <unordered_map>
 
@@ -37,6 +38,7 @@ TRACEPOINT(trace_sched_wait, "");
 TRACEPOINT(trace_sched_wait_ret, "");
 TRACEPOINT(trace_sched_wake, "wake %p", thread*);
 TRACEPOINT(trace_sched_migrate, "thread=%p cpu=%d", thread*, unsigned);
+TRACEPOINT(trace_sched_steal, "victim=%d", unsigned);
 TRACEPOINT(trace_sched_queue, "thread=%p", thread*);
 TRACEPOINT(trace_sched_preempt, "");
 TRACEPOINT(trace_timer_set, "timer=%p time=%d", timer_base*, s64);
@@ -140,6 +142,9 @@ cpu::cpu(unsigned _id)
     , preemption_timer(*this)
     , idle_thread()
     , terminating_thread(nullptr)
+    , migrating_thread(nullptr)
+    , migrating_target(nullptr)
+    , busy_time(0)
     , c(cinitial)
     , renormalize_count(0)
 {
@@ -170,6 +175,38 @@ void cpu::schedule()
     }
 }
 
+// How far apart two cpus are in the cache hierarchy: 0 if they share an L2
+// cache, 1 if they share the last level cache, 2 otherwise.
+static unsigned cache_distance(cpu* a, cpu* b)
+{
+    if (a->arch.l2_id == b->arch.l2_id) {
+        return 0;
+    } else if (a->arch.llc_id == b->arch.llc_id) {
+        return 1;
+    }
+    return 2;
+}
+
+// Where to move a thread which may no longer run on cpu "from": the least
+// loaded cpu it may run on, charging half a thread per cache level crossed.
+static cpu* affinity_target(thread& t, cpu* from)
+{
+    cpu* target = nullptr;
+    unsigned target_cost = 0;
+    for (auto c : cpus) {
+        if (!t.may_run_on(c)) {
+            continue;
+        }
+        auto cost = c->load() + cache_distance(from, c) * cpu::load_scale / 2;
+        if (!target || cost < target_cost) {
+            target = c;
+            target_cost = cost;
+        }
+    }
+    assert(target);
+    return target;
+}
+
 // In the x86 ABI, the FPU state is callee-saved, meaning that a program must
 // not call a function in the middle of an FPU calculation. But if we get a
 // preemption, i.e., the scheduler is called by an interrupt, the currently
@@ -196,6 +233,12 @@ void cpu::reschedule_from_interrupt(bool preempt)
 
     need_reschedule = false;
     handle_incoming_wakeups();
+    if (steal_requests) {
+        handle_steal_requests();
+    }
+    if (affinity_changed.load(std::memory_order_relaxed)) {
+        handle_affinity_changes();
+    }
 
     auto now = osv::clock::uptime::now();
     auto interval = now - running_since;
@@ -213,8 +256,19 @@ void cpu::reschedule_from_interrupt(bool preempt)
 
     p->_total_cpu_time += interval;
     p->_runtime.ran_for(interval);
+    if (p != idle_thread) {
+        busy_time += interval;
+    }
 
-    if (p_status == thread::status::running) {
+    if (p_status == thread::status::running && !p->may_run_on(this)) {
+        // p's affinity no longer includes this cpu. We cannot queue it on
+        // another cpu while we are still running on its stack, so switch
+        // away and let the next thread complete the move (finish_migration).
+        p->_runtime.hysteresis_run_stop();
+        p->_detached_state->st.store(thread::status::waking);
+        migrating_thread = p;
+        migrating_target = affinity_target(*p, this);
+    } else if (p_status == thread::status::running) {
         // The current thread is still runnable. Check if it still has the
         // lowest runtime, and update the timer until the next thread's turn.
         if (runqueue.empty()) {
@@ -248,9 +302,8 @@ void cpu::reschedule_from_interrupt(bool preempt)
         p->_runtime.hysteresis_run_stop();
     }
 
-    auto ni = runqueue.begin();
-    auto n = &*ni;
-    runqueue.erase(ni);
+    auto n = &*runqueue.begin();
+    dequeue(*n);
     assert(n->_detached_state->st.load() == thread::status::queued);
     trace_sched_switch(n, p->_runtime.get_local(), n->_runtime.get_local());
     n->_detached_state->st.store(thread::status::running);
@@ -278,11 +331,17 @@ void cpu::reschedule_from_interrupt(bool preempt)
             preemption_timer.set(now + delta);
         }
     }
+    if (n == idle_thread) {
+        mmu::lazy_tlb_enter();
+    } else if (p == idle_thread) {
+        mmu::lazy_tlb_leave();
+    }
     n->switch_to();
     if (p->_detached_state->_cpu->terminating_thread) {
         p->_detached_state->_cpu->terminating_thread->destroy();
         p->_detached_state->_cpu->terminating_thread = nullptr;
     }
+    p->_detached_state->_cpu->finish_migration();
 
     if (preempt) {
         p->_fpu.restore();
@@ -327,11 +386,13 @@ void cpu::do_idle()
         WITH_LOCK(idle_poll_lock) {
             // spin for a bit before halting
             for (unsigned ctr = 0; ctr < 10000; ++ctr) {
-                // FIXME: can we pull threads from loaded cpus?
                 handle_incoming_wakeups();
                 if (!runqueue.empty()) {
                     return;
                 }
+                if (ctr % 1000 == 0) {
+                    try_steal();
+                }
             }
         }
         std::unique_lock<irq_lock_type> guard(irq_lock);
@@ -378,6 +439,9 @@ void cpu::handle_incoming_wakeups()
                     // Special case of current thread being woken before
                     // having a chance to be scheduled out.
                     t._detached_state->st.store(thread::status::running);
+                } else if (!t.may_run_on(this)) {
+                    // t's affinity changed while it was away from this cpu
+                    migrate(t, affinity_target(t, this));
                 } else {
                     t._detached_state->st.store(thread::status::queued);
                     // Make sure the CPU-local runtime measure is suitably
@@ -397,6 +461,23 @@ void cpu::enqueue(thread& t)
 {
     trace_sched_queue(&t);
     runqueue.insert_equal(t);
+    cpu_set others = t._affinity;
+    others.clear(id);
+    t._stealable = &t != idle_thread && (!t._affinity || others);
+    if (t._stealable) {
+        stealable.store(stealable.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    }
+}
+
+void cpu::dequeue(thread& t)
+{
+    runqueue.erase(runqueue.iterator_to(t));
+    if (t._stealable) {
+        t._stealable = false;
+        stealable.store(stealable.load(std::memory_order_relaxed) - 1,
+                std::memory_order_relaxed);
+    }
 }
 
 void cpu::init_on_cpu()
@@ -405,55 +486,168 @@ void cpu::init_on_cpu()
     clock_event->setup_on_cpu();
 }
 
+// The load of a cpu is the number of threads waiting in its runqueue, plus
+// the fraction of recent time it spent running anything but the idle
+// thread, scaled by load_scale.  Unlike the queue length alone, this tells
+// a cpu running one cpu-bound thread apart from an idle one.
 unsigned cpu::load()
 {
-    return runqueue.size();
+    return runqueue.size() * load_scale + busy_avg.load(std::memory_order_relaxed);
+}
+
+// Moves a thread queued on this cpu to target. Must be called on this cpu,
+// with irq_lock held.
+void cpu::migrate_queued(thread& mig, cpu* target)
+{
+    dequeue(mig);
+    // we won't race with wake(), since we're not thread::waiting
+    assert(mig._detached_state->st.load() == thread::status::queued);
+    mig._detached_state->st.store(thread::status::waking);
+    migrate(mig, target);
+}
+
+// Sends a thread in the waking state, which belongs to this cpu but is
+// neither running nor queued, to target's incoming wakeup queue. Must be
+// called on this cpu, with irq_lock held.
+void cpu::migrate(thread& mig, cpu* target)
+{
+    trace_sched_migrate(&mig, target->id);
+    mig.suspend_timers();
+    mig._detached_state->_cpu = target;
+    // Convert the CPU-local runtime measure to a globally meaningful
+    // measure
+    mig._runtime.update_after_sleep();
+    mig._runtime.export_runtime();
+    mig.remote_thread_local_var(::percpu_base) = target->percpu_base;
+    mig.remote_thread_local_var(current_cpu) = target;
+    target->incoming_wakeups[id].push_front(mig);
+    target->incoming_wakeups_mask.set(id);
+    // FIXME: avoid if the cpu is alive and if the priority does not
+    // FIXME: warrant an interruption
+    target->send_wakeup_ipi();
+}
+
+// Called with irq_lock held, by the thread that runs after
+// reschedule_from_interrupt() switched away from migrating_thread.
+void cpu::finish_migration()
+{
+    if (!migrating_thread) {
+        return;
+    }
+    auto t = migrating_thread;
+    migrating_thread = nullptr;
+    migrate(*t, migrating_target);
+}
+
+// Called with irq_lock held, after set_affinity() on a thread queued here.
+void cpu::handle_affinity_changes()
+{
+    affinity_changed.store(false, std::memory_order_relaxed);
+    for (auto i = runqueue.begin(); i != runqueue.end(); ) {
+        auto& t = *i++;
+        if (!t.may_run_on(this)) {
+            migrate_queued(t, affinity_target(t, this));
+        }
+    }
+}
+
+// Called by an idle cpu to ask the busiest of its nearest cpus which have
+// queued threads it could take to hand one over. Another cpu's runqueue is protected by
+// that cpu's irq_lock, so we cannot take the thread ourselves; the victim
+// does it in handle_steal_requests() when the wakeup ipi reaches it, and
+// the thread arrives on our incoming_wakeups queue, which we are polling.
+void cpu::try_steal()
+{
+    cpu* victim = nullptr;
+    unsigned victim_distance = 0, victim_load = 0;
+    for (auto other : cpus) {
+        if (other == this || !other->stealable.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        auto distance = cache_distance(this, other);
+        auto load = other->load();
+        if (!victim || distance < victim_distance ||
+                (distance == victim_distance && load > victim_load)) {
+            victim = other;
+            victim_distance = distance;
+            victim_load = load;
+        }
+    }
+    if (victim && !victim->steal_requests.test_all_and_set(id)) {
+        trace_sched_steal(victim->id);
+        victim->send_wakeup_ipi();
+    }
+}
+
+// Called with irq_lock held. Hands the least urgent unpinned thread on our
+// runqueue to each cpu which asked for one and is still idle.
+void cpu::handle_steal_requests()
+{
+    cpu_set requests{steal_requests.fetch_clear()};
+    for (auto thief_id : requests) {
+        auto thief = cpus[thief_id];
+        if (!thief->runqueue.empty()) {
+            continue;
+        }
+        auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
+                [=](thread& t) { return t.may_run_on(thief); });
+        if (i == runqueue.rend()) {
+            continue;
+        }
+        migrate_queued(*i, thief);
+    }
 }
 
 void cpu::load_balance()
 {
     notifier::fire();
     timer tmr(*thread::current());
+    auto last = osv::clock::uptime::now();
+    auto last_busy = busy_time;
     while (true) {
         tmr.set(osv::clock::uptime::now() + 100_ms);
         thread::wait_until([&] { return tmr.expired(); });
+        // Fold the fraction of the last period we were busy into busy_avg
+        osv::clock::uptime::duration busy;
+        WITH_LOCK(irq_lock) {
+            busy = busy_time;
+        }
+        auto now = osv::clock::uptime::now();
+        auto period = (now - last).count();
+        unsigned sample = load_scale;
+        if ((busy - last_busy).count() < period) {
+            sample = (busy - last_busy).count() * load_scale / period;
+        }
+        busy_avg.store((busy_avg.load(std::memory_order_relaxed) * 3 + sample) / 4,
+                std::memory_order_relaxed);
+        last = now;
+        last_busy = busy;
+
         if (runqueue.empty()) {
             continue;
         }
+        // Look for the least loaded cpu, but charge half a thread for each
+        // level of cache hierarchy the migration would cross.
+        auto cost = [this](cpu* other) {
+            return other->load() + cache_distance(this, other) * load_scale / 2;
+        };
         auto min = *std::min_element(cpus.begin(), cpus.end(),
-                [](cpu* c1, cpu* c2) { return c1->load() < c2->load(); });
+                [&](cpu* c1, cpu* c2) { return cost(c1) < cost(c2); });
         if (min == this) {
             continue;
         }
         // This CPU is temporarily running one extra thread (this thread),
         // so don't migrate a thread away if the difference is only 1.
-        if (min->load() >= (load() - 1)) {
+        if (cost(min) + 2 * load_scale > load()) {
             continue;
         }
         WITH_LOCK(irq_lock) {
             auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
-                    [](thread& t) { return !t._attr._pinned_cpu; });
+                    [=](thread& t) { return t.may_run_on(min); });
             if (i == runqueue.rend()) {
                 continue;
             }
-            auto& mig = *i;
-            trace_sched_migrate(&mig, min->id);
-            runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
-            // we won't race with wake(), since we're not thread::waiting
-            assert(mig._detached_state->st.load() == thread::status::queued);
-            mig._detached_state->st.store(thread::status::waking);
-            mig.suspend_timers();
-            mig._detached_state->_cpu = min;
-            // Convert the CPU-local runtime measure to a globally meaningful
-            // measure
-            mig._runtime.export_runtime();
-            mig.remote_thread_local_var(::percpu_base) = min->percpu_base;
-            mig.remote_thread_local_var(current_cpu) = min;
-            min->incoming_wakeups[id].push_front(mig);
-            min->incoming_wakeups_mask.set(id);
-            // FIXME: avoid if the cpu is alive and if the priority does not
-            // FIXME: warrant an interruption
-            min->send_wakeup_ipi();
+            migrate_queued(*i, min);
         }
     }
 }
@@ -519,6 +713,48 @@ float thread::priority() const
     return _runtime.priority();
 }
 
+bool thread::may_run_on(cpu* c) const
+{
+    return !_affinity || _affinity.test(c->id);
+}
+
+void thread::set_affinity(const cpu_set& mask)
+{
+    _affinity = mask;
+    cpu* c = nullptr;
+    WITH_LOCK(irq_lock) {
+        auto st = _detached_state->st.load();
+        if (st == status::unstarted || st == status::prestarted) {
+            // start() will take care of it
+            return;
+        }
+        c = _detached_state->_cpu;
+        if (may_run_on(c)) {
+            return;
+        }
+        // Only c may move its threads. If we are running on c, we are
+        // either the thread being moved, or it is queued or asleep here;
+        // either way, the scheduler sorts it out when we schedule() below.
+        c->affinity_changed.store(true, std::memory_order_relaxed);
+        if (c != cpu::current()) {
+            c->send_wakeup_ipi();
+            return;
+        }
+    }
+    if (preemptable()) {
+        schedule();
+    } else {
+        need_reschedule = true;
+    }
+}
+
+void thread::pin(cpu* target)
+{
+    cpu_set mask;
+    mask.set(target->id);
+    current()->set_affinity(mask);
+}
+
 thread::stack_info::stack_info()
     : begin(nullptr), size(0), deleter(nullptr)
 {
@@ -581,6 +817,9 @@ thread::thread(std::function<void ()> func, attr attr, bool main)
     , _joiner(nullptr)
 {
     trace_thread_create(this);
+    if (_attr._pinned_cpu) {
+        _affinity.set(_attr._pinned_cpu->id);
+    }
     setup_tcb();
     WITH_LOCK(thread_map_mutex) {
         if (!main) {
@@ -653,6 +892,9 @@ void thread::start()
     }
 
     _detached_state->_cpu = _attr._pinned_cpu ? _attr._pinned_cpu : current()->tcpu();
+    if (!may_run_on(_detached_state->_cpu)) {
+        _detached_state->_cpu = affinity_target(*this, _detached_state->_cpu);
+    }
     remote_thread_local_var(percpu_base) = _detached_state->_cpu->percpu_base;
     remote_thread_local_var(current_cpu) = _detached_state->_cpu;
     _detached_state->st.store(status::waiting);
@@ -10,6 +10,8 @@
 #include "arch.hh"
 #include <atomic>
 #include <regex>
+#include <vector>
+#include <algorithm>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/range/algorithm/remove.hpp>
 #include <osv/debug.hh>
@@ -45,11 +47,50 @@ struct tracepoint_patch_sites_type {
 tracepoint_patch_sites_type tracepoint_patch_sites;
 
 constexpr size_t trace_page_size = 4096;  // need not match arch page size
-constexpr unsigned max_trace = trace_page_size * 1024;
-
-char *trace_log __attribute__((may_alias));
-std::atomic<size_t> trace_record_last;
+constexpr unsigned max_trace = trace_page_size * 1024;  // per cpu
+
+// Each cpu logs into a ring of its own, with interrupts disabled, so
+// logging needs no atomic read-modify-write and no shared cache lines.
+// Positions are byte offsets which only grow; the ring offset is the
+// position modulo max_trace.  Records never cross a trace page.
+struct trace_buf {
+    char* log __attribute__((may_alias));
+    // end of the last complete record, published for readers
+    std::atomic<size_t> last;
+    // end of the record being written
+    size_t pending;
+    // how far /proc/trace/stream has read this ring
+    std::atomic<size_t> read;
+    // records that overwrote data the stream had not read yet
+    std::atomic<u64> dropped;
+} CACHELINE_ALIGNED;
+
+trace_buf trace_for_cpu[sched::max_cpus];
 bool trace_enabled;
+// set once someone reads /proc/trace/stream, to start counting drops
+static bool trace_streaming;
+static ::mutex trace_stream_mutex;
+
+static trace_buf& this_cpu_trace_buf()
+{
+    auto c = sched::cpu::current();
+    return trace_for_cpu[c ? c->id : 0];
+}
+
+static void allocate_trace_bufs()
+{
+    auto alloc = [] (trace_buf& buf) {
+        if (!buf.log) {
+            auto log = (char *) aligned_alloc(trace_page_size, max_trace);
+            bzero(log, max_trace);
+            buf.log = log;
+        }
+    };
+    alloc(trace_for_cpu[0]);
+    for (auto c : sched::cpus) {
+        alloc(trace_for_cpu[c->id]);
+    }
+}
 
 typeof(tracepoint_base::tp_list) tracepoint_base::tp_list __attribute__((init_priority((int)init_prio::tracepoint_base)));
 
@@ -62,10 +103,7 @@ void enable_trace()
 
 void enable_tracepoint(std::string wildcard)
 {
-    if (!trace_log) {
-        trace_log = (char *) aligned_alloc(sizeof(long), max_trace);
-        bzero(trace_log, max_trace);
-    }
+    allocate_trace_bufs();
     wildcard = boost::algorithm::replace_all_copy(wildcard, std::string("*"), std::string(".*"));
     wildcard = boost::algorithm::replace_all_copy(wildcard, std::string("?"), std::string("."));
     std::regex re{wildcard};
@@ -235,24 +273,200 @@ void tracepoint_base::do_log_backtrace(trace_record* tr, u8*& buffer)
     buffer += backtrace_len * sizeof(void*);
 }
 
+// Called with interrupts disabled. The record is not visible to readers
+// until commit_trace_record() is called, on the same cpu.
 trace_record* allocate_trace_record(size_t size)
 {
+    auto& buf = this_cpu_trace_buf();
+    if (!buf.log) {
+        return nullptr;
+    }
     size += sizeof(trace_record);
     size = align_up(size, sizeof(long));
-    size_t p = trace_record_last.load(std::memory_order_relaxed);
-    size_t pn;
-    do {
-        pn = p + size;
-        if (align_down(p, trace_page_size) != align_down(pn, trace_page_size)) {
-            // crossed page boundary
-            pn = align_up(p, trace_page_size) + size;
-        }
-    } while (!trace_record_last.compare_exchange_weak(p, pn, std::memory_order_relaxed));
-    char* pp = &trace_log[p % max_trace];
+    size_t p = buf.last.load(std::memory_order_relaxed);
+    size_t pn = p + size;
+    if (align_down(p, trace_page_size) != align_down(pn, trace_page_size)) {
+        // crossed page boundary
+        pn = align_up(p, trace_page_size) + size;
+    }
+    char* pp = &buf.log[p % max_trace];
     // clear the first word, do indicate an padding at the end of the page
     reinterpret_cast<trace_record*>(pp)->tp = nullptr;
+    if (trace_streaming && pn > buf.read.load(std::memory_order_relaxed) + max_trace) {
+        buf.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    buf.pending = pn;
     pn -= size;
-    return reinterpret_cast<trace_record*>(&trace_log[pn % max_trace]);
+    return reinterpret_cast<trace_record*>(&buf.log[pn % max_trace]);
+}
+
+void commit_trace_record()
+{
+    auto& buf = this_cpu_trace_buf();
+    buf.last.store(buf.pending, std::memory_order_release);
+}
+
+// Size of a record's parameters, laid out by the serializer<> according to
+// the tracepoint's signature (see object_serializer<>).
+static size_t payload_size(u64 sig)
+{
+    size_t size = 0;
+    for (; sig; sig >>= 8) {
+        size_t n;
+        switch (sig & 255) {
+        case 'c': case 'b': case 'B': case '?': n = 1; break;
+        case 'h': case 'H': n = 2; break;
+        case 'i': case 'I': case 'f': n = 4; break;
+        case 'p':
+            size += object_serializer<const char*>::max_len;
+            continue;
+        default: n = 8; break;
+        }
+        size = align_up(size, n) + n;
+    }
+    return size;
+}
+
+// Python struct style signature, as expected by scripts/osv/trace.py
+static std::string signature_string(u64 sig)
+{
+    std::string ret;
+    for (; sig; sig >>= 8) {
+        if ((sig & 255) == 'p') {
+            ret += std::to_string(object_serializer<const char*>::max_len);
+        }
+        ret.push_back(sig & 255);
+    }
+    return ret;
+}
+
+template <typename T>
+static void put(std::string& out, T val)
+{
+    out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+static void put_str(std::string& out, const std::string& str)
+{
+    put<u16>(out, str.size());
+    out += str;
+}
+
+struct copied_record {
+    u64 time;
+    const char* rec;
+};
+
+// Copies the unread part of a cpu's ring, and returns the records in it.
+// The owning cpu keeps logging while we copy, so afterwards we throw away
+// whatever it may have overwritten in the meantime.
+static std::vector<copied_record> read_trace_buf(trace_buf& buf,
+        std::unique_ptr<char[]>& copy)
+{
+    std::vector<copied_record> records;
+    size_t last = buf.last.load(std::memory_order_acquire);
+    size_t begin = buf.read.load(std::memory_order_relaxed);
+    if (last > max_trace && begin < last - max_trace) {
+        begin = align_up(last - max_trace, trace_page_size);
+    }
+    copy.reset(new char[max_trace]);
+    for (size_t p = begin; p < last; ) {
+        auto n = std::min(last - p, max_trace - p % max_trace);
+        memcpy(copy.get() + p % max_trace, buf.log + p % max_trace, n);
+        p += n;
+    }
+    // Since we started copying, the writer may have overwritten the ring
+    // up to the page holding its current position, and perhaps the next.
+    size_t now = buf.last.load(std::memory_order_acquire);
+    size_t overwritten = align_up(now, trace_page_size) + 2 * trace_page_size;
+    if (overwritten > max_trace) {
+        begin = std::max(begin, overwritten - max_trace);
+    }
+    buf.read.store(last, std::memory_order_relaxed);
+    auto backtrace_size = tracepoint_base::backtrace_len * sizeof(void*);
+    for (size_t p = begin; p < last; ) {
+        auto tr = reinterpret_cast<trace_record*>(copy.get() + p % max_trace);
+        if (!tr->tp) {
+            p = align_up(p + 1, trace_page_size);
+            continue;
+        }
+        records.push_back({tr->time, reinterpret_cast<char*>(tr)});
+        auto size = sizeof(trace_record) + payload_size(tr->tp->sig);
+        if (tr->backtrace) {
+            size += backtrace_size;
+        }
+        p += align_up(size, sizeof(long));
+    }
+    return records;
+}
+
+std::string procfs_trace_stream()
+{
+    std::string out;
+    SCOPE_LOCK(trace_stream_mutex);
+    trace_streaming = true;
+    std::vector<std::unique_ptr<char[]>> copies;
+    std::vector<copied_record> records;
+    for (auto& buf : trace_for_cpu) {
+        if (!buf.log) {
+            continue;
+        }
+        copies.emplace_back();
+        auto r = read_trace_buf(buf, copies.back());
+        records.insert(records.end(), r.begin(), r.end());
+    }
+    // Each cpu's records are in time order; interleave them
+    std::stable_sort(records.begin(), records.end(),
+            [] (const copied_record& a, const copied_record& b) {
+                return a.time < b.time;
+            });
+
+    // Same format as scripts/osv/trace.py write()
+    std::vector<tracepoint_base*> tps;
+    for (auto& r : records) {
+        tps.push_back(reinterpret_cast<const trace_record*>(r.rec)->tp);
+    }
+    std::sort(tps.begin(), tps.end());
+    tps.erase(std::unique(tps.begin(), tps.end()), tps.end());
+    put<s32>(out, 2);
+    put<u64>(out, tps.size());
+    for (auto tp : tps) {
+        put<u64>(out, reinterpret_cast<u64>(tp));
+        put_str(out, tp->name);
+        put_str(out, signature_string(tp->sig));
+        put_str(out, tp->format);
+    }
+    for (auto& r : records) {
+        auto tr = reinterpret_cast<const trace_record*>(r.rec);
+        put<u64>(out, reinterpret_cast<u64>(tr->tp));
+        put<u64>(out, reinterpret_cast<u64>(tr->thread));
+        out.append(tr->thread_name.data(), tr->thread_name.size());
+        put<u64>(out, tr->time);
+        put<u32>(out, tr->cpu);
+        auto payload = reinterpret_cast<const char*>(tr->buffer);
+        if (tr->backtrace) {
+            auto bt = reinterpret_cast<void* const*>(payload);
+            for (unsigned i = 0; i < tracepoint_base::backtrace_len && bt[i]; i++) {
+                put<u64>(out, reinterpret_cast<u64>(bt[i]));
+            }
+            payload += tracepoint_base::backtrace_len * sizeof(void*);
+        }
+        put<u64>(out, 0);
+        out.append(payload, payload_size(tr->tp->sig));
+    }
+    return out;
+}
+
+std::string procfs_trace_dropped()
+{
+    std::string out;
+    for (unsigned i = 0; i < sched::max_cpus; i++) {
+        if (trace_for_cpu[i].log) {
+            out += osv::sprintf("%d %d\n", i,
+                    trace_for_cpu[i].dropped.load(std::memory_order_relaxed));
+        }
+    }
+    return out;
 }
 
 static __thread unsigned func_trace_nesting;
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <map>
 #include <errno.h>
+#include <limits>
 #include <osv/debug.h>
 
 #include <osv/sched.hh>
@@ -40,6 +41,7 @@ TRACEPOINT(trace_virtio_blk_make_request_seg_max, "request of size %d needs more
 TRACEPOINT(trace_virtio_blk_make_request_readonly, "write on readonly device");
 TRACEPOINT(trace_virtio_blk_wake, "");
 TRACEPOINT(trace_virtio_blk_strategy, "bio=%p", struct bio*);
+TRACEPOINT(trace_virtio_blk_merge, "bio=%p, into=%p", struct bio*, struct bio*);
 TRACEPOINT(trace_virtio_blk_req_ok, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
 TRACEPOINT(trace_virtio_blk_req_unsupp, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
 TRACEPOINT(trace_virtio_blk_req_err, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
@@ -51,6 +53,8 @@ namespace virtio {
 
 int blk::_instance = 0;
 
+static const int sector_size = 512;
+
 
 struct blk_priv {
     blk* drv;
@@ -113,7 +117,7 @@ bool blk::ack_irq()
 }
 
 blk::blk(pci::device& pci_dev)
-    : virtio_driver(pci_dev), _ro(false)
+    : virtio_driver(pci_dev), _ro(false), _size_max(0)
 {
 
     _driver_name = "virtio-blk";
@@ -123,20 +127,43 @@ blk::blk(pci::device& pci_dev)
     setup_features();
     read_config();
 
-    //register the single irq callback for the block
-    sched::thread* t = new sched::thread([this] { this->req_done(); },
-            sched::thread::attr().name("virtio-blk"));
-    t->start();
-    auto queue = get_virt_queue(0);
+    // Give each CPU a queue of its own, as far as the host and the MSI-X
+    // vectors allow; a shared level interrupt only serves the first queue.
+    unsigned nqueues = 1;
+    if (get_guest_feature_bit(VIRTIO_BLK_F_MQ) && pci_dev.is_msix()) {
+        nqueues = std::min({std::max<unsigned>(_config.num_queues, 1),
+                            _num_queues,
+                            (unsigned)sched::cpus.size(),
+                            pci_dev.msix_get_num_entries()});
+        nqueues = std::max(nqueues, 1U);
+    }
+
+    for (unsigned i = 0; i < nqueues; i++) {
+        auto* q = new blk_queue(this, get_virt_queue(i));
+        sched::thread::attr attr;
+        attr.name("virtio-blk" + (nqueues > 1 ? std::to_string(i) : ""));
+        if (nqueues > 1) {
+            attr.pin(sched::cpus[i]);
+        }
+        q->done_thread.reset(new sched::thread([this, q] { this->req_done(*q); }, attr));
+        q->done_thread->start();
+        // Enable indirect descriptor
+        q->vqueue->set_use_indirect(true);
+        _queues.emplace_back(q);
+    }
+
     if (pci_dev.is_msix()) {
-        _msi.easy_register({ { 0, [=] { queue->disable_interrupts(); }, t } });
+        std::vector<msix_binding> bindings;
+        for (unsigned i = 0; i < nqueues; i++) {
+            auto* queue = _queues[i]->vqueue;
+            bindings.push_back({ i, [=] { queue->disable_interrupts(); }, _queues[i]->done_thread.get() });
+        }
+        _msi.easy_register(bindings);
     } else {
+        sched::thread* t = _queues[0]->done_thread.get();
         _gsi.set_ack_and_handler(pci_dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] { t->wake(); });
     }
 
-    // Enable indirect descriptor
-    queue->set_use_indirect(true);
-
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
 
     struct blk_priv* prv;
@@ -166,8 +193,10 @@ void blk::read_config()
 
     trace_virtio_blk_read_config_capacity(_config.capacity);
 
-    if (get_guest_feature_bit(VIRTIO_BLK_F_SIZE_MAX))
+    if (get_guest_feature_bit(VIRTIO_BLK_F_SIZE_MAX)) {
+        _size_max = _config.size_max;
         trace_virtio_blk_read_config_size_max(_config.size_max);
+    }
     if (get_guest_feature_bit(VIRTIO_BLK_F_SEG_MAX))
         trace_virtio_blk_read_config_seg_max(_config.seg_max);
     if (get_guest_feature_bit(VIRTIO_BLK_F_GEOMETRY)) {
@@ -186,9 +215,9 @@ void blk::read_config()
     }
 }
 
-void blk::req_done()
+void blk::req_done(blk_queue& q)
 {
-    auto* queue = get_virt_queue(0);
+    auto* queue = q.vqueue;
     blk_req* req;
 
     while (1) {
@@ -198,21 +227,28 @@ void blk::req_done()
 
         u32 len;
         while((req = static_cast<blk_req*>(queue->get_buf_elem(&len))) != nullptr) {
-            if (req->bio) {
+            auto sector = req->hdr.sector;
+            auto* bio = req->bio;
+            while (bio) {
+                // biodone() may free the bio
+                auto* next = static_cast<struct bio*>(bio->bio_private);
+                auto bcount = bio->bio_bcount;
                 switch (req->res.status) {
                 case VIRTIO_BLK_S_OK:
-                    trace_virtio_blk_req_ok(req->bio, req->hdr.sector, req->bio->bio_bcount, req->hdr.type);
-                    biodone(req->bio, true);
+                    trace_virtio_blk_req_ok(bio, sector, bcount, req->hdr.type);
+                    biodone(bio, true);
                     break;
                 case VIRTIO_BLK_S_UNSUPP:
-                    trace_virtio_blk_req_unsupp(req->bio, req->hdr.sector, req->bio->bio_bcount, req->hdr.type);
-                    biodone(req->bio, false);
+                    trace_virtio_blk_req_unsupp(bio, sector, bcount, req->hdr.type);
+                    biodone(bio, false);
                     break;
                 default:
-                    trace_virtio_blk_req_err(req->bio, req->hdr.sector, req->bio->bio_bcount, req->hdr.type);
-                    biodone(req->bio, false);
+                    trace_virtio_blk_req_err(bio, sector, bcount, req->hdr.type);
+                    biodone(bio, false);
                     break;
-               }
+                }
+                sector += bcount / sector_size;
+                bio = next;
             }
 
             delete req;
@@ -229,79 +265,174 @@ int64_t blk::size()
     return _config.capacity * _config.blk_size;
 }
 
-static const int sector_size = 512;
+// An upper bound on the number of data segments of a bio: one per page it
+// touches, or more if the host limits segments to less than a page.
+unsigned blk::bio_segments(struct bio* bio)
+{
+    auto offset = reinterpret_cast<uintptr_t>(bio->bio_data) & (mmu::page_size - 1);
+    unsigned segs = (offset + bio->bio_bcount + mmu::page_size - 1) / mmu::page_size;
+    if (_size_max && _size_max < mmu::page_size) {
+        segs *= (mmu::page_size + _size_max - 1) / _size_max;
+    }
+    return segs;
+}
 
-int blk::make_request(struct bio* bio)
+// Queues a bio for submission, merging it into the last pending request if
+// it continues that request on disk.  Called with q.lock held.
+void blk::queue_bio(blk_queue& q, struct bio* bio, blk_request_type type)
 {
-    // The lock is here for parallel requests protection
-    WITH_LOCK(_lock) {
+    auto segs = bio_segments(bio);
+    bio->bio_private = nullptr;
+
+    if (type != VIRTIO_BLK_T_FLUSH && !q.pending.empty()) {
+        auto* req = q.pending.back();
+        auto* last = req->last;
+        if (req->hdr.type == type &&
+                last->bio_offset + (off_t)last->bio_bcount == bio->bio_offset &&
+                req->segs + segs <= _config.seg_max) {
+            trace_virtio_blk_merge(bio, req->bio);
+            last->bio_private = bio;
+            req->last = bio;
+            req->segs += segs;
+            return;
+        }
+    }
 
-        if (!bio) return EIO;
+    auto* req = new blk_req(bio);
+    blk_outhdr* hdr = &req->hdr;
+    hdr->type = type;
+    hdr->ioprio = 0;
+    hdr->sector = bio->bio_offset / sector_size;
+    req->segs = segs;
+    q.pending.push_back(req);
+}
 
-        if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
-            trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
-            return EIO;
+// Hands the pending requests to the host.  If another thread is already doing
+// so, it will pick ours up as well; otherwise keep going until no more arrive,
+// kicking the host once per batch.  Called with q.lock held.
+void blk::flush(blk_queue& q)
+{
+    if (q.submitting) {
+        return;
+    }
+    q.submitting = true;
+    std::vector<blk_req*> batch;
+    while (!q.pending.empty()) {
+        batch.swap(q.pending);
+        DROP_LOCK(q.lock) {
+            for (auto* req : batch) {
+                submit(q.vqueue, req);
+            }
+            q.vqueue->kick();
         }
+        batch.clear();
+    }
+    q.submitting = false;
+}
+
+void blk::unplug(void* arg)
+{
+    auto* q = static_cast<blk_queue*>(arg);
+    WITH_LOCK(q->lock) {
+        q->drv->flush(*q);
+    }
+}
 
-        auto* queue = get_virt_queue(0);
-        blk_request_type type;
-
-        switch (bio->bio_cmd) {
-        case BIO_READ:
-            type = VIRTIO_BLK_T_IN;
-            break;
-        case BIO_WRITE:
-            if (is_readonly()) {
-                trace_virtio_blk_make_request_readonly();
-                biodone(bio, false);
-                return EROFS;
+// Adds a data buffer to the request being built, feeding physically
+// contiguous pages to the host as a single segment, up to size_max.  Only
+// the segments from index first on belong to the data and may be extended.
+void blk::add_data_sg(vring* queue, size_t first, void* data, size_t len, u16 flags)
+{
+    auto& sg = queue->_sg_vec;
+    u32 limit = _size_max ? _size_max : std::numeric_limits<u32>::max();
+    auto* base = static_cast<char*>(data);
+
+    while (len) {
+        auto offset = reinterpret_cast<uintptr_t>(base) & (mmu::page_size - 1);
+        size_t size = std::min(len, mmu::page_size - offset);
+        u64 paddr = mmu::virt_to_phys(base);
+        base += size;
+        len -= size;
+
+        while (size) {
+            u32 n;
+            if (sg.size() > first && sg.back()._flags == flags &&
+                    sg.back()._paddr + sg.back()._len == paddr &&
+                    sg.back()._len < limit) {
+                n = std::min<size_t>(size, limit - sg.back()._len);
+                sg.back()._len += n;
+            } else {
+                n = std::min<size_t>(size, limit);
+                sg.emplace_back(paddr, n, flags);
             }
-            type = VIRTIO_BLK_T_OUT;
-            break;
-        case BIO_FLUSH:
-            type = VIRTIO_BLK_T_FLUSH;
-            break;
-        default:
-            return ENOTBLK;
+            paddr += n;
+            size -= n;
         }
+    }
+}
 
-        auto* req = new blk_req(bio);
-        blk_outhdr* hdr = &req->hdr;
-        hdr->type = type;
-        hdr->ioprio = 0;
-        hdr->sector = bio->bio_offset / sector_size;
-
-        queue->init_sg();
-        queue->add_out_sg(hdr, sizeof(struct blk_outhdr));
-
-        // need to break a contiguous buffers that > 4k into several physical page mapping
-        // even if the virtual space is contiguous.
-        size_t len = 0;
-        auto offset = reinterpret_cast<size_t>(bio->bio_data) & 0xfff;
-        auto *base = bio->bio_data;
-        while (len != bio->bio_bcount) {
-            auto size = std::min(bio->bio_bcount - len, mmu::page_size);
-            if (offset + size > mmu::page_size)
-                size = mmu::page_size - offset;
-            len += size;
-            if (type == VIRTIO_BLK_T_OUT)
-                queue->add_out_sg(base, size);
-            else
-                queue->add_in_sg(base, size);
-
-            base += size;
-            offset = 0;
-        }
+void blk::submit(vring* queue, blk_req* req)
+{
+    queue->init_sg();
+    queue->add_out_sg(&req->hdr, sizeof(struct blk_outhdr));
+
+    u16 flags = req->hdr.type == VIRTIO_BLK_T_OUT ?
+            vring_desc::VRING_DESC_F_READ : vring_desc::VRING_DESC_F_WRITE;
+    auto first = queue->_sg_vec.size();
+    for (auto* bio = req->bio; bio; bio = static_cast<struct bio*>(bio->bio_private)) {
+        add_data_sg(queue, first, bio->bio_data, bio->bio_bcount, flags);
+    }
 
-        req->res.status = 0;
-        queue->add_in_sg(&req->res, sizeof (struct blk_res));
+    req->res.status = 0;
+    queue->add_in_sg(&req->res, sizeof (struct blk_res));
 
+    if (!queue->add_buf(req)) {
+        // Let the host see what we queued so far, so it can make room
+        queue->kick();
         queue->add_buf_wait(req);
+    }
+}
 
-        queue->kick();
+int blk::make_request(struct bio* bio)
+{
+    if (!bio) return EIO;
 
-        return 0;
+    if (bio_segments(bio) > _config.seg_max) {
+        trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
+        return EIO;
+    }
+
+    blk_request_type type;
+
+    switch (bio->bio_cmd) {
+    case BIO_READ:
+        type = VIRTIO_BLK_T_IN;
+        break;
+    case BIO_WRITE:
+        if (is_readonly()) {
+            trace_virtio_blk_make_request_readonly();
+            biodone(bio, false);
+            return EROFS;
+        }
+        type = VIRTIO_BLK_T_OUT;
+        break;
+    case BIO_FLUSH:
+        type = VIRTIO_BLK_T_FLUSH;
+        break;
+    default:
+        return ENOTBLK;
+    }
+
+    // Any queue would do; the current CPU's keeps submitters apart
+    auto& q = *_queues[sched::cpu::current()->id % _queues.size()];
+    WITH_LOCK(q.lock) {
+        queue_bio(q, bio, type);
+        // A plugged caller has more to come: hold back until it unplugs
+        if (!bio_plug_defer(unplug, &q)) {
+            flush(q);
+        }
     }
+    return 0;
 }
 
 u32 blk::get_driver_features()
@@ -313,7 +444,8 @@ u32 blk::get_driver_features()
                  | ( 1 << VIRTIO_BLK_F_RO)
                  | ( 1 << VIRTIO_BLK_F_BLK_SIZE)
                  | ( 1 << VIRTIO_BLK_F_CONFIG_WCE)
-                 | ( 1 << VIRTIO_BLK_F_WCE));
+                 | ( 1 << VIRTIO_BLK_F_WCE)
+                 | ( 1 << VIRTIO_BLK_F_MQ));
 }
 
 hw_driver* blk::probe(hw_device* dev)
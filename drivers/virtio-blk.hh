@@ -10,6 +10,8 @@
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 #include <osv/bio.h>
+#include <memory>
+#include <vector>
 
 namespace virtio {
 
@@ -28,6 +30,7 @@ public:
         VIRTIO_BLK_F_WCE        = 9,  /* Writeback mode enabled after reset */
         VIRTIO_BLK_F_TOPOLOGY   = 10, /* Topology information is available */
         VIRTIO_BLK_F_CONFIG_WCE = 11, /* Writeback mode available in config */
+        VIRTIO_BLK_F_MQ         = 12, /* Support more than one vq */
     };
 
     enum {
@@ -95,6 +98,10 @@ public:
 
             /* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
             u8 wce;
+            u8 unused;
+
+            /* number of vqs, only available when VIRTIO_BLK_F_MQ is set */
+            u16 num_queues;
     } __attribute__((packed));
 
     /* This is the first element of the read scatter-gather list. */
@@ -128,7 +135,6 @@ public:
 
     int make_request(struct bio*);
 
-    void req_done();
     int64_t size();
 
     void set_readonly() {_ro = true;}
@@ -139,15 +145,41 @@ public:
     static hw_driver* probe(hw_device* dev);
 private:
 
+    // A request covers one bio, or several bios of adjacent sectors merged
+    // together; the bios are chained through bio_private.
     struct blk_req {
-        blk_req(struct bio* b) :bio(b) {};
+        blk_req(struct bio* b) :bio(b), last(b), segs(0) {};
         ~blk_req() {};
 
         blk_outhdr hdr;
         blk_res res;
         struct bio* bio;
+        struct bio* last;
+        // upper bound on the number of data segments
+        unsigned segs;
+    };
+
+    struct blk_queue {
+        blk_queue(blk* d, vring* vq) : drv(d), vqueue(vq) {}
+        blk* drv;
+        vring* vqueue;
+        std::unique_ptr<sched::thread> done_thread;
+        // Protects pending and submitting; the vring itself is only touched
+        // by the thread which set submitting.
+        mutex lock;
+        // Requests not yet handed to the device, in arrival order
+        std::vector<blk_req*> pending;
+        bool submitting = false;
     };
 
+    void req_done(blk_queue& q);
+    unsigned bio_segments(struct bio* bio);
+    void queue_bio(blk_queue& q, struct bio* bio, blk_request_type type);
+    void flush(blk_queue& q);
+    void submit(vring* queue, blk_req* req);
+    void add_data_sg(vring* queue, size_t first, void* data, size_t len, u16 flags);
+    static void unplug(void* q);
+
     std::string _driver_name;
     blk_config _config;
 
@@ -155,8 +187,9 @@ private:
     static int _instance;
     int _id;
     bool _ro;
-    // This mutex protects parallel make_request invocations
-    mutex _lock;
+    // 0 if the host did not give a limit
+    u32 _size_max;
+    std::vector<std::unique_ptr<blk_queue>> _queues;
     gsi_level_interrupt _gsi;
 };
 
@@ -17,12 +17,16 @@
 #include <osv/mmu.hh>
 
 #include <string>
+#include <sstream>
+#include <algorithm>
 #include <string.h>
 #include <map>
 #include <errno.h>
 #include <osv/debug.h>
 
 #include <osv/sched.hh>
+#include <osv/mutex.h>
+#include <osv/printf.hh>
 #include "osv/trace.hh"
 
 
@@ -38,6 +42,7 @@
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/udp.h>
 #include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
 
 TRACEPOINT(trace_virtio_net_rx_packet, "if=%d, len=%d", int, int);
 TRACEPOINT(trace_virtio_net_rx_wake, "");
@@ -49,7 +54,6 @@ TRACEPOINT(trace_virtio_net_tx_no_space_calling_gc, "if=%d", int);
 using namespace memory;
 
 // TODO list
-// irq thread affinity and tx affinity
 // tx zero copy
 // vlans?
 
@@ -57,6 +61,10 @@ namespace virtio {
 
 int net::_instance = 0;
 
+// The attached interfaces, for their statistics in /proc
+static mutex nets_lock;
+static std::vector<net*> nets;
+
 #define net_tag "virtio-net"
 #define net_d(...)   tprintf_d(net_tag, __VA_ARGS__)
 #define net_i(...)   tprintf_i(net_tag, __VA_ARGS__)
@@ -102,10 +110,11 @@ static int if_ioctl(struct ifnet* ifp, u_long command, caddr_t data)
  */
 static void if_qflush(struct ifnet* ifp)
 {
-    /*
-     * Since virtio_net currently doesn't have any Tx queue we just
-     * flush the upper layer queues.
-     */
+    net* vnet = (net*)ifp->if_softc;
+
+    // Drop the packets still waiting for a Tx ring and then flush the
+    // upper layer queues.
+    vnet->qflush();
     ::if_qflush(ifp);
 }
 
@@ -123,19 +132,7 @@ static int if_transmit(struct ifnet* ifp, struct mbuf* m_head)
 
     net_d("%s_start", __FUNCTION__);
 
-    /* Process packets */
-    vnet->_tx_ring_lock.lock();
-
-    net_d("*** processing packet! ***");
-
-    int error = vnet->tx_locked(m_head);
-
-    if (!error)
-        vnet->kick(1);
-
-    vnet->_tx_ring_lock.unlock();
-
-    return error;
+    return vnet->transmit(m_head);
 }
 
 static void if_init(void* xsc)
@@ -161,9 +158,12 @@ static void if_getinfo(struct ifnet* ifp, struct if_data* out_data)
 
 void net::fill_stats(struct if_data* out_data) const
 {
-    // We currently support only a single Tx/Rx queue so no iteration so far
-    fill_qstats(_rxq, out_data);
-    fill_qstats(_txq, out_data);
+    for (auto& rxq : _rxq) {
+        fill_qstats(*rxq, out_data);
+    }
+    for (auto& txq : _txq) {
+        fill_qstats(*txq, out_data);
+    }
 }
 
 void net::fill_qstats(const struct rxq& rxq,
@@ -178,18 +178,38 @@ void net::fill_qstats(const struct rxq& rxq,
 void net::fill_qstats(const struct txq& txq,
                              struct if_data* out_data) const
 {
-    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
     out_data->ifi_opackets += txq.stats.tx_packets;
     out_data->ifi_obytes   += txq.stats.tx_bytes;
     out_data->ifi_oerrors  += txq.stats.tx_err + txq.stats.tx_drops;
 }
 
+void net::fill_lro_stats(std::ostream& os) const
+{
+    u64 queued = 0, flushed = 0;
+    for (auto& rxq : _rxq) {
+        queued += rxq->stats.rx_lro_queued;
+        flushed += rxq->stats.rx_lro_flushed;
+    }
+    osv::fprintf(os, "%s queued %d flushed %d\n", _ifn->if_xname, queued, flushed);
+}
+
+std::string procfs_lro()
+{
+    std::ostringstream os;
+    WITH_LOCK(nets_lock) {
+        for (auto n : nets) {
+            n->fill_lro_stats(os);
+        }
+    }
+    return os.str();
+}
+
 bool net::ack_irq()
 {
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
 
     if (isr) {
-        _rxq.vqueue->disable_interrupts();
+        _rxq[0]->vqueue->disable_interrupts();
         return true;
     } else {
         return false;
@@ -198,12 +218,8 @@ bool net::ack_irq()
 }
 
 net::net(pci::device& dev)
-    : virtio_driver(dev),
-      _rxq(get_virt_queue(0), [this] { this->receiver(); }),
-      _txq(get_virt_queue(1))
+    : virtio_driver(dev)
 {
-    sched::thread* poll_task = &_rxq.poll_task;
-
     _driver_name = "virtio-net";
     virtio_i("VIRTIO NET INSTANCE");
     _id = _instance++;
@@ -213,6 +229,36 @@ net::net(pci::device& dev)
 
     _hdr_size = _mergeable_bufs ? sizeof(net_hdr_mrg_rxbuf) : sizeof(net_hdr);
 
+    // The host lays out its queues as rx0, tx0, rx1, tx1, ..., followed by
+    // the control queue. Use as many pairs as we have CPUs to serve them,
+    // but only with MSI-X: a shared level interrupt would have to wake
+    // every receiver anyway.
+    unsigned host_pairs = _mq ? std::max<unsigned>(_config.max_virtqueue_pairs, 1) : 1;
+    unsigned pairs = 1;
+    if (_mq && dev.is_msix()) {
+        pairs = std::min({host_pairs,
+                          (_num_queues - 1) / 2,
+                          (unsigned)sched::cpus.size(),
+                          dev.msix_get_num_entries() / 2});
+        pairs = std::max(pairs, 1U);
+    }
+    if (_ctrl_vq) {
+        _ctrl_vqueue = get_virt_queue(2 * host_pairs);
+    }
+
+    for (unsigned i = 0; i < pairs; i++) {
+        sched::thread::attr attr;
+        attr.name("virtio-net-rx" + (pairs > 1 ? std::to_string(i) : ""));
+        if (pairs > 1) {
+            // Keep each receiver on its own CPU; the MSI-X vector of the
+            // queue follows the thread it wakes (see set_affinity_and_wake).
+            attr.pin(sched::cpus[i]);
+        }
+        _rxq.emplace_back(new struct rxq(get_virt_queue(2 * i),
+                [this, i] { this->receiver(*_rxq[i]); }, attr));
+        _txq.emplace_back(new struct txq(get_virt_queue(2 * i + 1)));
+    }
+
     //initialize the BSD interface _if
     _ifn = if_alloc(IFT_ETHER);
     if (_ifn == NULL) {
@@ -231,7 +277,7 @@ net::net(pci::device& dev)
     _ifn->if_qflush = if_qflush;
     _ifn->if_init = if_init;
     _ifn->if_getinfo = if_getinfo;
-    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq.vqueue->size());
+    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq[0]->vqueue->size());
 
     _ifn->if_capabilities = 0;
 
@@ -243,30 +289,64 @@ net::net(pci::device& dev)
         }
     }
 
+    // With TSO4 the host merges segments itself, and the receiver merges
+    // the ones it passes on one by one; either way, only segments whose
+    // checksum the host vouched for.
     if (_guest_csum) {
-        _ifn->if_capabilities |= IFCAP_RXCSUM;
-        if (_guest_tso4)
-            _ifn->if_capabilities |= IFCAP_LRO;
+        _ifn->if_capabilities |= IFCAP_RXCSUM | IFCAP_LRO;
     }
 
     _ifn->if_capenable = _ifn->if_capabilities | IFCAP_HWSTATS;
 
-    //Start the polling thread before attaching it to the Rx interrupt
-    poll_task->start();
+    for (auto& rxq : _rxq) {
+        if (tcp_lro_init(&rxq->lro)) {
+            net_w("LRO initialization failed");
+        }
+        rxq->lro.ifp = _ifn;
+        rxq->lro.lro_input = lro_input;
+    }
+
+    // Start the polling threads before attaching them to the Rx interrupts.
+    // Only the first pair is used until the host agrees to use the others.
+    _rxq[0]->poll_task.start();
 
     ether_ifattach(_ifn, _config.mac);
+    WITH_LOCK(nets_lock) {
+        nets.push_back(this);
+    }
     if (dev.is_msix()) {
-        _msi.easy_register({
-            { 0, [&] { _rxq.vqueue->disable_interrupts(); }, poll_task },
-            { 1, [&] { _txq.vqueue->disable_interrupts(); }, nullptr }
-        });
+        register_msix(pairs);
     } else {
+        sched::thread* poll_task = &_rxq[0]->poll_task;
         _gsi.set_ack_and_handler(dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] { poll_task->wake(); });
     }
 
-    fill_rx_ring();
+    fill_rx_ring(*_rxq[0]);
 
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    if (pairs > 1) {
+        if (set_queue_pairs(pairs)) {
+            for (unsigned i = 1; i < pairs; i++) {
+                _rxq[i]->poll_task.start();
+                fill_rx_ring(*_rxq[i]);
+            }
+        } else {
+            // The host keeps steering to the first pair only, and would not
+            // look at the other queues either: drop them, and their vectors.
+            // Their receivers were never started, so there is nothing to stop.
+            net_w("Failed to enable %d queue pairs, falling back to one", pairs);
+            register_msix(1);
+            for (unsigned i = 1; i < pairs; i++) {
+                tcp_lro_free(&_rxq[i]->lro);
+            }
+            _rxq.resize(1);
+            _txq.resize(1);
+            // An interrupt may have come while the vectors were replaced
+            _rxq[0]->poll_task.wake();
+        }
+    }
+    net_i("Using %d Rx/Tx queue pairs (host offers %d)", queue_pairs(), host_pairs);
 }
 
 net::~net()
@@ -280,8 +360,27 @@ net::~net()
     // Since this will involve the rework of the virtio layer - make it for
     // all virtio drivers in a separate patchset.
 
+    WITH_LOCK(nets_lock) {
+        nets.erase(std::find(nets.begin(), nets.end(), this));
+    }
     ether_ifdetach(_ifn);
     if_free(_ifn);
+    for (auto& rxq : _rxq) {
+        tcp_lro_free(&rxq->lro);
+    }
+}
+
+void net::register_msix(unsigned pairs)
+{
+    _msi.easy_unregister();
+    std::vector<msix_binding> bindings;
+    for (unsigned i = 0; i < pairs; i++) {
+        auto rxq = _rxq[i].get();
+        auto txq = _txq[i].get();
+        bindings.push_back({ 2 * i, [=] { rxq->vqueue->disable_interrupts(); }, &rxq->poll_task });
+        bindings.push_back({ 2 * i + 1, [=] { txq->vqueue->disable_interrupts(); }, nullptr });
+    }
+    _msi.easy_register(bindings);
 }
 
 void net::read_config()
@@ -307,11 +406,56 @@ void net::read_config()
     _guest_tso4 = get_guest_feature_bit(VIRTIO_NET_F_GUEST_TSO4);
     _host_tso4 = get_guest_feature_bit(VIRTIO_NET_F_HOST_TSO4);
     _guest_ufo = get_guest_feature_bit(VIRTIO_NET_F_GUEST_UFO);
+    _ctrl_vq = get_guest_feature_bit(VIRTIO_NET_F_CTRL_VQ);
+    _mq = _ctrl_vq && get_guest_feature_bit(VIRTIO_NET_F_MQ);
 
     net_i("Features: %s=%d,%s=%d", "Status", _status, "TSO_ECN", _tso_ecn);
     net_i("Features: %s=%d,%s=%d", "Host TSO ECN", _host_tso_ecn, "CSUM", _csum);
     net_i("Features: %s=%d,%s=%d", "Guest_csum", _guest_csum, "guest tso4", _guest_tso4);
-    net_i("Features: %s=%d", "host tso4", _host_tso4);
+    net_i("Features: %s=%d,%s=%d", "host tso4", _host_tso4, "MQ", _mq);
+}
+
+bool net::ctrl_cmd(u8 cls, u8 cmd, const void* data, u32 len)
+{
+    vring* vq = _ctrl_vqueue;
+
+    if (!vq) {
+        return false;
+    }
+
+    assert(len <= sizeof(_ctrl_buf.data));
+    _ctrl_buf.hdr.class_t = cls;
+    _ctrl_buf.hdr.cmd = cmd;
+    memcpy(_ctrl_buf.data, data, len);
+    _ctrl_buf.ack = VIRTIO_NET_ERR;
+
+    vq->init_sg();
+    vq->add_out_sg(&_ctrl_buf.hdr, sizeof(_ctrl_buf.hdr));
+    vq->add_out_sg(_ctrl_buf.data, len);
+    vq->add_in_sg(&_ctrl_buf.ack, sizeof(_ctrl_buf.ack));
+    if (!vq->add_buf(&_ctrl_buf)) {
+        return false;
+    }
+    vq->kick();
+
+    // No interrupt is bound to the control queue: the host handles the
+    // command while processing our kick, so just poll for the reply.
+    u32 used_len;
+    while (!vq->get_buf_elem(&used_len)) {
+        sched::thread::yield();
+    }
+    vq->get_buf_finalize();
+    vq->get_buf_gc();
+
+    return _ctrl_buf.ack == VIRTIO_NET_OK;
+}
+
+bool net::set_queue_pairs(u16 pairs)
+{
+    net_ctrl_mq mq = { pairs };
+
+    return ctrl_cmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                    &mq, sizeof(mq));
 }
 
 /**
@@ -374,9 +518,9 @@ bool net::bad_rx_csum(struct mbuf* m, struct net_hdr* hdr)
     return false;
 }
 
-void net::receiver()
+void net::receiver(struct rxq& rxq)
 {
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
 
     while (1) {
 
@@ -390,6 +534,10 @@ void net::receiver()
         u32 offset = _hdr_size;
         u64 rx_drops = 0, rx_packets = 0, csum_ok = 0;
         u64 csum_err = 0, rx_bytes = 0;
+        // wake the consumers of the net channels we feed once per batch
+        net_channel_batch batch;
+        rxq.lro.lro_arg = &batch;
+        bool lro = _ifn->if_capenable & IFCAP_LRO;
 
         // use local header that we copy out of the mbuf since we're
         // truncating it.
@@ -403,6 +551,8 @@ void net::receiver()
             // Bad packet/buffer - discard and continue to the next one
             if (len < _hdr_size + ETHER_HDR_LEN) {
                 rx_drops++;
+                // freeing may sleep, so let go of the batch first
+                batch.flush();
                 m_free(m);
 
                 m = static_cast<struct mbuf*>(vq->get_buf_elem(&len));
@@ -457,14 +607,34 @@ void net::receiver()
                 else
                     csum_ok++;
 
+            } else if ((_ifn->if_capenable & IFCAP_RXCSUM) &&
+                       (mhdr->hdr.flags &
+                        net_hdr::VIRTIO_NET_HDR_F_DATA_VALID)) {
+                // the host (or its NIC) checked it already
+                m_head->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+                m_head->M_dat.MH.MH_pkthdr.csum_data = 0xFFFF;
+                csum_ok++;
             }
 
             rx_packets++;
             rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
 
-            bool fast_path = _ifn->if_classifier.post_packet(m_head);
-            if (!fast_path) {
-                (*_ifn->if_input)(_ifn, m_head);
+            // Merging trusts the checksum of the segments, so only do it
+            // for those the host checked.
+            int error = TCP_LRO_NOT_SUPPORTED;
+            if (lro && (m_head->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID)) {
+                // so may merging; what it holds is posted as a batch of
+                // its own when flushed
+                batch.flush();
+                error = tcp_lro_rx(&rxq.lro, m_head, 0);
+            }
+            if (error == TCP_LRO_CANNOT) {
+                // Could be a FIN or an out of order segment of a flow we
+                // hold segments of; don't let it overtake them.
+                tcp_lro_flush_all(&rxq.lro);
+            }
+            if (error) {
+                rx_input(m_head, batch);
             }
 
             trace_virtio_net_rx_packet(_ifn->if_index, rx_bytes);
@@ -478,23 +648,45 @@ void net::receiver()
             m = static_cast<struct mbuf*>(vq->get_buf_elem(&len));
         }
 
+        tcp_lro_flush_all(&rxq.lro);
+        batch.flush();
+
         if (vq->refill_ring_cond())
-            fill_rx_ring();
+            fill_rx_ring(rxq);
 
         // Update the stats
-        _rxq.stats.rx_drops      += rx_drops;
-        _rxq.stats.rx_packets    += rx_packets;
-        _rxq.stats.rx_csum       += csum_ok;
-        _rxq.stats.rx_csum_err   += csum_err;
-        _rxq.stats.rx_bytes      += rx_bytes;
+        rxq.stats.rx_drops      += rx_drops;
+        rxq.stats.rx_packets    += rx_packets;
+        rxq.stats.rx_csum       += csum_ok;
+        rxq.stats.rx_csum_err   += csum_err;
+        rxq.stats.rx_bytes      += rx_bytes;
+        rxq.stats.rx_lro_queued += rxq.lro.lro_queued;
+        rxq.stats.rx_lro_flushed += rxq.lro.lro_flushed;
+        rxq.lro.lro_queued = rxq.lro.lro_flushed = 0;
+    }
+}
+
+void net::rx_input(struct mbuf* m, net_channel_batch& batch)
+{
+    bool fast_path = _ifn->if_classifier.post_packet(m, batch);
+    if (!fast_path) {
+        // the stack may sleep, so let go of the batch first
+        batch.flush();
+        (*_ifn->if_input)(_ifn, m);
     }
 }
 
-void net::fill_rx_ring()
+void net::lro_input(struct lro_ctrl* lc, struct mbuf* m)
+{
+    auto vnet = static_cast<net*>(lc->ifp->if_softc);
+    vnet->rx_input(m, *static_cast<net_channel_batch*>(lc->lro_arg));
+}
+
+void net::fill_rx_ring(struct rxq& rxq)
 {
     trace_virtio_net_fill_rx_ring(_ifn->if_index);
     int added = 0;
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
 
     while (vq->avail_ring_not_empty()) {
         struct mbuf* m = m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR, MCLBYTES);
@@ -519,36 +711,130 @@ void net::fill_rx_ring()
         vq->kick();
 }
 
+int net::transmit(struct mbuf* m_head)
+{
+    struct txq& txq = select_txq();
+
+    // Queue the packet for whoever owns the ring, and if that is nobody
+    // become the owner and send everything queued so far with a single
+    // kick. A transmitter that loses the race for the lock can leave right
+    // away: the owner looks at the queue again after releasing the lock.
+    struct mbuf* old = txq.pending.load(std::memory_order_relaxed);
+    do {
+        m_head->m_hdr.mh_nextpkt = old;
+    } while (!txq.pending.compare_exchange_weak(old, m_head));
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (txq.pending.load(std::memory_order_relaxed) &&
+           txq.tx_ring_lock.try_lock()) {
+        tx_drain_locked(txq);
+        txq.tx_ring_lock.unlock();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    // Errors are accounted in the queue statistics; the packet is consumed
+    // either way.
+    return 0;
+}
+
+void net::qflush()
+{
+    for (auto& txq : _txq) {
+        struct mbuf* m = txq->pending.exchange(nullptr);
+        while (m) {
+            struct mbuf* next = m->m_hdr.mh_nextpkt;
+            m->m_hdr.mh_nextpkt = nullptr;
+            m_freem(m);
+            m = next;
+        }
+    }
+}
+
+void net::tx_drain_locked(struct txq& txq)
+{
+    DEBUG_ASSERT(txq.tx_ring_lock.owned(), "tx_ring_lock is not locked!");
+
+    struct mbuf* m = txq.pending.exchange(nullptr, std::memory_order_acquire);
+
+    // The list is newest first: reverse it to keep the packet order
+    struct mbuf* batch = nullptr;
+    while (m) {
+        struct mbuf* next = m->m_hdr.mh_nextpkt;
+        m->m_hdr.mh_nextpkt = batch;
+        batch = m;
+        m = next;
+    }
+
+    bool queued = false;
+    while (batch) {
+        m = batch;
+        batch = m->m_hdr.mh_nextpkt;
+        m->m_hdr.mh_nextpkt = nullptr;
+
+        net_d("*** processing packet! ***");
+
+        queued |= (tx_locked(txq, m) == 0);
+    }
+
+    if (queued && txq.vqueue->kick()) {
+        txq.stats.tx_kicks++;
+    }
+}
+
 // TODO: Does it really have to be "locked"?
-int net::tx_locked(struct mbuf* m_head, bool flush)
+int net::tx_locked(struct txq& txq, struct mbuf* m_head, bool flush)
 {
-    DEBUG_ASSERT(_tx_ring_lock.owned(), "_tx_ring_lock is not locked!");
+    DEBUG_ASSERT(txq.tx_ring_lock.owned(), "tx_ring_lock is not locked!");
 
     struct mbuf* m;
-    net_req* req = new net_req;
-    vring* vq = _txq.vqueue;
-    auto vq_sg_vec = &vq->_sg_vec;
+    net_req* req;
+    net_hdr_mrg_rxbuf mhdr;
+    vring* vq = txq.vqueue;
     int rc = 0;
-    struct txq_stats* stats = &_txq.stats;
+    struct txq_stats* stats = &txq.stats;
     u64 tx_bytes = 0;
+    int frags = 1;
 
-    req->um.reset(m_head);
+    memset(&mhdr, 0, sizeof(mhdr));
 
     if (m_head->M_dat.MH.MH_pkthdr.csum_flags != 0) {
-        m = tx_offload(m_head, &req->mhdr.hdr);
+        m = tx_offload(m_head, &mhdr.hdr);
         if ((m_head = m) == nullptr) {
-            delete req;
-
-            /* The buffer is not well-formed */
+            /* The buffer is not well-formed (and was freed) */
             rc = EINVAL;
             goto out;
         }
     }
 
-    if (_mergeable_bufs) {
-        req->mhdr.num_buffers = 0;
+    for (m = m_head; m != NULL; m = m->m_hdr.mh_next) {
+        if (m->m_hdr.mh_len != 0) {
+            frags++;
+        }
+    }
+
+    if (!vq->avail_ring_has_room(frags)) {
+        // can't call it, this is a get buf thing
+        if (vq->used_ring_not_empty()) {
+            trace_virtio_net_tx_no_space_calling_gc(_ifn->if_index);
+            tx_gc(txq);
+        }
+        if (!vq->avail_ring_has_room(frags)) {
+            net_d("%s: no room", __FUNCTION__);
+            m_freem(m_head);
+
+            rc = ENOBUFS;
+            goto out;
+        }
     }
 
+    // Return the completed descriptors to the free list now, so that
+    // avail_head() is the descriptor add_buf() is going to use and its
+    // request slot is free.
+    vq->get_buf_gc();
+    req = &txq.reqs[vq->avail_head()];
+    req->mhdr = mhdr;
+    req->m = m_head;
+
     vq->init_sg();
     vq->add_out_sg(static_cast<void*>(&req->mhdr), _hdr_size);
 
@@ -563,29 +849,20 @@ int net::tx_locked(struct mbuf* m_head, bool flush)
         }
     }
 
-    if (!vq->avail_ring_has_room(vq->_sg_vec.size())) {
-        // can't call it, this is a get buf thing
-        if (vq->used_ring_not_empty()) {
-            trace_virtio_net_tx_no_space_calling_gc(_ifn->if_index);
-            tx_gc();
-        } else {
-            net_d("%s: no room", __FUNCTION__);
-            delete req;
-
-            rc = ENOBUFS;
-            goto out;
-        }
-    }
-
     if (!vq->add_buf(req)) {
         trace_virtio_net_tx_failed_add_buf(_ifn->if_index);
-        delete req;
+        req->m = nullptr;
+        m_freem(m_head);
 
         rc = ENOBUFS;
         goto out;
     }
 
-    trace_virtio_net_tx_packet(_ifn->if_index, vq_sg_vec->size());
+    trace_virtio_net_tx_packet(_ifn->if_index, frags);
+
+    if (flush && vq->kick()) {
+        stats->tx_kicks++;
+    }
 
 out:
 
@@ -595,10 +872,10 @@ out:
         stats->tx_bytes += tx_bytes;
         stats->tx_packets++;
 
-        if (req->mhdr.hdr.flags & net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM)
+        if (mhdr.hdr.flags & net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM)
             stats->tx_csum++;
 
-        if (req->mhdr.hdr.gso_type)
+        if (mhdr.hdr.gso_type)
             stats->tx_tso++;
 
         break;
@@ -695,16 +972,17 @@ net::tx_offload(struct mbuf* m, struct net_hdr* hdr)
     return m;
 }
 
-void net::tx_gc()
+void net::tx_gc(struct txq& txq)
 {
     net_req* req;
     u32 len;
-    vring* vq = _txq.vqueue;
+    vring* vq = txq.vqueue;
 
     req = static_cast<net_req*>(vq->get_buf_elem(&len));
 
     while(req != nullptr) {
-        delete req;
+        m_freem(req->m);
+        req->m = nullptr;
         vq->get_buf_finalize();
 
         req = static_cast<net_req*>(vq->get_buf_elem(&len));
@@ -725,6 +1003,8 @@ u32 net::get_driver_features()
                  | (1 << VIRTIO_NET_F_HOST_TSO4)  \
                  | (1 << VIRTIO_NET_F_GUEST_ECN)
                  | (1 << VIRTIO_NET_F_GUEST_UFO)
+                 | (1 << VIRTIO_NET_F_CTRL_VQ)
+                 | (1 << VIRTIO_NET_F_MQ)
             );
 }
 
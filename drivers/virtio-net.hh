@@ -12,10 +12,19 @@
 #include <bsd/sys/net/if_var.h>
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/netinet/in.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
 
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
 namespace virtio {
 
 /**
@@ -211,25 +220,25 @@ public:
 
     void wait_for_queue(vring* queue);
     bool bad_rx_csum(struct mbuf* m, struct net_hdr* hdr);
-    void receiver();
-    void fill_rx_ring();
 
     bool ack_irq();
 
     /**
-     * Transmit a single mbuf.
-     * @param m_head a buffer to transmits
-     * @param flush kick() if TRUE
-     * @note should be called under the _tx_ring_lock.
+     * Transmit a single mbuf on the Tx queue of the current CPU.
+     * @param m_head a buffer to transmit
      *
      * @return 0 in case of success and an appropriate error code
      *         otherwise
      */
-    int tx_locked(struct mbuf* m_head, bool flush = false);
+    int transmit(struct mbuf* m_head);
+
+    /**
+     * Drop the packets queued for transmission but not yet on a Tx ring.
+     */
+    void qflush();
 
     struct mbuf* tx_offload(struct mbuf* m, struct net_hdr* hdr);
     void kick(int queue) {_queues[queue]->kick();}
-    void tx_gc();
     static hw_driver* probe(hw_device* dev);
 
     /**
@@ -239,18 +248,25 @@ public:
      */
     void fill_stats(struct if_data* out_data) const;
 
-    // tx ring lock protects this ring for multiple access
-    mutex _tx_ring_lock;
+    /**
+     * Print the LRO statistics of all the Rx queues, on one line
+     * @param os output stream
+     */
+    void fill_lro_stats(std::ostream& os) const;
+
+    /**
+     * @return the number of Rx/Tx queue pairs in use
+     */
+    unsigned queue_pairs() const { return _rxq.size(); }
 
 private:
 
+    // Per-packet Tx state. These are preallocated per Tx queue and indexed
+    // by the head descriptor of the packet's chain, so the header stays
+    // valid until the host consumes the descriptors.
     struct net_req {
         struct net::net_hdr_mrg_rxbuf mhdr;
-        struct free_deleter {
-            void operator()(struct mbuf* m) {m_freem(m);}
-        };
-
-        std::unique_ptr<struct mbuf, free_deleter> um;
+        struct mbuf* m = nullptr;
 
         net_req() {memset(&mhdr,0,sizeof(mhdr));};
     };
@@ -266,6 +282,8 @@ private:
     bool _guest_tso4 = false;
     bool _host_tso4 = false;
     bool _guest_ufo = false;
+    bool _ctrl_vq = false;
+    bool _mq = false;
 
     u32 _hdr_size;
 
@@ -277,6 +295,8 @@ private:
         u64 rx_drops;   /* if_iqdrops */
         u64 rx_csum;    /* number of packets with correct csum */
         u64 rx_csum_err;/* number of packets with a bad checksum */
+        u64 rx_lro_queued;  /* packets passed up in LRO aggregates */
+        u64 rx_lro_flushed; /* LRO aggregates passed up */
     };
 
     struct txq_stats {
@@ -286,25 +306,95 @@ private:
         u64 tx_drops;   /* Number of dropped packets */
         u64 tx_csum;    /* CSUM offload requests */
         u64 tx_tso;     /* GSO/TSO packets */
+        u64 tx_kicks;   /* Host notifications */
         /* u64 tx_rescheduled; */ /* TODO when we implement xoff */
     };
 
      /* Single Rx queue object */
     struct rxq {
-        rxq(vring* vq, std::function<void ()> poll_func)
-            : vqueue(vq), poll_task(poll_func, sched::thread::attr().name("virtio-net-rx")) {};
+        rxq(vring* vq, std::function<void ()> poll_func,
+            sched::thread::attr attr)
+            : vqueue(vq), poll_task(poll_func, attr) {};
         vring* vqueue;
         sched::thread  poll_task;
+        // merges the in-order TCP segments of a flow within an Rx batch
+        struct lro_ctrl lro = {};
         struct rxq_stats stats = { 0 };
     };
 
     /* Single Tx queue object */
     struct txq {
-        txq(vring* vq) : vqueue(vq) {};
+        txq(vring* vq) : vqueue(vq), reqs(new net_req[vq->size()]) {};
         vring* vqueue;
+        // tx ring lock protects this ring for multiple access
+        mutex tx_ring_lock;
+        std::unique_ptr<net_req[]> reqs;
+        // Packets handed over by transmitters that found the ring busy,
+        // linked through m_nextpkt, newest first. Drained by the holder
+        // of tx_ring_lock.
+        std::atomic<struct mbuf*> pending = { nullptr };
         struct txq_stats stats = { 0 };
     };
 
+    void receiver(struct rxq& rxq);
+    void fill_rx_ring(struct rxq& rxq);
+    // Passes a received packet up, through its net channel if it has one
+    void rx_input(struct mbuf* m, net_channel_batch& batch);
+    static void lro_input(struct lro_ctrl* lc, struct mbuf* m);
+
+    /**
+     * Transmit a single mbuf.
+     * @param txq Tx queue handle
+     * @param m_head a buffer to transmits
+     * @param flush kick() if TRUE
+     * @note should be called under the txq.tx_ring_lock.
+     *
+     * @return 0 in case of success and an appropriate error code
+     *         otherwise
+     */
+    int tx_locked(struct txq& txq, struct mbuf* m_head, bool flush = false);
+    void tx_gc(struct txq& txq);
+
+    /**
+     * Transmit all the packets queued on txq.pending and kick the host once
+     * for the whole batch.
+     * @note should be called under the txq.tx_ring_lock.
+     */
+    void tx_drain_locked(struct txq& txq);
+
+    /**
+     * Pick the Tx queue serving the current CPU.
+     */
+    struct txq& select_txq()
+    {
+        return *_txq[sched::cpu::current()->id % _txq.size()];
+    }
+
+    /**
+     * Send a command on the control virtqueue and wait for the host to
+     * acknowledge it.
+     * @param cls command class (VIRTIO_NET_CTRL_*)
+     * @param cmd command within the class
+     * @param data command specific payload
+     * @param len payload length
+     *
+     * @return true if the host replied with VIRTIO_NET_OK
+     */
+    bool ctrl_cmd(u8 cls, u8 cmd, const void* data, u32 len);
+
+    /**
+     * Tell the host how many Rx/Tx queue pairs it may steer traffic to.
+     * @param pairs number of queue pairs
+     */
+    bool set_queue_pairs(u16 pairs);
+
+    /**
+     * Bind the MSI-X vectors of the first queue pairs, replacing any bound
+     * before: each Rx vector wakes its receiver.
+     * @param pairs number of queue pairs
+     */
+    void register_msix(unsigned pairs);
+
     /**
      * Fill the Rx queue statistics in the general info struct
      * @param rxq Rx queue handle
@@ -319,9 +409,17 @@ private:
      */
     void fill_qstats(const struct txq& txq, struct if_data* out_data) const;
 
-    /* We currently support only a single Rx+Tx queue */
-    struct rxq _rxq;
-    struct txq _txq;
+    // Rx/Tx queue pair i lives on virtqueues 2i and 2i+1
+    std::vector<std::unique_ptr<struct rxq>> _rxq;
+    std::vector<std::unique_ptr<struct txq>> _txq;
+
+    // The control virtqueue follows the last queue pair the host offers
+    vring* _ctrl_vqueue = nullptr;
+    struct {
+        net_ctrl_hdr hdr;
+        u8 data[sizeof(net_ctrl_mq)];
+        net_ctrl_ack ack;
+    } _ctrl_buf;
 
     //maintains the virtio instance number for multiple drives
     static int _instance;
@@ -329,6 +427,12 @@ private:
     struct ifnet* _ifn;
 };
 
+/**
+ * The LRO statistics of the virtio-net interfaces, for /proc/lro: for each,
+ * the segments passed up in merged packets, and the merged packets.
+ */
+std::string procfs_lro();
+
 }
 
 #endif
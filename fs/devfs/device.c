@@ -55,6 +55,7 @@
 #include <osv/buf.h>
 
 #include <geom/geom_disk.h>
+#include <fs/vfs/vfs.h>
 
 struct mutex sched_mutex = MUTEX_INITIALIZER;
 
@@ -179,6 +180,9 @@ void device_register(struct device *dev, const char *name, int flags)
 	device_list = dev;
 
 	sched_unlock();
+
+	/* A lookup of this name may have failed before */
+	dentry_invalidate_negative();
 }
 
 
@@ -11,6 +11,9 @@
 #include <osv/prex.h>
 #include <osv/sched.hh>
 #include <osv/mmu.hh>
+#include <osv/trace.hh>
+#include <bsd/porting/uma_stub.h>
+#include "drivers/virtio-net.hh"
 
 #include <functional>
 #include <memory>
@@ -211,8 +214,16 @@ procfs_mount(mount* mp, char *dev, int flags, void* data)
     auto self = make_shared<proc_dir_node>(inode_count++);
     self->add("maps", inode_count++, mmu::procfs_maps);
 
+    auto trace = make_shared<proc_dir_node>(inode_count++);
+    trace->add("stream", inode_count++, procfs_trace_stream);
+    trace->add("dropped", inode_count++, procfs_trace_dropped);
+
     auto* root = new proc_dir_node(vp->v_ino);
     root->add("self", self);
+    root->add("trace", trace);
+    root->add("uma", inode_count++, procfs_uma_zones);
+    root->add("tlb", inode_count++, mmu::procfs_tlb);
+    root->add("lro", inode_count++, virtio::procfs_lro);
 
     vp->v_data = static_cast<void*>(root);
 
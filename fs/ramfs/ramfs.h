@@ -52,8 +52,8 @@ struct ramfs_node {
 	char	*rn_name;	/* name (null-terminated) */
 	size_t	 rn_namelen;	/* length of name not including terminator */
 	size_t	 rn_size;	/* file size */
-	char	*rn_buf;	/* buffer to the file data */
-	size_t	 rn_bufsize;	/* allocated buffer size */
+	void	**rn_pages;	/* file data, a page per slot (NULL for holes) */
+	size_t	 rn_nslots;	/* number of slots in rn_pages */
 };
 
 __BEGIN_DECLS
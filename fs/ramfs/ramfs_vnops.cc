@@ -44,6 +44,10 @@
 #include <osv/vnode.h>
 #include <osv/file.h>
 #include <osv/mount.h>
+#include <osv/mempool.hh>
+
+#include <algorithm>
+#include <unordered_map>
 
 #include "ramfs.h"
 
@@ -51,6 +55,98 @@
 static mutex_t ramfs_lock = MUTEX_INITIALIZER;
 static uint64_t inode_count = 1; /* inode 0 is reserved to root */
 
+using memory::page_size;
+
+/*
+ * File data is kept in pages, indexed by offset / page_size in rn_pages.
+ * Growing a file only adds pages (and grows the index by doubling), so
+ * the data already written is never copied.
+ *
+ * Pages of files mapped with MAP_SHARED are mapped as they are, and are
+ * counted in mapped_pages while mapped.  If the file lets go of such a
+ * page (truncate, remove), the last unmap frees it instead.
+ *
+ * A mapping may also store past the end of the file, in the last page or
+ * in pages its faults added.  That data is not part of the file, so it is
+ * cleared when the file grows over it.
+ */
+struct mapped_page {
+	unsigned count;
+	bool orphan;
+};
+static mutex_t ramfs_page_lock = MUTEX_INITIALIZER;
+static std::unordered_map<void *, mapped_page> mapped_pages;
+static char zero_page[page_size];
+
+static void
+ramfs_release_page(void *page)
+{
+	mutex_lock(&ramfs_page_lock);
+	auto i = mapped_pages.find(page);
+	if (i != mapped_pages.end()) {
+		i->second.orphan = true;
+		page = NULL;
+	}
+	mutex_unlock(&ramfs_page_lock);
+	if (page)
+		memory::free_page(page);
+}
+
+/* Release the pages from slot first on */
+static void
+ramfs_free_pages(struct ramfs_node *np, size_t first)
+{
+	for (size_t i = first; i < np->rn_nslots; i++) {
+		if (np->rn_pages[i]) {
+			ramfs_release_page(np->rn_pages[i]);
+			np->rn_pages[i] = NULL;
+		}
+	}
+}
+
+/* Clear the bytes from start to end in the pages the file has there */
+static void
+ramfs_zero_range(struct ramfs_node *np, size_t start, size_t end)
+{
+	size_t last = std::min(np->rn_nslots, (end + page_size - 1) / page_size);
+
+	for (size_t idx = start / page_size; idx < last; idx++) {
+		if (np->rn_pages[idx] == NULL)
+			continue;
+		size_t from = std::max(start, idx * page_size) - idx * page_size;
+		size_t to = std::min(end, (idx + 1) * page_size) - idx * page_size;
+		memset((char *)np->rn_pages[idx] + from, 0, to - from);
+	}
+}
+
+/*
+ * Return page idx of the file, allocating it if it is a hole; a new page
+ * is zeroed unless the caller is about to overwrite all of it.
+ */
+static void *
+ramfs_get_page(struct ramfs_node *np, size_t idx, bool zero)
+{
+	if (idx >= np->rn_nslots) {
+		size_t n = std::max(np->rn_nslots * 2, idx + 1);
+		void **pages = (void **)realloc(np->rn_pages, n * sizeof(void *));
+		if (pages == NULL)
+			return NULL;
+		memset(pages + np->rn_nslots, 0,
+		       (n - np->rn_nslots) * sizeof(void *));
+		np->rn_pages = pages;
+		np->rn_nslots = n;
+	}
+	if (np->rn_pages[idx] == NULL) {
+		void *page = memory::alloc_page();
+		if (page == NULL)
+			return NULL;
+		if (zero)
+			memset(page, 0, page_size);
+		np->rn_pages[idx] = page;
+	}
+	return np->rn_pages[idx];
+}
+
 struct ramfs_node *
 ramfs_allocate_node(char *name, int type)
 {
@@ -75,8 +171,8 @@ ramfs_allocate_node(char *name, int type)
 void
 ramfs_free_node(struct ramfs_node *np)
 {
-	if (np->rn_buf != NULL)
-		free(np->rn_buf);
+	ramfs_free_pages(np, 0);
+	free(np->rn_pages);
 
 	free(np->rn_name);
 	free(np);
@@ -246,30 +342,27 @@ static int
 ramfs_truncate(struct vnode *vp, off_t length)
 {
 	struct ramfs_node *np;
-	void *new_buf;
-	size_t new_size;
+	size_t first, tail;
 
 	DPRINTF(("truncate %s length=%d\n", vp->v_path, length));
 	np = (ramfs_node*)vp->v_data;
 
-	if (length == 0) {
-		if (np->rn_buf != NULL) {
-			free(np->rn_buf);
-			np->rn_buf = NULL;
-			np->rn_bufsize = 0;
-		}
-	} else if (size_t(length) > np->rn_bufsize) {
-		// XXX: this could use a page level allocator
-		new_size = round_page(length);
-		new_buf = malloc(new_size);
-		if (!new_buf)
-			return EIO;
-		if (np->rn_size != 0) {
-			memcpy(new_buf, np->rn_buf, vp->v_size);
-			free(np->rn_buf);
+	if (size_t(length) < np->rn_size) {
+		/* Drop the pages past the end, and clear the rest of the last one */
+		first = (length + page_size - 1) / page_size;
+		ramfs_free_pages(np, first);
+		tail = length % page_size;
+		if (tail && first - 1 < np->rn_nslots && np->rn_pages[first - 1])
+			memset((char *)np->rn_pages[first - 1] + tail, 0,
+			       page_size - tail);
+		if (length == 0) {
+			free(np->rn_pages);
+			np->rn_pages = NULL;
+			np->rn_nslots = 0;
 		}
-		np->rn_buf = (char*)new_buf;
-		np->rn_bufsize = new_size;
+	} else {
+		/* Growing only moves the end; the new part reads as zeroes */
+		ramfs_zero_range(np, np->rn_size, length);
 	}
 	np->rn_size = length;
 	vp->v_size = length;
@@ -298,7 +391,9 @@ static int
 ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 {
 	struct ramfs_node *np = (ramfs_node*)vp->v_data;
-	size_t len;
+	size_t len, idx, off, n;
+	void *page;
+	int error;
 
 	if (vp->v_type == VDIR)
 		return EISDIR;
@@ -318,13 +413,29 @@ ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 	else
 		len = uio->uio_resid;
 
-	return uiomove(np->rn_buf + uio->uio_offset, len, uio);
+	while (len > 0) {
+		idx = uio->uio_offset / page_size;
+		off = uio->uio_offset % page_size;
+		n = std::min(len, page_size - off);
+		page = idx < np->rn_nslots ? np->rn_pages[idx] : NULL;
+		if (page)
+			error = uiomove((char *)page + off, n, uio);
+		else
+			error = uiomove(zero_page, n, uio);
+		if (error)
+			return error;
+		len -= n;
+	}
+	return 0;
 }
 
 static int
 ramfs_write(struct vnode *vp, struct uio *uio, int ioflag)
 {
 	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	size_t idx, off, n;
+	void *page;
+	int error;
 
 	if (vp->v_type == VDIR)
 		return EISDIR;
@@ -338,27 +449,69 @@ ramfs_write(struct vnode *vp, struct uio *uio, int ioflag)
 
 	if (ioflag & IO_APPEND)
 		uio->uio_offset = np->rn_size;
-
-	if (size_t(uio->uio_offset + uio->uio_resid) > (size_t)vp->v_size) {
-		/* Expand the file size before writing to it */
-		off_t end_pos = uio->uio_offset + uio->uio_resid;
-		if (end_pos > (off_t)np->rn_bufsize) {
-			// XXX: this could use a page level allocator
-			size_t new_size = round_page(end_pos);
-			void *new_buf = malloc(new_size);
-			if (!new_buf)
-				return EIO;
-			if (np->rn_size != 0) {
-				memcpy(new_buf, np->rn_buf, vp->v_size);
-				free(np->rn_buf);
-			}
-			np->rn_buf = (char*)new_buf;
-			np->rn_bufsize = new_size;
+	if (size_t(uio->uio_offset) > np->rn_size)
+		ramfs_zero_range(np, np->rn_size, uio->uio_offset);
+
+	while (uio->uio_resid > 0) {
+		idx = uio->uio_offset / page_size;
+		off = uio->uio_offset % page_size;
+		n = std::min(size_t(uio->uio_resid), page_size - off);
+		page = ramfs_get_page(np, idx, n != page_size);
+		if (page == NULL)
+			return ENOSPC;
+		error = uiomove((char *)page + off, n, uio);
+		if (size_t(uio->uio_offset) > np->rn_size) {
+			np->rn_size = uio->uio_offset;
+			vp->v_size = uio->uio_offset;
 		}
-		np->rn_size = end_pos;
-		vp->v_size = end_pos;
+		if (error)
+			return error;
 	}
-	return uiomove(np->rn_buf + uio->uio_offset, uio->uio_resid, uio);
+	return 0;
+}
+
+static int
+ramfs_getpage(struct vnode *vp, off_t off, void **pagep)
+{
+	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	void *page;
+
+	if (vp->v_type != VREG)
+		return EINVAL;
+
+	page = ramfs_get_page(np, off / page_size, true);
+	if (page == NULL)
+		return ENOMEM;
+
+	mutex_lock(&ramfs_page_lock);
+	mapped_pages[page].count++;
+	mutex_unlock(&ramfs_page_lock);
+
+	*pagep = page;
+	return 0;
+}
+
+static int
+ramfs_putpage(struct vnode *vp, off_t off, void *page)
+{
+	bool release;
+
+	mutex_lock(&ramfs_page_lock);
+	auto i = mapped_pages.find(page);
+	if (i == mapped_pages.end()) {
+		mutex_unlock(&ramfs_page_lock);
+		return ENOENT;
+	}
+	release = false;
+	if (--i->second.count == 0) {
+		release = i->second.orphan;
+		mapped_pages.erase(i);
+	}
+	mutex_unlock(&ramfs_page_lock);
+
+	if (release)
+		memory::free_page(page);
+	return 0;
 }
 
 static int
@@ -388,11 +541,12 @@ ramfs_rename(struct vnode *dvp1, struct vnode *vp1, char *name1,
 			return ENOMEM;
 
 		if (vp1->v_type == VREG) {
-			/* Copy file data */
-			np->rn_buf = old_np->rn_buf;
+			/* Move file data */
+			np->rn_pages = old_np->rn_pages;
 			np->rn_size = old_np->rn_size;
-			np->rn_bufsize = old_np->rn_bufsize;
-			old_np->rn_buf = NULL;
+			np->rn_nslots = old_np->rn_nslots;
+			old_np->rn_pages = NULL;
+			old_np->rn_nslots = 0;
 		}
 		/* Remove source file */
 		ramfs_remove_node((ramfs_node*)dvp1->v_data, (ramfs_node*)vp1->v_data);
@@ -488,5 +642,7 @@ struct vnops ramfs_vnops = {
 	ramfs_inactive,		/* inactive */
 	ramfs_truncate,		/* truncate */
 	ramfs_link,		/* link */
+	ramfs_getpage,		/* getpage */
+	ramfs_putpage,		/* putpage */
 };
 
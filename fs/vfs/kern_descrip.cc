@@ -114,7 +114,7 @@ int fdset(int fd, struct file *fp)
     return 0;
 }
 
-static bool fhold_if_positive(file* f)
+bool fhold_if_positive(file* f)
 {
     auto c = f->f_count;
     // zero or negative f_count means that the file is being closed; don't
@@ -190,7 +190,9 @@ file::~file()
 
     poll_drain(fp);
     if (f_epolls) {
-        for (auto ep : *f_epolls) {
+        // epoll_file_closed() removes ep from f_epolls, so iterate a copy
+        auto epolls = *f_epolls;
+        for (auto ep : epolls) {
             epoll_file_closed(ep, this);
         }
     }
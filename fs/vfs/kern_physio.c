@@ -80,6 +80,65 @@ biofinish(struct bio *bp, struct devstat *stat, int error)
 	biodone(bp, error);
 }
 
+/*
+ * Plugging: between bio_plug() and the matching bio_unplug(), drivers may hold
+ * back the bios a thread issues, so adjacent ones can be merged and the whole
+ * batch handed to the device at once.  A plugged thread must not wait for its
+ * own bios before unplugging.
+ */
+#define BIO_PLUG_MAX_CB	8
+
+struct bio_plug_cb {
+	void (*fn)(void *);
+	void *arg;
+};
+
+static __thread int bio_plug_depth;
+static __thread int bio_plug_ncb;
+static __thread struct bio_plug_cb bio_plug_cbs[BIO_PLUG_MAX_CB];
+
+void
+bio_plug(void)
+{
+	bio_plug_depth++;
+}
+
+void
+bio_unplug(void)
+{
+	assert(bio_plug_depth > 0);
+	if (--bio_plug_depth) {
+		return;
+	}
+	// A callback may issue more bios; they are not plugged any more
+	while (bio_plug_ncb) {
+		struct bio_plug_cb cb = bio_plug_cbs[--bio_plug_ncb];
+		cb.fn(cb.arg);
+	}
+}
+
+bool
+bio_plug_defer(void (*unplug)(void *), void *arg)
+{
+	int i;
+
+	if (!bio_plug_depth) {
+		return false;
+	}
+	for (i = 0; i < bio_plug_ncb; i++) {
+		if (bio_plug_cbs[i].fn == unplug && bio_plug_cbs[i].arg == arg) {
+			return true;
+		}
+	}
+	if (bio_plug_ncb == BIO_PLUG_MAX_CB) {
+		return false;
+	}
+	bio_plug_cbs[bio_plug_ncb].fn = unplug;
+	bio_plug_cbs[bio_plug_ncb].arg = arg;
+	bio_plug_ncb++;
+	return true;
+}
+
 static void multiplex_bio_done(struct bio *b)
 {
 	struct bio *bio = b->bio_caller1;
@@ -126,6 +185,7 @@ void multiplex_strategy(struct bio *bio)
 	// finished, and when it drops its refcount to 0, we consider the main bio finished.
 	refcount_init(&bio->bio_refcnt, (len / dev->max_io_size) + !!(len % dev->max_io_size));
 
+	bio_plug();
 	while (len > 0) {
 		uint64_t req_size = MIN(len, dev->max_io_size);
 		struct bio *b = alloc_bio();
@@ -145,4 +205,5 @@ void multiplex_strategy(struct bio *bio)
 		offset += req_size;
 		len -= req_size;
 	}
+	bio_unplug();
 }
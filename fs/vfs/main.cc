@@ -1616,8 +1616,6 @@ vfs_init(void)
     const struct vfssw *fs;
 
     bio_init();
-    lookup_init();
-    vnode_init();
     task_alloc(&main_task);
 
     /*
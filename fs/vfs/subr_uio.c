@@ -56,10 +56,13 @@ uiomove(void *cp, int n, struct uio *uio)
 		if (cnt > n)
 			cnt = n;
 
-		if (uio->uio_rw == UIO_READ)
-			memcpy(iov->iov_base, cp, cnt);
-		else
-			memcpy(cp, iov->iov_base, cnt);
+		/* msync() writes mapped file pages back from themselves */
+		if (iov->iov_base != cp) {
+			if (uio->uio_rw == UIO_READ)
+				memcpy(iov->iov_base, cp, cnt);
+			else
+				memcpy(cp, iov->iov_base, cnt);
+		}
 
 		iov->iov_base = (char *)iov->iov_base + cnt;
 		iov->iov_len -= cnt;
@@ -130,8 +130,6 @@ int	 sec_vnode_permission(char *path);
 
 int	 namei(char *path, struct dentry **dpp);
 int	 lookup(char *path, struct dentry **dpp, char **name);
-void	 vnode_init(void);
-void	 lookup_init(void);
 
 int	 vfs_findroot(char *path, struct mount **mp, char **root);
 
@@ -140,6 +138,7 @@ int	 fs_noop(void);
 struct dentry *dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path);
 void	dref(struct dentry *dp);
 void	drele(struct dentry *dp);
+void	dentry_invalidate_negative(void);
 
 #ifdef DEBUG_VFS
 void	 vnode_dump(void);
@@ -12,6 +12,7 @@
 #include <osv/poll.h>
 #include <fs/vfs/vfs.h>
 #include <osv/vfs_file.hh>
+#include <osv/pagecache.hh>
 
 vfs_file::vfs_file(unsigned flags)
 	: file(flags, DTYPE_VNODE)
@@ -45,11 +46,23 @@ int vfs_file::read(struct uio *uio, int flags)
 
 	bytes = uio->uio_resid;
 
+	/*
+	 * A positioned read doesn't touch f_offset, so if the filesystem
+	 * keeps reads consistent with writes by itself (e.g., ZFS range
+	 * locks), readers can run in parallel.
+	 */
+	if ((flags & FOF_OFFSET) && (vp->v_mount->m_flags & MNT_SHAREDREAD) &&
+	    !pagecache::cached(vp))
+		return VOP_READ(vp, fp, uio, 0);
+
 	vn_lock(vp);
 	if ((flags & FOF_OFFSET) == 0)
 		uio->uio_offset = fp->f_offset;
 
-	error = VOP_READ(vp, fp, uio, 0);
+	if (pagecache::cached(vp))
+		error = pagecache::read(vp, fp, uio, 0);
+	else
+		error = VOP_READ(vp, fp, uio, 0);
 	if (!error) {
 		count = bytes - uio->uio_resid;
 		if ((flags & FOF_OFFSET) == 0)
@@ -82,7 +95,10 @@ int vfs_file::write(struct uio *uio, int flags)
 	if ((flags & FOF_OFFSET) == 0)
 	        uio->uio_offset = fp->f_offset;
 
-	error = VOP_WRITE(vp, uio, ioflags);
+	if (pagecache::cached(vp))
+		error = pagecache::write(vp, uio, ioflags);
+	else
+		error = VOP_WRITE(vp, uio, ioflags);
 	if (!error) {
 		count = bytes - uio->uio_resid;
 		if ((flags & FOF_OFFSET) == 0)
@@ -135,3 +151,59 @@ int vfs_file::chmod(mode_t mode)
 	// somehow this is handled outside file ops
 	abort();
 }
+
+bool vfs_file::has_pages()
+{
+	return f_dentry->d_vnode->v_type == VREG;
+}
+
+void* vfs_file::get_page(off_t offset)
+{
+	struct vnode *vp = f_dentry->d_vnode;
+	void *page;
+	int error = 0;
+
+	vn_lock(vp);
+	if (vp->v_op->vop_getpage)
+		error = VOP_GETPAGE(vp, offset, &page);
+	else
+		page = pagecache::get(vp, this, offset);
+	vn_unlock(vp);
+
+	return error ? nullptr : page;
+}
+
+bool vfs_file::put_page(void* page, off_t offset)
+{
+	// called when unmapping, where we can't wait for the vnode lock
+	struct vnode *vp = f_dentry->d_vnode;
+
+	if (vp->v_op->vop_putpage)
+		return VOP_PUTPAGE(vp, offset, page) == 0;
+	return pagecache::put(vp, offset, page);
+}
+
+// Pages a filesystem lends itself (vop_getpage) are writable, so only the
+// page cache's count writers.
+void vfs_file::add_writer()
+{
+	struct vnode *vp = f_dentry->d_vnode;
+
+	if (!vp->v_op->vop_getpage)
+		pagecache::add_writer(vp);
+}
+
+void vfs_file::remove_writer()
+{
+	struct vnode *vp = f_dentry->d_vnode;
+
+	if (!vp->v_op->vop_getpage)
+		pagecache::remove_writer(vp);
+}
+
+bool vfs_file::page_lent(void* page, off_t offset)
+{
+	struct vnode *vp = f_dentry->d_vnode;
+
+	return !vp->v_op->vop_getpage && pagecache::lent(vp, offset, page);
+}
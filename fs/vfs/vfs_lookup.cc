@@ -31,45 +31,160 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <atomic>
 
 #include <osv/dentry.h>
 #include <osv/vnode.h>
+#include <osv/rcu-hashtable.hh>
 #include "vfs.h"
 
-#define DENTRY_BUCKETS 32
+namespace {
 
-static LIST_HEAD(dentry_hash_head, dentry) dentry_hash_table[DENTRY_BUCKETS];
-static struct mutex dentry_hash_lock;
+struct dentry_key {
+    struct mount *mp;
+    const char *path;
+};
+
+struct dentry_key_hash {
+    size_t operator()(const dentry_key& k) const {
+        // FNV-1a over the path, with the mount point folded in
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (auto p = k.path; *p; p++) {
+            h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+        }
+        return h ^ reinterpret_cast<uintptr_t>(k.mp);
+    }
+};
+
+struct dentry_key_equal {
+    bool operator()(const dentry_key& a, const dentry_key& b) const {
+        return a.mp == b.mp && !strcmp(a.path, b.path);
+    }
+};
+
+/*
+ * A path that was recently looked up and found not to exist.
+ *
+ * Instead of tracking which directories each creation affects, any
+ * operation that can add a name anywhere bumps negative_gen, and
+ * entries recorded under an older generation are ignored.
+ */
+struct negative_dentry {
+    negative_dentry(struct mount *mp, const char *path, unsigned long gen)
+        : mp(mp), path(strdup(path)), gen(gen) {}
+    ~negative_dentry() { free(path); }
+    struct mount *mp;
+    char *path;
+    unsigned long gen;
+    TAILQ_ENTRY(negative_dentry) link;
+};
+
+}
+
+/*
+ * Active dentries, keyed by mount point and path.  Lookups are done under
+ * rcu_read_lock; dentry_hash_lock serializes insertion with dropping the
+ * last reference, so a dentry that is being freed is never found by a
+ * dentry_alloc() for the same path.
+ */
+static osv::rcu_hashtable<dentry_key, struct dentry *,
+                          dentry_key_hash, dentry_key_equal> dentry_table(8);
+static mutex dentry_hash_lock;
+
+static constexpr size_t max_negative_dentries = 4096;
+
+static osv::rcu_hashtable<dentry_key, negative_dentry *,
+                          dentry_key_hash, dentry_key_equal> negative_table;
+/* oldest first, for eviction */
+static TAILQ_HEAD(, negative_dentry) negative_list =
+    TAILQ_HEAD_INITIALIZER(negative_list);
+static mutex negative_lock;
+static std::atomic<unsigned long> negative_gen;
 
 /*
- * Get the hash value from the mount point and path name.
- * XXX: replace with a better hash for 64-bit pointers.
+ * Called after any operation that can make a path which did not exist
+ * before resolve (create, mkdir, link, rename, mount...).
  */
-static u_int
-dentry_hash(struct mount *mp, const char *path)
+void
+dentry_invalidate_negative(void)
+{
+    negative_gen.fetch_add(1);
+}
+
+static bool
+negative_lookup(struct mount *mp, const char *path)
 {
-    u_int val = 0;
+    auto gen = negative_gen.load();
+    bool found = false;
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto ndp = negative_table.lookup({mp, path});
+        found = ndp && (*ndp)->gen == gen;
+    }
+    return found;
+}
 
-    if (path) {
-        while (*path) {
-            val = ((val << 5) + val) + *path++;
+/* Called with negative_lock held */
+static void
+negative_remove(negative_dentry *ndp)
+{
+    negative_table.erase({ndp->mp, ndp->path});
+    TAILQ_REMOVE(&negative_list, ndp, link);
+    osv::rcu_dispose(ndp);
+}
+
+/*
+ * Remember that path was not found; gen is the generation read before
+ * the lookup started, so a creation racing with it invalidates the entry.
+ */
+static void
+negative_insert(struct mount *mp, const char *path, unsigned long gen)
+{
+    WITH_LOCK(negative_lock) {
+        negative_dentry *old = nullptr;
+        WITH_LOCK(osv::rcu_read_lock) {
+            auto ndp = negative_table.lookup({mp, path});
+            if (ndp) {
+                old = *ndp;
+            }
+        }
+        if (old) {
+            if (old->gen >= gen) {
+                return;
+            }
+            negative_remove(old);
+        }
+        if (negative_table.size() >= max_negative_dentries) {
+            negative_remove(TAILQ_FIRST(&negative_list));
         }
+        auto ndp = new negative_dentry(mp, path, gen);
+        negative_table.insert({mp, ndp->path}, ndp);
+        TAILQ_INSERT_TAIL(&negative_list, ndp, link);
     }
-    return (val ^ (unsigned long) mp) & (DENTRY_BUCKETS - 1);
 }
 
+static bool
+dref_if_positive(struct dentry *dp)
+{
+    auto c = dp->d_refcnt;
+    // zero means the last reference is being dropped; don't resurrect it
+    while (c > 0 && !__atomic_compare_exchange_n(&dp->d_refcnt, &c, c + 1, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // nothing to do
+    }
+    return c > 0;
+}
 
 struct dentry *
 dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
 {
     struct mount *mp = vp->v_mount;
-    struct dentry *dp = calloc(sizeof(*dp), 1);
+    struct dentry *dp = (struct dentry *)calloc(sizeof(*dp), 1);
 
     if (!dp) {
         return NULL;
     }
 
-    vp->v_refcnt++;
+    vref(vp);
 
     dp->d_refcnt = 1;
     dp->d_vnode = vp;
@@ -83,26 +198,26 @@ dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
 
     vn_add_name(vp, dp);
 
-    mutex_lock(&dentry_hash_lock);
-    LIST_INSERT_HEAD(&dentry_hash_table[dentry_hash(mp, path)], dp, d_link);
-    mutex_unlock(&dentry_hash_lock);
+    WITH_LOCK(dentry_hash_lock) {
+        dentry_key key{mp, dp->d_path};
+        if (!dentry_table.insert(key, dp)) {
+            // The newer dentry for a path shadows the older one
+            dentry_table.erase(key);
+            dentry_table.insert(key, dp);
+        }
+    }
     return dp;
 };
 
 static struct dentry *
 dentry_lookup(struct mount *mp, char *path)
 {
-    struct dentry *dp;
-
-    mutex_lock(&dentry_hash_lock);
-    LIST_FOREACH(dp, &dentry_hash_table[dentry_hash(mp, path)], d_link) {
-        if (dp->d_mount == mp && !strncmp(dp->d_path, path, PATH_MAX)) {
-            dp->d_refcnt++;
-            mutex_unlock(&dentry_hash_lock);
-            return dp;
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto dpp = dentry_table.lookup({mp, path});
+        if (dpp && dref_if_positive(*dpp)) {
+            return *dpp;
         }
     }
-    mutex_unlock(&dentry_hash_lock);
     return NULL;                /* not found */
 }
 
@@ -112,9 +227,14 @@ dref(struct dentry *dp)
     ASSERT(dp);
     ASSERT(dp->d_refcnt > 0);
 
-    mutex_lock(&dentry_hash_lock);
-    dp->d_refcnt++;
-    mutex_unlock(&dentry_hash_lock);
+    __sync_fetch_and_add(&dp->d_refcnt, 1);
+}
+
+static void
+dentry_free(struct dentry *dp)
+{
+    free(dp->d_path);
+    free(dp);
 }
 
 void
@@ -123,12 +243,31 @@ drele(struct dentry *dp)
     ASSERT(dp);
     ASSERT(dp->d_refcnt > 0);
 
+    auto c = dp->d_refcnt;
+    while (c > 1 && !__atomic_compare_exchange_n(&dp->d_refcnt, &c, c - 1, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // nothing to do
+    }
+    if (c > 1) {
+        return;
+    }
+
     mutex_lock(&dentry_hash_lock);
-    if (--dp->d_refcnt) {
+    if (__sync_sub_and_fetch(&dp->d_refcnt, 1)) {
         mutex_unlock(&dentry_hash_lock);
         return;
     }
-    LIST_REMOVE(dp, d_link);
+    dentry_key key{dp->d_mount, dp->d_path};
+    struct dentry *hashed = NULL;
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto dpp = dentry_table.lookup(key);
+        if (dpp) {
+            hashed = *dpp;
+        }
+    }
+    if (hashed == dp) {
+        dentry_table.erase(key);
+    }
     vn_del_name(dp->d_vnode, dp);
 
     mutex_unlock(&dentry_hash_lock);
@@ -139,8 +278,8 @@ drele(struct dentry *dp)
 
     vrele(dp->d_vnode);
 
-    free(dp->d_path);
-    free(dp);
+    /* lockless lookups may still be looking at it */
+    osv::rcu_defer(dentry_free, dp);
 }
 
 /*
@@ -158,6 +297,7 @@ namei(char *path, struct dentry **dpp)
     struct mount *mp;
     struct dentry *dp, *ddp;
     struct vnode *dvp, *vp;
+    unsigned long gen;
     int error, i;
 
     DPRINTF(VFSDB_VNODE, ("namei: path=%s\n", path));
@@ -177,6 +317,10 @@ namei(char *path, struct dentry **dpp)
         *dpp = dp;
         return 0;
     }
+    if (negative_lookup(mp, node)) {
+        return ENOENT;
+    }
+    gen = negative_gen.load();
     /*
      * Find target vnode, started from root directory.
      * This is done to attach the fs specific data to
@@ -220,7 +364,14 @@ namei(char *path, struct dentry **dpp)
         dp = dentry_lookup(mp, node);
         if (dp == NULL) {
             /* Find a vnode in this directory. */
-            error = VOP_LOOKUP(dvp, name, &vp);
+            if (negative_lookup(mp, node)) {
+                error = ENOENT;
+            } else {
+                error = VOP_LOOKUP(dvp, name, &vp);
+                if (error == ENOENT) {
+                    negative_insert(mp, node, gen);
+                }
+            }
             if (error) {
                 vn_unlock(dvp);
                 drele(ddp);
@@ -313,17 +464,3 @@ lookup(char *path, struct dentry **dpp, char **name)
     *name = strrchr(path, '/') + 1;
     return 0;
 }
-
-/*
- * vnode_init() is called once (from vfs_init)
- * in initialization.
- */
-void
-lookup_init(void)
-{
-    int i;
-
-    for (i = 0; i < DENTRY_BUCKETS; i++) {
-        LIST_INIT(&dentry_hash_table[i]);
-    }
-}
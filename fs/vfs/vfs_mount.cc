@@ -194,6 +194,7 @@ sys_mount(char *dev, char *dir, char *fsname, int flags, void *data)
      */
     LIST_INSERT_HEAD(&mount_list, mp, m_link);
     MOUNT_UNLOCK();
+    dentry_invalidate_negative();
 
     return 0;   /* success */
  err4:
@@ -260,6 +261,7 @@ found:
     if ((error = VFS_UNMOUNT(mp, flags)) != 0)
         goto out;
     LIST_REMOVE(mp, m_link);
+    dentry_invalidate_negative();
 
 #ifdef HAVE_BUFFERS
     /* Flush all buffers */
@@ -310,6 +312,7 @@ sys_pivot_root(const char *new_root, const char *put_old)
             return error;
         }
         LIST_REMOVE(oldmp, m_link);
+        dentry_invalidate_negative();
 
         newmp->m_root->d_vnode->v_mount = newmp;
 
@@ -53,6 +53,7 @@
 #include <osv/prex.h>
 #include <osv/vnode.h>
 #include <osv/vfs_file.hh>
+#include <osv/pagecache.hh>
 #include "vfs.h"
 #include <fs/fs.hh>
 
@@ -85,6 +86,7 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 			mode &= ~S_IFMT;
 			mode |= S_IFREG;
 			error = VOP_CREATE(ddp->d_vnode, filename, mode);
+			dentry_invalidate_negative();
 			vn_unlock(ddp->d_vnode);
 			drele(ddp);
 
@@ -142,6 +144,7 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 		error = VOP_TRUNCATE(vp, 0);
 		if (error)
 			goto out_vn_unlock;
+		pagecache::truncate(vp, 0);
 	}
 
 	try {
@@ -489,6 +492,7 @@ sys_mkdir(char *path, mode_t mode)
 	mode |= S_IFDIR;
 
 	error = VOP_MKDIR(ddp->d_vnode, name, mode);
+	dentry_invalidate_negative();
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -577,6 +581,7 @@ sys_mknod(char *path, mode_t mode)
 		error = VOP_MKDIR(ddp->d_vnode, name, mode);
 	else
 		error = VOP_CREATE(ddp->d_vnode, name, mode);
+	dentry_invalidate_negative();
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -720,6 +725,7 @@ sys_rename(char *src, char *dest)
 	}
 
 	error = VOP_RENAME(dvp1, vp1, sname, dvp2, vp2, dname);
+	dentry_invalidate_negative();
  err4:
 	vn_unlock(dvp2);
 	drele(ddp2);
@@ -789,6 +795,7 @@ sys_link(char *oldpath, char *newpath)
 	}
 
 	error = VOP_LINK(newdirdp->d_vnode, vp, name);
+	dentry_invalidate_negative();
  out1:
 	vn_unlock(newdirdp->d_vnode);
 	drele(newdirdp);
@@ -935,6 +942,8 @@ sys_truncate(char *path, off_t length)
 
 	vn_lock(dp->d_vnode);
 	error = VOP_TRUNCATE(dp->d_vnode, length);
+	if (!error)
+		pagecache::truncate(dp->d_vnode, length);
 	vn_unlock(dp->d_vnode);
 
 	drele(dp);
@@ -953,6 +962,8 @@ sys_ftruncate(struct file *fp, off_t length)
 	vp = fp->f_dentry->d_vnode;
 	vn_lock(vp);
 	error = VOP_TRUNCATE(vp, length);
+	if (!error)
+		pagecache::truncate(vp, length);
 	vn_unlock(vp);
 
 	return error;
@@ -41,6 +41,8 @@
 
 #include <osv/prex.h>
 #include <osv/vnode.h>
+#include <osv/rcu-hashtable.hh>
+#include <osv/pagecache.hh>
 #include "vfs.h"
 
 enum vtype iftovt_tab[16] = {
@@ -65,56 +67,78 @@ int vttoif_tab[10] = {
  * vrele      -1        *
  */
 
-#define VNODE_BUCKETS 32		/* size of vnode hash table */
+namespace {
+
+struct vnode_key {
+	struct mount *mp;
+	uint64_t ino;
+};
+
+struct vnode_key_hash {
+	size_t operator()(const vnode_key& k) const {
+		return k.ino ^
+		    (reinterpret_cast<uintptr_t>(k.mp) * 0x9e3779b97f4a7c15ULL);
+	}
+};
+
+struct vnode_key_equal {
+	bool operator()(const vnode_key& a, const vnode_key& b) const {
+		return a.mp == b.mp && a.ino == b.ino;
+	}
+};
+
+}
 
 /*
  * vnode table.
  * All active (opened) vnodes are stored on this hash table.
- * They can be accessed by its path name.
+ * They can be accessed by their mount point and inode number.
+ * Lookups are lockless (under rcu_read_lock); insertion and removal
+ * are done with vnode_lock held.
  */
-static LIST_HEAD(vnode_hash_head, vnode) vnode_table[VNODE_BUCKETS];
+static osv::rcu_hashtable<vnode_key, struct vnode *,
+			  vnode_key_hash, vnode_key_equal> vnode_table(8);
 
 /*
- * Global lock to access all vnodes and vnode table.
- * If a vnode is already locked, there is no need to
- * lock this global lock to access internal data.
+ * Global lock for adding vnodes to and removing them from the vnode
+ * table.  The last reference to a vnode is only dropped with it held,
+ * so that a vnode being freed is never found by vget().
  */
 static mutex_t vnode_lock = MUTEX_INITIALIZER;
 #define VNODE_LOCK()	mutex_lock(&vnode_lock)
 #define VNODE_UNLOCK()	mutex_unlock(&vnode_lock)
-#define VNODE_OWNED()	mutex_owned(&vnode_lock)
 
-/*
- * Get the hash value from the mount point and path name.
- * XXX(hch): replace with a better hash for 64-bit pointers.
- */
-static u_int
-vn_hash(struct mount *mp, uint64_t ino)
+static bool
+vref_if_positive(struct vnode *vp)
 {
-	return (ino ^ (unsigned long)mp) & (VNODE_BUCKETS - 1);
+	auto c = vp->v_refcnt;
+	while (c > 0 && !__atomic_compare_exchange_n(&vp->v_refcnt, &c, c + 1,
+	    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* nothing to do */
+	}
+	return c > 0;
 }
 
 /*
- * Returns locked vnode for specified mount point and path.
- * vn_lock() will increment the reference count of vnode.
- *
- * Locking: VNODE_LOCK must be held.
+ * Returns locked vnode for specified mount point and inode number.
+ * vn_lookup() will increment the reference count of vnode.
  */
 struct vnode *
 vn_lookup(struct mount *mp, uint64_t ino)
 {
-	struct vnode *vp;
+	struct vnode *vp = NULL;
 
-	assert(VNODE_OWNED());
-	LIST_FOREACH(vp, &vnode_table[vn_hash(mp, ino)], v_link) {
-		if (vp->v_mount == mp && vp->v_ino == ino) {
-			vp->v_refcnt++;
-			mutex_lock(&vp->v_lock);
-			vp->v_nrlocks++;
-			return vp;
-		}
+	WITH_LOCK(osv::rcu_read_lock) {
+		auto vpp = vnode_table.lookup({mp, ino});
+		if (vpp && vref_if_positive(*vpp))
+			vp = *vpp;
 	}
-	return NULL;		/* not found */
+	if (!vp)
+		return NULL;		/* not found */
+
+	mutex_lock(&vp->v_lock);
+	vp->v_nrlocks++;
+	return vp;
 }
 
 /*
@@ -161,8 +185,15 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 
 	DPRINTF(VFSDB_VNODE, ("vget %LLu\n", ino));
 
+	vp = vn_lookup(mp, ino);
+	if (vp) {
+		*vpp = vp;
+		return 1;
+	}
+
 	VNODE_LOCK();
 
+	/* Check again, now that nobody else can add it */
 	vp = vn_lookup(mp, ino);
 	if (vp) {
 		VNODE_UNLOCK();
@@ -170,7 +201,7 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 		return 1;
 	}
 
-	if (!(vp = malloc(sizeof(struct vnode)))) {
+	if (!(vp = (struct vnode *)malloc(sizeof(struct vnode)))) {
 		VNODE_UNLOCK();
 		return 0;
 	}
@@ -198,7 +229,7 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 	mutex_lock(&vp->v_lock);
 	vp->v_nrlocks++;
 
-	LIST_INSERT_HEAD(&vnode_table[vn_hash(mp, ino)], vp, v_link);
+	vnode_table.insert({mp, ino}, vp);
 	VNODE_UNLOCK();
 
 	*vpp = vp;
@@ -218,14 +249,23 @@ vput(struct vnode *vp)
 	DPRINTF(VFSDB_VNODE, ("vput: ref=%d %s\n", vp->v_refcnt,
 			      vp->v_path));
 
+	auto c = vp->v_refcnt;
+	while (c > 1 && !__atomic_compare_exchange_n(&vp->v_refcnt, &c, c - 1,
+	    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		/* nothing to do */
+	}
+	if (c > 1) {
+		vn_unlock(vp);
+		return;
+	}
+
 	VNODE_LOCK();
-	vp->v_refcnt--;
-	if (vp->v_refcnt > 0) {
-	    VNODE_UNLOCK();
+	if (__sync_sub_and_fetch(&vp->v_refcnt, 1) > 0) {
+		VNODE_UNLOCK();
 		vn_unlock(vp);
 		return;
 	}
-	LIST_REMOVE(vp, v_link);
+	vnode_table.erase({vp->v_mount, vp->v_ino});
 	VNODE_UNLOCK();
 
 	/*
@@ -238,7 +278,9 @@ vput(struct vnode *vp)
 	ASSERT(vp->v_nrlocks == 0);
 	mutex_unlock(&vp->v_lock);
 	mutex_destroy(&vp->v_lock);
-	free(vp);
+	pagecache::release(vp);
+	/* lockless lookups may still be looking at it */
+	osv::rcu_defer(free, vp);
 }
 
 /*
@@ -250,10 +292,8 @@ vref(struct vnode *vp)
 	ASSERT(vp);
 	ASSERT(vp->v_refcnt > 0);	/* Need vget */
 
-	VNODE_LOCK();
 	DPRINTF(VFSDB_VNODE, ("vref: ref=%d\n", vp->v_refcnt));
-	vp->v_refcnt++;
-	VNODE_UNLOCK();
+	__sync_fetch_and_add(&vp->v_refcnt, 1);
 }
 
 /*
@@ -278,17 +318,17 @@ vrele(struct vnode *vp)
 	 * deallocate the data.
 	 */
 	VOP_INACTIVE(vp);
-	vp->v_refcnt--;
-	if (vp->v_refcnt > 0) {
+	if (__sync_sub_and_fetch(&vp->v_refcnt, 1) > 0) {
 		VNODE_UNLOCK();
 		return;
 	}
-	LIST_REMOVE(vp, v_link);
+	vnode_table.erase({vp->v_mount, vp->v_ino});
 	VNODE_UNLOCK();
 
 	vfs_unbusy(vp->v_mount);
 	mutex_destroy(&vp->v_lock);
-	free(vp);
+	pagecache::release(vp);
+	osv::rcu_defer(free, vp);
 }
 
 /*
@@ -436,8 +476,6 @@ vn_access(struct vnode *vp, int flags)
 void
 vnode_dump(void)
 {
-	int i;
-	struct vnode *vp;
 	struct mount *mp;
 	char type[][6] = { "VNON ", "VREG ", "VDIR ", "VBLK ", "VCHR ",
 			   "VLNK ", "VSOCK", "VFIFO" };
@@ -447,16 +485,14 @@ vnode_dump(void)
 	dprintf(" vnode    mount    type  refcnt blkno    path\n");
 	dprintf(" -------- -------- ----- ------ -------- ------------------------------\n");
 
-	for (i = 0; i < VNODE_BUCKETS; i++) {
-	        LIST_FOREACH(vp, &vnode_table[i], v_link) {
-			mp = vp->v_mount;
+	vnode_table.for_each([&](const vnode_key& key, struct vnode *vp) {
+		mp = vp->v_mount;
 
-			dprintf(" %08x %08x %s %6d %8d %s%s\n", (u_int)vp,
-				(u_int)mp, type[vp->v_type], vp->v_refcnt,
-				(strlen(mp->m_path) == 1) ? "\0" : mp->m_path,
-				vp->v_path);
-		}
-	}
+		dprintf(" %08x %08x %s %6d %8d %s%s\n", (u_int)vp,
+			(u_int)mp, type[vp->v_type], vp->v_refcnt,
+			(strlen(mp->m_path) == 1) ? "\0" : mp->m_path,
+			vp->v_path);
+	});
 	dprintf("\n");
 	VNODE_UNLOCK();
 }
@@ -483,19 +519,6 @@ vop_eperm(void)
 	return EPERM;
 }
 
-/*
- * vnode_init() is called once (from vfs_init)
- * in initialization.
- */
-void
-vnode_init(void)
-{
-	int i;
-
-	for (i = 0; i < VNODE_BUCKETS; i++)
-		LIST_INIT(&vnode_table[i]);
-}
-
 void vn_add_name(struct vnode *vp, struct dentry *dp)
 {
 	vn_lock(vp);
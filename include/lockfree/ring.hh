@@ -12,6 +12,8 @@
 #define __LF_RING_HH__
 
 #include <atomic>
+#include <memory>
+#include <cassert>
 #include <osv/sched.hh>
 #include <arch.hh>
 
@@ -66,6 +68,62 @@ private:
     T _ring[MaxSize];
 };
 
+//
+// spsc ring whose size, a power of two, is chosen at construction
+//
+template<class T>
+class ring_spsc_dynamic {
+public:
+    explicit ring_spsc_dynamic(unsigned size)
+        : _begin(0), _end(0), _mask(size - 1), _ring(new T[size])
+    {
+        assert(size && !(size & (size - 1)));
+    }
+
+    bool push(const T& element)
+    {
+        unsigned end = _end.load(std::memory_order_relaxed);
+        unsigned beg = _begin.load(std::memory_order_relaxed);
+
+        if (end - beg > _mask) {
+            return false;
+        }
+
+        _ring[end & _mask] = element;
+        _end.store(end + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool pop(T& element)
+    {
+        unsigned beg = _begin.load(std::memory_order_relaxed);
+        unsigned end = _end.load(std::memory_order_acquire);
+
+        if (beg >= end) {
+            return false;
+        }
+
+        element = _ring[beg & _mask];
+        _begin.store(beg + 1, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    unsigned size() {
+        unsigned end = _end.load(std::memory_order_relaxed);
+        unsigned beg = _begin.load(std::memory_order_relaxed);
+
+        return (end - beg);
+    }
+
+private:
+    std::atomic<unsigned> _begin CACHELINE_ALIGNED;
+    std::atomic<unsigned> _end CACHELINE_ALIGNED;
+    const unsigned _mask;
+    std::unique_ptr<T[]> _ring;
+};
+
 //
 // mpsc ring of fixed size
 //
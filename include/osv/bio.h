@@ -124,6 +124,14 @@ void		biodone(struct bio *bio, bool ok);
 struct devstat;
 void    biofinish(struct bio *bp, struct devstat *stat, int error);
 
+void	bio_plug(void);
+void	bio_unplug(void);
+/*
+ * Called by a driver holding back a bio: returns true if the current thread
+ * is plugged, in which case unplug(arg) will be called by bio_unplug().
+ */
+bool	bio_plug_defer(void (*unplug)(void *), void *arg);
+
 __END_DECLS
 
 #endif /* !_SYS_BIO_H_ */
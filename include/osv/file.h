@@ -88,6 +88,20 @@ struct file {
 	virtual int chmod(mode_t mode) = 0;
 	virtual void poll_install(pollreq& pr) {}
 	virtual void poll_uninstall(pollreq& pr) {}
+	// Mappings of files that have pages map those instead of copies of
+	// them: get_page() returns the page at a page-aligned offset, valid
+	// until put_page(), which returns false if given some other page, or
+	// nullptr if the page could not be read.
+	virtual bool has_pages() { return false; }
+	virtual void* get_page(off_t offset) { return nullptr; }
+	virtual bool put_page(void* page, off_t offset) { return false; }
+	// The page may be lent from the filesystem's own cache, which mappings
+	// must not write: a file that has shared, writable mappings (between
+	// add_writer() and remove_writer()) lends no more pages, and the ones
+	// it lent before, which page_lent() tells apart, have to be unmapped.
+	virtual void add_writer() {}
+	virtual void remove_writer() {}
+	virtual bool page_lent(void* page, off_t offset) { return false; }
 
 	int		f_flags;	/* open flags */
 	int		f_count;	/* reference count, see below */
@@ -97,10 +111,7 @@ struct file {
 	filetype_t	f_type;		/* descriptor type */
 	TAILQ_HEAD(, poll_link) f_poll_list; /* poll request list */
 	mutex_t		f_lock;		/* lock */
-	std::unique_ptr<std::vector<file*>> f_epolls;
-	// poll_wake_count used for implementing epoll()'s EPOLLET using poll().
-	// Once we have a real epoll() implementation, it won't be needed.
-	int poll_wake_count = 0;
+	std::unique_ptr<std::vector<file*>> f_epolls; /* epolls watching us */
 };
 
 // struct file above is an abstract class; subclasses need to implement 8
@@ -153,6 +164,7 @@ void file_setoffset(struct file *fp, off_t off);
  * File descriptors reference count
  */
 void fhold(struct file* fp);
+bool fhold_if_positive(struct file* fp);
 int fdrop(struct file* fp);
 
 /* Get fp from fd and increment refcount */
@@ -16,7 +16,7 @@
 #include "drivers/pci.hh"
 #include "drivers/pci-function.hh"
 #include <osv/types.h>
-#include <initializer_list>
+#include <vector>
 #include <boost/optional.hpp>
 
 // max vectors per request
@@ -70,7 +70,7 @@ public:
     // 2. Allocate vectors and assign ISRs
     // 3. Setup entries
     // 4. Unmask interrupts
-    bool easy_register(std::initializer_list<msix_binding> bindings);
+    bool easy_register(const std::vector<msix_binding>& bindings);
     void easy_unregister();
 
     /////////////////////
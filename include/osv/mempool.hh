@@ -31,7 +31,18 @@ void free_phys_contiguous_aligned(void* p);
 
 void setup_free_memory(void* start, size_t bytes);
 
-void debug_memory_pool(size_t *total, size_t *contig);
+// Fragmentation of the free page ranges, as filled in by debug_memory_pool().
+struct fragmentation_report {
+    static constexpr unsigned nr_orders = 40;
+    size_t nr_ranges;
+    // number of huge pages that could be carved out of the free ranges
+    size_t huge_pages;
+    // ranges[i] is the number of free ranges of [2^i, 2^(i+1)) pages
+    size_t ranges[nr_orders];
+};
+
+void debug_memory_pool(size_t *total, size_t *contig,
+                       fragmentation_report *frag = nullptr);
 
 namespace bi = boost::intrusive;
 
@@ -102,6 +113,7 @@ struct page_range {
     explicit page_range(size_t size);
     size_t size;
     boost::intrusive::set_member_hook<> member_hook;
+    boost::intrusive::set_member_hook<> size_hook;
 };
 
 void free_initial_memory_range(void* addr, size_t size);
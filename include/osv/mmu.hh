@@ -14,6 +14,7 @@
 #include <osv/types.h>
 #include <functional>
 #include <osv/error.h>
+#include <osv/mutex.h>
 
 struct exception_frame;
 class balloon;
@@ -84,7 +85,7 @@ public:
     vma(addr_range range, unsigned perm, unsigned flags, bool map_dirty, map_page_ops *page_ops = nullptr);
     virtual ~vma();
     void set(uintptr_t start, uintptr_t end);
-    void protect(unsigned perm);
+    virtual void protect(unsigned perm);
     uintptr_t start() const;
     uintptr_t end() const;
     void* addr() const;
@@ -92,6 +93,9 @@ public:
     unsigned perm() const;
     unsigned flags() const;
     virtual void fault(uintptr_t addr, exception_frame *ef);
+    // Page faults normally hold the vma list lock for read only; return
+    // true if fault() may change the address space layout itself.
+    virtual bool fault_needs_exclusive() const { return false; }
     virtual void split(uintptr_t edge) = 0;
     virtual error sync(uintptr_t start, uintptr_t end) = 0;
     virtual int validate_perm(unsigned perm) { return 0; }
@@ -135,14 +139,20 @@ class file_vma : public vma {
 public:
     file_vma(addr_range range, unsigned perm, fileref file, f_offset offset, bool shared);
     ~file_vma();
+    virtual void fault(uintptr_t addr, exception_frame *ef) override;
     virtual void split(uintptr_t edge) override;
     virtual error sync(uintptr_t start, uintptr_t end) override;
     virtual int validate_perm(unsigned perm);
+    virtual void protect(unsigned perm) override;
+    // Unmaps the pages writer's file lent us, if it is our file too
+    void drop_lent_pages(file* writer);
 private:
     f_offset offset(uintptr_t addr);
+    bool writes_file(unsigned perm);
     fileref _file;
     f_offset _offset;
     bool _shared;
+    mutex _fault_mutex;
 };
 
 class jvm_balloon_vma : public vma {
@@ -152,6 +162,7 @@ public:
     virtual void split(uintptr_t edge) override;
     virtual error sync(uintptr_t start, uintptr_t end) override;
     virtual void fault(uintptr_t addr, exception_frame *ef) override;
+    virtual bool fault_needs_exclusive() const override { return true; }
     void detach_balloon();
 private:
     balloon *_balloon;
@@ -206,7 +217,21 @@ void vcleanup(void* addr, size_t size);
 
 void vm_fault(uintptr_t addr, exception_frame* ef);
 
+// Called by the scheduler when a cpu switches to its idle thread and back;
+// TLB flushes don't interrupt idle cpus, which flush when they leave idle.
+void lazy_tlb_enter();
+void lazy_tlb_leave();
+
+namespace stats {
+    // TLB shootdowns (flushes that interrupted other cpus), in total and
+    // in the last whole second
+    ulong tlb_shootdowns();
+    ulong tlb_shootdowns_per_second();
+}
+
 std::string procfs_maps();
+// TLB shootdown counts, for /proc/tlb
+std::string procfs_tlb();
 
 }
 
@@ -96,6 +96,11 @@ struct mount {
  */
 #define	MNT_VISFLAGMASK	0x0000ffff
 
+/*
+ * Internal flags, not visible to statfs().
+ */
+#define	MNT_SHAREDREAD	0x00010000	/* fs locks its own reads, vn_lock not needed */
+
 #ifdef _KERNEL
 
 /*
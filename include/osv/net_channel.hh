@@ -9,11 +9,14 @@
 #define NETCHANNEL_HH_
 
 #include <osv/mutex.h>
+#include <osv/spinlock.h>
 #include <osv/sched.hh>
 #include <lockfree/ring.hh>
 #include <functional>
-#include <unordered_map>
+#include <chrono>
+#include <cstring>
 #include <osv/rcu.hh>
+#include <osv/rcu-hashtable.hh>
 #include <bsd/porting/netport.h>
 #include <bsd/sys/netinet/in.h>
 #include <bsd/sys/netinet/ip.h>
@@ -23,19 +26,40 @@ struct pollreq;
 
 // Lock-free queue for moving packets to a single consumer
 // Supports waiting via sched::thread::wait_for()
+//
+// A channel fed by a single flow has a single producer, the receive queue
+// the flow is steered to; one matching many flows (say, of a UDP server)
+// must be created as multi_producer.
 class net_channel {
 private:
     std::function<void (mbuf*)> _process_packet;
-    ring_spsc<mbuf*, 256> _queue;
+    ring_spsc_dynamic<mbuf*> _queue;
+    bool _multi_producer;
+    spinlock_t _producer_lock;
     sched::thread_handle _waiting_thread CACHELINE_ALIGNED;
     // extra list of threads to wake
     osv::rcu_ptr<std::vector<pollreq*>> _pollers;
     mutex _pollers_mutex;
 public:
-    explicit net_channel(std::function<void (mbuf*)> process_packet)
-        : _process_packet(std::move(process_packet)) {}
+    // Tunables, set from the command line: the number of packets a channel
+    // can hold (a power of two), and how long a consumer about to sleep
+    // spins waiting for packets first (0 to not spin at all).
+    static unsigned ring_depth;
+    static std::chrono::nanoseconds busy_poll;
+
+    explicit net_channel(std::function<void (mbuf*)> process_packet,
+                         bool multi_producer = false)
+        : _process_packet(std::move(process_packet)), _queue(ring_depth)
+        , _multi_producer(multi_producer) {}
     // producer: try to push a packet
-    bool push(mbuf* m) { return _queue.push(m); }
+    bool push(mbuf* m) {
+        if (!_multi_producer) {
+            return _queue.push(m);
+        }
+        WITH_LOCK(_producer_lock) {
+            return _queue.push(m);
+        }
+    }
     // consumer: wake the consumer (best used after multiple push()s)
     void wake() {
         _waiting_thread.wake();
@@ -45,6 +69,10 @@ public:
     }
     // consumer: consume all available packets using process_packet()
     void process_queue();
+    // consumer: spin for up to busy_poll, until packets arrive; returns
+    // true if there are any.  Drops mtx, the socket lock held by the
+    // caller, while spinning: the channel may be gone when it returns.
+    bool poll_wait(mutex& mtx);
     // add/remove current thread from poller list
     void add_poller(pollreq& pr);
     void del_poller(pollreq& pr);
@@ -69,51 +97,118 @@ public:
 
 }
 
-struct ipv4_tcp_conn_id {
-    ipv4_tcp_conn_id(in_addr src_addr, in_addr dst_addr, in_port_t src_port, in_port_t dst_port)
-        : src_addr(src_addr), dst_addr(dst_addr), src_port(src_port), dst_port(dst_port) {}
+// Identifies the packets a channel takes.  Addresses are kept in IPv6 form,
+// IPv4 ones as IPv4-mapped (::ffff:a.b.c.d); "src" is the remote end and
+// "dst" the local one, as seen on incoming packets.  A socket not connected
+// to a particular peer leaves the remote address and port zero to match
+// any, and a socket bound to no particular local address also the local
+// address.
+struct flow_key {
+    flow_key(u8 proto, in_addr src_addr, in_addr dst_addr, in_port_t src_port, in_port_t dst_port)
+        : src_port(src_port), dst_port(dst_port), proto(proto)
+    {
+        map_ipv4(this->src_addr, src_addr);
+        map_ipv4(this->dst_addr, dst_addr);
+    }
+    flow_key(u8 proto, const u8* src_addr6, const u8* dst_addr6, in_port_t src_port, in_port_t dst_port)
+        : src_port(src_port), dst_port(dst_port), proto(proto)
+    {
+        memcpy(src_addr, src_addr6, sizeof(src_addr));
+        memcpy(dst_addr, dst_addr6, sizeof(dst_addr));
+    }
 
-    in_addr src_addr;
-    in_addr dst_addr;
+    u32 src_addr[4];
+    u32 dst_addr[4];
     in_port_t src_port;
     in_port_t dst_port;
+    u8 proto;
+
+    // The key of a socket not connected to a peer, which would also take
+    // this flow
+    flow_key unconnected() const {
+        flow_key k = *this;
+        memset(k.src_addr, 0, sizeof(k.src_addr));
+        k.src_port = 0;
+        return k;
+    }
+    // ... and of one also bound to no particular address
+    flow_key unbound() const {
+        flow_key k = unconnected();
+        memset(k.dst_addr, 0, sizeof(k.dst_addr));
+        return k;
+    }
 
     size_t hash() const {
         // FIXME: protection against hash attacks?
-        return src_addr.s_addr ^ dst_addr.s_addr ^ src_port ^ dst_port;
+        size_t h = proto;
+        for (int i = 0; i < 4; i++) {
+            h ^= src_addr[i] ^ dst_addr[i];
+        }
+        return h ^ src_port ^ (size_t(dst_port) << 16);
     }
-    bool operator==(const ipv4_tcp_conn_id& x) const {
-        return src_addr == x.src_addr
-            && dst_addr == x.dst_addr
+    bool operator==(const flow_key& x) const {
+        return !memcmp(src_addr, x.src_addr, sizeof(src_addr))
+            && !memcmp(dst_addr, x.dst_addr, sizeof(dst_addr))
             && src_port == x.src_port
-            && dst_port == x.dst_port;
+            && dst_port == x.dst_port
+            && proto == x.proto;
+    }
+private:
+    static void map_ipv4(u32* a, in_addr addr) {
+        if (addr.s_addr == INADDR_ANY) {
+            // keep "any" the same for both families
+            a[0] = a[1] = a[2] = a[3] = 0;
+            return;
+        }
+        a[0] = a[1] = 0;
+        a[2] = htonl(0xffff);
+        a[3] = addr.s_addr;
     }
 };
 
 namespace std {
 
 template <>
-struct hash<ipv4_tcp_conn_id> {
-    size_t operator()(ipv4_tcp_conn_id x) const { return x.hash(); }
+struct hash<flow_key> {
+    size_t operator()(const flow_key& x) const { return x.hash(); }
 };
 
 }
 
+// Defers waking up the consumers of the channels packets are posted to, so
+// each is woken once when the batch is flushed, rather than once per packet.
+// The channels are protected by rcu, so the batch holds rcu_read_lock from the
+// first packet posted until flush(): the producer must not sleep in between.
+class net_channel_batch {
+public:
+    ~net_channel_batch() { flush(); }
+    void flush();
+private:
+    void add(net_channel* nc);
+    friend class classifier;
+private:
+    static constexpr unsigned max_channels = 16;
+    net_channel* _channels[max_channels];
+    unsigned _nr = 0;
+    bool _locked = false;
+};
+
 class classifier {
 public:
     classifier();
-    // consumer side operations
-    void add(ipv4_tcp_conn_id id, net_channel* channel);
-    void remove(ipv4_tcp_conn_id id);
-    // producer side operations
+    // consumer side operations; add() fails if the key is taken
+    bool add(const flow_key& key, net_channel* channel);
+    void remove(const flow_key& key);
+    // producer side operations; false means the caller should pass the
+    // packet up the stack itself
     bool post_packet(mbuf* m);
+    bool post_packet(mbuf* m, net_channel_batch& batch);
 private:
-    net_channel* classify_ipv4_tcp(mbuf* m);
+    net_channel* classify(mbuf* m);
+    net_channel* lookup(const flow_key& key);
 private:
-    using ipv4_tcp_channels = std::unordered_map<ipv4_tcp_conn_id, net_channel*>;
-    mutex _mtx;
-    // FIXME: use a fine-grained rcu hash table
-    osv::rcu_ptr<ipv4_tcp_channels, osv::rcu_deleter<ipv4_tcp_channels>> _ipv4_tcp_channels;
+    using channels = osv::rcu_hashtable<flow_key, net_channel*>;
+    channels _channels;
 };
 
 #endif /* NETCHANNEL_HH_ */
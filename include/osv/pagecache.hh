@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_PAGECACHE_HH_
+#define OSV_PAGECACHE_HH_
+
+#include <sys/types.h>
+
+struct vnode;
+struct file;
+struct uio;
+
+// Pages of file data that mappings of a file share.
+//
+// The page cache holds one page per (vnode, offset) for as long as some
+// mapping maps it, so a file mapped many times takes one copy of memory,
+// not one per mapping.  Where it can, that page is the filesystem's own:
+// ZFS lends the pages of the ARC's buffers (vop_holdpage), so mapped data
+// is not in memory twice.  Lent pages are read-only, so while a file has
+// shared, writable mappings (add_writer()), the page cache reads pages
+// into copies of its own instead, and read() and write() go through those
+// to stay coherent with stores through the mappings.  Blocks that don't
+// hold whole, aligned pages are always copied.  Files whose filesystem
+// keeps their data in pages (ramfs) lend those instead, and don't use the
+// page cache.
+//
+// Each vnode has its own index of pages, and lock.
+namespace pagecache {
+
+// Whether any of the file's pages are cached; cheap, no locking.
+bool cached(vnode* vp);
+
+// The following must be called with the vnode lock held.
+
+// Returns the page at the page-aligned offset, borrowing or reading it in
+// if it is not cached, with a reference for the caller; nullptr on error.
+void* get(vnode* vp, file* fp, off_t offset);
+// read() and write() for a file with cached pages
+int read(vnode* vp, file* fp, uio* uio, int ioflags);
+int write(vnode* vp, uio* uio, int ioflags);
+// Zeroes what is past the new end of the file in cached pages
+void truncate(vnode* vp, off_t length);
+
+// Drops the reference get() took; returns false if page is not the cached
+// page at offset.  Does not need the vnode lock.
+bool put(vnode* vp, off_t offset, void* page);
+
+// Count the file's shared, writable mappings, while which it lends no
+// pages.  Need not have the vnode lock.
+void add_writer(vnode* vp);
+void remove_writer(vnode* vp);
+// Whether page, at offset, is one the filesystem lent
+bool lent(vnode* vp, off_t offset, void* page);
+
+// Frees the vnode's index, when the vnode itself is freed
+void release(vnode* vp);
+
+}
+
+#endif /* OSV_PAGECACHE_HH_ */
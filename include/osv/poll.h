@@ -125,13 +125,11 @@ struct poll_file;
 
 struct poll_file {
     poll_file() = default;
-    // Note that events is int, not short, for EPOLLET support.
-    poll_file(fileref fp, int events, short revents, int c = 0)
-        : fp(fp), events(events), revents(revents), last_poll_wake_count(c) {}
+    poll_file(fileref fp, int events, short revents)
+        : fp(fp), events(events), revents(revents) {}
     fileref fp;
     int events;
     short revents;
-    int last_poll_wake_count;   // For implementing EPOLLET
 };
 
 /*
@@ -173,6 +171,9 @@ __END_DECLS
 
 int do_poll(std::vector<poll_file>& pfd, int _timeout);
 void epoll_file_closed(file* epoller, file* client);
+// Queues client on epoller's ready list, if it waits for these events.
+// Called with client->f_lock held.
+void epoll_wake(file* epoller, file* client, int events);
 
 #endif
 
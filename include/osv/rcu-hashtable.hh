@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_RCU_HASHTABLE_HH_
+#define OSV_RCU_HASHTABLE_HH_
+
+#include <osv/rcu.hh>
+#include <osv/mutex.h>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace osv {
+
+// A hash table with lock-free lookups and O(1) updates.
+//
+// Lookups must be done within rcu_read_lock, and the returned value must not
+// be used after it is dropped.  Updates only touch the bucket of the key,
+// linking and unlinking nodes in place, under one of a fixed set of locks
+// striped over the hash, so updates of keys in different stripes don't
+// contend.  When the number of entries grows past twice (or falls below an
+// eighth of) the number of buckets, the updater that notices rebuilds the
+// table with fresh nodes, one stripe at a time: updates elsewhere go on
+// meanwhile, and ones in stripes already copied go to both tables.  The
+// new table is then published for readers, and the old one disposed of
+// after the readers using it are gone.  This is O(n), but happens often
+// enough only for the cost to be amortized over the updates.
+template <typename Key, typename Value,
+          typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class rcu_hashtable {
+private:
+    struct node {
+        node(const Key& k, const Value& v) : key(k), value(v) {}
+        Key key;
+        Value value;
+        rcu_ptr<node> next;
+    };
+    struct table {
+        explicit table(unsigned order)
+            : order(order), buckets(new rcu_ptr<node>[size_t(1) << order]) {}
+        size_t size() const { return size_t(1) << order; }
+        unsigned order;
+        std::unique_ptr<rcu_ptr<node>[]> buckets;
+    };
+    // Stripes are the top bits of the hash, like buckets, so each bucket
+    // of a table no smaller than the stripes is in just one of them
+    static constexpr unsigned max_lock_order = 6;
+public:
+    explicit rcu_hashtable(unsigned min_order = 4)
+        : _min_order(min_order)
+        , _lock_order(min_order < max_lock_order ? min_order : max_lock_order)
+        , _locks(new mutex[size_t(1) << _lock_order])
+        , _order(min_order)
+        , _table(new table(min_order)) {}
+    ~rcu_hashtable() {
+        // there can no longer be any readers
+        free_table(_table.read_by_owner());
+    }
+    rcu_hashtable(const rcu_hashtable&) = delete;
+    rcu_hashtable& operator=(const rcu_hashtable&) = delete;
+
+    // Must be called with rcu_read_lock held; returns nullptr if not found
+    const Value* lookup(const Key& key) const {
+        auto t = _table.read();
+        for (auto n = t->buckets[bucket(*t, hash(key))].read(); n; n = n->next.read()) {
+            if (Equal()(n->key, key)) {
+                return &n->value;
+            }
+        }
+        return nullptr;
+    }
+    // Calls func(key, value) for every entry; must be called with
+    // rcu_read_lock held, or with updates otherwise excluded
+    template <typename Func>
+    void for_each(Func func) const {
+        auto t = _table.read();
+        for (size_t i = 0; i < t->size(); i++) {
+            for (auto n = t->buckets[i].read(); n; n = n->next.read()) {
+                func(n->key, n->value);
+            }
+        }
+    }
+    // Returns false, and leaves the table alone, if the key is already there
+    bool insert(const Key& key, const Value& value);
+    // Returns false if the key was not there
+    bool erase(const Key& key);
+    size_t size() const { return _count.load(std::memory_order_relaxed); }
+private:
+    static uint64_t hash(const Key& key) {
+        // Spread weak hashes (say, a XOR of addresses and ports) over the
+        // high bits, which are the ones we use
+        return Hash()(key) * 0x9e3779b97f4a7c15ULL;
+    }
+    static size_t bucket(const table& t, uint64_t h) {
+        return h >> (64 - t.order);
+    }
+    size_t stripe(uint64_t h) const {
+        return _lock_order ? h >> (64 - _lock_order) : 0;
+    }
+    // The following are called with the lock of the key's stripe held
+    static bool link(table& t, uint64_t h, const Key& key, const Value& value);
+    static bool unlink(table& t, uint64_t h, const Key& key);
+    table* mirror(table* t, size_t stripe);
+
+    void maybe_resize();
+    void resize(unsigned order);
+    static void free_table(table* t);
+private:
+    unsigned _min_order;
+    unsigned _lock_order;
+    std::unique_ptr<mutex[]> _locks;
+    std::atomic<size_t> _count = {0};
+    // Only changed by resize(), with _resize_mtx held
+    std::atomic<unsigned> _order;
+    rcu_ptr<table> _table;
+    // The table resize() is building, and how many stripes it has copied
+    std::atomic<table*> _next = {nullptr};
+    std::atomic<size_t> _migrated = {0};
+    mutex _resize_mtx;
+};
+
+// Links a node for key into t, unless it is there already
+template <typename Key, typename Value, typename Hash, typename Equal>
+bool rcu_hashtable<Key, Value, Hash, Equal>::link(table& t, uint64_t h,
+        const Key& key, const Value& value)
+{
+    auto& head = t.buckets[bucket(t, h)];
+    for (auto n = head.read_by_owner(); n; n = n->next.read_by_owner()) {
+        if (Equal()(n->key, key)) {
+            return false;
+        }
+    }
+    auto n = new node(key, value);
+    n->next.assign(head.read_by_owner());
+    head.assign(n);
+    return true;
+}
+
+template <typename Key, typename Value, typename Hash, typename Equal>
+bool rcu_hashtable<Key, Value, Hash, Equal>::unlink(table& t, uint64_t h, const Key& key)
+{
+    auto link = &t.buckets[bucket(t, h)];
+    for (auto n = link->read_by_owner(); n; n = link->read_by_owner()) {
+        if (Equal()(n->key, key)) {
+            link->assign(n->next.read_by_owner());
+            rcu_dispose(n);
+            return true;
+        }
+        link = &n->next;
+    }
+    return false;
+}
+
+// Returns the table being built by resize() if it already has the stripe's
+// entries, so updates made to t must be made there too
+template <typename Key, typename Value, typename Hash, typename Equal>
+auto rcu_hashtable<Key, Value, Hash, Equal>::mirror(table* t, size_t stripe) -> table*
+{
+    auto next = _next.load(std::memory_order_acquire);
+    if (next && next != t &&
+            stripe < _migrated.load(std::memory_order_relaxed)) {
+        return next;
+    }
+    return nullptr;
+}
+
+template <typename Key, typename Value, typename Hash, typename Equal>
+bool rcu_hashtable<Key, Value, Hash, Equal>::insert(const Key& key, const Value& value)
+{
+    auto h = hash(key);
+    auto s = stripe(h);
+    WITH_LOCK(_locks[s]) {
+        auto t = _table.read_by_owner();
+        if (!link(*t, h, key, value)) {
+            return false;
+        }
+        if (auto next = mirror(t, s)) {
+            link(*next, h, key, value);
+        }
+    }
+    if (++_count > 2 * (size_t(1) << _order.load(std::memory_order_relaxed))) {
+        maybe_resize();
+    }
+    return true;
+}
+
+template <typename Key, typename Value, typename Hash, typename Equal>
+bool rcu_hashtable<Key, Value, Hash, Equal>::erase(const Key& key)
+{
+    auto h = hash(key);
+    auto s = stripe(h);
+    WITH_LOCK(_locks[s]) {
+        auto t = _table.read_by_owner();
+        if (!unlink(*t, h, key)) {
+            return false;
+        }
+        if (auto next = mirror(t, s)) {
+            unlink(*next, h, key);
+        }
+    }
+    auto order = _order.load(std::memory_order_relaxed);
+    if (--_count < (size_t(1) << order) / 8 && order > _min_order) {
+        maybe_resize();
+    }
+    return true;
+}
+
+template <typename Key, typename Value, typename Hash, typename Equal>
+void rcu_hashtable<Key, Value, Hash, Equal>::maybe_resize()
+{
+    // One resize at a time.  Updates don't wait for it: they may have
+    // raced with it anyway, so we check again, and the next update after
+    // it checks again too.
+    if (!_resize_mtx.try_lock()) {
+        return;
+    }
+    auto order = _order.load(std::memory_order_relaxed);
+    auto count = _count.load(std::memory_order_relaxed);
+    if (count > 2 * (size_t(1) << order)) {
+        resize(order + 1);
+    } else if (count < (size_t(1) << order) / 8 && order > _min_order) {
+        resize(order - 1);
+    }
+    _resize_mtx.unlock();
+}
+
+// Called with _resize_mtx held
+template <typename Key, typename Value, typename Hash, typename Equal>
+void rcu_hashtable<Key, Value, Hash, Equal>::resize(unsigned order)
+{
+    auto old = _table.read_by_owner();
+    auto neww = new table(order);
+    _migrated.store(0, std::memory_order_relaxed);
+    _next.store(neww, std::memory_order_release);
+    // Copy each stripe with only its own lock held; updates to it wait for
+    // that, and from then on update both tables (see mirror()).
+    auto stripes = size_t(1) << _lock_order;
+    auto per_stripe = old->size() / stripes;
+    for (size_t s = 0; s < stripes; s++) {
+        WITH_LOCK(_locks[s]) {
+            for (size_t i = s * per_stripe; i < (s + 1) * per_stripe; i++) {
+                for (auto n = old->buckets[i].read_by_owner(); n; n = n->next.read_by_owner()) {
+                    auto& head = neww->buckets[bucket(*neww, hash(n->key))];
+                    auto copy = new node(n->key, n->value);
+                    copy->next.assign(head.read_by_owner());
+                    head.assign(copy);
+                }
+            }
+            _migrated.store(s + 1, std::memory_order_relaxed);
+        }
+    }
+    _table.assign(neww);
+    _order.store(order, std::memory_order_relaxed);
+    // Wait out updates that may still be making changes to the old table,
+    // which later ones will leave alone.
+    for (size_t s = 0; s < stripes; s++) {
+        WITH_LOCK(_locks[s]) {}
+    }
+    _next.store(nullptr, std::memory_order_relaxed);
+    rcu_defer(free_table, old);
+}
+
+template <typename Key, typename Value, typename Hash, typename Equal>
+void rcu_hashtable<Key, Value, Hash, Equal>::free_table(table* t)
+{
+    for (size_t i = 0; i < t->size(); i++) {
+        auto n = t->buckets[i].read_by_owner();
+        while (n) {
+            auto next = n->next.read_by_owner();
+            delete n;
+            n = next;
+        }
+    }
+    delete t;
+}
+
+}
+
+#endif /* OSV_RCU_HASHTABLE_HH_ */
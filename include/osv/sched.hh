@@ -72,6 +72,10 @@ class cpu_set {
 public:
     explicit cpu_set() : _mask() {}
     cpu_set(const cpu_set& other) : _mask(other._mask.load(std::memory_order_relaxed)) {}
+    cpu_set& operator=(const cpu_set& other) {
+        _mask.store(other._mask.load(std::memory_order_relaxed), std::memory_order_release);
+        return *this;
+    }
     void set(unsigned c) {
         _mask.fetch_or(1UL << c, std::memory_order_release);
     }
@@ -85,6 +89,9 @@ public:
     void clear(unsigned c) {
         _mask.fetch_and(~(1UL << c), std::memory_order_release);
     }
+    bool test(unsigned c) const {
+        return _mask.load(std::memory_order_relaxed) & (1UL << c);
+    }
     class iterator;
     iterator begin() {
         return iterator(*this);
@@ -440,6 +447,20 @@ public:
      * explained in set_priority().
      */
     float priority() const;
+    /**
+     * Set the cpus the thread may run on
+     *
+     * An empty set (the default for threads not pinned at creation) allows
+     * all cpus. A thread running or queued on a cpu outside the new set is
+     * migrated to one inside it; a sleeping thread moves when it is woken.
+     */
+    void set_affinity(const cpu_set& cpus);
+    cpu_set get_affinity() const { return _affinity; }
+    bool may_run_on(cpu* c) const;
+    /**
+     * Migrate the current thread to the given cpu, and keep it there
+     */
+    static void pin(cpu* target);
 private:
     static void wake_impl(detached_state* st,
             unsigned allowed_initial_states_mask = 1 << unsigned(status::waiting));
@@ -532,6 +553,9 @@ private:
     arch_thread _arch;
     arch_fpu _fpu;
     unsigned int _id;
+    cpu_set _affinity;
+    // queued, and counted in its cpu's stealable count
+    bool _stealable = false;
     std::atomic<bool> _interrupted;
     std::function<void ()> _cleanup;
     std::vector<std::unique_ptr<char[]>> _tls;
@@ -635,8 +659,24 @@ struct cpu : private timer_base::client {
     typedef lockless_queue<thread, &thread::_wakeup_link> incoming_wakeup_queue;
     cpu_set incoming_wakeups_mask;
     incoming_wakeup_queue* incoming_wakeups;
+    // idle cpus asking us to hand them one of our queued threads
+    cpu_set steal_requests;
+    // queued threads which may run on another cpu: neither the idle
+    // thread, nor pinned here
+    std::atomic<unsigned> stealable = { 0 };
+    // set when a thread on our runqueue may no longer run here
+    std::atomic<bool> affinity_changed = { false };
     thread* terminating_thread;
+    // a thread we switched away from because its affinity excludes us,
+    // to be sent to migrating_target once we are off its stack
+    thread* migrating_thread;
+    cpu* migrating_target;
     osv::clock::uptime::time_point running_since;
+    // time spent running threads other than the idle thread, and its
+    // recent average as a fraction of load_scale (see load())
+    osv::clock::uptime::duration busy_time;
+    std::atomic<unsigned> busy_avg = { 0 };
+    static constexpr unsigned load_scale = 1024;
     char* percpu_base;
     static cpu* current();
     void init_on_cpu();
@@ -650,8 +690,15 @@ struct cpu : private timer_base::client {
     void send_wakeup_ipi();
     void load_balance();
     unsigned load();
+    void try_steal();
+    void handle_steal_requests();
+    void migrate_queued(thread& t, cpu* target);
+    void migrate(thread& t, cpu* target);
+    void handle_affinity_changes();
+    void finish_migration();
     void reschedule_from_interrupt(bool preempt = false);
     void enqueue(thread& t);
+    void dequeue(thread& t);
     void init_idle_thread();
     virtual void timer_fired() override;
     class notifier;
@@ -3,6 +3,9 @@
 #include <sys/cdefs.h>
 
 __BEGIN_DECLS
+/* memcpy() of up to this many bytes reads all of the source before writing */
+#define MEMCPY_OVERLAP_SAFE 64
+
 void *memcpy_backwards(void *dest, const void *src, size_t n);
 __END_DECLS
 
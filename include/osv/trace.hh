@@ -42,6 +42,14 @@ struct trace_record {
 };
 
 trace_record* allocate_trace_record(size_t size);
+void commit_trace_record();
+
+// Contents of /proc/trace/stream: the trace records logged since the
+// previous read, in the format of scripts/osv/trace.py.
+std::string procfs_trace_stream();
+// Contents of /proc/trace/dropped: "cpu count" lines, counting records
+// lost because the stream was not read fast enough.
+std::string procfs_trace_dropped();
 
 template <size_t idx, size_t N, typename... args>
 struct tuple_formatter
@@ -241,6 +249,7 @@ public:
     static void log_backtraces();
     void add_probe(probe* p);
     void del_probe(probe* p);
+    static const size_t backtrace_len = 10;
     tracepoint_id id;
     const char* name;
     const char* format;
@@ -275,7 +284,6 @@ private:
     void update();
     static std::unordered_set<tracepoint_id>& known_ids();
     static bool _log_backtrace;
-    static const size_t backtrace_len = 10;
 };
 
 namespace {
@@ -323,6 +331,9 @@ public:
             return;
         }
         auto tr = allocate_trace_record(size());
+        if (!tr) {
+            return;
+        }
         tr->tp = this;
         tr->thread = sched::thread::current();
         tr->thread_name = tr->thread->name_raw();
@@ -336,6 +347,7 @@ public:
         tr->backtrace = false;
         log_backtrace(tr, buffer);
         serialize(buffer, as);
+        commit_trace_record();
     }
     void serialize(void* buffer, std::tuple<s_args...> as) {
         return serializer<0, sizeof...(s_args), s_args...>::write(buffer, 0, as);
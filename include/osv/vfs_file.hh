@@ -21,6 +21,12 @@ public:
     virtual int stat(struct stat* buf) override;
     virtual int close() override;
     virtual int chmod(mode_t mode) override;
+    virtual bool has_pages() override;
+    virtual void* get_page(off_t offset) override;
+    virtual bool put_page(void* page, off_t offset) override;
+    virtual void add_writer() override;
+    virtual void remove_writer() override;
+    virtual bool page_lent(void* page, off_t offset) override;
 };
 
 #endif /* VFS_FILE_HH_ */
@@ -68,7 +68,6 @@ enum vtype {
  */
 struct vnode {
 	uint64_t	v_ino;		/* inode number */
-	LIST_ENTRY(vnode) v_link;	/* link for hash list */
 	struct mount	*v_mount;	/* mounted vfs pointer */
 	struct vnops	*v_op;		/* vnode operations */
 	int		v_refcnt;	/* reference count */
@@ -79,6 +78,8 @@ struct vnode {
 	mutex_t		v_lock;		/* lock for this vnode */
 	LIST_HEAD(, dentry) v_names;	/* directory entries pointing at this */
 	int		v_nrlocks;	/* lock count (for debug) */
+	int		v_npages;	/* pages in the page cache */
+	void		*v_pagecache;	/* the page cache's index of them */
 	void		*v_data;	/* private data for fs */
 };
 
@@ -138,6 +139,10 @@ typedef	int (*vnop_setattr_t)	(struct vnode *, struct vattr *);
 typedef	int (*vnop_inactive_t)	(struct vnode *);
 typedef	int (*vnop_truncate_t)	(struct vnode *, off_t);
 typedef	int (*vnop_link_t)      (struct vnode *, struct vnode *, char *);
+typedef	int (*vnop_getpage_t)	(struct vnode *, off_t, void **);
+typedef	int (*vnop_putpage_t)	(struct vnode *, off_t, void *);
+typedef	int (*vnop_holdpage_t)	(struct vnode *, off_t, void **, void **);
+typedef	int (*vnop_relepage_t)	(struct vnode *, void *);
 
 /*
  * vnode operations
@@ -162,6 +167,24 @@ struct vnops {
 	vnop_inactive_t		vop_inactive;
 	vnop_truncate_t		vop_truncate;
 	vnop_link_t		vop_link;
+	/*
+	 * Optional: for filesystems that keep file data in pages, lend the
+	 * page at a page-aligned offset to a mapping, until it is returned
+	 * with putpage, which fails with ENOENT if the page is not the file's.
+	 * putpage must not take the vnode lock.  Files of other filesystems
+	 * are mapped through the page cache.
+	 */
+	vnop_getpage_t		vop_getpage;
+	vnop_putpage_t		vop_putpage;
+	/*
+	 * Optional: for filesystems that cache file data in whole pages of
+	 * their own, hold the cached page at a page-aligned offset, setting a
+	 * handle to release it with.  Held pages are read-only: the page cache
+	 * lends them to mappings that don't write the file.  relepage must not
+	 * take the vnode lock.
+	 */
+	vnop_holdpage_t		vop_holdpage;
+	vnop_relepage_t		vop_relepage;
 };
 
 /*
@@ -187,6 +210,10 @@ struct vnops {
 #define VOP_INACTIVE(VP)	   ((VP)->v_op->vop_inactive)(VP)
 #define VOP_TRUNCATE(VP, N)	   ((VP)->v_op->vop_truncate)(VP, N)
 #define VOP_LINK(DVP, SVP, N) 	   ((DVP)->v_op->vop_link)(DVP, SVP, N)
+#define VOP_GETPAGE(VP, OFF, P)	   ((VP)->v_op->vop_getpage)(VP, OFF, P)
+#define VOP_PUTPAGE(VP, OFF, P)	   ((VP)->v_op->vop_putpage)(VP, OFF, P)
+#define VOP_HOLDPAGE(VP, OFF, P, H) ((VP)->v_op->vop_holdpage)(VP, OFF, P, H)
+#define VOP_RELEPAGE(VP, H)	   ((VP)->v_op->vop_relepage)(VP, H)
 
 int	 vop_nullop(void);
 int	 vop_einval(void);
@@ -7,6 +7,7 @@
 
 #include <osv/sched.hh>
 #include "signal.hh"
+#include "libc.hh"
 #include <pthread.h>
 #include <errno.h>
 #include <mutex>
@@ -649,3 +650,95 @@ int pthread_setname_np(pthread_t p, const char* name)
     pthread::from_libc(p)->_thread.set_name(name);
     return 0;
 }
+
+static int setaffinity(sched::thread* t, size_t cpusetsize,
+        const cpu_set_t* cpuset)
+{
+    sched::cpu_set mask;
+    bool all = true;
+    for (auto c : sched::cpus) {
+        if (CPU_ISSET_S(c->id, cpusetsize, cpuset)) {
+            mask.set(c->id);
+        } else {
+            all = false;
+        }
+    }
+    if (!mask) {
+        return EINVAL;
+    }
+    // An empty mask allows all cpus, including ones brought up later
+    t->set_affinity(all ? sched::cpu_set() : mask);
+    return 0;
+}
+
+static int getaffinity(sched::thread* t, size_t cpusetsize, cpu_set_t* cpuset)
+{
+    if (cpusetsize * 8 < sched::cpus.size()) {
+        return EINVAL;
+    }
+    CPU_ZERO_S(cpusetsize, cpuset);
+    for (auto c : sched::cpus) {
+        if (t->may_run_on(c)) {
+            CPU_SET_S(c->id, cpusetsize, cpuset);
+        }
+    }
+    return 0;
+}
+
+int pthread_setaffinity_np(pthread_t thread, size_t cpusetsize,
+        const cpu_set_t* cpuset)
+{
+    return setaffinity(&pthread::from_libc(thread)->_thread, cpusetsize, cpuset);
+}
+
+int pthread_getaffinity_np(pthread_t thread, size_t cpusetsize,
+        cpu_set_t* cpuset)
+{
+    return getaffinity(&pthread::from_libc(thread)->_thread, cpusetsize, cpuset);
+}
+
+// We have a single process, so the pid here is a thread id, with 0 meaning
+// the calling thread, as in Linux.
+static sched::thread* find_thread(pid_t pid)
+{
+    if (pid == 0) {
+        return sched::thread::current();
+    }
+    return sched::thread::find_by_id(pid);
+}
+
+int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t* cpuset)
+{
+    auto t = find_thread(pid);
+    if (!t) {
+        return libc_error(ESRCH);
+    }
+    int err = setaffinity(t, cpusetsize, cpuset);
+    if (err) {
+        return libc_error(err);
+    }
+    return 0;
+}
+
+int sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t* cpuset)
+{
+    auto t = find_thread(pid);
+    if (!t) {
+        return libc_error(ESRCH);
+    }
+    int err = getaffinity(t, cpusetsize, cpuset);
+    if (err) {
+        return libc_error(err);
+    }
+    return 0;
+}
+
+int __sched_cpucount(size_t cpusetsize, const cpu_set_t* cpuset)
+{
+    int count = 0;
+    auto bytes = reinterpret_cast<const unsigned char*>(cpuset);
+    for (size_t i = 0; i < cpusetsize; i++) {
+        count += __builtin_popcount(bytes[i]);
+    }
+    return count;
+}
@@ -75,6 +75,15 @@ void handle_segmentation_fault(ulong addr, exception_frame* ef)
     generate_signal(si, ef);
 }
 
+void handle_bus_error(ulong addr, exception_frame* ef)
+{
+    siginfo_t si;
+    si.si_signo = SIGBUS;
+    si.si_code = BUS_ADRERR;
+    si.si_addr = reinterpret_cast<void*>(addr);
+    generate_signal(si, ef);
+}
+
 }
 
 using namespace osv;
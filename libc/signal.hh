@@ -29,6 +29,7 @@ sigset* thread_signals();
 
 void generate_signal(siginfo_t &siginfo, exception_frame* ef);
 void handle_segmentation_fault(ulong addr, exception_frame* ef);
+void handle_bus_error(ulong addr, exception_frame* ef);
 
 }
 
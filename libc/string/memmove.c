@@ -9,6 +9,7 @@ void *memmove(void *dest, const void *src, size_t n)
 	const char *s = src;
 
 	if (d==s) return d;
+	if (n <= MEMCPY_OVERLAP_SAFE) return memcpy(d, s, n);
 	if (s+n <= d || d+n <= s) return memcpy(d, s, n);
 
 	if (d<s) {
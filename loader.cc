@@ -38,6 +38,7 @@
 #include "arch-setup.hh"
 #include "osv/trace.hh"
 #include <osv/power.hh>
+#include <osv/net_channel.hh>
 #include <osv/rcu.hh>
 #include <osv/mempool.hh>
 #include <bsd/porting/networking.hh>
@@ -142,6 +143,8 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         ("env", bpo::value<std::vector<std::string>>(), "set Unix-like environment variable (putenv())")
         ("cwd", bpo::value<std::vector<std::string>>(), "set current working directory")
         ("bootchart", "perform a test boot measuring a time distribution of the various operations\n")
+        ("nc-ring-depth", bpo::value<unsigned>(), "packets queued per net channel (a power of two)")
+        ("nc-busy-poll", bpo::value<unsigned>(), "microseconds a net channel reader spins for packets before sleeping")
     ;
     bpo::variables_map vars;
     // don't allow --foo bar (require --foo=bar) so we can find the first non-option
@@ -191,6 +194,19 @@ std::tuple<int, char**> parse_options(int ac, char** av)
             }
         }
     }
+    if (vars.count("nc-ring-depth")) {
+        auto depth = vars["nc-ring-depth"].as<unsigned>();
+        if (!depth || (depth & (depth - 1))) {
+            printf("Ignoring '--nc-ring-depth', not a power of two\n");
+        } else {
+            net_channel::ring_depth = depth;
+        }
+    }
+
+    if (vars.count("nc-busy-poll")) {
+        net_channel::busy_poll = std::chrono::microseconds(vars["nc-busy-poll"].as<unsigned>());
+    }
+
     opt_mount = !vars.count("nomount");
     opt_vga = vars.count("vga");
 
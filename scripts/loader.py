@@ -821,26 +821,26 @@ def align_down(v, pagesize):
 def align_up(v, pagesize):
     return align_down(v + pagesize - 1, pagesize)
 
-def all_traces():
-    # XXX: needed for GDB to see 'trace_page_size'
-    gdb.lookup_global_symbol('gdb_trace_function_entry')
-
+def cpu_traces(trace_buf, tracepoints):
     inf = gdb.selected_inferior()
-    trace_log = gdb.lookup_global_symbol('trace_log').value()
+    trace_log = trace_buf['log']
     if not trace_log:
-    	return
+        return
     max_trace = ulong(gdb.parse_and_eval('max_trace'))
     trace_log = inf.read_memory(trace_log, max_trace)
     trace_page_size = ulong(gdb.parse_and_eval('trace_page_size'))
-    last = ulong(gdb.lookup_global_symbol('trace_record_last').value()['_M_i'])
-    last %= max_trace
-    pivot = align_up(last, trace_page_size)
-    trace_log = trace_log[pivot:] + trace_log[:pivot]
-    last += max_trace - pivot
+    last = ulong(trace_buf['last']['_M_i'])
+    if last == 0:
+        return
+    if last > max_trace:
+        # the ring wrapped around; the oldest records follow the newest
+        last %= max_trace
+        pivot = align_up(last, trace_page_size)
+        trace_log = trace_log[pivot:] + trace_log[:pivot]
+        last += max_trace - pivot
 
     tp_ptr = gdb.lookup_type('tracepoint_base').pointer()
     backtrace_len = ulong(gdb.parse_and_eval('tracepoint_base::backtrace_len'))
-    tracepoints = {}
 
     i = 0
     while i < last:
@@ -870,6 +870,17 @@ def all_traces():
         i = align_up(i, 8)
         yield Trace(tp, thread, thread_name, time, cpu, data, backtrace=backtrace)
 
+def all_traces():
+    # XXX: needed for GDB to see 'trace_page_size'
+    gdb.lookup_global_symbol('gdb_trace_function_entry')
+
+    # Each cpu logs into its own ring; merge them by time
+    trace_for_cpu = gdb.lookup_global_symbol('trace_for_cpu').value()
+    max_cpus = ulong(gdb.parse_and_eval('sched::max_cpus'))
+    tracepoints = {}
+    per_cpu = [list(cpu_traces(trace_for_cpu[i], tracepoints)) for i in range(max_cpus)]
+    return trace.merge(*per_cpu)
+
 def save_traces_to_file(filename):
     trace.write_to_file(filename, list(all_traces()))
 
@@ -2,6 +2,7 @@ import os
 import mmap
 import struct
 import sys
+import heapq
 
 # version 2 introduced thread_name
 _format_version = 2
@@ -235,6 +236,42 @@ class read_file:
     def get_traces(self):
         return read(self.map)
 
+class read_files:
+    """Reads several trace files, each ordered by time, as one trace.
+    For example successive reads of /proc/trace/stream."""
+    def __init__(self, filenames):
+        self.readers = [read_file(filename) for filename in filenames]
+
+    def __enter__(self):
+        for reader in self.readers:
+            reader.__enter__()
+        return self
+
+    def __exit__(self, *args):
+        for reader in self.readers:
+            reader.__exit__(*args)
+
+    def get_traces(self):
+        return merge(*[reader.get_traces() for reader in self.readers])
+
+def merge(*streams):
+    """Merges streams of traces, each ordered by time, into one"""
+    heap = []
+    for stream in streams:
+        it = iter(stream)
+        for t in it:
+            heap.append((t.time, len(heap), t, it))
+            break
+    heapq.heapify(heap)
+    seq = len(heap)
+    while heap:
+        time, _, t, it = heapq.heappop(heap)
+        yield t
+        for t in it:
+            heapq.heappush(heap, (t.time, seq, t, it))
+            seq += 1
+            break
+
 def write_to_file(filename, traces):
     with open(filename, 'wb') as file:
         return write(traces, file.write)
@@ -45,10 +45,11 @@ class src_addr_formatter:
         return text
 
 def add_trace_source_options(parser):
-    parser.add_argument("tracefile", help="Path to trace file")
+    parser.add_argument("tracefile", nargs='+', help="Path to trace file; several files "
+        "(e.g. successive reads of /proc/trace/stream) are merged by time")
 
 def get_trace_reader(args):
-    return trace.read_file(args.tracefile)
+    return trace.read_files(args.tracefile)
 
 def add_symbol_resolution_options(parser):
     group = parser.add_argument_group('symbol resolution')
@@ -382,7 +383,7 @@ if __name__ == "__main__":
         Extracts trace from a running OSv instance via GDB.
         """)
     add_symbol_resolution_options(cmd_extract)
-    add_trace_source_options(cmd_extract)
+    cmd_extract.add_argument("tracefile", help="Path to trace file")
     cmd_extract.set_defaults(func=extract)
 
     args = parser.parse_args()
@@ -8,7 +8,9 @@
 #include <time.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <assert.h>
 #include <osv/debug.h>
+#include <osv/clock.hh>
 #include <bsd/porting/callout.h>
 #include <bsd/porting/netport.h>
 #include <bsd/porting/sync_stub.h>
@@ -160,9 +162,76 @@ void test2(void)
     tdbg("BSD Callout Test2 - END\n");
 }
 
+/********************** Test 3 **********************/
+
+/*
+ * Arm many callouts with timeouts over several levels of the timer wheel,
+ * re-arm or stop some of them, and check that each of the remaining ones
+ * runs once, and not before it was due.
+ */
+#define T3_NR 2000
+struct t3_callout {
+    struct callout c;
+    osv::clock::uptime::time_point due;
+    int runs;
+    int early;
+};
+struct t3_callout t3[T3_NR];
+
+void t3_fn(void *arg)
+{
+    struct t3_callout *t = (struct t3_callout *)arg;
+
+    if (osv::clock::uptime::now() < t->due)
+        t->early++;
+    t->runs++;
+}
+
+void t3_arm(struct t3_callout *t, int ticks)
+{
+    t->due = osv::clock::uptime::now() + std::chrono::nanoseconds(ticks2ns(ticks));
+    callout_reset(&t->c, ticks, t3_fn, t);
+}
+
+void test3(void)
+{
+    int i, runs = 0, early = 0, stopped = 0;
+
+    tdbg("BSD Callout Test3 - BEGIN\n");
+    for (i = 0; i < T3_NR; i++) {
+        callout_init(&t3[i].c, 1);
+        t3[i].runs = t3[i].early = 0;
+        /* up to 5 seconds, past the first two levels */
+        t3_arm(&t3[i], (i * 7919) % (5 * hz));
+    }
+    usleep(100000);
+    for (i = 0; i < T3_NR; i += 3) {
+        if (callout_pending(&t3[i].c))
+            t3_arm(&t3[i], (i * 104729) % (2 * hz));
+    }
+    for (i = 1; i < T3_NR; i += 5) {
+        if (callout_pending(&t3[i].c)) {
+            callout_stop(&t3[i].c);
+            stopped++;
+        }
+    }
+    sleep(6);
+    for (i = 0; i < T3_NR; i++) {
+        runs += t3[i].runs;
+        early += t3[i].early;
+        if (t3[i].runs > 1)
+            tdbg("callout %d ran %d times\n", i, t3[i].runs);
+    }
+    tdbg("runs=%d expected=%d early=%d\n", runs, T3_NR - stopped, early);
+    assert(runs == T3_NR - stopped);
+    assert(early == 0);
+    tdbg("BSD Callout Test3 - END\n");
+}
+
 int main(int argc, char **argv)
 {
     test1();
     test2();
+    test3();
     return 0;
 }
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures the Internet checksum over buffers of 63 bytes to 64 KB, at
+// aligned and misaligned starts: a plain word-at-a-time loop, in_cksum(),
+// and copying the data then summing it against in_cksum_copy(), which
+// does both in one pass.  Results are checked against the plain loop, for
+// these sizes, and for every size up to 1 KB at each of 16 alignments.
+//
+// usage: misc-cksum [seconds per run]
+
+#include <bsd/porting/netport.h>
+#include <bsd/sys/sys/mbuf.h>
+#include <bsd/machine/in_cksum.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+// Sums the buffer as 16-bit words, as if it started at an even offset
+static u_int plain_sum(const void* buf, int len)
+{
+    auto p = static_cast<const u_char*>(buf);
+    u_int64_t sum = 0;
+    for (; len >= 2; len -= 2, p += 2) {
+        u_int16_t w;
+        memcpy(&w, p, 2);
+        sum += w;
+    }
+    if (len) {
+        sum += *p;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static u_int fold(u_int sum)
+{
+    return sum == 0xffff ? 0 : sum;
+}
+
+// in_cksum() over a buffer, through an mbuf pointing at it
+static u_int mbuf_sum(void* buf, int len)
+{
+    struct mbuf m;
+    memset(&m, 0, sizeof(m));
+    m.m_hdr.mh_data = static_cast<caddr_t>(buf);
+    m.m_hdr.mh_len = len;
+    return ~in_cksum(&m, len) & 0xffff;
+}
+
+// Checks in_cksum() and in_cksum_copy() against the plain loop
+static bool check(const u_char* src, u_char* dst, size_t len, int align)
+{
+    auto s = src + align;
+    auto d = dst + align;
+    auto expect = plain_sum(s, len);
+    bool ok = true;
+    if (fold(mbuf_sum(const_cast<u_char*>(s), len)) != fold(expect)) {
+        printf("in_cksum mismatch: size %zu align %d\n", len, align);
+        ok = false;
+    }
+    if (fold(in_cksum_copy(s, d, len)) != fold(expect) || memcmp(s, d, len)) {
+        printf("in_cksum_copy mismatch: size %zu align %d\n", len, align);
+        ok = false;
+    }
+    return ok;
+}
+
+template <typename Func>
+static double bench(double seconds, size_t len, Func func)
+{
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    auto end = start + std::chrono::duration<double>(seconds);
+    size_t iterations = 0;
+    clock::time_point now;
+    do {
+        for (int i = 0; i < 1000; i++) {
+            func();
+        }
+        iterations += 1000;
+        now = clock::now();
+    } while (now < end);
+    std::chrono::duration<double> elapsed = now - start;
+    return iterations * len / elapsed.count() / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+    const size_t max_len = 64 * 1024;
+    std::vector<u_char> src(max_len + 64), dst(max_len + 64);
+    for (auto& c : src) {
+        c = rand();
+    }
+
+    bool ok = true;
+    for (size_t len = 0; len <= 1024; len++) {
+        for (int align = 0; align < 16; align++) {
+            ok &= check(src.data(), dst.data(), len, align);
+        }
+    }
+
+    printf("%6s %5s %10s %10s %12s %12s  (GB/s)\n",
+           "size", "align", "plain", "in_cksum", "copy+cksum", "cksum_copy");
+    for (size_t len : {63, 64, 256, 1024, 1471, 4096, 9001, 16384, 65535, 65536}) {
+        for (int align : {0, 1, 2, 3}) {
+            ok &= check(src.data(), dst.data(), len, align);
+            auto s = src.data() + align;
+            auto d = dst.data() + align;
+
+            volatile u_int sink;
+            auto plain = bench(seconds, len, [&] { sink = plain_sum(s, len); });
+            auto cksum = bench(seconds, len, [&] { sink = mbuf_sum(s, len); });
+            auto separate = bench(seconds, len, [&] {
+                memcpy(d, s, len);
+                sink = mbuf_sum(d, len);
+            });
+            auto fused = bench(seconds, len, [&] { sink = in_cksum_copy(s, d, len); });
+            (void)sink;
+            printf("%6zu %5d %10.2f %10.2f %12.2f %12.2f\n",
+                   len, align, plain, cksum, separate, fused);
+        }
+    }
+    return ok ? 0 : 1;
+}
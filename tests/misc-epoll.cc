@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures the cost of an epoll_wait() that finds a single ready fd, as a
+// function of the number of fds registered with the epoll.
+//
+// Each fd is the read side of a pipe, so a run with N fds needs 2N file
+// descriptors; on OSv the descriptor table limits this to about 8000.
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+
+static void bench(int nfds, int iterations)
+{
+    int ep = epoll_create1(0);
+    std::vector<int> rfds, wfds;
+    for (int i = 0; i < nfds; i++) {
+        int s[2];
+        if (pipe(s) < 0) {
+            printf("%6d  could only create %d pipes, skipping\n", nfds, i);
+            goto out;
+        }
+        rfds.push_back(s[0]);
+        wfds.push_back(s[1]);
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, s[0], &event) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    {
+        epoll_event events[16];
+        char c = 'x';
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            int n = i % nfds;
+            if (write(wfds[n], &c, 1) != 1) {
+                perror("write");
+                exit(1);
+            }
+            int r = epoll_wait(ep, events, 16, -1);
+            if (r != 1 || events[0].data.u32 != unsigned(n)) {
+                printf("epoll_wait returned %d\n", r);
+                exit(1);
+            }
+            if (read(rfds[n], &c, 1) != 1) {
+                perror("read");
+                exit(1);
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> sec = end - start;
+        printf("%6d  %10.3f\n", nfds, sec.count() * 1e6 / iterations);
+    }
+
+out:
+    for (auto fd : rfds) {
+        close(fd);
+    }
+    for (auto fd : wfds) {
+        close(fd);
+    }
+    close(ep);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 100000;
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+
+    // Make room for the largest run, where the system allows it
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    printf("   fds  usec/wakeup\n");
+    for (int nfds : { 10, 1000, 8000, 50000 }) {
+        bench(nfds, iterations);
+    }
+    return 0;
+}
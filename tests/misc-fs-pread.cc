@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures how pread() throughput on a single file scales with the number
+// of threads reading it concurrently, as a database reading its data files
+// would.  With the reads serialized by the vnode lock, the aggregate
+// throughput stays flat as threads are added.
+//
+// usage: misc-fs-pread [file size in MB] [block size in KB] [seconds per run] [path]
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <random>
+
+static std::atomic<bool> done;
+
+static void reader(int fd, size_t file_size, size_t block, unsigned seed, size_t& bytes)
+{
+    std::vector<char> buf(block);
+    std::default_random_engine rnd(seed);
+    std::uniform_int_distribution<size_t> dist(0, file_size / block - 1);
+    bytes = 0;
+    while (!done.load(std::memory_order_relaxed)) {
+        auto r = pread(fd, buf.data(), block, dist(rnd) * block);
+        if (r != ssize_t(block)) {
+            perror("pread");
+            exit(1);
+        }
+        bytes += r;
+    }
+}
+
+static double run(int fd, size_t file_size, size_t block, int nthreads, int seconds)
+{
+    std::vector<std::thread> threads;
+    std::vector<size_t> bytes(nthreads);
+    done.store(false);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < nthreads; i++) {
+        threads.emplace_back(reader, fd, file_size, block, i, std::ref(bytes[i]));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    done.store(true);
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    size_t total = 0;
+    for (auto b : bytes) {
+        total += b;
+    }
+    return total / sec.count() / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    size_t file_size = size_t(argc > 1 ? atoi(argv[1]) : 64) << 20;
+    size_t block = size_t(argc > 2 ? atoi(argv[2]) : 4) << 10;
+    int seconds = argc > 3 ? atoi(argv[3]) : 2;
+    const char* path = argc > 4 ? argv[4] : "/tmp/misc-fs-pread.dat";
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    std::vector<char> buf(1 << 20, 'x');
+    for (size_t off = 0; off < file_size; off += buf.size()) {
+        if (write(fd, buf.data(), buf.size()) != ssize_t(buf.size())) {
+            perror("write");
+            return 1;
+        }
+    }
+    fsync(fd);
+
+    // warm up the cache
+    run(fd, file_size, block, 1, 1);
+
+    unsigned ncpus = std::thread::hardware_concurrency();
+    double base = 0;
+    printf("threads  MB/s      scaling\n");
+    for (unsigned n = 1; n <= 2 * ncpus; n *= 2) {
+        double mbs = run(fd, file_size, block, n, seconds);
+        if (n == 1) {
+            base = mbs;
+        }
+        printf("%-8u %-9.1f %.2fx\n", n, mbs, mbs / base);
+    }
+
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures memcpy(), memmove() and memset() from 1 byte to 16 MB, with the
+// source and destination at various alignments, and checks the results.
+// memmove() is measured with the destination just below the source, which
+// is the overlap it hands to memcpy().
+//
+// usage: misc-memcpy [seconds per run]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+template <typename Func>
+static double bench(double seconds, size_t len, Func func)
+{
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    auto end = start + std::chrono::duration<double>(seconds);
+    size_t iterations = 0;
+    size_t batch = std::max<size_t>(1, (1 << 20) / len);
+    clock::time_point now;
+    do {
+        for (size_t i = 0; i < batch; i++) {
+            func();
+            asm volatile("" : : : "memory");
+        }
+        iterations += batch;
+        now = clock::now();
+    } while (now < end);
+    std::chrono::duration<double> elapsed = now - start;
+    return iterations * len / elapsed.count() / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.1;
+    const size_t max_len = 16 << 20;
+    std::vector<unsigned char> src(max_len + 128), dst(max_len + 128);
+    for (auto& c : src) {
+        c = rand();
+    }
+
+    bool ok = true;
+    printf("%9s %5s %5s %10s %10s %10s  (GB/s)\n",
+           "size", "src", "dst", "memcpy", "memmove", "memset");
+    std::vector<size_t> sizes;
+    for (size_t len = 1; len <= max_len; len *= 2) {
+        sizes.push_back(len);
+        if (len >= 4 && len < max_len) {
+            sizes.push_back(len + len / 2 + 1);
+        }
+    }
+    for (auto len : sizes) {
+        for (auto align : { std::make_pair(0, 0), std::make_pair(1, 0),
+                            std::make_pair(0, 7), std::make_pair(3, 13) }) {
+            auto s = src.data() + align.first;
+            auto d = dst.data() + align.second;
+
+            // a guard byte on each side
+            memset(dst.data(), 0xa5, len + 64);
+            memcpy(d, s, len);
+            if (memcmp(d, s, len) || (align.second && d[-1] != 0xa5) || d[len] != 0xa5) {
+                printf("memcpy mismatch: size %zu src %d dst %d\n", len, align.first, align.second);
+                ok = false;
+            }
+            memset(d, 0x3c, len);
+            for (size_t i = 0; i < len; i++) {
+                if (d[i] != 0x3c) {
+                    printf("memset mismatch: size %zu dst %d\n", len, align.second);
+                    ok = false;
+                    break;
+                }
+            }
+            if (d[len] != 0xa5) {
+                printf("memset overrun: size %zu dst %d\n", len, align.second);
+                ok = false;
+            }
+
+            auto copy = bench(seconds, len, [&] { memcpy(d, s, len); });
+            auto move = bench(seconds, len, [&] { memmove(d + 1, d + 2, len); });
+            auto set = bench(seconds, len, [&] { memset(d, 0, len); });
+            printf("%9zu %5d %5d %10.2f %10.2f %10.2f\n",
+                   len, align.first, align.second, copy, move, set);
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures how page fault throughput scales with the number of threads
+// faulting in disjoint parts of the same anonymous mapping.
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static constexpr size_t page_size = 4096;
+
+std::chrono::duration<double> fault_in(size_t mb, unsigned nthreads)
+{
+    size_t size = mb*1024*1024;
+    char *p = reinterpret_cast<char*>(mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0));
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // Interleave the threads page by page, so faults land in the same page
+    // tables and huge page ranges, rather than each thread getting a range
+    // of its own.
+    std::vector<std::thread> threads;
+    auto start = std::chrono::system_clock::now();
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([=] {
+            for (size_t i = t * page_size; i < size; i += nthreads * page_size) {
+                p[i] = 0xfe;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::system_clock::now();
+    munmap(p, size);
+    return end - start;
+}
+
+int main(int argc, char **argv)
+{
+    size_t mb = 1024;
+    if (argc > 1) {
+        mb = atoi(argv[1]);
+    }
+    unsigned ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (auto i = 1; i <= 5; i++) {
+        printf("Iteration %d\n\n", i);
+        printf("threads  time (seconds)\n");
+
+        for (unsigned n = 1; n <= ncpus; n *= 2) {
+            auto t = fault_in(mb, n);
+            printf("%7u  %-6.3f\n", n, t.count());
+        }
+
+        printf("\n");
+    }
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares the throughput of sending a file over a TCP connection with
+// sendfile() and with a read()/write() loop, as a static content server
+// would.  Also checks that what arrives is the file.
+//
+// usage: misc-sendfile [file size in MB] [rounds] [path]
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static const int port = 7778;
+
+static int connected_pair(int& server)
+{
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+    if (bind(ls, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) < 0 || listen(ls, 1) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(s, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    server = accept(ls, nullptr, nullptr);
+    close(ls);
+    return s;
+}
+
+static char pattern(size_t off)
+{
+    return off * 7 + (off >> 12);
+}
+
+// Receives size bytes, checking them against the file's contents
+static void receive(int s, size_t size, bool& ok)
+{
+    std::vector<char> buf(65536);
+    size_t off = 0;
+    ok = true;
+    while (off < size) {
+        auto r = read(s, buf.data(), buf.size());
+        if (r <= 0) {
+            ok = false;
+            return;
+        }
+        for (ssize_t i = 0; i < r; i++) {
+            if (buf[i] != pattern(off + i)) {
+                ok = false;
+            }
+        }
+        off += r;
+    }
+}
+
+static void send_sendfile(int s, int fd, size_t size)
+{
+    off_t off = 0;
+    while (size_t(off) < size) {
+        if (sendfile(s, fd, &off, size - off) <= 0) {
+            perror("sendfile");
+            exit(1);
+        }
+    }
+}
+
+static void send_read_write(int s, int fd, size_t size)
+{
+    std::vector<char> buf(65536);
+    lseek(fd, 0, SEEK_SET);
+    while (size) {
+        auto r = read(fd, buf.data(), buf.size());
+        if (r <= 0) {
+            perror("read");
+            exit(1);
+        }
+        for (ssize_t done = 0; done < r; ) {
+            auto w = write(s, buf.data() + done, r - done);
+            if (w <= 0) {
+                perror("write");
+                exit(1);
+            }
+            done += w;
+        }
+        size -= r;
+    }
+}
+
+static void bench(const char* name, void (*send)(int, int, size_t),
+        int fd, size_t size, int rounds)
+{
+    int server;
+    int s = connected_pair(server);
+    bool ok;
+    auto start = std::chrono::high_resolution_clock::now();
+    std::thread receiver([&] { receive(server, size * rounds, ok); });
+    for (int i = 0; i < rounds; i++) {
+        send(s, fd, size);
+    }
+    receiver.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("%-12s %8.1f MB/s%s\n", name, size * rounds / sec.count() / 1e6,
+            ok ? "" : "  (data mismatch!)");
+    close(s);
+    close(server);
+    if (!ok) {
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = size_t(argc > 1 ? atoi(argv[1]) : 64) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    const char* path = argc > 3 ? argv[3] : "/tmp/misc-sendfile.dat";
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    std::vector<char> buf(65536);
+    for (size_t off = 0; off < size; off += buf.size()) {
+        for (size_t i = 0; i < buf.size(); i++) {
+            buf[i] = pattern(off + i);
+        }
+        if (write(fd, buf.data(), buf.size()) != ssize_t(buf.size())) {
+            perror("write");
+            return 1;
+        }
+    }
+
+    // warm up the cache, then alternate
+    bench("read/write", send_read_write, fd, size, 1);
+    for (int i = 0; i < 2; i++) {
+        bench("read/write", send_read_write, fd, size, rounds);
+        bench("sendfile", send_sendfile, fd, size, rounds);
+    }
+
+    close(fd);
+    unlink(path);
+    return 0;
+}
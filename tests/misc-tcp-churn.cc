@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures the rate of TCP connection setup and teardown while a number of
+// other connections stay established, which is what stresses the per-flow
+// state (such as the net channel classifier) of the stack.
+//
+// The classifier only sees packets arriving on a network interface, not on
+// loopback, so the two ends have to be on different machines: run the
+// server in OSv, and the client (this same file, built for the host) on
+// the host, pointed at the guest's address:
+//
+// usage: misc-tcp-churn server
+//        misc-tcp-churn client <address> [idle connections] [churned connections]
+//
+// Each idle connection takes a file descriptor on each side, and the
+// server can have at most FDMAX (16384) open.
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+static const int port = 7777;
+static const int max_idle = 15000;
+
+// The client sends one of these on each connection
+static const char keep = 'k', drop = 'd', done = 'x';
+
+static void usage()
+{
+    fprintf(stderr, "usage: misc-tcp-churn server\n"
+            "       misc-tcp-churn client <address> [idle connections] [churned connections]\n");
+    exit(1);
+}
+
+// Keeps the connections asked to be kept, and closes the others at once, so
+// that TIME_WAIT is kept on this side rather than using up the client's
+// ephemeral ports.  Closes the kept ones when the client is done, and
+// waits for the next run.
+static void server()
+{
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    if (bind(ls, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) < 0 || listen(ls, 1024) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    printf("listening on port %d\n", port);
+    std::vector<int> kept;
+    while (true) {
+        int s = accept(ls, nullptr, nullptr);
+        if (s < 0) {
+            perror("accept");
+            exit(1);
+        }
+        char c = drop;
+        if (read(s, &c, 1) == 1 && c == keep) {
+            kept.push_back(s);
+            continue;
+        }
+        close(s);
+        if (c == done) {
+            printf("run done, closing %zu idle connections\n", kept.size());
+            for (auto k : kept) {
+                close(k);
+            }
+            kept.clear();
+        }
+    }
+}
+
+static int connect_to(in_addr addr, char what)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr = addr;
+    sin.sin_port = htons(port);
+    if (connect(s, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    if (write(s, &what, 1) != 1) {
+        perror("write");
+        exit(1);
+    }
+    return s;
+}
+
+static void client(in_addr addr, int idle, int churn)
+{
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    std::vector<int> connected;
+    for (int i = 0; i < idle; i++) {
+        connected.push_back(connect_to(addr, keep));
+    }
+    printf("%d idle connections established\n", idle);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < churn; i++) {
+        int s = connect_to(addr, drop);
+        char c;
+        while (read(s, &c, 1) > 0) {
+        }
+        close(s);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("%d connections in %.3f s, %.0f connections/s\n",
+            churn, sec.count(), churn / sec.count());
+
+    close(connect_to(addr, done));
+    for (auto s : connected) {
+        close(s);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "server")) {
+        server();
+    } else if (argc > 2 && !strcmp(argv[1], "client")) {
+        in_addr addr;
+        if (!inet_aton(argv[2], &addr)) {
+            usage();
+        }
+        int idle = argc > 3 ? atoi(argv[3]) : 8000;
+        int churn = argc > 4 ? atoi(argv[4]) : 20000;
+        if (idle > max_idle) {
+            fprintf(stderr, "at most %d idle connections\n", max_idle);
+            return 1;
+        }
+        client(addr, idle, churn);
+    } else {
+        usage();
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares the ZFS compression algorithms on the files of the image: reads
+// them in 128K records, as ZFS stores them, and reports the compression
+// ratio and compression and decompression throughput of lzjb and lz4.
+// Records which don't compress by 1/8 are stored uncompressed by ZFS, so
+// they don't count for decompression.
+//
+// usage: misc-zfs-compress [directory] [repeats]
+
+#include <sys/stat.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+extern "C" {
+    size_t lzjb_compress(void *src, void *dst, size_t s_len, size_t d_len, int level);
+    int lzjb_decompress(void *src, void *dst, size_t s_len, size_t d_len, int level);
+    size_t lz4_compress(void *src, void *dst, size_t s_len, size_t d_len, int level);
+    int lz4_decompress(void *src, void *dst, size_t s_len, size_t d_len, int level);
+}
+
+static constexpr size_t record_size = 128 * 1024;
+
+struct algorithm {
+    const char* name;
+    size_t (*compress)(void *, void *, size_t, size_t, int);
+    int (*decompress)(void *, void *, size_t, size_t, int);
+};
+
+static std::vector<std::vector<char>> records;
+
+static int add_file(const char* path, const struct stat* st, int type, struct FTW*)
+{
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    std::vector<char> buf(record_size);
+    ssize_t n;
+    while ((n = read(fd, buf.data(), buf.size())) > 0) {
+        buf.resize(n);
+        records.push_back(buf);
+        buf.resize(record_size);
+    }
+    close(fd);
+    return 0;
+}
+
+using clock_type = std::chrono::high_resolution_clock;
+
+static double seconds_since(clock_type::time_point start)
+{
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    const char* dir = argc > 1 ? argv[1] : "/usr";
+    int repeats = argc > 2 ? atoi(argv[2]) : 5;
+
+    nftw(dir, add_file, 16, FTW_PHYS);
+    size_t total = 0;
+    for (auto& r : records) {
+        total += r.size();
+    }
+    if (!total) {
+        printf("no files under %s\n", dir);
+        return 1;
+    }
+    printf("%s: %zu records, %.1f MB\n", dir, records.size(), total / 1e6);
+    printf("%-6s %8s %14s %16s\n", "", "ratio", "compress MB/s", "decompress MB/s");
+
+    algorithm algorithms[] = {
+        { "lzjb", lzjb_compress, lzjb_decompress },
+        { "lz4", lz4_compress, lz4_decompress },
+    };
+    std::vector<char> out(record_size);
+    for (auto& a : algorithms) {
+        std::vector<std::vector<char>> compressed(records.size());
+        size_t stored = 0;
+        auto start = clock_type::now();
+        for (size_t i = 0; i < records.size(); i++) {
+            auto& r = records[i];
+            std::vector<char> c(r.size());
+            // as zio_compress_data(): it has to save at least 1/8
+            size_t d_len = r.size() - (r.size() >> 3);
+            size_t c_len = a.compress(r.data(), c.data(), r.size(), d_len, 0);
+            if (c_len <= d_len) {
+                c.resize(c_len);
+                compressed[i] = std::move(c);
+                stored += c_len;
+            } else {
+                stored += r.size();
+            }
+        }
+        auto compress_time = seconds_since(start);
+
+        size_t decompressed = 0;
+        start = clock_type::now();
+        for (int rep = 0; rep < repeats; rep++) {
+            for (size_t i = 0; i < records.size(); i++) {
+                auto& c = compressed[i];
+                if (c.empty()) {
+                    continue;
+                }
+                auto& r = records[i];
+                if (a.decompress(c.data(), out.data(), c.size(), r.size(), 0) != 0 ||
+                    (rep == 0 && memcmp(out.data(), r.data(), r.size()) != 0)) {
+                    printf("%s: record %zu does not decompress\n", a.name, i);
+                    return 1;
+                }
+                decompressed += r.size();
+            }
+        }
+        auto decompress_time = seconds_since(start);
+
+        printf("%-6s %8.2f %14.1f %16.1f\n", a.name, double(total) / stored,
+               total / compress_time / 1e6, decompressed / decompress_time / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests changing the cpu affinity of running, spinning and sleeping threads.
+
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <atomic>
+#include <osv/sched.hh>
+#include <osv/debug.hh>
+
+static unsigned this_cpu()
+{
+    return sched::cpu::current()->id;
+}
+
+static cpu_set_t one_cpu(unsigned c)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(c, &set);
+    return set;
+}
+
+int main(int argc, char **argv)
+{
+    debug("Running affinity tests\n");
+    unsigned ncpus = sched::cpus.size();
+
+    // Move ourselves around
+    for (unsigned c = 0; c < ncpus; c++) {
+        auto set = one_cpu(c);
+        assert(sched_setaffinity(0, sizeof(set), &set) == 0);
+        assert(this_cpu() == c);
+        cpu_set_t get;
+        assert(sched_getaffinity(0, sizeof(get), &get) == 0);
+        assert(CPU_COUNT(&get) == 1 && CPU_ISSET(c, &get));
+    }
+
+    // Masks with more than one cpu
+    if (ncpus > 1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(0, &set);
+        CPU_SET(1, &set);
+        assert(sched_setaffinity(0, sizeof(set), &set) == 0);
+        assert(this_cpu() <= 1);
+        cpu_set_t get;
+        assert(sched_getaffinity(0, sizeof(get), &get) == 0);
+        assert(CPU_EQUAL(&set, &get));
+    }
+
+    // A mask with no existing cpu is refused
+    cpu_set_t none;
+    CPU_ZERO(&none);
+    CPU_SET(sched::max_cpus, &none);
+    assert(sched_setaffinity(0, sizeof(none), &none) == -1 && errno == EINVAL);
+
+    // A thread spinning on another cpu, and one sleeping there
+    static std::atomic<unsigned> spinner_cpu(ncpus);
+    static std::atomic<bool> done(false);
+    pthread_t spinner, sleeper;
+    pthread_create(&spinner, nullptr, [](void*) -> void* {
+        while (!done.load()) {
+            spinner_cpu.store(this_cpu());
+        }
+        return nullptr;
+    }, nullptr);
+    std::atomic<unsigned> sleeper_cpu(ncpus);
+    pthread_create(&sleeper, nullptr, [](void* arg) -> void* {
+        usleep(100000);
+        static_cast<std::atomic<unsigned>*>(arg)->store(this_cpu());
+        return nullptr;
+    }, &sleeper_cpu);
+    for (unsigned c = 0; c < ncpus; c++) {
+        auto set = one_cpu(c);
+        assert(pthread_setaffinity_np(spinner, sizeof(set), &set) == 0);
+        while (spinner_cpu.load() != c) {
+            sched::thread::yield();
+        }
+    }
+    auto set = one_cpu(ncpus - 1);
+    assert(pthread_setaffinity_np(sleeper, sizeof(set), &set) == 0);
+    pthread_join(sleeper, nullptr);
+    assert(sleeper_cpu.load() == ncpus - 1);
+    done.store(true);
+    pthread_join(spinner, nullptr);
+
+    // Back to all cpus
+    cpu_set_t all;
+    CPU_ZERO(&all);
+    for (unsigned c = 0; c < ncpus; c++) {
+        CPU_SET(c, &all);
+    }
+    assert(sched_setaffinity(0, sizeof(all), &all) == 0);
+    assert(!sched::thread::current()->get_affinity());
+
+    debug("Affinity tests succeeded\n");
+}
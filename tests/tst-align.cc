@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests posix_memalign() and aligned_alloc() for alignments from 16 bytes
+// up to 2MB, for both small and large objects.
+
+#define BOOST_TEST_MODULE tst-align
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <cstdint>
+#include <vector>
+
+#ifdef __OSV__
+#include <osv/mempool.hh>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+static bool is_aligned(void* p, size_t alignment)
+{
+    return !(reinterpret_cast<uintptr_t>(p) & (alignment - 1));
+}
+
+static const size_t sizes[] = { 1, 8, 16, 100, 1000, 2048, 4000, 4096,
+                                5000, 65536, 1 << 20, 3 << 20 };
+
+BOOST_AUTO_TEST_CASE(test_posix_memalign)
+{
+    for (size_t alignment = 16; alignment <= (2 << 20); alignment *= 2) {
+        for (auto size : sizes) {
+            // keep a few around so that consecutive allocations do not
+            // just reuse the same block
+            std::vector<void*> bufs;
+            for (int i = 0; i < 4; i++) {
+                void* p = nullptr;
+                BOOST_REQUIRE_EQUAL(posix_memalign(&p, alignment, size), 0);
+                BOOST_REQUIRE(p);
+                BOOST_REQUIRE_MESSAGE(is_aligned(p, alignment),
+                    "posix_memalign(" << alignment << ", " << size << ") = " << p);
+                memset(p, 0x5a, size);
+                bufs.push_back(p);
+            }
+            for (auto p : bufs) {
+                free(p);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_aligned_alloc)
+{
+    for (size_t alignment = 16; alignment <= (2 << 20); alignment *= 2) {
+        void* p = aligned_alloc(alignment, alignment);
+        BOOST_REQUIRE(p);
+        BOOST_REQUIRE(is_aligned(p, alignment));
+        memset(p, 0xa5, alignment);
+        // realloc() must handle aligned blocks like any other
+        p = realloc(p, alignment * 2);
+        BOOST_REQUIRE(p);
+        free(p);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_bad_alignment)
+{
+    void* p;
+    BOOST_REQUIRE_EQUAL(posix_memalign(&p, 24, 100), EINVAL);
+}
+
+#ifdef __OSV__
+BOOST_AUTO_TEST_CASE(test_phys_contiguous_aligned)
+{
+    for (size_t alignment = 16; alignment <= (2 << 20); alignment *= 2) {
+        void* p = memory::alloc_phys_contiguous_aligned(8192, alignment);
+        BOOST_REQUIRE(p);
+        BOOST_REQUIRE(is_aligned(p, alignment));
+        memset(p, 0, 8192);
+        memory::free_phys_contiguous_aligned(p);
+    }
+}
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests that runnable threads started on one cpu spread out to the others,
+// and that threads pinned to a busy cpu stay there.
+
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <osv/sched.hh>
+#include <osv/debug.hh>
+
+static unsigned this_cpu()
+{
+    return sched::cpu::current()->id;
+}
+
+int main(int argc, char **argv)
+{
+    debug("Running load balancing tests\n");
+    unsigned ncpus = sched::cpus.size();
+    if (ncpus < 2) {
+        debug("Load balancing needs more than one cpu, skipped\n");
+        return 0;
+    }
+
+    // one thread per cpu, all started on this one (new threads start on
+    // their creator's cpu)
+    std::atomic<bool> done(false);
+    std::vector<std::atomic<unsigned>> where(ncpus);
+    std::vector<std::unique_ptr<sched::thread>> threads;
+    for (unsigned i = 0; i < ncpus; i++) {
+        where[i].store(this_cpu());
+        threads.emplace_back(new sched::thread([&, i] {
+            while (!done.load(std::memory_order_relaxed)) {
+                where[i].store(this_cpu(), std::memory_order_relaxed);
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t->start();
+    }
+
+    auto spread = [&] {
+        std::vector<bool> used(ncpus);
+        unsigned n = 0;
+        for (auto& w : where) {
+            auto c = w.load();
+            if (!used[c]) {
+                used[c] = true;
+                n++;
+            }
+        }
+        return n;
+    };
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (spread() < ncpus && std::chrono::steady_clock::now() < deadline) {
+        usleep(100000);
+    }
+    done.store(true);
+    threads.clear();
+    assert(spread() == ncpus);
+
+    // threads pinned to cpu 0 make it busy, but give the idle cpus nothing
+    // to steal
+    done.store(false);
+    for (unsigned i = 0; i < ncpus; i++) {
+        threads.emplace_back(new sched::thread([&, i] {
+            while (!done.load(std::memory_order_relaxed)) {
+                where[i].store(this_cpu(), std::memory_order_relaxed);
+            }
+        }, sched::thread::attr().pin(sched::cpus[0])));
+    }
+    for (auto& t : threads) {
+        t->start();
+    }
+    usleep(500000);
+    done.store(true);
+    threads.clear();
+    for (auto& w : where) {
+        assert(w.load() == 0);
+    }
+
+    debug("Load balancing tests succeeded\n");
+}
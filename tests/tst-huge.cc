@@ -102,6 +102,20 @@ int main(int argc, char **argv)
         }
     } while(addr);
 
+    // Show how fragmented free memory is by now.
+    size_t total, contig;
+    memory::fragmentation_report frag;
+    memory::debug_memory_pool(&total, &contig, &frag);
+    std::cerr << "free: " << (total >> 20) << " MB in " << frag.nr_ranges
+              << " ranges, largest " << (contig >> 10) << " kB, "
+              << frag.huge_pages << " huge pages\n";
+    size_t nr_ranges = 0;
+    for (auto n : frag.ranges) {
+        nr_ranges += n;
+    }
+    assert(nr_ranges == frag.nr_ranges);
+    assert(contig <= total);
+
     // We will map a 128Mb array again. There are no more huge pages, so we
     // will fail. The mapping will consist of small pages filling the space of
     // huge pages. If everything works, we should have no problems reading back
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Feeds TCP segments to tcp_lro the way the virtio-net receiver does, and
+// checks that what it passes up is the same stream, in order, in packets
+// with correct lengths and checksums.
+
+#define BOOST_TEST_MODULE tst-lro
+
+#include <bsd/porting/netport.h>
+#include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/net/if.h>
+#include <bsd/sys/net/if_var.h>
+#include <bsd/sys/net/if_types.h>
+#include <bsd/sys/net/ethernet.h>
+#include <bsd/sys/netinet/ip.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+static const unsigned mss = 1448;
+static const u32 iss = 0xfffff000;   // wraps around within the stream
+static const unsigned tcp_hlen = sizeof(tcphdr) + TCPOLEN_TSTAMP_APPA;
+
+static u8 stream_byte(u32 off)
+{
+    return off % 251;
+}
+
+static u32 sum16(const u8* p, unsigned len, u32 sum = 0)
+{
+    for (unsigned i = 0; i + 1 < len; i += 2) {
+        sum += p[i] << 8 | p[i + 1];
+    }
+    if (len & 1) {
+        sum += p[len - 1] << 8;
+    }
+    return sum;
+}
+
+static u16 fold(u32 sum)
+{
+    while (sum > 0xffff) {
+        sum = (sum >> 16) + (sum & 0xffff);
+    }
+    return sum;
+}
+
+// The sum over the TCP segment after the IP header, and its pseudo header
+static u16 tcp_sum(const u8* ip_hdr, unsigned tcp_len)
+{
+    auto ip = reinterpret_cast<const struct ip*>(ip_hdr);
+    u32 sum = sum16(reinterpret_cast<const u8*>(&ip->ip_src), 8);
+    sum += IPPROTO_TCP + tcp_len;
+    return fold(sum16(ip_hdr + sizeof(*ip), tcp_len, sum));
+}
+
+// An Ethernet frame with the TCP segment at offset off of the stream,
+// flagged the way the receiver flags frames the host checked
+static mbuf* segment(u32 off, unsigned len, u8 flags = TH_ACK)
+{
+    auto m = m_getcl(M_NOWAIT, MT_DATA, M_PKTHDR);
+    BOOST_REQUIRE(m);
+    auto p = mtod(m, u8*);
+    unsigned total = ETHER_HDR_LEN + sizeof(struct ip) + tcp_hlen + len;
+    memset(p, 0, total - len);
+
+    auto eh = reinterpret_cast<ether_header*>(p);
+    eh->ether_type = htons(ETHERTYPE_IP);
+
+    auto ip = reinterpret_cast<struct ip*>(p + ETHER_HDR_LEN);
+    ip->ip_v = IPVERSION;
+    ip->ip_hl = sizeof(*ip) >> 2;
+    ip->ip_len = htons(sizeof(*ip) + tcp_hlen + len);
+    ip->ip_off = htons(IP_DF);
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_TCP;
+    ip->ip_src.s_addr = htonl(0x0a000002);
+    ip->ip_dst.s_addr = htonl(0x0a000001);
+    ip->ip_sum = htons(~fold(sum16(reinterpret_cast<u8*>(ip), sizeof(*ip))));
+
+    auto th = reinterpret_cast<tcphdr*>(ip + 1);
+    th->th_sport = htons(40000);
+    th->th_dport = htons(80);
+    th->th_seq = tcp_seq(htonl(iss + off));
+    th->th_ack = tcp_seq(htonl(1));
+    th->th_off = tcp_hlen >> 2;
+    th->th_flags = flags;
+    th->th_win = htons(1000);
+    auto ts = reinterpret_cast<u32*>(th + 1);
+    ts[0] = htonl(TCPOPT_NOP << 24 | TCPOPT_NOP << 16 |
+                  TCPOPT_TIMESTAMP << 8 | TCPOLEN_TIMESTAMP);
+    ts[1] = htonl(1 + off / mss);
+    ts[2] = htonl(1);
+
+    auto data = reinterpret_cast<u8*>(th) + tcp_hlen;
+    for (unsigned i = 0; i < len; i++) {
+        data[i] = stream_byte(off + i);
+    }
+    th->th_sum = htons(~tcp_sum(reinterpret_cast<u8*>(ip), tcp_hlen + len));
+
+    m->m_hdr.mh_len = m->M_dat.MH.MH_pkthdr.len = total;
+    m->M_dat.MH.MH_pkthdr.csum_flags = CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+    m->M_dat.MH.MH_pkthdr.csum_data = 0xffff;
+    return m;
+}
+
+// What the interface passed up, checked and flattened
+struct packet {
+    u32 seq;
+    u8 flags;
+    u32 tsval;
+    std::vector<u8> data;
+};
+
+struct receiver {
+    receiver() {
+        ifp = if_alloc(IFT_ETHER);
+        BOOST_REQUIRE(ifp);
+        ifp->if_mtu = ETHERMTU;
+        BOOST_REQUIRE_EQUAL(tcp_lro_init(&lc), 0);
+        lc.ifp = ifp;
+        lc.lro_arg = this;
+        lc.lro_input = [] (lro_ctrl* lc, mbuf* m) {
+            static_cast<receiver*>(lc->lro_arg)->input(m);
+        };
+    }
+    ~receiver() {
+        tcp_lro_free(&lc);
+        if_free(ifp);
+    }
+    // Same as virtio-net's receiver
+    void rx(mbuf* m) {
+        int error = tcp_lro_rx(&lc, m, 0);
+        if (error == TCP_LRO_CANNOT) {
+            tcp_lro_flush_all(&lc);
+        }
+        if (error) {
+            input(m);
+        }
+    }
+    void input(mbuf* m) {
+        std::vector<u8> buf(m->M_dat.MH.MH_pkthdr.len);
+        m_copydata(m, 0, buf.size(), reinterpret_cast<caddr_t>(buf.data()));
+        m_freem(m);
+
+        auto ip_hdr = buf.data() + ETHER_HDR_LEN;
+        auto ip = reinterpret_cast<struct ip*>(ip_hdr);
+        BOOST_REQUIRE_EQUAL(ntohs(ip->ip_len), buf.size() - ETHER_HDR_LEN);
+        BOOST_REQUIRE_EQUAL(fold(sum16(ip_hdr, sizeof(*ip))), 0xffff);
+        unsigned tcp_len = ntohs(ip->ip_len) - sizeof(*ip);
+        BOOST_REQUIRE_EQUAL(tcp_sum(ip_hdr, tcp_len), 0xffff);
+
+        auto th = reinterpret_cast<tcphdr*>(ip + 1);
+        auto ts = reinterpret_cast<u32*>(th + 1);
+        auto data = reinterpret_cast<u8*>(th) + (th->th_off << 2);
+        packets.push_back({ntohl(th->th_seq.raw()) - iss, th->th_flags, ntohl(ts[1]),
+                           std::vector<u8>(data, buf.data() + buf.size())});
+    }
+    // Checks that the packets carry the stream up to len, in order
+    void check_stream(u32 len) {
+        u32 off = 0;
+        for (auto& p : packets) {
+            BOOST_REQUIRE_EQUAL(p.seq, off);
+            std::vector<u8> expected;
+            for (unsigned i = 0; i < p.data.size(); i++) {
+                expected.push_back(stream_byte(off++));
+            }
+            BOOST_REQUIRE(p.data == expected);
+        }
+        BOOST_REQUIRE_EQUAL(off, len);
+    }
+    struct ifnet* ifp;
+    lro_ctrl lc = {};
+    std::vector<packet> packets;
+};
+
+BOOST_AUTO_TEST_CASE(test_in_order_stream)
+{
+    receiver r;
+    const unsigned nsegs = 200;
+    for (unsigned i = 0; i < nsegs; i++) {
+        r.rx(segment(i * mss, mss));
+    }
+    tcp_lro_flush_all(&r.lc);
+
+    r.check_stream(nsegs * mss);
+    BOOST_REQUIRE_EQUAL(r.lc.lro_queued, nsegs);
+    BOOST_REQUIRE_EQUAL(r.lc.lro_flushed, r.packets.size());
+    // merged up to what fits in an IP packet
+    BOOST_REQUIRE_LE(r.packets.size(), nsegs / 40);
+    for (auto& p : r.packets) {
+        BOOST_REQUIRE_LE(sizeof(struct ip) + tcp_hlen + p.data.size(), 65535);
+        // the latest timestamp of the merged segments
+        BOOST_REQUIRE_EQUAL(p.tsval, (p.seq + p.data.size() - 1) / mss + 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_odd_sizes)
+{
+    receiver r;
+    u32 off = 0;
+    for (unsigned len : { 1u, 100u, 1447u, mss, 3u, 777u, mss, 2u }) {
+        r.rx(segment(off, len));
+        off += len;
+    }
+    tcp_lro_flush_all(&r.lc);
+
+    r.check_stream(off);
+    BOOST_REQUIRE_EQUAL(r.packets.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_control_segments_keep_their_place)
+{
+    receiver r;
+    // a retransmission of what we have seen is not merged, and does not
+    // overtake the segments held before it
+    for (unsigned i = 0; i < 3; i++) {
+        r.rx(segment(i * mss, mss));
+    }
+    r.rx(segment(mss, mss));
+    BOOST_REQUIRE_EQUAL(r.packets.size(), 2);
+    BOOST_REQUIRE_EQUAL(r.packets[0].data.size(), 3 * mss);
+    BOOST_REQUIRE_EQUAL(r.packets[1].seq, mss);
+
+    // nor does a FIN
+    r.packets.clear();
+    for (unsigned i = 3; i < 6; i++) {
+        r.rx(segment(i * mss, mss));
+    }
+    r.rx(segment(6 * mss, 10, TH_ACK | TH_FIN));
+    tcp_lro_flush_all(&r.lc);
+    BOOST_REQUIRE_EQUAL(r.packets.size(), 2);
+    BOOST_REQUIRE_EQUAL(r.packets[0].seq, 3 * mss);
+    BOOST_REQUIRE_EQUAL(r.packets[0].data.size(), 3 * mss);
+    BOOST_REQUIRE(!(r.packets[0].flags & TH_FIN));
+    BOOST_REQUIRE_EQUAL(r.packets[1].seq, 6 * mss);
+    BOOST_REQUIRE(r.packets[1].flags & TH_FIN);
+}
@@ -7,6 +7,8 @@
 
 #include <string.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 // This test assures that the "memmove" function works as expected in the various
 // situations it can be used at.
@@ -111,6 +113,25 @@ int main()
         pass_if(buf_tmp, loop_results[i], 16);
     }
 
+    // Overlapping moves either way, of all the sizes memcpy() treats
+    // differently, against a copy through a separate buffer.
+    std::vector<char> buf(8192 + 256), expect(buf.size());
+    for (size_t n = 0; n <= 8192; n += (n < 300 ? 1 : 251)) {
+        for (int off = -70; off <= 70; off++) {
+            for (size_t i = 0; i < buf.size(); i++) {
+                buf[i] = expect[i] = i * 7;
+            }
+            std::vector<char> tmp(&buf[128 + off], &buf[128 + off] + n);
+            std::copy(tmp.begin(), tmp.end(), &expect[128]);
+            memmove(&buf[128], &buf[128 + off], n);
+            if (buf != expect) {
+                std::cerr << "ERROR: memmove of " << n << " bytes from offset "
+                          << off << "\n";
+                exit(1);
+            }
+        }
+    }
+
     std::cerr << "PASSED\n";
     return 0;
 }
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
+#include <vector>
 
 static int tests = 0, fails = 0;
 
@@ -81,6 +82,45 @@ static int check_mapping(void *addr, size_t size, unsigned flags, int fd,
     return 0;
 }
 
+// Mappings of a file share its pages, and read() and write() see them
+static void test_shared_pages(int fd)
+{
+    constexpr size_t size = 3 * 4096;
+    std::vector<char> buf(size, 'a');
+    report(pwrite(fd, buf.data(), size, 0) == ssize_t(size), "fill file");
+    auto prot = PROT_READ | PROT_WRITE;
+    auto s1 = static_cast<char*>(mmap(NULL, size, prot, MAP_SHARED, fd, 0));
+    auto s2 = static_cast<char*>(mmap(NULL, size, prot, MAP_SHARED, fd, 0));
+    auto p1 = static_cast<char*>(mmap(NULL, size, prot, MAP_PRIVATE, fd, 0));
+    auto p2 = static_cast<char*>(mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    report(s1 != MAP_FAILED && s2 != MAP_FAILED && p1 != MAP_FAILED && p2 != MAP_FAILED,
+           "map the file four times");
+
+    s1[1] = 'b';
+    report(s2[1] == 'b', "store through one shared mapping is seen by another");
+    char c = 0;
+    report(pread(fd, &c, 1, 1) == 1 && c == 'b', "store through a shared mapping is seen by read()");
+    report(p1[1] == 'b' && p2[1] == 'b', "and by private mappings not written to");
+    report(pwrite(fd, "c", 1, 4096) == 1 && s1[4096] == 'c' && p1[4096] == 'c',
+           "write() is seen through the mappings");
+
+    p1[4096] = 'd';
+    report(s1[4096] == 'c' && p2[4096] == 'c' && pread(fd, &c, 1, 4096) == 1 && c == 'c',
+           "store through a private mapping is not seen by others");
+    report(pwrite(fd, "e", 1, 4097) == 1 && p1[4097] == 'a' && s2[4097] == 'e',
+           "a private copy no longer sees write()");
+    report(mprotect(p2, size, prot) == 0, "mprotect private mapping writable");
+    p2[2 * 4096] = 'f';
+    report(s1[2 * 4096] == 'a' && p1[2 * 4096] == 'a', "and a store to it is still private");
+
+    report(ftruncate(fd, 4096) == 0 && s1[4096] == 0, "truncate clears mapped pages past the end");
+    report(munmap(s1, size) == 0 && munmap(s2, size) == 0 &&
+           munmap(p1, size) == 0 && munmap(p2, size) == 0, "munmap");
+    struct stat st;
+    report(fstat(fd, &st) == 0 && st.st_size == 4096, "unmapping doesn't grow the file back");
+    report(pread(fd, &c, 1, 1) == 1 && c == 'b', "data is still there after unmapping");
+}
+
 int main(int argc, char *argv[])
 {
     auto fd = open("/tmp/mmap-file-test", O_CREAT|O_TRUNC|O_RDWR, 0666);
@@ -116,6 +156,8 @@ int main(int argc, char *argv[])
     report(check_mapping(aligned_addr, size, MAP_SHARED | MAP_FIXED, fd, 0, 0) == 0,
         "passed an aligned addr and MAP_FIXED, then mmap should return exactly the specified addr.");
 
+    test_shared_pages(fd);
+
     report(close(fd) == 0, "close");
 
     fd = open("/tmp/mmap-file-test", O_WRONLY);
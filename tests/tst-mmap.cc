@@ -7,14 +7,19 @@
 
 #ifdef __OSV__
 #include <osv/sched.hh>
+#include <osv/barrier.hh>
 #endif
 
 #include <sys/mman.h>
 #include <signal.h>
 
+#include <unistd.h>
+
 #include <iostream>
 #include <cassert>
 #include <cstdlib>
+#include <atomic>
+#include <vector>
 
 static bool segv_received = false;
 static void segv_handler(int sig, siginfo_t *si, void *unused)
@@ -200,6 +205,92 @@ int main(int argc, char **argv)
     delete t1; // also join()s the thread
     delete t2;
     munmap(buf, 4096);
+
+    // Again, but with t1 spinning instead of sleeping: then its cpu is not
+    // idle, and must be interrupted to flush (an idle one flushes lazily,
+    // when it starts running a thread again).
+    state.store(0);
+    buf = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    assert(buf != MAP_FAILED);
+    t1 = new sched::thread([&]{
+        *(char*)buf = 0;
+        state.store(1);
+        while (state.load() != 2) {
+            *(volatile char*)buf;
+        }
+        assert(!try_write(buf));
+    }, sched::thread::attr().pin(sched::cpus[0]));
+    t2 = new sched::thread([&]{
+        while (state.load() != 1) {
+        }
+        mprotect(buf, 4096, PROT_READ);
+        state.store(2);
+    }, sched::thread::attr().pin(sched::cpus[1]));
+    t1->start();
+    t2->start();
+    delete t1;
+    delete t2;
+    munmap(buf, 4096);
+
+    // Two cpus keep replacing a page each, while the other cpus read them
+    // and go idle and back at random; a read after a replacement must never
+    // see the old page, whether its cpu got the flush IPI, was skipped as
+    // idle, or both, by different flushes.
+    if (sched::cpus.size() >= 3) {
+        const int rounds = 2000;
+        void* pages[2];
+        std::atomic<int> done[2];
+        for (int k = 0; k < 2; k++) {
+            pages[k] = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+            assert(pages[k] != MAP_FAILED);
+            done[k].store(0);
+        }
+        std::vector<sched::thread*> threads;
+        for (int k = 0; k < 2; k++) {
+            threads.push_back(new sched::thread([&, k] {
+                for (int r = 1; r <= rounds; r++) {
+                    *(volatile int*)pages[k] = r;
+                    for (int i = 0; i < r % 64 * 10; i++) {
+                        barrier();
+                    }
+                    // replacing the mapping unmaps, and flushes, the old page
+                    void* p = mmap(pages[k], 4096, PROT_READ|PROT_WRITE,
+                            MAP_ANONYMOUS|MAP_PRIVATE|MAP_FIXED, -1, 0);
+                    assert(p == pages[k]);
+                    done[k].store(r);
+                }
+            }, sched::thread::attr().pin(sched::cpus[k])));
+        }
+        for (unsigned c = 2; c < sched::cpus.size(); c++) {
+            threads.push_back(new sched::thread([&, c] {
+                unsigned seed = c;
+                while (done[0].load() < rounds || done[1].load() < rounds) {
+                    for (int k = 0; k < 2; k++) {
+                        // fill the TLB
+                        *(volatile int*)pages[k];
+                    }
+                    seed = seed * 1103515245 + 12345;
+                    if (seed & 0x10000) {
+                        usleep(seed % 50);
+                    }
+                    for (int k = 0; k < 2; k++) {
+                        int d = done[k].load();
+                        int v = *(volatile int*)pages[k];
+                        // only later rounds write to the new page
+                        assert(v == 0 || v > d);
+                    }
+                }
+            }, sched::thread::attr().pin(sched::cpus[c])));
+        }
+        for (auto t : threads) {
+            t->start();
+        }
+        for (auto t : threads) {
+            delete t;
+        }
+        munmap(pages[0], 4096);
+        munmap(pages[1], 4096);
+    }
 #endif
 
     // Test that mprotect() only hides memory, doesn't free it
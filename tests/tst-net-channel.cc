@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests which channel the classifier steers TCP and UDP packets, over IPv4
+// and IPv6, to, and that UDP sockets receive through their channels.
+
+#define BOOST_TEST_MODULE tst-net-channel
+
+#include <osv/net_channel.hh>
+#include <bsd/porting/netport.h>
+#include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/net/ethernet.h>
+#include <bsd/sys/net/if.h>
+#include <bsd/sys/net/if_var.h>
+#include <bsd/sys/net/if_types.h>
+#include <bsd/sys/netinet/ip.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/udp.h>
+#include <bsd/machine/in_cksum.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include <boost/test/unit_test.hpp>
+
+static const u8 local_mac[ETHER_ADDR_LEN] = { 0x52, 0x54, 0, 0x12, 0x34, 0x56 };
+static const u8 broadcast_mac[ETHER_ADDR_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static in_addr addr4(const char* a)
+{
+    unsigned b[4];
+    BOOST_REQUIRE_EQUAL(sscanf(a, "%u.%u.%u.%u", &b[0], &b[1], &b[2], &b[3]), 4);
+    in_addr ret;
+    ret.s_addr = htonl(b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]);
+    return ret;
+}
+
+static std::vector<u8> addr6(u8 last)
+{
+    // fd00::last
+    std::vector<u8> a(16);
+    a[0] = 0xfd;
+    a[15] = last;
+    return a;
+}
+
+// Builds an Ethernet frame carrying a TCP or UDP header and no payload
+static mbuf* frame(u8 proto, u8 tcp_flags, in_port_t sport, in_port_t dport,
+        const std::function<unsigned (u8*, unsigned)>& ip_header,
+        u16 ether_type, const u8* dest_mac = local_mac)
+{
+    auto m = m_gethdr(M_NOWAIT, MT_DATA);
+    BOOST_REQUIRE(m);
+    auto p = mtod(m, u8*);
+    auto eh = reinterpret_cast<ether_header*>(p);
+    memcpy(eh->ether_dhost, dest_mac, ETHER_ADDR_LEN);
+    memset(eh->ether_shost, 0, ETHER_ADDR_LEN);
+    eh->ether_type = htons(ether_type);
+    unsigned len = ETHER_HDR_LEN;
+    unsigned l4_len = proto == IPPROTO_TCP ? sizeof(tcphdr) : sizeof(udphdr);
+    len += ip_header(p + len, l4_len);
+    if (proto == IPPROTO_TCP) {
+        auto th = reinterpret_cast<tcphdr*>(p + len);
+        memset(th, 0, sizeof(*th));
+        th->th_sport = htons(sport);
+        th->th_dport = htons(dport);
+        th->th_off = sizeof(*th) >> 2;
+        th->th_flags = tcp_flags;
+    } else {
+        auto uh = reinterpret_cast<udphdr*>(p + len);
+        memset(uh, 0, sizeof(*uh));
+        uh->uh_sport = htons(sport);
+        uh->uh_dport = htons(dport);
+        uh->uh_ulen = htons(sizeof(*uh));
+    }
+    len += l4_len;
+    m->m_hdr.mh_len = m->M_dat.MH.MH_pkthdr.len = len;
+    return m;
+}
+
+static mbuf* frame4(u8 proto, const char* src, in_port_t sport,
+        const char* dst, in_port_t dport, u8 tcp_flags = TH_ACK,
+        const u8* dest_mac = local_mac)
+{
+    return frame(proto, tcp_flags, sport, dport, [=] (u8* p, unsigned l4_len) {
+        auto ip = reinterpret_cast<struct ip*>(p);
+        memset(ip, 0, sizeof(*ip));
+        ip->ip_v = IPVERSION;
+        ip->ip_hl = sizeof(*ip) >> 2;
+        ip->ip_len = htons(sizeof(*ip) + l4_len);
+        ip->ip_off = htons(IP_DF);
+        ip->ip_ttl = 64;
+        ip->ip_p = proto;
+        ip->ip_src = addr4(src);
+        ip->ip_dst = addr4(dst);
+        return unsigned(sizeof(*ip));
+    }, ETHERTYPE_IP, dest_mac);
+}
+
+static mbuf* frame6(u8 proto, u8 src, in_port_t sport, u8 dst, in_port_t dport,
+        u8 tcp_flags = TH_ACK)
+{
+    return frame(proto, tcp_flags, sport, dport, [=] (u8* p, unsigned l4_len) {
+        memset(p, 0, 40);
+        p[0] = 6 << 4;
+        p[4] = l4_len >> 8;
+        p[5] = l4_len;
+        p[6] = proto;
+        p[7] = 64;
+        memcpy(p + 8, addr6(src).data(), 16);
+        memcpy(p + 24, addr6(dst).data(), 16);
+        return 40u;
+    }, ETHERTYPE_IPV6);
+}
+
+// A channel counting the packets it was given
+struct counting_channel {
+    counting_channel() : nc([this] (mbuf* m) { ++count; m_freem(m); }, true) {}
+    unsigned take() {
+        nc.process_queue();
+        auto ret = count;
+        count = 0;
+        return ret;
+    }
+    unsigned count = 0;
+    net_channel nc;
+};
+
+// Posts the packet, and tells which of the channels got it, if any
+static int post(classifier& cls, mbuf* m, std::vector<counting_channel*> chans)
+{
+    if (!cls.post_packet(m)) {
+        m_freem(m);
+        for (auto c : chans) {
+            BOOST_REQUIRE_EQUAL(c->take(), 0);
+        }
+        return -1;
+    }
+    int ret = -1;
+    for (unsigned i = 0; i < chans.size(); i++) {
+        if (chans[i]->take()) {
+            BOOST_REQUIRE_EQUAL(ret, -1);
+            ret = i;
+        }
+    }
+    BOOST_REQUIRE(ret != -1);
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(test_tcp_ipv4)
+{
+    classifier cls;
+    counting_channel c;
+    flow_key key(IPPROTO_TCP, addr4("10.0.0.2"), addr4("10.0.0.1"), 40000, 80);
+    BOOST_REQUIRE(cls.add(key, &c.nc));
+    BOOST_REQUIRE(!cls.add(key, &c.nc));
+
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_TCP, "10.0.0.2", 40000, "10.0.0.1", 80), {&c}), 0);
+    // another peer, or port
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_TCP, "10.0.0.3", 40000, "10.0.0.1", 80), {&c}), -1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_TCP, "10.0.0.2", 40001, "10.0.0.1", 80), {&c}), -1);
+    // control segments take the slow path
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_TCP, "10.0.0.2", 40000, "10.0.0.1", 80, TH_FIN | TH_ACK), {&c}), -1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_TCP, "10.0.0.2", 40000, "10.0.0.1", 80, TH_RST), {&c}), -1);
+    // TCP has no wildcards
+    flow_key listen(IPPROTO_TCP, in_addr{INADDR_ANY}, in_addr{INADDR_ANY}, 0, 81);
+    counting_channel l;
+    BOOST_REQUIRE(cls.add(listen, &l.nc));
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_TCP, "10.0.0.2", 40000, "10.0.0.1", 81), {&c, &l}), -1);
+
+    cls.remove(key);
+    cls.remove(listen);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_TCP, "10.0.0.2", 40000, "10.0.0.1", 80), {&c}), -1);
+}
+
+BOOST_AUTO_TEST_CASE(test_udp_ipv4)
+{
+    classifier cls;
+    counting_channel any, bound, connected;
+    flow_key any_key(IPPROTO_UDP, in_addr{INADDR_ANY}, in_addr{INADDR_ANY}, 0, 53);
+    flow_key bound_key(IPPROTO_UDP, in_addr{INADDR_ANY}, addr4("10.0.0.1"), 0, 53);
+    flow_key connected_key(IPPROTO_UDP, addr4("10.0.0.2"), addr4("10.0.0.1"), 5000, 53);
+    std::vector<counting_channel*> all{&any, &bound, &connected};
+
+    BOOST_REQUIRE(cls.add(any_key, &any.nc));
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.1", 53), all), 0);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.3", 5000, "10.0.1.1", 53), all), 0);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.1", 54), all), -1);
+
+    // the most specific socket wins
+    BOOST_REQUIRE(cls.add(bound_key, &bound.nc));
+    BOOST_REQUIRE(cls.add(connected_key, &connected.nc));
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.1", 53), all), 2);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5001, "10.0.0.1", 53), all), 1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.3", 5000, "10.0.0.1", 53), all), 1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.1.1", 53), all), 0);
+
+    // datagrams which may be for more than one socket take the slow path
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "224.0.0.251", 53), all), -1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "255.255.255.255", 53, 0, broadcast_mac), all), -1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.255", 53, 0, broadcast_mac), all), -1);
+
+    // and so do fragments
+    auto m = frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.1", 53);
+    auto iph = reinterpret_cast<struct ip*>(mtod(m, u8*) + ETHER_HDR_LEN);
+    iph->ip_off = htons(IP_MF);
+    BOOST_REQUIRE_EQUAL(post(cls, m, all), -1);
+
+    cls.remove(connected_key);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.1", 53), all), 1);
+    cls.remove(bound_key);
+    cls.remove(any_key);
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.1", 53), all), -1);
+}
+
+BOOST_AUTO_TEST_CASE(test_ipv6)
+{
+    classifier cls;
+    counting_channel tcp, udp;
+    std::vector<counting_channel*> all{&tcp, &udp};
+    flow_key tcp_key(IPPROTO_TCP, addr6(2).data(), addr6(1).data(), 40000, 80);
+    std::vector<u8> any6(16);
+    flow_key udp_key(IPPROTO_UDP, any6.data(), addr6(1).data(), 0, 53);
+    BOOST_REQUIRE(cls.add(tcp_key, &tcp.nc));
+    BOOST_REQUIRE(cls.add(udp_key, &udp.nc));
+
+    BOOST_REQUIRE_EQUAL(post(cls, frame6(IPPROTO_TCP, 2, 40000, 1, 80), all), 0);
+    BOOST_REQUIRE_EQUAL(post(cls, frame6(IPPROTO_TCP, 2, 40000, 1, 80, TH_SYN), all), -1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame6(IPPROTO_UDP, 2, 5000, 1, 53), all), 1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame6(IPPROTO_UDP, 3, 5001, 1, 53), all), 1);
+    BOOST_REQUIRE_EQUAL(post(cls, frame6(IPPROTO_UDP, 2, 5000, 4, 53), all), -1);
+    // the IPv4 flow with the same ports is a different one
+    BOOST_REQUIRE_EQUAL(post(cls, frame4(IPPROTO_UDP, "10.0.0.2", 5000, "10.0.0.1", 53), all), -1);
+
+    cls.remove(tcp_key);
+    cls.remove(udp_key);
+}
+
+// An interface of our own, attached to the stack, to post frames to
+struct test_interface {
+    test_interface() {
+        ifp = if_alloc(IFT_ETHER);
+        BOOST_REQUIRE(ifp);
+        if_initname(ifp, "tstnc", 0);
+        ifp->if_mtu = ETHERMTU;
+        ether_ifattach(ifp, local_mac);
+    }
+    ~test_interface() {
+        ether_ifdetach(ifp);
+        if_free(ifp);
+    }
+    // Posts a datagram to 10.0.0.1, telling whether it took the fast path
+    bool post(const char* src, in_port_t sport, in_port_t dport, std::string data) {
+        auto m = frame4(IPPROTO_UDP, src, sport, "10.0.0.1", dport);
+        BOOST_REQUIRE(m_append(m, data.size(), data.c_str()));
+        auto p = mtod(m, u8*) + ETHER_HDR_LEN;
+        auto iph = reinterpret_cast<struct ip*>(p);
+        iph->ip_len = htons(ntohs(iph->ip_len) + data.size());
+        iph->ip_sum = in_cksum_hdr(iph);
+        auto uh = reinterpret_cast<udphdr*>(p + sizeof(*iph));
+        uh->uh_ulen = htons(sizeof(*uh) + data.size());
+        m->M_dat.MH.MH_pkthdr.rcvif = ifp;
+        if (ifp->if_classifier.post_packet(m)) {
+            return true;
+        }
+        m_freem(m);
+        return false;
+    }
+    struct ifnet* ifp;
+};
+
+static int udp_socket(in_port_t port, bool reuse = false)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    BOOST_REQUIRE(s >= 0);
+    int one = 1;
+    if (reuse) {
+        BOOST_REQUIRE_EQUAL(setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)), 0);
+    }
+    timeval tv = { 1, 0 };
+    BOOST_REQUIRE_EQUAL(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)), 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    BOOST_REQUIRE_EQUAL(bind(s, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)), 0);
+    return s;
+}
+
+static std::string receive(int s, const char* src, in_port_t sport)
+{
+    char buf[100];
+    sockaddr_in from;
+    socklen_t len = sizeof(from);
+    auto n = recvfrom(s, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+    BOOST_REQUIRE(n >= 0);
+    BOOST_REQUIRE_EQUAL(from.sin_addr.s_addr, addr4(src).s_addr);
+    BOOST_REQUIRE_EQUAL(ntohs(from.sin_port), sport);
+    return std::string(buf, n);
+}
+
+BOOST_AUTO_TEST_CASE(test_udp_socket)
+{
+    // bound before the interface attaches, and after
+    int before = udp_socket(5301);
+    test_interface intf;
+    int after = udp_socket(5302);
+
+    BOOST_REQUIRE(intf.post("10.0.0.2", 5000, 5301, "first"));
+    BOOST_REQUIRE(intf.post("10.0.0.3", 5001, 5301, "second"));
+    BOOST_REQUIRE(intf.post("10.0.0.2", 5000, 5302, "third"));
+    BOOST_REQUIRE_EQUAL(receive(before, "10.0.0.2", 5000), "first");
+    BOOST_REQUIRE_EQUAL(receive(before, "10.0.0.3", 5001), "second");
+    BOOST_REQUIRE_EQUAL(receive(after, "10.0.0.2", 5000), "third");
+    BOOST_REQUIRE(!intf.post("10.0.0.2", 5000, 5303, "nobody"));
+
+    // sockets sharing their port leave the choice to udp_input()
+    int reuse = udp_socket(5303, true);
+    BOOST_REQUIRE(!intf.post("10.0.0.2", 5000, 5303, "shared"));
+
+    // closing takes the socket's channel off the interface
+    close(before);
+    BOOST_REQUIRE(!intf.post("10.0.0.2", 5000, 5301, "closed"));
+    BOOST_REQUIRE(intf.post("10.0.0.2", 5000, 5302, "open"));
+    BOOST_REQUIRE_EQUAL(receive(after, "10.0.0.2", 5000), "open");
+    close(after);
+    BOOST_REQUIRE(!intf.post("10.0.0.2", 5000, 5302, "closed"));
+    close(reuse);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests ramfs file data handling: large and sparse files, truncation, and
+// MAP_SHARED mappings, which map the file's own pages.  Mounts a ramfs of
+// its own, as the root filesystem may be ZFS.
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <vector>
+
+extern "C" {
+    int sys_mount(char *dev, char *dir, char *fsname, int flags, void *data);
+    int sys_umount(const char *path);
+}
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg);
+}
+
+static char pattern(size_t off)
+{
+    return off * 7 + (off >> 12);
+}
+
+static bool check_read(int fd, off_t off, size_t len, bool zero)
+{
+    std::vector<char> buf(len);
+    if (pread(fd, buf.data(), len, off) != ssize_t(len)) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != (zero ? 0 : pattern(off + i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/tst-ramfs";
+    char fstype[] = "ramfs";
+    char dev[] = "";
+    mkdir(dir, 0755);
+    report(sys_mount(dev, dir, fstype, 0, nullptr) == 0, "mount ramfs");
+
+    auto fd = open("/tmp/tst-ramfs/file", O_CREAT|O_TRUNC|O_RDWR, 0666);
+    report(fd >= 0, "open");
+
+    // Append in odd-sized chunks, so that writes straddle pages
+    const size_t size = 16 << 20, chunk = 10000;
+    std::vector<char> buf(chunk);
+    bool ok = true;
+    for (size_t off = 0; off < size; off += chunk) {
+        size_t n = std::min(chunk, size - off);
+        for (size_t i = 0; i < n; i++) {
+            buf[i] = pattern(off + i);
+        }
+        ok &= write(fd, buf.data(), n) == ssize_t(n);
+    }
+    report(ok, "write a large file");
+    report(check_read(fd, 0, size, false), "read it back");
+
+    struct stat st;
+    report(fstat(fd, &st) == 0 && st.st_size == off_t(size), "file size");
+
+    // Shrinking and growing again must not bring old data back
+    report(ftruncate(fd, 5000) == 0, "truncate to a partial page");
+    report(ftruncate(fd, 3 * 4096) == 0, "grow it again");
+    report(check_read(fd, 0, 5000, false) && check_read(fd, 5000, 3 * 4096 - 5000, true),
+           "grown part reads as zeroes");
+
+    // A write far past the end leaves a hole
+    const off_t far = 100 << 20;
+    report(pwrite(fd, "x", 1, far) == 1, "write past the end");
+    report(check_read(fd, 3 * 4096, 4096, true), "hole reads as zeroes");
+
+    // MAP_SHARED maps the file itself
+    report(ftruncate(fd, 2 * 4096) == 0, "truncate for mmap");
+    auto p = static_cast<char*>(mmap(nullptr, 2 * 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    report(p != MAP_FAILED, "mmap MAP_SHARED");
+    p[4096 + 1] = 'a';
+    char c = 0;
+    report(pread(fd, &c, 1, 4096 + 1) == 1 && c == 'a', "store through mapping is seen by read()");
+    report(pwrite(fd, "b", 1, 2) == 1 && p[2] == 'b', "write() is seen through mapping");
+    report(msync(p, 2 * 4096, MS_SYNC) == 0, "msync");
+
+    // Truncating under a mapping must not free pages that are mapped
+    report(ftruncate(fd, 0) == 0, "truncate while mapped");
+    p[4096 + 2] = 'c';
+    report(munmap(p, 2 * 4096) == 0, "munmap");
+
+    // Stores past the end of the file, in its last page or in pages after
+    // it, are not file data: growing the file must not bring them in
+    report(ftruncate(fd, 100) == 0, "truncate to part of a page");
+    p = static_cast<char*>(mmap(nullptr, 3 * 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    report(p != MAP_FAILED, "mmap past the end");
+    p[200] = 'd';
+    p[4096 + 5] = 'e';
+    p[2 * 4096 + 5] = 'f';
+    report(munmap(p, 3 * 4096) == 0, "munmap");
+    report(ftruncate(fd, 3 * 4096) == 0, "grow over the stores");
+    report(check_read(fd, 100, 3 * 4096 - 100, true), "grown part reads as zeroes");
+
+    report(ftruncate(fd, 100) == 0, "truncate to part of a page");
+    p = static_cast<char*>(mmap(nullptr, 3 * 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
+    report(p != MAP_FAILED, "mmap past the end");
+    p[200] = 'g';
+    p[4096 + 5] = 'h';
+    report(munmap(p, 3 * 4096) == 0, "munmap");
+    report(pwrite(fd, "x", 1, 2 * 4096) == 1, "write after the stores");
+    report(check_read(fd, 100, 2 * 4096 - 100, true), "gap before the write reads as zeroes");
+
+    report(close(fd) == 0, "close");
+    report(unlink("/tmp/tst-ramfs/file") == 0, "unlink");
+    report(sys_umount(dir) == 0, "umount ramfs");
+    rmdir(dir);
+
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
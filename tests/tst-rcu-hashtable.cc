@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests osv::rcu_hashtable, including lookups racing with updates and resizes.
+
+#define BOOST_TEST_MODULE tst-rcu-hashtable
+
+#include <osv/rcu-hashtable.hh>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using table = osv::rcu_hashtable<unsigned, unsigned>;
+
+static bool lookup(table& t, unsigned key, unsigned& value)
+{
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto v = t.lookup(key);
+        if (!v) {
+            return false;
+        }
+        value = *v;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(test_insert_erase)
+{
+    table t;
+    unsigned v;
+    BOOST_REQUIRE(!lookup(t, 1, v));
+    BOOST_REQUIRE(t.insert(1, 10));
+    BOOST_REQUIRE(!t.insert(1, 11));
+    BOOST_REQUIRE(lookup(t, 1, v) && v == 10);
+    BOOST_REQUIRE(t.erase(1));
+    BOOST_REQUIRE(!t.erase(1));
+    BOOST_REQUIRE(!lookup(t, 1, v));
+    BOOST_REQUIRE_EQUAL(t.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_resize)
+{
+    table t;
+    const unsigned n = 100000;
+    // grow
+    for (unsigned i = 0; i < n; i++) {
+        BOOST_REQUIRE(t.insert(i, i * 2));
+    }
+    BOOST_REQUIRE_EQUAL(t.size(), n);
+    for (unsigned i = 0; i < n; i++) {
+        unsigned v;
+        BOOST_REQUIRE(lookup(t, i, v) && v == i * 2);
+    }
+    // and shrink back
+    for (unsigned i = 0; i < n; i += 2) {
+        BOOST_REQUIRE(t.erase(i));
+    }
+    for (unsigned i = 1; i < n; i += 2) {
+        BOOST_REQUIRE(t.erase(i));
+    }
+    BOOST_REQUIRE_EQUAL(t.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_lookup)
+{
+    table t;
+    // Keys below stable are always there; the writer churns the others
+    const unsigned stable = 1000, churn = 50000;
+    for (unsigned i = 0; i < stable; i++) {
+        t.insert(i, i);
+    }
+    std::atomic<bool> done(false);
+    std::atomic<unsigned> errors(0);
+    std::thread reader([&] {
+        while (!done.load()) {
+            for (unsigned i = 0; i < stable; i++) {
+                unsigned v;
+                if (!lookup(t, i, v) || v != i) {
+                    errors++;
+                }
+            }
+        }
+    });
+    for (int round = 0; round < 4; round++) {
+        for (unsigned i = stable; i < stable + churn; i++) {
+            t.insert(i, i);
+        }
+        for (unsigned i = stable; i < stable + churn; i++) {
+            t.erase(i);
+        }
+    }
+    done.store(true);
+    reader.join();
+    BOOST_REQUIRE_EQUAL(errors.load(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_updates)
+{
+    table t;
+    // Writers update disjoint keys, in all stripes, racing with each
+    // other's resizes
+    const unsigned writers = 4, keys = 20000;
+    std::atomic<unsigned> errors(0);
+    std::vector<std::thread> threads;
+    for (unsigned w = 0; w < writers; w++) {
+        threads.emplace_back([&, w] {
+            for (int round = 0; round < 4; round++) {
+                for (unsigned i = w; i < keys * writers; i += writers) {
+                    if (!t.insert(i, i)) {
+                        errors++;
+                    }
+                }
+                for (unsigned i = w; i < keys * writers; i += writers) {
+                    unsigned v;
+                    if (!lookup(t, i, v) || v != i) {
+                        errors++;
+                    }
+                }
+                for (unsigned i = w; i < keys * writers; i += writers) {
+                    if (!t.erase(i)) {
+                        errors++;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    BOOST_REQUIRE_EQUAL(errors.load(), 0);
+    BOOST_REQUIRE_EQUAL(t.size(), 0);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Sends UDP datagrams gathered from odd-sized pieces over loopback, with
+// its checksum offload turned off, so that the sender computes the
+// checksum from the sum taken while copying the data in, and the receiver
+// checks it in software and drops the datagram if it is wrong.
+
+#define BOOST_TEST_MODULE tst-udp-cksum
+
+#include <bsd/porting/netport.h>
+#include <bsd/sys/net/if.h>
+#include <bsd/sys/net/if_var.h>
+#include <bsd/sys/netinet/in.h>
+#include <bsd/sys/netinet/ip_var.h>
+#include <bsd/sys/netinet/udp.h>
+#include <bsd/sys/netinet/udp_var.h>
+#include <osv/ioctl.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+// Turns the checksum offload of the loopback interface off, for a scope
+class no_loopback_csum {
+public:
+    no_loopback_csum() {
+        _ifp = ifunit_ref("lo0");
+        BOOST_REQUIRE(_ifp);
+        _saved = _ifp->if_capenable;
+        set_caps(_saved & ~(IFCAP_TXCSUM | IFCAP_RXCSUM));
+        BOOST_REQUIRE_EQUAL(_ifp->if_hwassist & CSUM_UDP, 0);
+    }
+    ~no_loopback_csum() {
+        set_caps(_saved);
+        if_rele(_ifp);
+    }
+private:
+    void set_caps(int caps) {
+        struct bsd_ifreq ifr = {};
+        ifr.ifr_reqcap = caps;
+        BOOST_REQUIRE_EQUAL((*_ifp->if_ioctl)(_ifp, SIOCSIFCAP, (caddr_t)&ifr), 0);
+    }
+    struct ifnet* _ifp;
+    int _saved;
+};
+
+static int udp_socket(sockaddr_in& addr)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    BOOST_REQUIRE(s >= 0);
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    BOOST_REQUIRE_EQUAL(bind(s, (sockaddr*)&addr, sizeof(addr)), 0);
+    socklen_t len = sizeof(addr);
+    BOOST_REQUIRE_EQUAL(getsockname(s, (sockaddr*)&addr, &len), 0);
+    int size = 64 << 10;
+    BOOST_REQUIRE_EQUAL(setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)), 0);
+    BOOST_REQUIRE_EQUAL(setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)), 0);
+    timeval tv = { 1, 0 };
+    BOOST_REQUIRE_EQUAL(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)), 0);
+    return s;
+}
+
+BOOST_AUTO_TEST_CASE(test_odd_iovecs)
+{
+    no_loopback_csum no_csum;
+    sockaddr_in from, to;
+    int tx = udp_socket(from);
+    int rx = udp_socket(to);
+    auto badsum = V_udpstat.udps_badsum;
+
+    // Pieces starting at odd offsets of the datagram, and of the mbufs
+    // they are copied into; the last ones need IP fragments.
+    std::vector<std::vector<size_t>> layouts = {
+        { 1 },
+        { 2, 1 },
+        { 1, 2, 3 },
+        { 3, 5, 7, 11, 13 },
+        { 7, 1000, 33, 1 },
+        { 1, 1471, 2049, 3 },
+        { 4095, 1, 8191 },
+        { 1, 5000, 3, 9001 },
+        { 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 30001 },
+    };
+    for (auto& layout : layouts) {
+        std::vector<std::vector<char>> pieces;
+        std::vector<char> expected;
+        std::vector<iovec> iov;
+        for (auto len : layout) {
+            std::vector<char> piece(len);
+            for (auto& c : piece) {
+                c = rand();
+            }
+            expected.insert(expected.end(), piece.begin(), piece.end());
+            pieces.push_back(std::move(piece));
+            iov.push_back({ pieces.back().data(), len });
+        }
+
+        msghdr msg = {};
+        msg.msg_name = &to;
+        msg.msg_namelen = sizeof(to);
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+        BOOST_REQUIRE_EQUAL(sendmsg(tx, &msg, 0), expected.size());
+
+        std::vector<char> received(expected.size() + 1);
+        auto n = recv(rx, received.data(), received.size(), 0);
+        BOOST_REQUIRE_MESSAGE(n >= 0, "datagram of " << expected.size() << " bytes lost");
+        received.resize(n);
+        BOOST_REQUIRE(received == expected);
+    }
+    BOOST_REQUIRE_EQUAL(V_udpstat.udps_badsum, badsum);
+
+    close(tx);
+    close(rx);
+}
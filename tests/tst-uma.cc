@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests the zone allocator of the BSD code: items are initialized once and
+// then cached, limits are enforced, and waiters at the limit are woken.
+
+#define BOOST_TEST_MODULE tst-uma
+
+#include <bsd/porting/netport.h>
+#include <bsd/porting/uma_stub.h>
+#include <osv/sched.hh>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+static std::atomic<int> inits, finis, ctors, dtors;
+
+static int item_init(void* mem, int size, int flags)
+{
+    inits++;
+    return 0;
+}
+
+static void item_fini(void* mem, int size)
+{
+    finis++;
+}
+
+static int item_ctor(void* mem, int size, void* arg, int flags)
+{
+    ctors++;
+    return 0;
+}
+
+static void item_dtor(void* mem, int size, void* arg)
+{
+    dtors++;
+}
+
+static uma_zone_t create_zone()
+{
+    inits = finis = ctors = dtors = 0;
+    return uma_zcreate("tst-uma", 100, item_ctor, item_dtor,
+                       item_init, item_fini, UMA_ALIGN_PTR, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_caching)
+{
+    auto zone = create_zone();
+    std::vector<void*> items;
+    for (int i = 0; i < 1000; i++) {
+        items.push_back(uma_zalloc(zone, M_NOWAIT));
+        BOOST_REQUIRE(items.back());
+    }
+    for (auto item : items) {
+        uma_zfree(zone, item);
+    }
+    items.clear();
+    for (int i = 0; i < 1000; i++) {
+        items.push_back(uma_zalloc(zone, M_NOWAIT));
+    }
+    // constructed each time, but initialized only when first allocated
+    BOOST_REQUIRE_EQUAL(ctors, 2000);
+    BOOST_REQUIRE_EQUAL(inits, 1000);
+    BOOST_REQUIRE_EQUAL(finis, 0);
+    for (auto item : items) {
+        uma_zfree(zone, item);
+    }
+    BOOST_REQUIRE_EQUAL(dtors, 2000);
+    zone_drain(zone);
+    BOOST_REQUIRE(finis > 0);
+    uma_zdestroy(zone);
+    BOOST_REQUIRE_EQUAL(finis, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(test_limit)
+{
+    const int max = 16 * sched::cpus.size();
+    auto zone = create_zone();
+    uma_zone_set_max(zone, max);
+    std::vector<void*> items;
+    for (int i = 0; i < max; i++) {
+        items.push_back(uma_zalloc(zone, M_NOWAIT));
+        BOOST_REQUIRE(items.back());
+    }
+    BOOST_REQUIRE(uma_zone_exhausted(zone));
+    BOOST_REQUIRE(!uma_zalloc(zone, M_NOWAIT));
+
+    // a free item can be allocated again
+    uma_zfree(zone, items.back());
+    items.back() = uma_zalloc(zone, M_NOWAIT);
+    BOOST_REQUIRE(items.back());
+
+    // a waiter at the limit is woken by a free
+    std::atomic<void*> got(nullptr);
+    std::thread waiter([&] { got = uma_zalloc(zone, M_WAITOK); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BOOST_REQUIRE(!got);
+    uma_zfree(zone, items.back());
+    items.pop_back();
+    waiter.join();
+    BOOST_REQUIRE(got);
+    items.push_back(got);
+
+    std::ifstream f("/proc/uma");
+    std::stringstream stats;
+    stats << f.rdbuf();
+    BOOST_REQUIRE(stats.str().find("tst-uma") != std::string::npos);
+
+    for (auto item : items) {
+        uma_zfree(zone, item);
+    }
+    uma_zdestroy(zone);
+    BOOST_REQUIRE_EQUAL(finis, inits);
+}
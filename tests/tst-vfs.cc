@@ -14,6 +14,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <vector>
 #include <boost/test/unit_test.hpp>
 
 #include <osv/dentry.h>
@@ -98,3 +100,55 @@ BOOST_AUTO_TEST_CASE(test_concurrent_file_operations)
 
     debug("concurrent file operation tests succeeded\n");
 }
+
+BOOST_AUTO_TEST_CASE(test_negative_dentries)
+{
+    TempDir dir;
+
+    // Each failed lookup is remembered; whatever creates the path must
+    // make it visible again.
+    assert_stat_error(dir / "file", ENOENT);
+    assert_stat_error(dir / "file", ENOENT);
+    mkfile(dir / "file");
+    assert_exists(dir / "file");
+
+    assert_stat_error(dir / "sub/file", ENOENT);
+    BOOST_REQUIRE(fs::create_directories(dir / "sub"));
+    assert_stat_error(dir / "sub/file", ENOENT);
+    mkfile(dir / "sub/file");
+    assert_exists(dir / "sub/file");
+
+    assert_stat_error(dir / "renamed", ENOENT);
+    fs::rename(dir / "file", dir / "renamed");
+    assert_exists(dir / "renamed");
+
+    assert_stat_error(dir / "linked", ENOENT);
+    fs::create_hard_link(dir / "renamed", dir / "linked");
+    assert_exists(dir / "linked");
+}
+
+BOOST_AUTO_TEST_CASE(test_many_open_files)
+{
+    TempDir dir;
+    constexpr int N = 2000;
+
+    // Dentries and vnodes stay hashed while the files are open, which
+    // makes both tables grow, and shrink again when they're closed
+    std::vector<int> fds;
+    for (int i = 0; i < N; i++) {
+        auto path = dir / std::to_string(i);
+        int fd = open(path.c_str(), O_CREAT | O_RDWR, 0644);
+        BOOST_REQUIRE(fd >= 0);
+        fds.push_back(fd);
+    }
+    for (int i = 0; i < N; i++) {
+        assert_exists(dir / std::to_string(i));
+    }
+    for (auto fd : fds) {
+        close(fd);
+    }
+    for (int i = 0; i < N; i++) {
+        BOOST_REQUIRE(fs::remove(dir / std::to_string(i)));
+        assert_stat_error(dir / std::to_string(i), ENOENT);
+    }
+}